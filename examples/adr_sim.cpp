@@ -0,0 +1,203 @@
+// adr_sim.cpp
+//
+// Nodes scattered around a gateway send telemetry to it, either all on one fixed spreading factor at full
+// power, or each on the spreading factor and power chosen for it by RHAdaptiveRate, and reports the
+// delivery ratio and the airtime spent per delivered octet.
+//
+// Build with "make adrsim" in the top directory, then:
+//   ./adrsim [adr|sf [nodes [radius_m [minutes [interval_s [margin_db [seed]]]]]]]
+// sf is the fixed spreading factor to compare against, 7 to 12. margin_db is the controller's target SNR margin.
+// The gateway has a demodulator for each spreading factor, as LoRaWAN gateways do, modelled as one radio
+// per spreading factor. With adr it answers each message with the SNR it measured, which the node records
+// against the settings it sent with, so the controller's view of each link does not depend on the
+// gateway's power. The answers are counted in the total airtime.
+
+#include <RHSimNetwork.h>
+#include <RHDatagram.h>
+#include <RHAdaptiveRate.h>
+#include <math.h>
+
+// Simulation parameters, from the command line
+static bool          adaptive  = true;    // RHAdaptiveRate, else a fixed spreading factor
+static uint8_t       fixedSF   = 12;      // The fixed spreading factor
+static unsigned int  numNodes  = 40;      // Nodes sending to the gateway
+static float         radius    = 6000;    // Largest distance from the gateway, metres
+static unsigned long minutes   = 120;     // Virtual time to simulate
+static unsigned long interval  = 300;     // Mean time between messages from each node, seconds
+static float         margin    = RH_ADR_DEFAULT_TARGET_MARGIN / 10.0; // Target SNR margin, dB
+static uint32_t      seed      = 1;       // Random seed
+
+// Application payload octets
+#define PAYLOAD 20
+
+// Transmitter power allowed, dBm. 14 is the EU 868 MHz limit
+#define MIN_POWER 2
+#define MAX_POWER 14
+
+// Gateway address
+#define GATEWAY 1
+
+static uint64_t      uplinkAirtime = 0;   // Time on air of the nodes' messages, us
+static uint32_t      uplinks[RH_SF_SCAN_MAX + 1]; // Messages sent on each spreading factor
+static int32_t       powerSum = 0;        // Sum of the powers messages were sent with, dBm
+static uint32_t      reports = 0;         // SNR reports that reached their node
+static uint32_t      delivered = 0;       // Messages the gateway received
+
+struct Node
+{
+    RHSimDriver*     radio;
+    RHDatagram*      manager;
+    RHAdaptiveRate*  adr;
+};
+
+// One demodulator of the gateway, on one spreading factor
+static void gatewayTask(RHSimDriver& driver, void* arg)
+{
+    Node& node = *(Node*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_SIM_MAX_MESSAGE_LEN];
+
+    node.manager->init();
+    while (true)
+    {
+	node.manager->waitAvailable();
+	uint8_t len = sizeof(buf);
+	RHAddress from;
+	if (!node.manager->recvfrom(buf, &len, &from) || len < sizeof(uint32_t))
+	    continue;
+	uint32_t tag;
+	memcpy(&tag, buf, sizeof(tag));
+	network.messageDelivered(tag, len);
+	delivered++;
+	if (adaptive)
+	{
+	    int16_t snr = driver.lastSNR();
+	    node.manager->sendto((uint8_t*)&snr, sizeof(snr), from);
+	    node.manager->waitPacketSent();
+	}
+    }
+}
+
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    Node& node = *(Node*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[PAYLOAD];
+
+    node.manager->init();
+    if (!adaptive)
+	driver.setLinkParams(fixedSF, 125000, MAX_POWER);
+    delay(network.random(0, interval * 1000));
+    while (true)
+    {
+	RHAdaptiveRate::LinkConfig config;
+	if (adaptive)
+	{
+	    node.adr->select(GATEWAY, &config);
+	    driver.setLinkParams(config.sf, config.bw, config.power);
+	}
+	uint32_t tag = network.messageSent();
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &tag, sizeof(tag));
+	uplinkAirtime += driver.timeOnAir(sizeof(buf));
+	uplinks[driver.spreadingFactor()]++;
+	powerSum += driver.txPower();
+	node.manager->sendto(buf, sizeof(buf), GATEWAY);
+	node.manager->waitPacketSent();
+
+	if (adaptive)
+	{
+	    // The report comes straight back, on the same spreading factor
+	    unsigned long timeout = driver.timeOnAir(sizeof(int16_t)) / 1000 + 100;
+	    unsigned long start = millis();
+	    bool got = false;
+	    while (!got && millis() - start < timeout)
+	    {
+		if (!node.manager->waitAvailableTimeout(timeout - (millis() - start)))
+		    break;
+		int16_t snr;
+		uint8_t len = sizeof(snr);
+		RHAddress from;
+		if (node.manager->recvfrom((uint8_t*)&snr, &len, &from) && from == GATEWAY && len == sizeof(snr))
+		{
+		    node.adr->recordSnr(GATEWAY, snr, config);
+		    node.adr->recordDelivery(GATEWAY);
+		    reports++;
+		    got = true;
+		}
+	    }
+	    if (!got)
+		node.adr->recordLoss(GATEWAY);
+	}
+	delay(-logf(network.random(1, 1000000) / 1000000.0) * interval * 1000);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) adaptive = strcmp(argv[1], "adr") == 0;
+    if (argc > 1 && !adaptive) fixedSF = atoi(argv[1]);
+    if (argc > 2) numNodes = atoi(argv[2]);
+    if (argc > 3) radius   = atof(argv[3]);
+    if (argc > 4) minutes  = atol(argv[4]);
+    if (argc > 5) interval = atol(argv[5]);
+    if (argc > 6) margin   = atof(argv[6]);
+    if (argc > 7) seed     = atol(argv[7]);
+    if (fixedSF < RH_SF_SCAN_MIN || fixedSF > RH_SF_SCAN_MAX || numNodes < 1 || minutes < 1 || interval < 1)
+    {
+	fprintf(stderr, "usage: %s [adr|sf [nodes [radius_m [minutes [interval_s [margin_db [seed]]]]]]]\n", argv[0]);
+	return 1;
+    }
+
+    RHSimNetwork network(seed);
+    network.setPathLoss(RH_SIM_DEFAULT_REFERENCE_LOSS, RH_SIM_DEFAULT_PATH_LOSS_EXPONENT, 4);
+    unsigned int i;
+    uint8_t sf;
+    for (sf = RH_SF_SCAN_MIN; sf <= RH_SF_SCAN_MAX; sf++)
+    {
+	Node* node = new Node;
+	node->radio = new RHSimDriver(network);
+	node->radio->setLinkParams(sf, 125000, MAX_POWER);
+	node->manager = new RHDatagram(*node->radio, GATEWAY);
+	node->adr = NULL;
+	network.addNode(*node->radio, 0, 0, gatewayTask, node);
+    }
+    for (i = 0; i < numNodes; i++)
+    {
+	Node* node = new Node;
+	node->radio = new RHSimDriver(network);
+	node->manager = new RHDatagram(*node->radio, GATEWAY + 1 + i);
+	node->adr = new RHAdaptiveRate(*node->radio);
+	node->adr->setSpreadingFactorRange(RH_SF_SCAN_MIN, RH_SF_SCAN_MAX);
+	node->adr->setPowerRange(MIN_POWER, MAX_POWER);
+	node->adr->setTargetMargin(margin * 10);
+	float angle = network.random(0, 3600) * M_PI / 1800;
+	float range = radius * sqrtf(network.random(1, 1000000) / 1000000.0);
+	network.addNode(*node->radio, range * cosf(angle), range * sinf(angle), nodeTask, node);
+    }
+
+    network.run(minutes * 60000);
+    network.printReport(stdout);
+
+    uint32_t sent = 0;
+    for (sf = RH_SF_SCAN_MIN; sf <= RH_SF_SCAN_MAX; sf++)
+	sent += uplinks[sf];
+    if (adaptive)
+	printf("Adaptive with %.1f dB margin, %u nodes within %.0f m\n", margin, numNodes, radius);
+    else
+	printf("Fixed SF%u at %d dBm, %u nodes within %.0f m\n", fixedSF, MAX_POWER, numNodes, radius);
+    printf("Messages by spreading factor:");
+    for (sf = RH_SF_SCAN_MIN; sf <= RH_SF_SCAN_MAX; sf++)
+	printf(" SF%u %.0f%%", sf, sent ? 100.0 * uplinks[sf] / sent : 0.0);
+    printf("\nMean power: %.1f dBm\n", sent ? (double)powerSum / sent : 0.0);
+    if (adaptive)
+	printf("SNR reports received: %lu\n", (unsigned long)reports);
+    printf("Delivered: %lu of %lu, %.1f%%\n", (unsigned long)delivered, (unsigned long)sent,
+	   sent ? 100.0 * delivered / sent : 0.0);
+    // Every delivered message carries PAYLOAD octets
+    printf("Airtime: %.1f s uplink, %.1f s in all, %.2f ms uplink and %.2f ms in all per delivered octet\n",
+	   uplinkAirtime / 1e6, network.airtime() / 1e6,
+	   delivered ? uplinkAirtime / 1e3 / (delivered * PAYLOAD) : 0.0,
+	   delivered ? network.airtime() / 1e3 / (delivered * PAYLOAD) : 0.0);
+    return 0;
+}
@@ -0,0 +1,195 @@
+// compress_sim.cpp
+//
+// Sends JSON telemetry from a star of nodes to a gateway with RHReliableDatagram, with or without
+// RHCompressedDriver under it, and reports the compression ratio, the airtime it saved and the CPU time it took.
+//
+// Build with "make compresssim" in the top directory, then:
+//   ./compresssim [compressed|plain [sf [nodes [minutes [seed]]]]]
+// The CPU time is measured on this host, by compressing and decompressing the same kind of messages in a loop.
+
+#include <RHSimNetwork.h>
+#include <RHReliableDatagram.h>
+#include <RHCompressedDriver.h>
+#include <math.h>
+#include <time.h>
+
+// Simulation parameters, from the command line
+static bool          compressed = true;   // RHCompressedDriver under the manager, else the plain radio
+static uint8_t       sf         = 11;     // Spreading factor
+static unsigned int  numNodes   = 10;     // Nodes sending telemetry to the gateway
+static unsigned long minutes    = 60;     // Virtual time to simulate
+static uint32_t      seed       = 1;      // Random seed
+
+// Mean time between messages from each node, ms
+#define INTERVAL 60000
+
+// Shared by every node: the keys and the parts of the values that telemetry messages usually hold,
+// the most common last, where matches from the start of a message can reach them
+static const char dictionary[] =
+    "\"status\":\"low battery\"\"status\":\"ok\"}"
+    "{\"id\":\"node-0\",\"seq\":\",\"t\":2\",\"h\":\",\"p\":10\",\"bat\":3.\",\"rssi\":-";
+
+static uint32_t      delivered = 0;       // Messages delivered to the gateway
+static uint32_t      corrupt = 0;         // Delivered but not as sent
+
+struct Node
+{
+    RHSimDriver*         radio;
+    RHCompressedDriver*  compressor;
+    RHReliableDatagram*  manager;
+};
+
+// The message a node sends with a tag. Readings are made up from the tag, so the gateway can check them
+static uint8_t telemetry(char* buf, uint8_t cap, uint16_t node, uint32_t tag)
+{
+    uint32_t x = tag * 2654435761UL + node;
+    int len = snprintf(buf, cap,
+		       "{\"id\":\"node-%02u\",\"seq\":%lu,\"t\":%.2f,\"h\":%.1f,\"p\":%.1f,\"bat\":%.2f,\"rssi\":-%u,\"status\":\"%s\"}",
+		       node, (unsigned long)tag, 18 + (x % 700) / 100.0, 40 + (x >> 8) % 300 / 10.0,
+		       1000 + (x >> 12) % 300 / 10.0, 3.3 + (x >> 16) % 90 / 100.0, 60 + (x >> 20) % 60,
+		       (x >> 24) % 16 ? "ok" : "low battery");
+    return len < cap ? len : cap;
+}
+
+static void gatewayTask(RHSimDriver& driver, void* arg)
+{
+    Node& node = *(Node*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_SIM_MAX_MESSAGE_LEN + 1];
+    char expected[RH_SIM_MAX_MESSAGE_LEN];
+
+    node.manager->init();
+    while (true)
+    {
+	uint8_t len = RH_SIM_MAX_MESSAGE_LEN;
+	RHAddress from;
+	if (!node.manager->recvfromAckTimeout(buf, &len, 60000, &from))
+	    continue;
+	buf[len] = 0;
+	const char* seq = strstr((char*)buf, "\"seq\":");
+	unsigned long tag;
+	if (!seq || sscanf(seq + 6, "%lu", &tag) != 1)
+	{
+	    corrupt++;
+	    continue;
+	}
+	if (telemetry(expected, sizeof(expected), from - 1, tag) != len || memcmp(expected, buf, len))
+	{
+	    corrupt++;
+	    continue;
+	}
+	network.messageDelivered(tag, len);
+	delivered++;
+    }
+}
+
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    Node& node = *(Node*)arg;
+    RHSimNetwork& network = driver.network();
+    char buf[RH_SIM_MAX_MESSAGE_LEN];
+
+    node.manager->init();
+    driver.setCADTimeout(10000);
+    delay(network.random(0, INTERVAL));
+    while (true)
+    {
+	uint32_t tag = network.messageSent();
+	uint8_t len = telemetry(buf, sizeof(buf), node.manager->thisAddress() - 1, tag);
+	node.manager->sendtoWait((uint8_t*)buf, len, 1);
+	delay(-logf(network.random(1, 1000000) / 1000000.0) * INTERVAL);
+    }
+}
+
+// Host CPU time per message, microseconds
+static double cpuMicros(struct timespec& start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (now.tv_sec - start.tv_sec) * 1e6 + (now.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) compressed = strcmp(argv[1], "plain") != 0;
+    if (argc > 2) sf         = atoi(argv[2]);
+    if (argc > 3) numNodes   = atoi(argv[3]);
+    if (argc > 4) minutes    = atol(argv[4]);
+    if (argc > 5) seed       = atol(argv[5]);
+    if (sf < 7 || sf > 12 || numNodes < 1 || numNodes > 99 || minutes < 1)
+    {
+	fprintf(stderr, "usage: %s [compressed|plain [sf [nodes [minutes [seed]]]]]\n", argv[0]);
+	return 1;
+    }
+
+    RHSimNetwork network(seed);
+    Node* nodes = new Node[numNodes + 1];
+    unsigned int i;
+    for (i = 0; i <= numNodes; i++)
+    {
+	nodes[i].radio = new RHSimDriver(network);
+	nodes[i].radio->setModemParams(sf, 125000, 5);
+	nodes[i].compressor = compressed ? new RHCompressedDriver(*nodes[i].radio) : NULL;
+	if (compressed)
+	    nodes[i].compressor->setDictionary((const uint8_t*)dictionary, sizeof(dictionary) - 1, 1);
+	nodes[i].manager = new RHReliableDatagram(compressed ? (RHGenericDriver&)*nodes[i].compressor
+						  : *nodes[i].radio, i + 1);
+	// Slower spreading factors allow more time for each message
+	nodes[i].manager->setTimeout(nodes[i].radio->timeOnAir(128) / 500);
+	float angle = network.random(0, 3600) * M_PI / 1800;
+	float range = i ? 2000 * sqrtf(network.random(0, 1000000) / 1000000.0) : 0;
+	network.addNode(*nodes[i].radio, range * cosf(angle), range * sinf(angle),
+			i ? nodeTask : gatewayTask, &nodes[i]);
+    }
+
+    network.run(minutes * 60000);
+    network.printReport(stdout);
+
+    printf("%s, SF%u, %u nodes, %lu minutes\n", compressed ? "Compressed" : "Plain", sf, numNodes, minutes);
+    printf("Delivered: %lu, corrupt %lu\n", (unsigned long)delivered, (unsigned long)corrupt);
+    printf("Airtime: %.1f s\n", network.airtime() / 1e6);
+    if (!compressed)
+	return 0;
+
+    RHCompressedDriver::Stats total;
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i <= numNodes; i++)
+    {
+	const RHCompressedDriver::Stats& stats = nodes[i].compressor->stats();
+	total.sent += stats.sent;
+	total.compressed += stats.compressed;
+	total.octetsIn += stats.octetsIn;
+	total.octetsOut += stats.octetsOut;
+	total.airtimeSaved += stats.airtimeSaved;
+	total.received += stats.received;
+	total.dropped += stats.dropped;
+    }
+    printf("Compression: %lu of %lu messages sent compressed, %lu octets sent for %lu, ratio %.2f\n",
+	   (unsigned long)total.compressed, (unsigned long)total.sent, (unsigned long)total.octetsOut,
+	   (unsigned long)total.octetsIn, total.octetsIn ? (double)total.octetsOut / total.octetsIn : 1.0);
+    printf("Airtime saved: %.1f s, %.1f ms per message sent\n", total.airtimeSaved / 1e6,
+	   total.sent ? total.airtimeSaved / 1e3 / total.sent : 0.0);
+    printf("Decompressed: %lu, dropped %lu\n", (unsigned long)total.received, (unsigned long)total.dropped);
+
+    // CPU time on this host, over messages like those sent
+    const uint32_t loops = 100000;
+    char message[RH_SIM_MAX_MESSAGE_LEN];
+    uint8_t packed[RH_SIM_MAX_MESSAGE_LEN];
+    uint8_t unpacked[RH_SIM_MAX_MESSAGE_LEN];
+    double compressTime = 0, decompressTime = 0;
+    uint32_t n;
+    for (n = 0; n < loops; n++)
+    {
+	uint8_t len = telemetry(message, sizeof(message), n % numNodes + 1, n);
+	struct timespec start;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+	uint8_t packedLen = nodes[0].compressor->compress((uint8_t*)message, len, packed, sizeof(packed));
+	compressTime += cpuMicros(start);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+	nodes[0].compressor->decompress(packed, packedLen, unpacked, sizeof(unpacked));
+	decompressTime += cpuMicros(start);
+    }
+    printf("CPU time on this host: %.2f us to compress, %.2f us to decompress a message\n",
+	   compressTime / loops, decompressTime / loops);
+    return 0;
+}
@@ -0,0 +1,146 @@
+// copy_sim.cpp
+//
+// Sends RHMesh messages along a chain of relays, and reports how many octets the process copies with
+// memcpy() and memmove() per delivered message, and how much host CPU time each delivered message costs.
+// The counts take in the whole process: the driver and the simulated air interface copy each frame as a
+// radio's FIFO would, and the managers copy it between their layers, so comparing builds of the managers
+// shows what each change to their copy path saves.
+//
+// Build with "make copysim" in the top directory, then:
+//   ./copysim [hops [payload [messages [interval_ms [seed]]]]]
+// The routes are set by hand and never expire, so no route discovery traffic is counted. The build wraps
+// memcpy() and memmove() with the linker, and stops the compiler from expanding them inline, to count them.
+
+#include <RHSimNetwork.h>
+#include <RHMesh.h>
+#include <time.h>
+
+// Simulation parameters, from the command line
+static unsigned int  hops     = 3;       // Hops from the source to the destination
+static unsigned int  payload  = 50;      // Application payload octets
+static unsigned long messages = 2000;    // Messages to send
+static unsigned long interval = 2000;    // Time between messages, ms
+static uint32_t      seed     = 1;       // Random seed
+
+// What the copy functions have done
+static uint64_t copiedOctets = 0;
+static uint64_t copyCalls = 0;
+
+extern "C" void* __real_memcpy(void* dest, const void* src, size_t n);
+extern "C" void* __real_memmove(void* dest, const void* src, size_t n);
+
+extern "C" void* __wrap_memcpy(void* dest, const void* src, size_t n)
+{
+    copiedOctets += n;
+    copyCalls++;
+    return __real_memcpy(dest, src, n);
+}
+
+extern "C" void* __wrap_memmove(void* dest, const void* src, size_t n)
+{
+    copiedOctets += n;
+    copyCalls++;
+    return __real_memmove(dest, src, n);
+}
+
+static unsigned long delivered = 0;
+static bool          finished = false;
+
+static double cpuTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sourceTask(RHSimDriver& driver, void* arg)
+{
+    RHMesh& mesh = *(RHMesh*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+
+    mesh.init();
+    mesh.setRouteLifetime(0);
+    mesh.addRouteTo(hops + 1, 2);
+    unsigned long nextSend = millis();
+    unsigned long i;
+    for (i = 0; i < messages; i++)
+    {
+	nextSend += interval;
+	delay(nextSend - millis());
+	// The tag is written out by hand so that the application's own copies are not counted
+	uint32_t tag = network.messageSent();
+	uint8_t j;
+	for (j = 0; j < payload; j++)
+	    buf[j] = j < sizeof(tag) ? tag >> (8 * j) : 0;
+	mesh.sendtoWait(buf, payload, hops + 1);
+    }
+    delay(interval);
+    finished = true;
+    while (true)
+	delay(3600000);
+}
+
+// The relays and the destination
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    RHMesh& mesh = *(RHMesh*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+    RHAddress self = mesh.thisAddress();
+
+    mesh.init();
+    mesh.setRouteLifetime(0);
+    if (self <= hops)
+	mesh.addRouteTo(hops + 1, self + 1);
+    mesh.addRouteTo(1, self - 1);
+    while (!finished)
+    {
+	uint8_t len = sizeof(buf);
+	if (mesh.recvfromAckTimeout(buf, &len, 1000) && len >= sizeof(uint32_t))
+	{
+	    uint32_t tag = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+	    network.messageDelivered(tag, len);
+	    delivered++;
+	}
+    }
+    while (true)
+	delay(3600000);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) hops     = atoi(argv[1]);
+    if (argc > 2) payload  = atoi(argv[2]);
+    if (argc > 3) messages = atol(argv[3]);
+    if (argc > 4) interval = atol(argv[4]);
+    if (argc > 5) seed     = atol(argv[5]);
+    if (hops < 1 || hops > 100 || payload < sizeof(uint32_t) || payload > RH_MESH_MAX_MESSAGE_LEN || interval < 1)
+    {
+	fprintf(stderr, "usage: %s [hops [payload [messages [interval_ms [seed]]]]]\n", argv[0]);
+	return 1;
+    }
+
+    // Each node is in range of its neighbours in the chain only
+    RHSimNetwork network(seed);
+    unsigned int i;
+    for (i = 0; i <= hops; i++)
+    {
+	RHSimDriver* driver = new RHSimDriver(network);
+	RHMesh* mesh = new RHMesh(*driver, i + 1);
+	network.addNode(*driver, i * 3000.0, 0, i == 0 ? sourceTask : nodeTask, mesh);
+    }
+
+    uint64_t octets0 = copiedOctets;
+    uint64_t calls0 = copyCalls;
+    double start = cpuTime();
+    network.run(((uint64_t)messages + 2) * interval);
+    double cpu = cpuTime() - start;
+    network.printReport(stdout);
+    printf("%u hops, %u octet payload\n", hops, payload);
+    if (delivered)
+	printf("Per delivered message: %.0f octets copied in %.1f copies, %.1f us of host CPU\n",
+	       (double)(copiedOctets - octets0) / delivered, (double)(copyCalls - calls0) / delivered,
+	       cpu * 1e6 / delivered);
+    return 0;
+}
@@ -0,0 +1,197 @@
+// density_sim.cpp
+//
+// Simulates a mesh of RHMesh nodes packed into a fixed area, each sending messages to random other
+// nodes, and reports how much of the channel route discovery floods take as the network gets denser,
+// with or without rebroadcast suppression and replies from cached routes.
+//
+// Build with "make densitysim" in the top directory, then:
+//   ./densitysim [nodes|sweep [threshold [cached_s [jitter_ms|auto [side_m [minutes [interval_s [seed]]]]]]]]
+// sweep runs each of a range of node counts in turn, and prints one line for each.
+// threshold is the suppression threshold, 0 for every node to rebroadcast every request.
+// cached_s is the maximum age of a route used to answer for its destination, 0 for no cached replies.
+// jitter_ms is the longest a node waits before rebroadcasting a request, counting the copies it hears.
+// auto derives it from the time on air of a request, see RH_MESH_REBROADCAST_SLOTS.
+// The airtime of a route discovery counts every request and response frame sent for it, but not the
+// acknowledgements of the responses.
+
+#include <RHSimNetwork.h>
+#include <RHMesh.h>
+
+// Simulation parameters, from the command line
+static unsigned int  numNodes  = 60;      // Number of nodes, 0 to sweep
+static unsigned int  threshold = RH_MESH_SUPPRESSION_THRESHOLD; // Rebroadcast suppression threshold
+static unsigned long cachedAge = RH_MESH_CACHED_REPLY_AGE / 1000; // Age of routes used for cached replies, s
+static unsigned int  jitter    = RH_MESH_REBROADCAST_JITTER; // Rebroadcast delay, ms
+static float         side      = 8000;    // Side of the square area, metres
+static unsigned long minutes   = 120;     // Virtual time to simulate
+static unsigned long interval  = 300;     // Mean time between messages from each node, seconds
+static uint32_t      seed      = 1;       // Random seed
+
+// Node counts of a sweep
+static const unsigned int sweep[] = { 20, 40, 60, 90, 120 };
+
+// Application payload octets
+#define PAYLOAD 20
+
+// Route discovery traffic of the run in progress
+static uint32_t discoveries = 0;          // Requests sent by their originator
+static uint64_t discoveryAirtime = 0;     // Time on air of request and response frames, us
+
+// A simulated radio that counts the route discovery frames it sends
+class CountingDriver : public RHSimDriver
+{
+public:
+    CountingDriver(RHSimNetwork& network) : RHSimDriver(network) {}
+
+    virtual bool send(const uint8_t* data, uint8_t len)
+    {
+	if (!RHSimDriver::send(data, len))
+	    return false;
+	const RHRouter::RoutedMessageHeader* h = (const RHRouter::RoutedMessageHeader*)data;
+	if (len > sizeof(*h))
+	{
+	    uint8_t type = data[sizeof(*h)];
+	    if (type == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST
+		|| type == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
+		discoveryAirtime += timeOnAir(len);
+	    if (type == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST && h->source == _thisAddress)
+		discoveries++;
+	}
+	return true;
+    }
+};
+
+// What one run came to
+struct Result
+{
+    float         delivery;    // %
+    float         channelUse;  // % of elapsed time, summed over nodes
+    uint32_t      discoveries;
+    float         perDiscovery; // Airtime per route discovery, ms
+    unsigned long suppressed;
+    uint32_t      jitter;       // Rebroadcast delay in use, ms
+};
+
+// Main program of every node
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    RHMesh& mesh = *(RHMesh*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+
+    mesh.init();
+    mesh.setSuppressionThreshold(threshold);
+    mesh.setCachedReplyAge(cachedAge * 1000);
+    mesh.setRebroadcastJitter(jitter);
+    unsigned long nextSend = millis() + random(0, interval * 1000);
+    while (true)
+    {
+	long wait = (long)(nextSend - millis());
+	if (wait <= 0)
+	{
+	    RHAddress dest = random(1, numNodes);
+	    if (dest >= mesh.thisAddress())
+		dest++;
+	    uint32_t tag = network.messageSent();
+	    memset(buf, 0, PAYLOAD);
+	    memcpy(buf, &tag, sizeof(tag));
+	    mesh.sendtoWait(buf, PAYLOAD, dest);
+	    nextSend += random(interval * 500, interval * 1500);
+	    continue;
+	}
+
+	uint8_t len = sizeof(buf);
+	RHAddress from;
+	if (mesh.recvfromAckTimeout(buf, &len, wait > 60000 ? 60000 : wait, &from) && len >= sizeof(uint32_t))
+	{
+	    uint32_t tag;
+	    memcpy(&tag, buf, sizeof(tag));
+	    network.messageDelivered(tag, len);
+	}
+    }
+}
+
+static Result run(bool report)
+{
+    RHSimNetwork* network = new RHSimNetwork(seed);
+    RHSimDriver** drivers = new RHSimDriver*[numNodes];
+    RHMesh** meshes = new RHMesh*[numNodes];
+    unsigned int i;
+    for (i = 0; i < numNodes; i++)
+    {
+	drivers[i] = new CountingDriver(*network);
+	meshes[i] = new RHMesh(*drivers[i], i + 1);
+	float x = network->random(0, (long)side);
+	float y = network->random(0, (long)side);
+	network->addNode(*drivers[i], x, y, nodeTask, meshes[i]);
+    }
+
+    discoveries = 0;
+    discoveryAirtime = 0;
+    network->run(minutes * 60000);
+    if (report)
+	network->printReport(stdout);
+
+    Result r;
+    r.delivery = network->messagesSent() ? 100.0 * network->messagesDelivered() / network->messagesSent() : 0;
+    r.channelUse = 100.0 * network->airtime() / network->now();
+    r.discoveries = discoveries;
+    r.perDiscovery = discoveries ? discoveryAirtime / 1000.0 / discoveries : 0;
+    r.suppressed = 0;
+    for (i = 0; i < numNodes; i++)
+	r.suppressed += meshes[i]->suppressedRebroadcasts();
+    r.jitter = meshes[0]->rebroadcastJitter();
+
+    // The tasks are abandoned with the network, so nothing uses the nodes after this
+    delete network;
+    for (i = 0; i < numNodes; i++)
+    {
+	delete meshes[i];
+	delete drivers[i];
+    }
+    delete[] meshes;
+    delete[] drivers;
+    return r;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) numNodes  = strcmp(argv[1], "sweep") ? atoi(argv[1]) : 0;
+    if (argc > 2) threshold = atoi(argv[2]);
+    if (argc > 3) cachedAge = atol(argv[3]);
+    if (argc > 4) jitter    = strcmp(argv[4], "auto") ? atoi(argv[4]) : RH_MESH_REBROADCAST_JITTER_AUTO;
+    if (argc > 5) side      = atof(argv[5]);
+    if (argc > 6) minutes   = atol(argv[6]);
+    if (argc > 7) interval  = atol(argv[7]);
+    if (argc > 8) seed      = atol(argv[8]);
+    if (numNodes == 1 || threshold > 0xff || jitter > 0xffff || interval < 1 || minutes < 1)
+    {
+	fprintf(stderr, "usage: %s [nodes|sweep [threshold [cached_s [jitter_ms|auto [side_m [minutes [interval_s [seed]]]]]]]]\n",
+		argv[0]);
+	return 1;
+    }
+
+    if (numNodes)
+    {
+	Result r = run(true);
+	printf("%u nodes in %.0f m square, suppression threshold %u, cached replies up to %lu s old, jitter %u ms\n",
+	       numNodes, side, threshold, cachedAge, r.jitter);
+	printf("Rebroadcasts suppressed: %lu\n", r.suppressed);
+	printf("Route discoveries: %u, %.0f ms of airtime each\n", r.discoveries, r.perDiscovery);
+	return 0;
+    }
+
+    printf("%.0f m square, suppression threshold %u, cached replies up to %lu s old, %lu min, message every %lu s\n",
+	   side, threshold, cachedAge, minutes, interval);
+    printf("nodes  jitter  delivery  channel use  discoveries  airtime/discovery  suppressed\n");
+    unsigned int i;
+    for (i = 0; i < sizeof(sweep) / sizeof(sweep[0]); i++)
+    {
+	numNodes = sweep[i];
+	Result r = run(false);
+	printf("%5u  %4u ms  %7.1f%%  %10.1f%%  %11u  %14.0f ms  %10lu\n", numNodes, r.jitter, r.delivery,
+	       r.channelUse, r.discoveries, r.perDiscovery, r.suppressed);
+	fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,166 @@
+// fountain_sim.cpp
+//
+// Sends one image from a node to every other node, either broadcast with RHFountain or to each node in
+// turn with RHFragmenter, and reports the airtime each took for the number of receivers.
+//
+// Build with "make fountainsim" in the top directory, then:
+//   ./fountainsim [fountain|unicast [receivers [size [fading_db [radius_m [seed]]]]]]
+// Receivers are placed up to radius_m from the sender. Each frame fades independently at each receiver,
+// by a normal deviate of fading_db standard deviation, so different receivers lose different frames.
+
+#include <RHSimNetwork.h>
+#include <RHReliableDatagram.h>
+#include <RHFragmenter.h>
+#include <RHFountain.h>
+#include <math.h>
+
+// Simulation parameters, from the command line
+static bool          fountain     = true;   // RHFountain broadcast, else RHFragmenter to each receiver
+static unsigned int  numReceivers = 20;     // Nodes the image is sent to
+static uint32_t      size         = 16000;  // Image size, octets
+static float         fading       = 6;      // Per frame fading standard deviation, dB
+static float         radius       = 3000;   // Largest distance from the sender, metres
+static uint32_t      seed         = 1;      // Random seed
+
+// Time allowed for the transfer, virtual ms
+#define RUN_TIME (4 * 3600000UL)
+
+static uint8_t*      image;
+static unsigned int  complete = 0;          // Receivers that got the image intact
+static unsigned long started = 0;           // Sender's clock when it started and finished, ms
+static unsigned long finished = 0;
+static uint64_t      airtimeAtEnd = 0;      // Network airtime when the sender finished, us
+static uint16_t      blocksSent = 0;        // RHFountain coded blocks
+static uint16_t      blockCount = 0;
+
+// Path loss plus independent fading for every frame
+class FadingNetwork : public RHSimNetwork
+{
+public:
+    FadingNetwork(uint32_t seed) : RHSimNetwork(seed) {}
+
+    virtual float pathLoss(uint16_t from, uint16_t to)
+    {
+	float u1 = random(1, 1000000) / 1000000.0;
+	float u2 = random(0, 1000000) / 1000000.0;
+	return RHSimNetwork::pathLoss(from, to) + fading * sqrtf(-2.0 * logf(u1)) * cosf(2.0 * M_PI * u2);
+    }
+};
+
+struct Node
+{
+    RHSimDriver*         radio;
+    RHReliableDatagram*  manager;
+    RHFragmenter*        fragmenter;
+    RHFountain*          fountain;
+    uint8_t*             buf;       // Where a receiver's sink puts the image
+};
+
+static bool sink(RHAddress, uint32_t offset, const uint8_t* data, uint8_t len, void* arg)
+{
+    memcpy((uint8_t*)arg + offset, data, len);
+    return true;
+}
+
+static void senderTask(RHSimDriver& driver, void* arg)
+{
+    Node& node = *(Node*)arg;
+    RHSimNetwork& network = driver.network();
+
+    node.manager->init();
+    delay(1000);
+    started = millis();
+    RHAddress* receivers = new RHAddress[numReceivers];
+    unsigned int i;
+    for (i = 0; i < numReceivers; i++)
+	receivers[i] = i + 2;
+    if (fountain)
+    {
+	node.fountain->broadcast(image, size, receivers, numReceivers);
+	blocksSent = node.fountain->blocksSent();
+	blockCount = (size + node.fountain->blockLength() - 1) / node.fountain->blockLength();
+    }
+    else
+    {
+	for (i = 0; i < numReceivers; i++)
+	    node.fragmenter->sendtoWait(image, size, receivers[i]);
+    }
+    finished = millis();
+    airtimeAtEnd = network.airtime();
+    delete[] receivers;
+}
+
+static void receiverTask(RHSimDriver&, void* arg)
+{
+    Node& node = *(Node*)arg;
+    bool intact = false;
+
+    node.manager->init();
+    // Goes on receiving after the image is complete, to answer RHFountain feedback windows
+    while (true)
+    {
+	uint32_t len = size;
+	bool got = fountain ? node.fountain->recvfromTimeout(node.buf, &len, 60000)
+	    : node.fragmenter->recvfromTimeout(node.buf, &len, 60000);
+	if (got && !intact && len == size && !memcmp(node.buf, image, size))
+	{
+	    intact = true;
+	    complete++;
+	}
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) fountain     = strcmp(argv[1], "unicast") != 0;
+    if (argc > 2) numReceivers = atoi(argv[2]);
+    if (argc > 3) size         = atol(argv[3]);
+    if (argc > 4) fading       = atof(argv[4]);
+    if (argc > 5) radius       = atof(argv[5]);
+    if (argc > 6) seed         = atol(argv[6]);
+    if (numReceivers < 1 || numReceivers > RH_FOUNTAIN_MAX_RECEIVERS || size < 1 || fading < 0)
+    {
+	fprintf(stderr, "usage: %s [fountain|unicast [receivers [size [fading_db [radius_m [seed]]]]]]\n", argv[0]);
+	return 1;
+    }
+
+    FadingNetwork network(seed);
+    image = new uint8_t[size];
+    uint32_t j;
+    for (j = 0; j < size; j++)
+	image[j] = network.random(0, 256);
+
+    Node* nodes = new Node[numReceivers + 1];
+    unsigned int i;
+    for (i = 0; i <= numReceivers; i++)
+    {
+	nodes[i].radio = new RHSimDriver(network);
+	nodes[i].manager = new RHReliableDatagram(*nodes[i].radio, i + 1);
+	nodes[i].fragmenter = fountain ? NULL : new RHFragmenter(*nodes[i].manager);
+	nodes[i].fountain = fountain ? new RHFountain(*nodes[i].manager) : NULL;
+	nodes[i].buf = i ? new uint8_t[size] : NULL;
+	if (i && !fountain)
+	    nodes[i].fragmenter->setSink(sink, nodes[i].buf);
+	float angle = network.random(0, 3600) * M_PI / 1800;
+	float range = i ? radius * sqrtf(network.random(0, 1000000) / 1000000.0) : 0;
+	network.addNode(*nodes[i].radio, range * cosf(angle), range * sinf(angle),
+			i ? receiverTask : senderTask, &nodes[i]);
+    }
+
+    network.run(RUN_TIME);
+    network.printReport(stdout);
+
+    printf("%s, %u receivers within %.0f m, %u octet image, %.0f dB fading\n",
+	   fountain ? "Fountain broadcast" : "Unicast to each receiver", numReceivers, radius, size, fading);
+    if (!finished)
+	printf("Not finished in %lu s\n", RUN_TIME / 1000);
+    else
+	printf("Received intact by %u of %u, in %.1f s\n", complete, numReceivers, (finished - started) / 1000.0);
+    uint64_t airtime = finished ? airtimeAtEnd : network.airtime();
+    printf("Airtime: %.1f s, %.2f s per receiver, %.1f ms per image octet\n",
+	   airtime / 1e6, airtime / 1e6 / numReceivers, airtime / 1e3 / size);
+    if (fountain && blockCount)
+	printf("Coded blocks: %u for %u blocks, %.1f%% more\n", blocksSent, blockCount,
+	       100.0 * (blocksSent - blockCount) / blockCount);
+    return 0;
+}
@@ -0,0 +1,192 @@
+// frag_sim.cpp
+//
+// Sends long messages with RHFragmenter over RHReliableDatagram, and reports whether each arrived intact,
+// how long it took, and how many fragments had to be sent again. One of four scenarios:
+//   single       one sender, one message reassembled in the receiver's buffer
+//   interleaved  two senders at once to the same receiver, which reassembles both messages side by side
+//   sink         one sender reading the message from a callback, and a receiver storing each fragment
+//                through a sink, so the message may be longer than RH_FRAG_BUFFER_SIZE
+//   jammer       as single, with a jammer near the receiver that the sender cannot hear, and no manager
+//                retries, so that lost fragments are left to the fragmenter's selective retransmission
+//
+// Build with "make fragsim" in the top directory, then:
+//   ./fragsim [single|interleaved|sink|jammer [size [jam_percent [seed]]]]
+// size is the length of each message, by default 4000 octets, or 15000 with a sink.
+// jam_percent is the fraction of time the jammer transmits. The senders and the receiver wait for a clear
+// channel before they send, and the senders start within a second of each other.
+
+#include <RHSimNetwork.h>
+#include <RHReliableDatagram.h>
+#include <RHFragmenter.h>
+
+// Simulation parameters, from the command line
+static const char*   scenario = "single"; // Which scenario to run
+static uint32_t      size     = 0;        // Message length, octets, 0 for the scenario's default
+static float         jam      = 10;       // Jammer duty cycle, percent
+static uint32_t      seed     = 1;        // Random seed
+
+// Time allowed for the transfers, virtual ms
+#define RUN_TIME 600000UL
+
+// Jammer frame length, octets
+#define JAM_LEN 40
+
+// Addresses
+#define RECEIVER 1
+
+// One sender and what became of its message
+struct Sender
+{
+    RHReliableDatagram*  manager;
+    RHFragmenter*        fragmenter;
+    uint8_t*             message;
+    bool                 done;        // sendtoWait() returned
+    bool                 acked;       // sendtoWait() returned true
+    bool                 intact;      // The receiver got the message unchanged
+    unsigned long        took;        // ms
+    uint32_t             retransmitted;
+};
+
+static Sender        senders[2];
+static unsigned int  numSenders = 1;
+static bool          useSink = false;
+static uint8_t*      sinkBuf;           // Where the receiver's sink stores the message
+static RHReliableDatagram* receiver;
+
+static uint8_t source(uint32_t offset, uint8_t* buf, uint8_t len, void* arg)
+{
+    memcpy(buf, (uint8_t*)arg + offset, len);
+    return len;
+}
+
+static bool sink(RHAddress, uint32_t offset, const uint8_t* data, uint8_t len, void*)
+{
+    memcpy(sinkBuf + offset, data, len);
+    return true;
+}
+
+static void senderTask(RHSimDriver& driver, void* arg)
+{
+    Sender& s = *(Sender*)arg;
+
+    s.manager->init();
+    driver.setCADTimeout(10000);
+    if (strcmp(scenario, "jammer") == 0)
+	s.manager->setRetries(0);
+    delay(1000 + driver.network().random(0, 1000));
+    unsigned long start = millis();
+    if (useSink)
+	s.acked = s.fragmenter->sendtoWait(source, s.message, size, RECEIVER);
+    else
+	s.acked = s.fragmenter->sendtoWait(s.message, size, RECEIVER);
+    s.took = millis() - start;
+    s.retransmitted = s.fragmenter->retransmissions();
+    s.done = true;
+    while (true)
+	delay(3600000);
+}
+
+static void receiverTask(RHSimDriver& driver, void* arg)
+{
+    RHFragmenter& fragmenter = *(RHFragmenter*)arg;
+    uint8_t* buf = new uint8_t[size];
+
+    receiver->init();
+    driver.setCADTimeout(10000);
+    if (useSink)
+	fragmenter.setSink(sink, NULL);
+    while (true)
+    {
+	uint32_t len = size;
+	RHAddress from;
+	if (!fragmenter.recvfromTimeout(buf, &len, 60000, &from) || len != size)
+	    continue;
+	unsigned int i;
+	for (i = 0; i < numSenders; i++)
+	    if (senders[i].manager->thisAddress() == from)
+		senders[i].intact = !memcmp(useSink ? sinkBuf : buf, senders[i].message, size);
+    }
+}
+
+// Sends frames of junk, at random, for a fraction jam of the time
+static void jammerTask(RHSimDriver& driver, void*)
+{
+    RHSimNetwork& network = driver.network();
+    uint8_t junk[JAM_LEN];
+    memset(junk, 0x55, sizeof(junk));
+    uint32_t frameTime = driver.timeOnAir(sizeof(junk)) / 1000;
+    unsigned long gap = frameTime * (100 - jam) / jam;
+
+    while (true)
+    {
+	delay(network.random(0, 2 * gap + 1));
+	driver.send(junk, sizeof(junk));
+	driver.waitPacketSent();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) scenario = argv[1];
+    if (argc > 2) size     = atol(argv[2]);
+    if (argc > 3) jam      = atof(argv[3]);
+    if (argc > 4) seed     = atol(argv[4]);
+    if (   (strcmp(scenario, "single") && strcmp(scenario, "interleaved") && strcmp(scenario, "sink")
+	    && strcmp(scenario, "jammer"))
+	|| jam <= 0 || jam >= 100)
+    {
+	fprintf(stderr, "usage: %s [single|interleaved|sink|jammer [size [jam_percent [seed]]]]\n", argv[0]);
+	return 1;
+    }
+    useSink = strcmp(scenario, "sink") == 0;
+    numSenders = strcmp(scenario, "interleaved") == 0 ? 2 : 1;
+    if (!size)
+	size = useSink ? 15000 : 4000;
+    if (!useSink && size > RH_FRAG_BUFFER_SIZE)
+    {
+	fprintf(stderr, "%s: messages longer than %u octets need a sink\n", argv[0], RH_FRAG_BUFFER_SIZE);
+	return 1;
+    }
+
+    // The senders are 3 km from the receiver, and the jammer 3 km beyond it, out of the senders' range
+    RHSimNetwork network(seed);
+    RHSimDriver* radio = new RHSimDriver(network);
+    receiver = new RHReliableDatagram(*radio, RECEIVER);
+    network.addNode(*radio, 0, 0, receiverTask, new RHFragmenter(*receiver));
+    sinkBuf = new uint8_t[size];
+    unsigned int i;
+    for (i = 0; i < numSenders; i++)
+    {
+	Sender& s = senders[i];
+	radio = new RHSimDriver(network);
+	s.manager = new RHReliableDatagram(*radio, i + 2);
+	s.fragmenter = new RHFragmenter(*s.manager);
+	s.message = new uint8_t[size];
+	uint32_t j;
+	for (j = 0; j < size; j++)
+	    s.message[j] = network.random(0, 256);
+	network.addNode(*radio, -3000, i * 500.0, senderTask, &s);
+    }
+    if (strcmp(scenario, "jammer") == 0)
+	network.addNode(*new RHSimDriver(network), 3000, 0, jammerTask, NULL);
+
+    network.run(RUN_TIME);
+    network.printReport(stdout);
+
+    uint32_t count = (size + senders[0].fragmenter->fragmentLength() - 1) / senders[0].fragmenter->fragmentLength();
+    printf("Scenario %s: %u octet messages in %u fragments of up to %u octets\n",
+	   scenario, size, count, senders[0].fragmenter->fragmentLength());
+    if (strcmp(scenario, "jammer") == 0)
+	printf("Jammer on the air %.0f%% of the time, no manager retries\n", jam);
+    for (i = 0; i < numSenders; i++)
+    {
+	Sender& s = senders[i];
+	if (!s.done)
+	    printf("Sender %u: not finished in %lu s\n", s.manager->thisAddress(), RUN_TIME / 1000);
+	else
+	    printf("Sender %u: %s, %s, in %.1f s, %u fragments sent again\n", s.manager->thisAddress(),
+		   s.acked ? "acknowledged" : "gave up", s.intact ? "received intact" : "not received intact",
+		   s.took / 1000.0, s.retransmitted);
+    }
+    return 0;
+}
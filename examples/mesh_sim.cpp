@@ -0,0 +1,85 @@
+// mesh_sim.cpp
+//
+// Simulates a network of RHMesh nodes scattered at random over a square area,
+// each sending messages to random other nodes, and reports how well they were delivered.
+//
+// Build with "make meshsim" in the top directory, then:
+//   ./meshsim [nodes [side_m [minutes [interval_s [payload [seed]]]]]]
+
+#include <RHSimNetwork.h>
+#include <RHMesh.h>
+
+// Simulation parameters, from the command line
+static unsigned int  numNodes = 50;      // Number of nodes
+static float         side     = 3000;    // Side of the square area, metres
+static unsigned long minutes  = 60;      // Virtual time to simulate
+static unsigned long interval = 120;     // Mean time between messages from each node, seconds
+static uint8_t       payload  = 20;      // Application payload octets
+static uint32_t      seed     = 1;       // Random seed
+
+// Main program of every node
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    RHMesh& mesh = *(RHMesh*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+
+    mesh.init();
+    unsigned long nextSend = millis() + random(0, interval * 1000);
+    while (true)
+    {
+	long wait = (long)(nextSend - millis());
+	if (wait <= 0)
+	{
+	    // Pick someone else to send to
+	    RHAddress dest = random(1, numNodes);
+	    if (dest >= mesh.thisAddress())
+		dest++;
+	    uint32_t tag = network.messageSent();
+	    memset(buf, 0, payload);
+	    memcpy(buf, &tag, sizeof(tag));
+	    mesh.sendtoWait(buf, payload, dest);
+	    nextSend += random(interval * 500, interval * 1500);
+	    continue;
+	}
+
+	uint8_t len = sizeof(buf);
+	RHAddress from;
+	if (mesh.recvfromAckTimeout(buf, &len, wait > 60000 ? 60000 : wait, &from) && len >= sizeof(uint32_t))
+	{
+	    uint32_t tag;
+	    memcpy(&tag, buf, sizeof(tag));
+	    network.messageDelivered(tag, len);
+	}
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) numNodes = atoi(argv[1]);
+    if (argc > 2) side     = atof(argv[2]);
+    if (argc > 3) minutes  = atol(argv[3]);
+    if (argc > 4) interval = atol(argv[4]);
+    if (argc > 5) payload  = atoi(argv[5]);
+    if (argc > 6) seed     = atol(argv[6]);
+    if (numNodes < 2 || payload < sizeof(uint32_t) || payload > RH_MESH_MAX_MESSAGE_LEN)
+    {
+	fprintf(stderr, "usage: %s [nodes [side_m [minutes [interval_s [payload [seed]]]]]]\n", argv[0]);
+	return 1;
+    }
+
+    RHSimNetwork network(seed);
+    unsigned int i;
+    for (i = 0; i < numNodes; i++)
+    {
+	RHSimDriver* driver = new RHSimDriver(network);
+	RHMesh* mesh = new RHMesh(*driver, i + 1);
+	float x = network.random(0, (long)side);
+	float y = network.random(0, (long)side);
+	network.addNode(*driver, x, y, nodeTask, mesh);
+    }
+
+    network.run(minutes * 60000);
+    network.printReport(stdout);
+    return 0;
+}
@@ -0,0 +1,155 @@
+// mobility_sim.cpp
+//
+// Simulates a mesh of RHMesh nodes, some of which wander around the area, each sending messages to random
+// other nodes, and reports the delivery ratio and the airtime spent per delivered message for a given
+// route lifetime. Comparing lifetimes shows how much airtime stale routes waste on retries to next hops
+// that have moved away.
+//
+// Build with "make mobilitysim" in the top directory, then:
+//   ./mobilitysim [lifetime_s [nodes [mobile [side_m [speed_mps [minutes [interval_s [seed]]]]]]]]
+// lifetime_s 0 means routes never expire. The mobile nodes move between random points at speed_mps.
+
+#include <RHSimNetwork.h>
+#include <RHMesh.h>
+#include <math.h>
+
+// Simulation parameters, from the command line
+static unsigned long lifetime = RH_DEFAULT_ROUTE_LIFETIME / 1000; // Route lifetime, seconds
+static unsigned int  numNodes = 40;      // Number of nodes
+static unsigned int  numMobile = 20;     // How many of them move
+static float         side     = 3000;    // Side of the square area, metres
+static float         speed    = 5;       // Speed of the mobile nodes, metres per second
+static unsigned long minutes  = 120;     // Virtual time to simulate
+static unsigned long interval = 60;      // Mean time between messages from each node, seconds
+static uint32_t      seed     = 1;       // Random seed
+
+// Application payload octets
+#define PAYLOAD 20
+
+// Time between position updates, ms
+#define MOVE_STEP 1000
+
+// Where each mobile node is and where it is heading
+static float* posX;
+static float* posY;
+static float* targetX;
+static float* targetY;
+
+static uint32_t noRoute = 0;       // Sends that failed for want of a route
+static uint32_t undelivered = 0;   // Sends that failed at the first hop
+
+// Main program of every mesh node
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    RHMesh& mesh = *(RHMesh*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+
+    mesh.init();
+    mesh.setRouteLifetime(lifetime * 1000);
+    unsigned long nextSend = millis() + random(0, interval * 1000);
+    while (true)
+    {
+	long wait = (long)(nextSend - millis());
+	if (wait <= 0)
+	{
+	    RHAddress dest = random(1, numNodes);
+	    if (dest >= mesh.thisAddress())
+		dest++;
+	    uint32_t tag = network.messageSent();
+	    memset(buf, 0, PAYLOAD);
+	    memcpy(buf, &tag, sizeof(tag));
+	    uint8_t error = mesh.sendtoWait(buf, PAYLOAD, dest);
+	    if (error == RH_ROUTER_ERROR_NO_ROUTE)
+		noRoute++;
+	    else if (error == RH_ROUTER_ERROR_UNABLE_TO_DELIVER)
+		undelivered++;
+	    nextSend += random(interval * 500, interval * 1500);
+	    continue;
+	}
+
+	uint8_t len = sizeof(buf);
+	RHAddress from;
+	if (mesh.recvfromAckTimeout(buf, &len, wait > 60000 ? 60000 : wait, &from) && len >= sizeof(uint32_t))
+	{
+	    uint32_t tag;
+	    memcpy(&tag, buf, sizeof(tag));
+	    network.messageDelivered(tag, len);
+	}
+    }
+}
+
+// Moves the mobile nodes. Runs on a radio of its own that is never used
+static void moverTask(RHSimDriver& driver, void*)
+{
+    RHSimNetwork& network = driver.network();
+    float step = speed * MOVE_STEP / 1000;
+    while (true)
+    {
+	delay(MOVE_STEP);
+	unsigned int i;
+	for (i = 0; i < numMobile; i++)
+	{
+	    float dx = targetX[i] - posX[i];
+	    float dy = targetY[i] - posY[i];
+	    float d = sqrtf(dx * dx + dy * dy);
+	    if (d <= step)
+	    {
+		posX[i] = targetX[i];
+		posY[i] = targetY[i];
+		targetX[i] = network.random(0, (long)side);
+		targetY[i] = network.random(0, (long)side);
+	    }
+	    else
+	    {
+		posX[i] += dx * step / d;
+		posY[i] += dy * step / d;
+	    }
+	    network.setPosition(i, posX[i], posY[i]);
+	}
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) lifetime  = atol(argv[1]);
+    if (argc > 2) numNodes  = atoi(argv[2]);
+    if (argc > 3) numMobile = atoi(argv[3]);
+    if (argc > 4) side      = atof(argv[4]);
+    if (argc > 5) speed     = atof(argv[5]);
+    if (argc > 6) minutes   = atol(argv[6]);
+    if (argc > 7) interval  = atol(argv[7]);
+    if (argc > 8) seed      = atol(argv[8]);
+    if (numNodes < 2 || numMobile > numNodes || speed <= 0 || interval < 1)
+    {
+	fprintf(stderr, "usage: %s [lifetime_s [nodes [mobile [side_m [speed_mps [minutes [interval_s [seed]]]]]]]]\n",
+		argv[0]);
+	return 1;
+    }
+
+    RHSimNetwork network(seed);
+    posX = new float[numNodes];
+    posY = new float[numNodes];
+    targetX = new float[numNodes];
+    targetY = new float[numNodes];
+    unsigned int i;
+    // The mobile nodes come first, so that their node indexes match
+    for (i = 0; i < numNodes; i++)
+    {
+	RHSimDriver* driver = new RHSimDriver(network);
+	RHMesh* mesh = new RHMesh(*driver, i + 1);
+	posX[i] = network.random(0, (long)side);
+	posY[i] = network.random(0, (long)side);
+	targetX[i] = network.random(0, (long)side);
+	targetY[i] = network.random(0, (long)side);
+	network.addNode(*driver, posX[i], posY[i], nodeTask, mesh);
+    }
+    network.addNode(*new RHSimDriver(network), 0, 0, moverTask, NULL);
+
+    network.run(minutes * 60000);
+    network.printReport(stdout);
+    printf("Route lifetime %lu s, %u of %u nodes moving at %.1f m/s\n", lifetime, numMobile, numNodes, speed);
+    printf("Sends failed: %lu with no route, %lu undeliverable to the next hop\n",
+	   (unsigned long)noRoute, (unsigned long)undelivered);
+    return 0;
+}
@@ -0,0 +1,152 @@
+// recovery_sim.cpp
+//
+// Simulates a source sending regular messages to a destination two hops away through a relay with a long
+// record of success, with a second relay as the backup next hop, and reports how long the source takes
+// to stop trying the relay once it has gone off the air, and what that costs.
+//
+// Build with "make recoverysim" in the top directory, then:
+//   ./recoverysim [fail_s [interval_s [minutes [seed]]]]
+// The primary relay goes off the air fail_s seconds in. The source sends every interval_s seconds.
+
+#include <RHSimNetwork.h>
+#include <RHRouter.h>
+
+// Simulation parameters, from the command line
+static unsigned long failAt   = 600;     // When the primary relay fails, seconds
+static unsigned long interval = 10;      // Time between messages, seconds
+static unsigned long minutes  = 20;      // Virtual time to simulate
+static uint32_t      seed     = 1;       // Random seed
+
+// Addresses
+#define SOURCE  1
+#define PRIMARY 2
+#define BACKUP  3
+#define DEST    4
+
+// Application payload octets
+#define PAYLOAD 20
+
+// What the source saw after the failure
+static unsigned long sentAfter = 0;        // Messages sent
+static unsigned long failedAfter = 0;      // Sends that reached no next hop
+static unsigned long triedPrimary = 0;     // Sends that tried the failed relay first
+static uint64_t      sendTimeAfter = 0;    // Time spent in sendtoWait(), us
+static uint64_t      sendTimeBefore = 0;   // Time spent in sendtoWait() before the failure, us
+static unsigned long sentBefore = 0;
+static long          switchedAt = -1;      // Time the backup became the primary, ms after the failure
+
+static void sourceTask(RHSimDriver& driver, void* arg)
+{
+    RHRouter& router = *(RHRouter*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[PAYLOAD];
+
+    router.init();
+    router.addRouteTo(DEST, PRIMARY);
+    router.addBackupRouteTo(DEST, BACKUP);
+    // Our clock has an offset, but runs at the same rate as the failTask's to within its ppm
+    uint64_t t0 = network.micros();
+    while (true)
+    {
+	delay(interval * 1000);
+	uint64_t start = network.micros() - t0;
+	bool after = start >= (uint64_t)failAt * 1000000;
+	RHAddress first = router.getRouteTo(DEST)->next_hop;
+	uint32_t tag = network.messageSent();
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &tag, sizeof(tag));
+	uint8_t error = router.sendtoWait(buf, sizeof(buf), DEST);
+	uint64_t took = network.micros() - t0 - start;
+	if (after)
+	{
+	    sentAfter++;
+	    sendTimeAfter += took;
+	    if (error != RH_ROUTER_ERROR_NONE)
+		failedAfter++;
+	    if (first == PRIMARY)
+		triedPrimary++;
+	    if (switchedAt < 0 && router.getRouteTo(DEST)->next_hop == BACKUP)
+		switchedAt = (network.micros() - t0 - (uint64_t)failAt * 1000000) / 1000;
+	}
+	else
+	{
+	    sentBefore++;
+	    sendTimeBefore += took;
+	}
+    }
+}
+
+// The relays and the destination
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    RHRouter& router = *(RHRouter*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_ROUTER_MAX_MESSAGE_LEN];
+
+    router.init();
+    if (router.thisAddress() != DEST)
+	router.addRouteTo(DEST, DEST);
+    while (true)
+    {
+	uint8_t len = sizeof(buf);
+	if (router.recvfromAckTimeout(buf, &len, 60000) && len >= sizeof(uint32_t))
+	{
+	    uint32_t tag;
+	    memcpy(&tag, buf, sizeof(tag));
+	    network.messageDelivered(tag, len);
+	}
+    }
+}
+
+// Takes the primary relay off the air
+static void failTask(RHSimDriver& driver, void* arg)
+{
+    delay(failAt * 1000);
+    driver.network().setPosition(*(uint16_t*)arg, 1e6, 1e6);
+    while (true)
+	delay(3600000);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) failAt   = atol(argv[1]);
+    if (argc > 2) interval = atol(argv[2]);
+    if (argc > 3) minutes  = atol(argv[3]);
+    if (argc > 4) seed     = atol(argv[4]);
+    if (interval < 1 || minutes * 60 <= failAt)
+    {
+	fprintf(stderr, "usage: %s [fail_s [interval_s [minutes [seed]]]]\n", argv[0]);
+	return 1;
+    }
+
+    // The source and destination are out of each other's range, the relays halfway between
+    RHSimNetwork network(seed);
+    static const float x[] = { 0, 3000, 3000, 6000 };
+    static const float y[] = { 0,  300, -300,    0 };
+    static uint16_t primaryNode;
+    uint8_t i;
+    for (i = 0; i < 4; i++)
+    {
+	RHSimDriver* driver = new RHSimDriver(network);
+	RHRouter* router = new RHRouter(*driver, i + 1);
+	uint16_t node = network.addNode(*driver, x[i], y[i], i == 0 ? sourceTask : nodeTask, router);
+	if (i + 1 == PRIMARY)
+	    primaryNode = node;
+    }
+    network.addNode(*new RHSimDriver(network), 0, 0, failTask, &primaryNode);
+
+    network.run(minutes * 60000);
+    network.printReport(stdout);
+    printf("Primary relay failed at %lu s, message every %lu s\n", failAt, interval);
+    printf("Mean send time before the failure: %.0f ms\n", sentBefore ? sendTimeBefore / 1000.0 / sentBefore : 0.0);
+    printf("After the failure: %lu sent, %lu failed, %lu tried the failed relay first, mean send time %.0f ms\n",
+	   sentAfter, failedAfter, triedPrimary, sentAfter ? sendTimeAfter / 1000.0 / sentAfter : 0.0);
+    if (sentBefore && sentAfter)
+	printf("Extra send time after the failure: %.2f s\n",
+	       (sendTimeAfter - (double)sendTimeBefore * sentAfter / sentBefore) / 1e6);
+    if (switchedAt >= 0)
+	printf("Backup became the primary %.1f s after the failure\n", switchedAt / 1000.0);
+    else
+	printf("Backup never became the primary\n");
+    return 0;
+}
@@ -0,0 +1,85 @@
+#!/usr/bin/python
+#
+# Measures the jitter of the RxDone and TxDone timestamps (lastTxTime, recvWithMeta) between two radios.
+#
+# Run "rf_timestamp_jitter.py tx [count [interval_s]]" on one Pi and "rf_timestamp_jitter.py rx [count]" on
+# the other. The sender sends count packets of the same length, each carrying the TxDone time of the one
+# before. For each pair of packets the receiver compares the time between their RxDone timestamps with the
+# time between their TxDone timestamps. The packets take the same time on air, so the difference is the
+# error of the four timestamps, plus the drift between the two clocks, which is estimated and taken out.
+
+import sys, os
+
+# Add path to pyRadioHeadRF95 module
+sys.path.append(os.path.dirname(__file__) + "/../")
+
+import pyRadioHeadRF95 as radio
+import struct
+import time
+
+role = sys.argv[1] if len(sys.argv) > 1 else "rx"
+count = int(sys.argv[2]) if len(sys.argv) > 2 else 500
+interval = float(sys.argv[3]) if len(sys.argv) > 3 else 1.0
+
+# Sequence number, TxDone time of the previous packet in ns
+PACKET = "<IQ"
+
+rf95 = radio.RF95()
+rf95.init()
+rf95.setTxPower(14, False)
+rf95.setFrequency(868)
+
+print("StartUp Done!")
+
+if role == "tx":
+    last = 0
+    for seq in range(count + 1):
+        msg = struct.pack(PACKET, seq, last)
+        rf95.send(msg, len(msg))
+        rf95.waitPacketSent()
+        last = rf95.lastTxTime()
+        time.sleep(interval)
+    print("Sent " + str(count + 1) + " packets")
+    sys.exit(0)
+
+# Receiver: RxDone times by sequence number, and TxDone times as they are reported in the next packet
+rxTime = {}
+txTime = {}
+print("Receiving...")
+while len(rxTime) < count + 1:
+    if not rf95.available():
+        time.sleep(0.01)
+        continue
+    (msg, l, meta) = rf95.recvWithMeta()
+    if l != struct.calcsize(PACKET):
+        continue
+    (seq, last) = struct.unpack(PACKET, msg)
+    rxTime[seq] = meta["timestamp"]
+    if seq > 0 and last:
+        txTime[seq - 1] = last
+    if seq == count:
+        break
+
+errors = []
+intervals = []
+for seq in sorted(txTime):
+    if seq - 1 in txTime and seq in rxTime and seq - 1 in rxTime:
+        tx = txTime[seq] - txTime[seq - 1]
+        errors.append((rxTime[seq] - rxTime[seq - 1]) - tx)
+        intervals.append(tx)
+
+if len(errors) < 10:
+    print("Only " + str(len(errors)) + " packet pairs received, not enough to measure")
+    sys.exit(1)
+
+# The clocks drift apart at a constant rate, which shows as an error in proportion to the interval
+drift = float(sum(errors)) / sum(intervals)
+residual = sorted(abs(e - drift * i) / 1000.0 for (e, i) in zip(errors, intervals))
+mean = sum(residual) / len(residual)
+
+def percentile(p):
+    return residual[min(len(residual) - 1, int(p / 100.0 * len(residual)))]
+
+print("%d packet pairs, clock drift %.2f ppm" % (len(residual), drift * 1e6))
+print("Timestamp error per pair: mean %.1f us, median %.1f us, 95th percentile %.1f us, 99th percentile %.1f us, max %.1f us"
+      % (mean, percentile(50), percentile(95), percentile(99), residual[-1]))
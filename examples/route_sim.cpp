@@ -0,0 +1,220 @@
+// route_sim.cpp
+//
+// Replays the traffic of one node in a large mesh against the routing table of an RHRouter, and reports
+// how often a route had to be rediscovered and what the routing table work cost on this host. The same
+// traffic is replayed against a model of the original table, which scanned its entries linearly and
+// retired the oldest by shifting the array down, for comparison.
+//
+// Build with "make routesim" in the top directory, then:
+//   ./routesim [nodes [messages [skew [overheard [seed]]]]]
+// Each message goes to another node chosen with Zipf popularity of exponent skew, 0 being uniform. Each
+// message is accompanied by overheard routes to other nodes, drawn in the same way, as RHMesh learns
+// them from route discovery traffic passing by.
+// The table holds RH_ROUTING_TABLE_SIZE routes, which can be set at build time, for example:
+//   make routesim SIMFLAGS=-DRH_ROUTING_TABLE_SIZE=50
+
+#include <RHSimNetwork.h>
+#include <RHMesh.h>
+#include <math.h>
+#include <time.h>
+
+// Simulation parameters, from the command line
+static unsigned int  numNodes  = 150;     // Number of nodes in the mesh
+static unsigned long messages  = 100000;  // Messages sent by the node under test
+static float         skew      = 1.0;     // Zipf exponent of destination popularity
+static unsigned int  overheard = 1;       // Routes overheard per message sent
+static uint32_t      seed      = 1;       // Random seed
+
+// Times each replay is repeated, to get above the resolution of the clock
+#define REPEATS 20
+
+// One event of the traffic
+struct Event
+{
+    bool      send;   // Send a message to addr, else learn a route to addr
+    RHAddress addr;
+};
+
+// The original routing table: linear scans, and the oldest entry retired by shifting the rest down
+class LinearTable
+{
+public:
+    LinearTable(unsigned int size) : _size(size) { _routes = new RHRouter::RoutingTableEntry[size]; clear(); }
+
+    void clear()
+    {
+	unsigned int i;
+	for (i = 0; i < _size; i++)
+	{
+	    _routes[i].dest = 0;
+	    _routes[i].state = RHRouter::Invalid;
+	}
+    }
+
+    RHRouter::RoutingTableEntry* getRouteTo(RHAddress dest)
+    {
+	unsigned int i;
+	for (i = 0; i < _size; i++)
+	    if (_routes[i].dest == dest && _routes[i].state != RHRouter::Invalid)
+		return &_routes[i];
+	return NULL;
+    }
+
+    void addRouteTo(RHAddress dest, RHAddress next_hop)
+    {
+	unsigned int i;
+	for (i = 0; i < _size; i++)
+	    if (_routes[i].dest == dest)
+		break;
+	if (i == _size)
+	    for (i = 0; i < _size; i++)
+		if (_routes[i].state == RHRouter::Invalid)
+		    break;
+	if (i == _size)
+	{
+	    memmove(&_routes[0], &_routes[1], sizeof(_routes[0]) * (_size - 1));
+	    i = _size - 1;
+	}
+	_routes[i].dest = dest;
+	_routes[i].next_hop = next_hop;
+	_routes[i].state = RHRouter::Valid;
+    }
+
+private:
+    unsigned int                 _size;
+    RHRouter::RoutingTableEntry* _routes;
+};
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Any node will do as the next hop
+static RHAddress nextHop(RHAddress dest)
+{
+    return 2 + dest % 4;
+}
+
+// Replays the traffic against a table, returning the number of rediscoveries and the time taken
+template <class Table> static unsigned long replay(Table& table, Event* events, unsigned long numEvents,
+						   double* elapsed)
+{
+    unsigned long rediscoveries = 0;
+    double start = seconds();
+    unsigned int r;
+    for (r = 0; r < REPEATS; r++)
+    {
+	table.clear();
+	rediscoveries = 0;
+	unsigned long e;
+	for (e = 0; e < numEvents; e++)
+	{
+	    RHAddress addr = events[e].addr;
+	    if (!events[e].send)
+		table.addRouteTo(addr, nextHop(addr));
+	    else if (!table.getRouteTo(addr))
+	    {
+		// This is where RHMesh would spend up to RH_MESH_ARP_TIMEOUT on discovery
+		rediscoveries++;
+		table.addRouteTo(addr, nextHop(addr));
+	    }
+	}
+    }
+    *elapsed = (seconds() - start) / REPEATS;
+    return rediscoveries;
+}
+
+// The RHRouter under test, reduced to its routing table
+class RouterTable : public RHRouter
+{
+public:
+    RouterTable(RHGenericDriver& driver) : RHRouter(driver, 1) { setRouteLifetime(0); }
+    void clear() { clearRoutingTable(); }
+    void addRouteTo(RHAddress dest, RHAddress next_hop) { RHRouter::addRouteTo(dest, next_hop); }
+    RoutingTableEntry* getRouteTo(RHAddress dest)
+    {
+	// route() marks a route used when it sends over it
+	RoutingTableEntry* route = RHRouter::getRouteTo(dest);
+	if (route)
+	    refreshRouteTo(dest, route->next_hop);
+	return route;
+    }
+};
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) numNodes  = atoi(argv[1]);
+    if (argc > 2) messages  = atol(argv[2]);
+    if (argc > 3) skew      = atof(argv[3]);
+    if (argc > 4) overheard = atoi(argv[4]);
+    if (argc > 5) seed      = atol(argv[5]);
+    if (numNodes < 3 || numNodes > RH_BROADCAST_ADDRESS || messages < 1 || skew < 0)
+    {
+	fprintf(stderr, "usage: %s [nodes [messages [skew [overheard [seed]]]]]\n", argv[0]);
+	return 1;
+    }
+
+    RHSimNetwork network(seed);
+    RHSimDriver driver(network);
+
+    // Popularity of the other nodes, ranked in random order
+    unsigned int others = numNodes - 1;
+    RHAddress* ranked = new RHAddress[others];
+    double* cumulative = new double[others];
+    unsigned int i;
+    for (i = 0; i < others; i++)
+	ranked[i] = i + 2;
+    for (i = others - 1; i > 0; i--)
+    {
+	unsigned int j = network.random(0, i + 1);
+	RHAddress t = ranked[i];
+	ranked[i] = ranked[j];
+	ranked[j] = t;
+    }
+    double total = 0;
+    for (i = 0; i < others; i++)
+	cumulative[i] = total += pow(i + 1, -skew);
+
+    unsigned long numEvents = messages * (1 + overheard);
+    Event* events = new Event[numEvents];
+    unsigned long e;
+    for (e = 0; e < numEvents; e++)
+    {
+	double u = network.random(0, 1000000) / 1000000.0 * total;
+	unsigned int lo = 0, hi = others - 1;
+	while (lo < hi)
+	{
+	    unsigned int mid = (lo + hi) / 2;
+	    if (cumulative[mid] < u)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	events[e].send = e % (1 + overheard) == 0;
+	events[e].addr = ranked[lo];
+    }
+
+    RouterTable router(driver);
+    LinearTable linear(RH_ROUTING_TABLE_SIZE);
+    LinearTable linearAll(others);
+    double routerTime, linearTime, linearAllTime;
+    unsigned long routerMisses = replay(router, events, numEvents, &routerTime);
+    unsigned long linearMisses = replay(linear, events, numEvents, &linearTime);
+    unsigned long linearAllMisses = replay(linearAll, events, numEvents, &linearAllTime);
+
+    printf("%u nodes, %lu messages, Zipf skew %.2f, %u overheard routes per message\n",
+	   numNodes, messages, skew, overheard);
+    printf("%-34s %10s %16s %12s\n", "Table", "Entries", "Rediscoveries", "ns/event");
+    printf("%-34s %10u %15.2f%% %12.1f\n", "RHRouter, indexed, LRU", RH_ROUTING_TABLE_SIZE,
+	   100.0 * routerMisses / messages, routerTime * 1e9 / numEvents);
+    printf("%-34s %10u %15.2f%% %12.1f\n", "Original, linear, oldest retired", RH_ROUTING_TABLE_SIZE,
+	   100.0 * linearMisses / messages, linearTime * 1e9 / numEvents);
+    printf("%-34s %10u %15.2f%% %12.1f\n", "Original, linear, oldest retired", others,
+	   100.0 * linearAllMisses / messages, linearAllTime * 1e9 / numEvents);
+    printf("Rediscoveries are per message sent. Each costs a route discovery of up to %.1f s\n",
+	   RH_MESH_ARP_TIMEOUT / 1000.0);
+    return 0;
+}
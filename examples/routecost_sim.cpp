@@ -0,0 +1,130 @@
+// routecost_sim.cpp
+//
+// Simulates a mesh of RHMesh nodes over fading links, each sending messages to random other nodes, and
+// reports the end to end delivery ratio and the airtime per delivered message with routes chosen in one
+// of three ways:
+//   first  the first route discovery response wins and every hop costs the same, as RHMesh originally did
+//   hops   the response over the fewest hops within the discovery window wins
+//   snr    the response with the lowest accumulated link cost (see RHMesh::linkCost()) wins, the default
+//
+// Build with "make routecostsim" in the top directory, then:
+//   ./routecostsim [first|hops|snr [nodes [side_m [fading_db [minutes [interval_s [seed]]]]]]]
+// Each frame's received power varies about the path loss with a normal deviate of fading_db, so a long hop
+// with little margin works some of the time, and wins the race to answer discovery more often than not.
+
+#include <RHSimNetwork.h>
+#include <RHMesh.h>
+#include <math.h>
+
+// Simulation parameters, from the command line
+static const char*   mode     = "snr";   // How routes are chosen
+static unsigned int  numNodes = 40;      // Number of nodes
+static float         side     = 12000;   // Side of the square area, metres
+static float         fading   = 4;       // Standard deviation of the per frame fading, dB
+static unsigned long minutes  = 120;     // Virtual time to simulate
+static unsigned long interval = 300;     // Mean time between messages from each node, seconds
+static uint32_t      seed     = 1;       // Random seed
+
+// Application payload octets
+#define PAYLOAD 20
+
+// Path loss with fading that changes from frame to frame
+class FadingNetwork : public RHSimNetwork
+{
+public:
+    FadingNetwork(uint32_t seed) : RHSimNetwork(seed) {}
+
+protected:
+    virtual float pathLoss(uint16_t from, uint16_t to)
+    {
+	// Box-Muller normal deviate
+	float u1 = (random(0, 1000000) + 1) / 1000001.0;
+	float u2 = random(0, 1000000) / 1000000.0;
+	return RHSimNetwork::pathLoss(from, to) + fading * sqrtf(-2.0 * logf(u1)) * cosf(2.0 * M_PI * u2);
+    }
+};
+
+// RHMesh with the link cost the mode calls for
+class CostMesh : public RHMesh
+{
+public:
+    CostMesh(RHGenericDriver& driver, RHAddress thisAddress) : RHMesh(driver, thisAddress) {}
+
+protected:
+    virtual uint8_t linkCost()
+    {
+	return strcmp(mode, "snr") == 0 ? RHMesh::linkCost() : RH_MESH_HOP_COST;
+    }
+};
+
+// Main program of every node
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    CostMesh& mesh = *(CostMesh*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+
+    mesh.init();
+    if (strcmp(mode, "first") == 0)
+	mesh.setDiscoveryWindow(0);
+    unsigned long nextSend = millis() + random(0, interval * 1000);
+    while (true)
+    {
+	long wait = (long)(nextSend - millis());
+	if (wait <= 0)
+	{
+	    RHAddress dest = random(1, numNodes);
+	    if (dest >= mesh.thisAddress())
+		dest++;
+	    uint32_t tag = network.messageSent();
+	    memset(buf, 0, PAYLOAD);
+	    memcpy(buf, &tag, sizeof(tag));
+	    mesh.sendtoWait(buf, PAYLOAD, dest);
+	    nextSend += random(interval * 500, interval * 1500);
+	    continue;
+	}
+
+	uint8_t len = sizeof(buf);
+	RHAddress from;
+	if (mesh.recvfromAckTimeout(buf, &len, wait > 60000 ? 60000 : wait, &from) && len >= sizeof(uint32_t))
+	{
+	    uint32_t tag;
+	    memcpy(&tag, buf, sizeof(tag));
+	    network.messageDelivered(tag, len);
+	}
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) mode     = argv[1];
+    if (argc > 2) numNodes = atoi(argv[2]);
+    if (argc > 3) side     = atof(argv[3]);
+    if (argc > 4) fading   = atof(argv[4]);
+    if (argc > 5) minutes  = atol(argv[5]);
+    if (argc > 6) interval = atol(argv[6]);
+    if (argc > 7) seed     = atol(argv[7]);
+    if (   (strcmp(mode, "first") && strcmp(mode, "hops") && strcmp(mode, "snr"))
+	|| numNodes < 2 || fading < 0 || interval < 1)
+    {
+	fprintf(stderr, "usage: %s [first|hops|snr [nodes [side_m [fading_db [minutes [interval_s [seed]]]]]]]\n",
+		argv[0]);
+	return 1;
+    }
+
+    FadingNetwork network(seed);
+    unsigned int i;
+    for (i = 0; i < numNodes; i++)
+    {
+	RHSimDriver* driver = new RHSimDriver(network);
+	CostMesh* mesh = new CostMesh(*driver, i + 1);
+	float x = network.random(0, (long)side);
+	float y = network.random(0, (long)side);
+	network.addNode(*driver, x, y, nodeTask, mesh);
+    }
+
+    network.run(minutes * 60000);
+    network.printReport(stdout);
+    printf("Routes chosen by %s, %u nodes in %.0f m square, %.1f dB fading\n", mode, numNodes, side, fading);
+    return 0;
+}
@@ -0,0 +1,157 @@
+// sfscan_sim.cpp
+//
+// A gateway with a single radio scans several spreading factors with setSFScan() while nodes
+// around it each send on the spreading factor they were given, and reports how likely a message
+// on each spreading factor was to be detected and received.
+//
+// Build with "make sfscansim" in the top directory, then:
+//   ./sfscansim [lowest_sf-highest_sf [preamble [nodes [load [minutes [seed]]]]]]
+// preamble is the senders' preamble length in symbols, by default the shortest the scan can catch on every
+// spreading factor in the range: 8 for one, 72 for SF7 to SF12. load is the offered traffic on each spreading
+// factor as a fraction of its capacity, kept low by default so that collisions between nodes are rare
+// and the losses are mostly preambles the scan missed. Nodes are within 1 km, so all are strong enough.
+
+#include <RHSimNetwork.h>
+#include <RHDatagram.h>
+#include <math.h>
+
+// Simulation parameters, from the command line
+static uint8_t       lowestSF  = 7;       // Spreading factors used by the nodes and scanned by the gateway
+static uint8_t       highestSF = 12;
+static uint16_t      preamble  = 0;       // Senders' preamble length, symbols, 0 for coveringPreamble()
+static unsigned int  numNodes  = 30;      // Nodes, given spreading factors in turn
+static float         load      = 0.05;    // Offered load on each spreading factor, fraction of channel time
+static unsigned long minutes   = 60;      // Virtual time to simulate
+static uint32_t      seed      = 1;       // Random seed
+
+// Application payload octets
+#define PAYLOAD 20
+
+// Messages sent and received on each spreading factor
+static uint32_t      sent[RH_SF_SCAN_MAX + 1];
+static uint32_t      received[RH_SF_SCAN_MAX + 1];
+
+// Whether setSFScan() expected to catch every preamble
+static bool          covered;
+
+// The shortest preamble setSFScan() can catch on every spreading factor, see RHGenericDriver::planSFScan():
+// after a CAD on the fastest and one on the slowest, still time for a CAD and the receiver to lock on.
+// The simulated radio's CADs take 2 symbols
+static uint16_t coveringPreamble()
+{
+    uint16_t cads = lowestSF == highestSF ? 1 : (1 << (highestSF - lowestSF)) + 1;
+    return 2 * cads + 2 + RH_SF_SCAN_LOCK_SYMBOLS;
+}
+
+struct Node
+{
+    RHSimDriver*  radio;
+    RHDatagram*   manager;
+    uint8_t       sf;
+    float         interval;  // Mean time between messages, ms
+};
+
+static void gatewayTask(RHSimDriver& driver, void* arg)
+{
+    Node& node = *(Node*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_SIM_MAX_MESSAGE_LEN];
+
+    node.manager->init();
+    covered = driver.setSFScan(((1 << (highestSF + 1)) - 1) & ~((1 << lowestSF) - 1), preamble);
+    while (true)
+    {
+	uint8_t len = sizeof(buf);
+	if (node.manager->recvfrom(buf, &len) && len >= sizeof(uint32_t))
+	{
+	    uint32_t tag;
+	    memcpy(&tag, buf, sizeof(tag));
+	    network.messageDelivered(tag, len);
+	    received[driver.lastRxSpreadingFactor()]++;
+	}
+	else
+	    node.manager->waitAvailableTimeout(60000);
+    }
+}
+
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    Node& node = *(Node*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[PAYLOAD];
+
+    node.manager->init();
+    driver.setModemParams(node.sf, 125000, 5);
+    driver.setPreambleLength(preamble);
+    delay(network.random(0, (long)node.interval));
+    while (true)
+    {
+	// Poisson arrivals, sent without listening first, as LoRaWAN class A devices do
+	uint32_t tag = network.messageSent();
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &tag, sizeof(tag));
+	node.manager->sendto(buf, sizeof(buf), 1);
+	driver.waitPacketSent();
+	driver.sleep();
+	sent[node.sf]++;
+	delay(-logf(network.random(1, 1000000) / 1000000.0) * node.interval);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) sscanf(argv[1], "%hhu-%hhu", &lowestSF, &highestSF);
+    if (argc > 2) preamble = atoi(argv[2]);
+    if (argc > 3) numNodes = atoi(argv[3]);
+    if (argc > 4) load     = atof(argv[4]);
+    if (argc > 5) minutes  = atol(argv[5]);
+    if (argc > 6) seed     = atol(argv[6]);
+    if (lowestSF < RH_SF_SCAN_MIN || highestSF > RH_SF_SCAN_MAX || lowestSF > highestSF
+	|| (argc > 2 && preamble < 6) || numNodes < 1 || load <= 0 || minutes < 1)
+    {
+	fprintf(stderr, "usage: %s [lowest_sf-highest_sf [preamble [nodes [load [minutes [seed]]]]]]\n", argv[0]);
+	return 1;
+    }
+
+    if (!preamble)
+	preamble = coveringPreamble();
+
+    RHSimNetwork network(seed);
+    uint8_t numSFs = highestSF - lowestSF + 1;
+    Node* nodes = new Node[numNodes + 1];
+    unsigned int i;
+    for (i = 0; i <= numNodes; i++)
+    {
+	nodes[i].radio = new RHSimDriver(network);
+	nodes[i].manager = new RHDatagram(*nodes[i].radio, i + 1);
+	nodes[i].sf = lowestSF + (i ? (i - 1) % numSFs : 0);
+	// Each spreading factor carries load of its own capacity between its nodes
+	unsigned int sharing = numNodes / numSFs + ((i - 1) % numSFs < numNodes % numSFs ? 1 : 0);
+	nodes[i].radio->setModemParams(nodes[i].sf, 125000, 5);
+	nodes[i].radio->setPreambleLength(preamble);
+	nodes[i].interval = (float)sharing * nodes[i].radio->timeOnAir(PAYLOAD) / 1000 / load;
+	float angle = network.random(0, 3600) * M_PI / 1800;
+	float range = i ? 1000 * sqrtf(network.random(0, 1000000) / 1000000.0) : 0;
+	network.addNode(*nodes[i].radio, range * cosf(angle), range * sinf(angle),
+			i ? nodeTask : gatewayTask, &nodes[i]);
+    }
+    // The gateway keeps its own settings for sending
+    nodes[0].radio->setModemParams(lowestSF, 125000, 5);
+    nodes[0].radio->setPreambleLength(preamble);
+
+    network.run(minutes * 60000);
+    network.printReport(stdout);
+
+    printf("Scanning SF%u to SF%u, %u symbol preamble: %s\n", lowestSF, highestSF, preamble,
+	   covered ? "every preamble should be caught" : "the scan cannot look at every spreading factor in time");
+    printf("SF  sent   received  CADs     detections  max gap / window (ms)\n");
+    uint8_t sf;
+    for (sf = lowestSF; sf <= highestSF; sf++)
+    {
+	const RHGenericDriver::SFScanStats& stats = nodes[0].radio->sfScanStats(sf);
+	printf("%-3u %-6u %5.1f%%    %-8u %-11u %.1f / %.1f\n", sf, sent[sf],
+	       sent[sf] ? 100.0 * received[sf] / sent[sf] : 0.0, stats.cads, stats.detections,
+	       stats.maxGap / 1000.0, stats.window / 1000.0);
+    }
+    return 0;
+}
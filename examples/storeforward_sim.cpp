@@ -0,0 +1,150 @@
+// storeforward_sim.cpp
+//
+// Simulates a source sending regular messages through a relay to a destination that is only
+// intermittently in range of the relay, as a node that sleeps or roams would be, and reports the
+// delivery ratio with and without store-and-forward at the relay.
+//
+// Build with "make storeforwardsim" in the top directory, then:
+//   ./storeforwardsim [on|off [up_s [down_s [max_age_s [interval_s [minutes [seed]]]]]]]
+// The destination is in range for up_s seconds, then out of range for down_s seconds, and so on, and
+// says hello with a broadcast each time it comes back. Held messages are dropped after max_age_s, or
+// after RH_ROUTER_FORWARD_MAX_RETRIES timed retries.
+
+#include <RHSimNetwork.h>
+#include <RHRouter.h>
+
+// Simulation parameters, from the command line
+static bool          enabled  = true;    // Store-and-forward at the relay
+static unsigned long up       = 60;      // Time the destination is in range, seconds
+static unsigned long down     = 60;      // Time the destination is out of range, seconds
+static unsigned long maxAge   = RH_ROUTER_FORWARD_MAX_AGE / 1000; // Age after which held messages are dropped, s
+static unsigned long interval = 20;      // Time between messages from the source, seconds
+static unsigned long minutes  = 240;     // Virtual time to simulate
+static uint32_t      seed     = 1;       // Random seed
+
+// Addresses
+#define SOURCE 1
+#define RELAY  2
+#define DEST   3
+
+// Application payload octets
+#define PAYLOAD 20
+
+static RHRouter* routers[3];
+static uint16_t  destNode;
+static bool      woken = false;  // The destination has just come back into range
+
+static void sourceTask(RHSimDriver& driver, void* arg)
+{
+    RHRouter& router = *(RHRouter*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[PAYLOAD];
+
+    router.init();
+    router.addRouteTo(DEST, RELAY);
+    delay(network.random(0, interval * 1000));
+    while (true)
+    {
+	uint32_t tag = network.messageSent();
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &tag, sizeof(tag));
+	router.sendtoWait(buf, sizeof(buf), DEST);
+	delay(interval * 1000);
+    }
+}
+
+static void relayTask(RHSimDriver&, void* arg)
+{
+    RHRouter& router = *(RHRouter*)arg;
+    uint8_t buf[RH_ROUTER_MAX_MESSAGE_LEN];
+
+    router.init();
+    router.addRouteTo(DEST, DEST);
+    router.addRouteTo(SOURCE, SOURCE);
+    router.setStoreAndForward(enabled, maxAge * 1000);
+    while (true)
+    {
+	uint8_t len = sizeof(buf);
+	router.recvfromAckTimeout(buf, &len, 60000);
+    }
+}
+
+static void destTask(RHSimDriver& driver, void* arg)
+{
+    RHRouter& router = *(RHRouter*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_ROUTER_MAX_MESSAGE_LEN];
+
+    router.init();
+    router.addRouteTo(SOURCE, RELAY);
+    while (true)
+    {
+	if (woken)
+	{
+	    // Let the neighbours know we are back
+	    woken = false;
+	    uint8_t hello = 0;
+	    router.sendtoWait(&hello, sizeof(hello), RH_BROADCAST_ADDRESS);
+	}
+	uint8_t len = sizeof(buf);
+	RHAddress dest;
+	if (router.recvfromAckTimeout(buf, &len, 1000, NULL, &dest) && dest == DEST && len >= sizeof(uint32_t))
+	{
+	    uint32_t tag;
+	    memcpy(&tag, buf, sizeof(tag));
+	    network.messageDelivered(tag, len);
+	}
+    }
+}
+
+// Moves the destination in and out of range of the relay
+static void cycleTask(RHSimDriver& driver, void*)
+{
+    RHSimNetwork& network = driver.network();
+    while (true)
+    {
+	delay(up * 1000);
+	network.setPosition(destNode, 1e6, 1e6);
+	delay(down * 1000);
+	network.setPosition(destNode, 6000, 0);
+	woken = true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) enabled  = strcmp(argv[1], "off") != 0;
+    if (argc > 2) up       = atol(argv[2]);
+    if (argc > 3) down     = atol(argv[3]);
+    if (argc > 4) maxAge   = atol(argv[4]);
+    if (argc > 5) interval = atol(argv[5]);
+    if (argc > 6) minutes  = atol(argv[6]);
+    if (argc > 7) seed     = atol(argv[7]);
+    if (up < 1 || interval < 1)
+    {
+	fprintf(stderr, "usage: %s [on|off [up_s [down_s [max_age_s [interval_s [minutes [seed]]]]]]]\n", argv[0]);
+	return 1;
+    }
+
+    // The source and destination are out of each other's range, the relay halfway between
+    RHSimNetwork network(seed);
+    static const float x[] = { 0, 3000, 6000 };
+    static const RHSimTask tasks[] = { sourceTask, relayTask, destTask };
+    uint8_t i;
+    for (i = 0; i < 3; i++)
+    {
+	RHSimDriver* driver = new RHSimDriver(network);
+	routers[i] = new RHRouter(*driver, i + 1);
+	uint16_t node = network.addNode(*driver, x[i], 0, tasks[i], routers[i]);
+	if (i + 1 == DEST)
+	    destNode = node;
+    }
+    network.addNode(*new RHSimDriver(network), 0, 0, cycleTask, NULL);
+
+    network.run(minutes * 60000);
+    network.printReport(stdout);
+    printf("Store-and-forward %s, destination up %lu s and down %lu s, held messages dropped after %lu s\n",
+	   enabled ? "on" : "off", up, down, maxAge);
+    printf("Held messages dropped at the relay: %u\n", routers[RELAY - 1]->forwardDropped());
+    return 0;
+}
@@ -0,0 +1,172 @@
+// tdma_sim.cpp
+//
+// Compares listen-before-talk (CSMA) with RHTdma on a star of nodes all sending to one
+// coordinator, and reports how much of the channel carried delivered messages.
+//
+// Build with "make tdmasim" in the top directory, then:
+//   ./tdmasim [csma|tdma [nodes [load [radius_m [minutes [payload [seed]]]]]]]
+// load is the offered traffic as a fraction of the channel capacity, summed over all nodes.
+// Nodes are placed up to radius_m from the coordinator. Beyond about 2 km some of them can no longer
+// hear each other, and listen-before-talk stops protecting their transmissions from each other.
+
+#include <RHSimNetwork.h>
+#include <RHDatagram.h>
+#include <RHTdma.h>
+#include <math.h>
+
+// Simulation parameters, from the command line
+static bool          tdma     = true;    // RHTdma, else CSMA
+static unsigned int  numNodes = 20;      // Number of nodes sending to the coordinator
+static float         load     = 0.8;     // Offered load, fraction of channel time
+static float         radius   = 3000;    // Largest distance from the coordinator, metres
+static unsigned long minutes  = 30;      // Virtual time to simulate
+static uint8_t       payload  = 20;      // Application payload octets
+static uint32_t      seed     = 1;       // Random seed
+
+// Traffic starts after this much network time, so that nodes can join first, ms
+#define WARMUP 20000
+
+// Mean time between messages from each node, ms
+static float         interval;
+
+// Messages delivered to the coordinator
+static uint32_t      delivered = 0;
+
+// Every node runs a datagram manager over either the plain simulated radio or RHTdma
+struct Node
+{
+    RHSimDriver*  radio;
+    RHTdma*       tdma;
+    RHDatagram*   manager;
+};
+
+static void coordinatorTask(RHSimDriver& driver, void* arg)
+{
+    Node& node = *(Node*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_SIM_MAX_MESSAGE_LEN];
+
+    node.manager->init();
+    if (node.tdma)
+	node.tdma->setCoordinator(numNodes + 1, payload);
+    while (true)
+    {
+	uint8_t len = sizeof(buf);
+	if (node.manager->recvfrom(buf, &len) && len >= sizeof(uint32_t))
+	{
+	    uint32_t tag;
+	    memcpy(&tag, buf, sizeof(tag));
+	    network.messageDelivered(tag, len);
+	    delivered++;
+	}
+	else
+	    node.manager->waitAvailableTimeout(60000);
+    }
+}
+
+static void nodeTask(RHSimDriver& driver, void* arg)
+{
+    Node& node = *(Node*)arg;
+    RHSimNetwork& network = driver.network();
+    uint8_t buf[RH_SIM_MAX_MESSAGE_LEN];
+
+    node.manager->init();
+    if (node.tdma)
+	node.tdma->join();
+    else
+	driver.setCADTimeout(10000);
+
+    // Node clocks have random offsets, so the warm up is timed from the node's own start
+    float nextSend = millis() + WARMUP + network.random(0, (long)interval);
+    while (true)
+    {
+	long wait = (long)(nextSend - millis());
+	if (wait <= 0)
+	{
+	    // Poisson arrivals. A node that was held up sends its backlog back to back
+	    uint32_t tag = network.messageSent();
+	    memset(buf, 0, payload);
+	    memcpy(buf, &tag, sizeof(tag));
+	    node.manager->sendto(buf, payload, 1);
+	    nextSend += -logf(network.random(1, 1000000) / 1000000.0) * interval;
+	    continue;
+	}
+	// Nothing is sent to the nodes, but RHTdma needs polling to follow the beacons
+	uint8_t len = sizeof(buf);
+	if (!node.manager->recvfrom(buf, &len))
+	    node.manager->waitAvailableTimeout(wait > 60000 ? 60000 : wait);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) tdma     = strcmp(argv[1], "csma") != 0;
+    if (argc > 2) numNodes = atoi(argv[2]);
+    if (argc > 3) load     = atof(argv[3]);
+    if (argc > 4) radius   = atof(argv[4]);
+    if (argc > 5) minutes  = atol(argv[5]);
+    if (argc > 6) payload  = atoi(argv[6]);
+    if (argc > 7) seed     = atol(argv[7]);
+    if (numNodes < 1 || numNodes >= RH_TDMA_MAX_SLOTS || load <= 0 || payload < sizeof(uint32_t)
+	|| payload > RH_SIM_MAX_MESSAGE_LEN || minutes * 60000 <= WARMUP)
+    {
+	fprintf(stderr, "usage: %s [csma|tdma [nodes [load [radius_m [minutes [payload [seed]]]]]]]\n", argv[0]);
+	return 1;
+    }
+
+    RHSimNetwork network(seed);
+    Node* nodes = new Node[numNodes + 1];
+    unsigned int i;
+    for (i = 0; i <= numNodes; i++)
+    {
+	nodes[i].radio = new RHSimDriver(network);
+	nodes[i].tdma = tdma ? new RHTdma(*nodes[i].radio) : NULL;
+	nodes[i].manager = new RHDatagram(tdma ? (RHGenericDriver&)*nodes[i].tdma : *nodes[i].radio, i + 1);
+	// Spread evenly over a disc around the coordinator
+	float angle = network.random(0, 3600) * M_PI / 1800;
+	float range = i ? radius * sqrtf(network.random(0, 1000000) / 1000000.0) : 0;
+	network.addNode(*nodes[i].radio, range * cosf(angle), range * sinf(angle),
+			i ? nodeTask : coordinatorTask, &nodes[i]);
+    }
+    uint32_t airtime = nodes[0].radio->timeOnAir(payload);
+    interval = (float)numNodes * airtime / 1000 / load;
+
+    network.run(minutes * 60000);
+    network.printReport(stdout);
+
+    float elapsed = (minutes * 60000 - WARMUP) * 1000.0;
+    printf("MAC: %s, %u nodes within %.0f m, offered load %.0f%% of the channel\n",
+	   tdma ? "TDMA" : "CSMA", numNodes, radius, load * 100);
+    printf("Channel utilisation: %.1f%% of the time carried messages that were delivered\n",
+	   100.0 * delivered * airtime / elapsed);
+    if (!tdma)
+    {
+	// Contention: how long listen-before-talk held each message back
+	uint32_t attempts = 0, cads = 0, busy = 0, timeouts = 0, longest = 0;
+	uint64_t delay = 0;
+	for (i = 1; i <= numNodes; i++)
+	{
+	    const RHGenericDriver::CADStats& stats = nodes[i].radio->cadStats();
+	    attempts += stats.attempts;
+	    cads += stats.cads;
+	    busy += stats.busy;
+	    timeouts += stats.timeouts;
+	    delay += stats.totalDelay;
+	    if (stats.maxDelay > longest)
+		longest = stats.maxDelay;
+	}
+	if (attempts)
+	    printf("CAD: %.2f per message, %.1f%% busy, %u timeouts, contention delay mean %.1f ms, max %.1f ms\n",
+		   (float)cads / attempts, 100.0 * busy / cads, timeouts, delay / 1000.0 / attempts, longest / 1000.0);
+    }
+    else
+    {
+	int32_t worst = 0;
+	for (i = 1; i <= numNodes; i++)
+	    if (abs(nodes[i].tdma->clockError()) > worst)
+		worst = abs(nodes[i].tdma->clockError());
+	printf("Superframe %.1f ms, largest clock error at the last beacon %d us\n",
+	       nodes[0].tdma->superframeTime() / 1000.0, worst);
+    }
+    return 0;
+}
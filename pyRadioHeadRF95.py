@@ -5,12 +5,6 @@ import os
 
 ffi = FFI()
 
-buf = ffi.new("char[]", 1024)
-l = ffi.new("uint8_t*")
-l[0] = 0
-src = ffi.new("uint8_t*")
-src[0] = 0
-
 
 class RF95:
     # Bandwidth values
@@ -40,9 +34,49 @@ class RF95:
     CodingRate4_7 = 7
     CodingRate4_8 = 8
 
+    # The callback given to setFragmentSink(), kept referenced while the library may call it
+    fragmentSink = None
+
     def __init__(self):
 
-        ffi.cdef("int init();\
+        ffi.cdef("typedef struct {\
+                      uint64_t timestamp;\
+                      int16_t rssi;\
+                      int16_t snr;\
+                      int32_t freqError;\
+                      uint16_t to;\
+                      uint16_t from;\
+                      uint8_t id;\
+                      uint8_t flags;\
+                  } rx_meta_t;\
+                  typedef struct {\
+                      uint32_t attempts;\
+                      uint32_t cads;\
+                      uint32_t busy;\
+                      uint32_t timeouts;\
+                      uint64_t totalDelay;\
+                      uint32_t maxDelay;\
+                      uint32_t lastDelay;\
+                      uint16_t lastCads;\
+                  } cad_stats_t;\
+                  typedef struct {\
+                      uint32_t cads;\
+                      uint32_t detections;\
+                      uint32_t received;\
+                      uint32_t maxGap;\
+                      uint32_t window;\
+                  } sf_scan_stats_t;\
+                  typedef struct {\
+                      uint32_t sent;\
+                      uint32_t compressed;\
+                      uint32_t octetsIn;\
+                      uint32_t octetsOut;\
+                      uint64_t airtimeSaved;\
+                      uint64_t cpuTime;\
+                      uint32_t received;\
+                      uint32_t dropped;\
+                  } compression_stats_t;\
+                  int init();\
                   void setTxPower(int8_t power, bool useRFO);\
                   bool setFrequency(float centre);\
                   void setSpreadingFactor(int8_t sf);\
@@ -53,6 +87,8 @@ class RF95:
           int waitAvailableTimeout(int ms);\
           int available();\
           int recv(char* buf, uint8_t* len);\
+          int recvWithMeta(char* buf, uint8_t* len, rx_meta_t* meta);\
+          int recvInto(uint8_t* buf, uint8_t cap, rx_meta_t* meta);\
           int maxMessageLength();\
           int printRegisters();\
           int enterSleepMode();\
@@ -69,10 +105,60 @@ class RF95:
           int setRetries(uint8_t retries);\
           int retransmissions();\
           int resetRetransmissions();\
+          \
+          typedef uint8_t (*fragment_source_t)(uint32_t offset, uint8_t* buf, uint8_t len, void* arg);\
+          typedef bool (*fragment_sink_t)(uint16_t from, uint32_t offset, const uint8_t* data, uint8_t len, void* arg);\
+          int fragmenterInit();\
+          int sendFragmented(const uint8_t* data, uint32_t len, uint16_t dst);\
+          int sendFragmentedFrom(fragment_source_t source, void* arg, uint32_t len, uint16_t dst);\
+          int recvFragmented(uint8_t* buf, uint32_t* len, uint16_t timeout, uint16_t* from);\
+          void setFragmentSink(fragment_sink_t sink, void* arg);\
+          void setFragmentLength(uint8_t len);\
+          int fragmentLength();\
+          uint32_t fragmentBufferSize();\
+          uint32_t fragmentRetransmissions();\
+          int compressionInit(const uint8_t* dict, uint16_t len, uint8_t id);\
+          void getCompressionStats(compression_stats_t* stats);\
+          void clearCompressionStats();\
+          int fountainInit();\
+          int broadcastFountain(const uint8_t* data, uint32_t len, const uint16_t* receivers, uint16_t numReceivers);\
+          int recvFountain(uint8_t* buf, uint32_t* len, uint16_t timeout, uint16_t* from);\
+          void setFountainFeedback(uint16_t window, uint8_t burst);\
+          uint32_t fountainBufferSize();\
+          int fountainBlocksSent();\
+          \
           int lastSNR();\
           int lastRssi();\
           bool isChannelActive();\
+          void setCADTimeout(unsigned long timeout);\
+          void setCADBackoff(uint8_t minExponent, uint8_t maxExponent, uint32_t slotTime);\
+          void getCADStats(cad_stats_t* stats);\
+          void clearCADStats();\
+          void setSniffMode(bool on, uint16_t interval);\
+          bool sniffing();\
+          uint16_t sniffInterval();\
+          uint16_t setWakeupPreamble(uint16_t interval);\
+          uint32_t sniffTimeToWake();\
+          uint32_t radioOnTime();\
+          uint32_t wakeCount();\
+          uint32_t cadDetectCount();\
+          void resetSniffStats();\
+          bool setSymbolTimeout(uint16_t symbols);\
+          uint16_t symbolTimeout();\
+          bool receiveWindow(uint64_t start, uint16_t timeoutSymbols);\
+          int rxWindowState();\
+          int waitRxWindow();\
+          void cancelRxWindow();\
+          uint16_t rxTimeouts();\
+          uint64_t clockMicros();\
+          bool setSFScan(uint16_t sfMask, uint16_t preamble);\
+          uint8_t lastRxSpreadingFactor();\
+          void getSFScanStats(uint8_t sf, sf_scan_stats_t* stats);\
+          void clearSFScanStats();\
+          int scanChannels(const float* frequencies, uint8_t count, uint16_t dwell, uint16_t sfMask, float* out);\
           int frequencyError();\
+          uint64_t lastRxTime();\
+          uint64_t lastTxTime();\
           \
           void setSyncWord(uint8_t syncWord);\
           int getSyncWord();\
@@ -141,8 +227,9 @@ class RF95:
     def waitPacketSent(self):
         radiohead.waitPacketSent()
 
-    def waitAvailableTimeout(self):
-        radiohead.waitAvailableTimeout()
+    def waitAvailableTimeout(self, ms):
+        # Sleeps between polls while sniffing, see setSniffMode()
+        return radiohead.waitAvailableTimeout(ms) == 1
 
     def available(self):
         b = radiohead.available()
@@ -152,8 +239,33 @@ class RF95:
             return False
 
     def recv(self):
-        radiohead.recv(buf, l)
-        return (ffi.unpack(buf, l[0]), l[0])
+        buf = bytearray(radiohead.maxMessageLength())
+        n = self.recvInto(buf)
+        return (bytes(memoryview(buf)[:n]), n) if n > 0 else (b"", 0)
+
+    def recvWithMeta(self):
+        # Metadata timestamp is when RxDone was signalled, in ns of the monotonic clock
+        buf = bytearray(radiohead.maxMessageLength())
+        meta = self.newRxMeta()
+        n = self.recvInto(buf, meta)
+        if n < 0:
+            return (b"", 0, None)
+        return (bytes(memoryview(buf)[:n]), n,
+                {"timestamp": meta.timestamp, "rssi": meta.rssi, "snr": meta.snr / 10.0,
+                 "freqError": meta.freqError, "to": meta.to, "from": getattr(meta, "from"),
+                 "id": meta.id, "flags": meta.flags})
+
+    def newRxMeta(self):
+        # Metadata for recvInto(), to allocate once and reuse for every message
+        return ffi.new("rx_meta_t*")
+
+    def recvInto(self, buffer, meta=None):
+        # Receives a message straight into a writable bytearray or memoryview, truncated to its length, with the
+        # payload read from the radio's FIFO into it. Fills meta from newRxMeta() if given.
+        # Returns the message length, or -1 if there is none
+        cap = min(len(buffer), 255)
+        return radiohead.recvInto(ffi.from_buffer("uint8_t[]", buffer, require_writable=True), cap,
+                                  ffi.NULL if meta is None else meta)
 
     def maxMessageLength(self):
         return radiohead.maxMessageLength()
@@ -165,13 +277,19 @@ class RF95:
         radiohead.enterSleepMode()
 
     def recvfromAck(self):
+        buf = ffi.new("char[]", radiohead.maxMessageLength())
+        l = ffi.new("uint8_t*")
+        src = ffi.new("uint8_t*")
         radiohead.recvfromAck(buf, l, src)
-        return (ffi.string(buf), l[0], src[0])
+        return (ffi.unpack(buf, l[0]), l[0], src[0])
 
     def recvfromAckTimeout(self, timeout):
-        ris = radiohead.recvfromAck(buf, l, timeout, src)
+        buf = ffi.new("char[]", radiohead.maxMessageLength())
+        l = ffi.new("uint8_t*")
+        src = ffi.new("uint8_t*")
+        ris = radiohead.recvfromAckTimeout(buf, l, timeout, src)
         if ris > 0:
-            return (ffi.string(buf), l[0], src[0])
+            return (ffi.unpack(buf, l[0]), l[0], src[0])
         else:
             return ("", -1, -1)
 
@@ -193,6 +311,89 @@ class RF95:
     def setTimeout(self, timeout):
         radiohead.setTimeout(timeout)
 
+    def fragmenterInit(self):
+        # Messages longer than one frame, carried by the manager: call managerInit() first
+        return radiohead.fragmenterInit()
+
+    def sendFragmented(self, data, dst):
+        return radiohead.sendFragmented(data, len(data), dst)
+
+    def sendFragmentedFrom(self, read, length, dst):
+        # read(offset, n) returns the n bytes of the message at offset, so that it need not all be in memory
+        def source(offset, buf, n, arg):
+            chunk = read(offset, n)
+            ffi.memmove(buf, chunk, len(chunk))
+            return len(chunk)
+        callback = ffi.callback("fragment_source_t", source)
+        return radiohead.sendFragmentedFrom(callback, ffi.NULL, length, dst)
+
+    def setFragmentSink(self, write):
+        # write(src, offset, data) stores each fragment as it arrives and returns True, and recvFragmented()
+        # then returns only the length. None goes back to reassembling up to fragmentBufferSize() bytes
+        if write is None:
+            self.fragmentSink = None
+            radiohead.setFragmentSink(ffi.NULL, ffi.NULL)
+            return
+        def sink(src, offset, data, n, arg):
+            return bool(write(src, offset, ffi.unpack(data, n)))
+        self.fragmentSink = ffi.callback("fragment_sink_t", sink)
+        radiohead.setFragmentSink(self.fragmentSink, ffi.NULL)
+
+    def recvFragmented(self, timeout=0):
+        fbuf = ffi.new("uint8_t[]", radiohead.fragmentBufferSize())
+        flen = ffi.new("uint32_t*", len(fbuf))
+        fsrc = ffi.new("uint16_t*")
+        if radiohead.recvFragmented(fbuf, flen, timeout, fsrc) < 0:
+            return (b"", -1, -1)
+        return (ffi.unpack(fbuf, flen[0]) if self.fragmentSink is None else b"", flen[0], fsrc[0])
+
+    def setFragmentLength(self, l):
+        radiohead.setFragmentLength(l)
+
+    def fragmentLength(self):
+        return radiohead.fragmentLength()
+
+    def fragmentRetransmissions(self):
+        return radiohead.fragmentRetransmissions()
+
+    def compressionInit(self, dictionary=b"", id=0):
+        # Compresses every message sent from now on, against a dictionary shared by all nodes, and decompresses
+        # those received. Call before setting headers, and before managerInit() for the manager's messages too
+        return radiohead.compressionInit(dictionary, len(dictionary), id)
+
+    def getCompressionStats(self):
+        s = ffi.new("compression_stats_t*")
+        radiohead.getCompressionStats(s)
+        return {"sent": s.sent, "compressed": s.compressed, "octetsIn": s.octetsIn, "octetsOut": s.octetsOut,
+                "airtimeSaved": s.airtimeSaved, "cpuTime": s.cpuTime,
+                "received": s.received, "dropped": s.dropped}
+
+    def clearCompressionStats(self):
+        radiohead.clearCompressionStats()
+
+    def fountainInit(self):
+        # Broadcast of one long message to many nodes, carried by the manager: call managerInit() first
+        return radiohead.fountainInit()
+
+    def broadcastFountain(self, data, receivers=()):
+        # Returns how many of receivers reported the message decoded. No receivers sends open loop
+        rcv = ffi.new("uint16_t[]", list(receivers)) if receivers else ffi.NULL
+        return radiohead.broadcastFountain(data, len(data), rcv, len(receivers))
+
+    def recvFountain(self, timeout=0):
+        fbuf = ffi.new("uint8_t[]", radiohead.fountainBufferSize())
+        flen = ffi.new("uint32_t*", len(fbuf))
+        fsrc = ffi.new("uint16_t*")
+        if radiohead.recvFountain(fbuf, flen, timeout, fsrc) < 0:
+            return (b"", -1, -1)
+        return (ffi.unpack(fbuf, flen[0]), flen[0], fsrc[0])
+
+    def setFountainFeedback(self, window, burst):
+        radiohead.setFountainFeedback(window, burst)
+
+    def fountainBlocksSent(self):
+        return radiohead.fountainBlocksSent()
+
     def setModeIdle(self):
         radiohead.setModeIdle()
 
@@ -211,9 +412,117 @@ class RF95:
     def isChannelActive(self):
         return radiohead.isChannelActive()
 
+    def setCADTimeout(self, timeout):
+        radiohead.setCADTimeout(timeout)
+
+    def setCADBackoff(self, minExponent, maxExponent, slotTime=0):
+        radiohead.setCADBackoff(minExponent, maxExponent, slotTime)
+
+    def getCADStats(self):
+        s = ffi.new("cad_stats_t*")
+        radiohead.getCADStats(s)
+        return {"attempts": s.attempts, "cads": s.cads, "busy": s.busy, "timeouts": s.timeouts,
+                "totalDelay": s.totalDelay, "maxDelay": s.maxDelay,
+                "lastDelay": s.lastDelay, "lastCads": s.lastCads}
+
+    def clearCADStats(self):
+        radiohead.clearCADStats()
+
+    def setSniffMode(self, on, interval=0):
+        # While sniffing the radio sleeps, and wakes every interval ms to run CAD. 0 derives the interval
+        # from our own preamble length. Poll available() or use waitAvailableTimeout() to drive it
+        radiohead.setSniffMode(on, interval)
+
+    def sniffing(self):
+        return radiohead.sniffing()
+
+    def sniffInterval(self):
+        return radiohead.sniffInterval()
+
+    def setWakeupPreamble(self, interval):
+        # Sets a preamble long enough for a receiver sniffing every interval ms, returns its length in symbols
+        return radiohead.setWakeupPreamble(interval)
+
+    def sniffTimeToWake(self):
+        return radiohead.sniffTimeToWake()
+
+    def radioOnTime(self):
+        # Microseconds the receiver has been on while sniffing
+        return radiohead.radioOnTime()
+
+    def wakeCount(self):
+        return radiohead.wakeCount()
+
+    def cadDetectCount(self):
+        return radiohead.cadDetectCount()
+
+    def resetSniffStats(self):
+        radiohead.resetSniffStats()
+
+    # States returned by rxWindowState() and waitRxWindow()
+    RX_WINDOW_NONE, RX_WINDOW_PENDING, RX_WINDOW_OPEN, RX_WINDOW_RECEIVED, RX_WINDOW_TIMEOUT = range(5)
+
+    def setSymbolTimeout(self, symbols):
+        return radiohead.setSymbolTimeout(symbols)
+
+    def symbolTimeout(self):
+        return radiohead.symbolTimeout()
+
+    def receiveWindow(self, start, timeoutSymbols):
+        # start is in us on the clockMicros() timebase, eg lastTxTime() // 1000 plus the reply delay
+        return radiohead.receiveWindow(start, timeoutSymbols)
+
+    def rxWindowState(self):
+        return radiohead.rxWindowState()
+
+    def waitRxWindow(self):
+        # Sleeps until the window closes. RX_WINDOW_RECEIVED means recv() has a message
+        return radiohead.waitRxWindow()
+
+    def cancelRxWindow(self):
+        radiohead.cancelRxWindow()
+
+    def rxTimeouts(self):
+        return radiohead.rxTimeouts()
+
+    def clockMicros(self):
+        return radiohead.clockMicros()
+
+    def setSFScan(self, sfMask, preamble=0):
+        # sfMask has bit n set to scan spreading factor n, eg 0x380 for SF7 to SF9. 0 stops scanning
+        return radiohead.setSFScan(sfMask, preamble)
+
+    def lastRxSpreadingFactor(self):
+        return radiohead.lastRxSpreadingFactor()
+
+    def getSFScanStats(self, sf):
+        s = ffi.new("sf_scan_stats_t*")
+        radiohead.getSFScanStats(sf, s)
+        return {"cads": s.cads, "detections": s.detections, "received": s.received,
+                "maxGap": s.maxGap, "window": s.window}
+
+    def clearSFScanStats(self):
+        radiohead.clearSFScanStats()
+
+    # Columns of the rows returned by scanChannels()
+    SCAN_COLUMNS = ("frequency", "samples", "min", "mean", "max", "p10", "p50", "p90", "p99", "cadDetected")
+
+    def scanChannels(self, frequencies, dwell=10, sfMask=0):
+        # Returns a len(frequencies) x len(SCAN_COLUMNS) memoryview of floats, which numpy.asarray() wraps without copying
+        count = len(frequencies)
+        out = ffi.new("float[]", count * len(self.SCAN_COLUMNS))
+        radiohead.scanChannels(ffi.new("float[]", list(frequencies)), count, dwell, sfMask, out)
+        return memoryview(ffi.buffer(out)).cast("B").cast("f", [count, len(self.SCAN_COLUMNS)])
+
     def frequencyError(self):
         return radiohead.frequencyError()
 
+    def lastRxTime(self):
+        return radiohead.lastRxTime()
+
+    def lastTxTime(self):
+        return radiohead.lastTxTime()
+
     def getLastRawRssi(self):
         return radiohead.getLastRawRssi()
 
@@ -0,0 +1,241 @@
+// RHAdaptiveRate.cpp
+//
+// Adaptive data rate controller for RH_RF95 and other LoRa drivers
+
+#include <RHAdaptiveRate.h>
+
+// The bandwidths supported by RH_RF95 in Hz, narrowest first, with 10*log10(bw) in tenths of a dB
+PROGMEM static const long ADR_BANDWIDTHS[] =
+{
+    7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000
+};
+PROGMEM static const int16_t ADR_BANDWIDTH_DB[] =
+{
+    389,  402,   419,   432,   450,   462,   480,   510,    540,    570
+};
+#define RH_ADR_NUM_BANDWIDTHS (sizeof(ADR_BANDWIDTHS) / sizeof(long))
+
+// Minimum demodulation SNR for SF6..SF12 in tenths of a dB, per SX1276 datasheet table 13
+PROGMEM static const int16_t ADR_SNR_FLOOR[] =
+{
+    -50, -75, -100, -125, -150, -175, -200
+};
+
+// Relative symbol duration, smaller is faster
+static uint32_t symbolCost(uint8_t sf, long bw)
+{
+    return (1000000UL << sf) / bw;
+}
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHAdaptiveRate::RHAdaptiveRate(RHGenericDriver& driver)
+    :
+    _driver(driver),
+    _targetMargin(RH_ADR_DEFAULT_TARGET_MARGIN),
+    _hysteresis(RH_ADR_DEFAULT_HYSTERESIS),
+    _minSf(7),
+    _maxSf(12),
+    _minBw(125000),
+    _maxBw(125000),
+    _minPower(5),
+    _maxPower(20)
+{
+    reset();
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+void RHAdaptiveRate::setTargetMargin(int16_t margin)
+{
+    _targetMargin = margin;
+}
+
+void RHAdaptiveRate::setHysteresis(int16_t hysteresis)
+{
+    _hysteresis = hysteresis;
+}
+
+void RHAdaptiveRate::setSpreadingFactorRange(uint8_t minSf, uint8_t maxSf)
+{
+    _minSf = minSf < 6 ? 6 : minSf;
+    _maxSf = maxSf > 12 ? 12 : maxSf;
+}
+
+void RHAdaptiveRate::setBandwidthRange(long minBw, long maxBw)
+{
+    _minBw = minBw;
+    _maxBw = maxBw;
+}
+
+void RHAdaptiveRate::setPowerRange(int8_t minPower, int8_t maxPower)
+{
+    _minPower = minPower;
+    _maxPower = maxPower;
+}
+
+void RHAdaptiveRate::reset()
+{
+    _peers.clear();
+}
+
+////////////////////////////////////////////////////////////////////
+void RHAdaptiveRate::recordSnr(RHAddress peer, int16_t snr, const LinkConfig& config)
+{
+    PeerState& p = *_peers.insert(peer);
+    // Normalise to what would be seen at 0dBm in a 1Hz bandwidth
+    p.history[p.next] = snr - (config.power * 10) + bandwidthDb(config.bw);
+    p.next = (p.next + 1) % RH_ADR_HISTORY_LEN;
+    if (p.count < RH_ADR_HISTORY_LEN)
+	p.count++;
+    // Hearing from the peer at all means the link works
+    p.losses = 0;
+}
+
+void RHAdaptiveRate::recordLastPacket(RHAddress peer)
+{
+    recordLastPacket(peer, _driver.txPower());
+}
+
+void RHAdaptiveRate::recordLastPacket(RHAddress peer, int8_t peerPower)
+{
+    LinkConfig config;
+    config.sf = _driver.spreadingFactor();
+    config.bw = _driver.signalBandwidth();
+    config.power = peerPower;
+    recordSnr(peer, _driver.lastSNR(), config);
+}
+
+void RHAdaptiveRate::recordLoss(RHAddress peer)
+{
+    PeerState* p = _peers.insert(peer);
+    if (p->losses < 0xff)
+	p->losses++;
+}
+
+void RHAdaptiveRate::recordDelivery(RHAddress peer)
+{
+    PeerState* p = _peers.find(peer);
+    if (p)
+	p->losses = 0;
+}
+
+////////////////////////////////////////////////////////////////////
+int16_t RHAdaptiveRate::margin(RHAddress peer, const LinkConfig& config)
+{
+    PeerState* p = _peers.find(peer);
+    if (!p || !p->count)
+	return -32768;
+    return linkQuality(*p) + (config.power * 10) - bandwidthDb(config.bw) - snrFloor(config.sf);
+}
+
+bool RHAdaptiveRate::select(RHAddress peer, LinkConfig* config)
+{
+    PeerState* found = _peers.find(peer);
+    if (!found || !found->count)
+    {
+	// Know nothing: be as robust as we are allowed to be
+	config->sf = _maxSf;
+	config->bw = _minBw;
+	config->power = _maxPower;
+	return false;
+    }
+
+    PeerState& p = *found;
+    int16_t quality = linkQuality(p);
+    LinkConfig candidate;
+    if (p.haveCurrent && margin(peer, p.current) >= _targetMargin)
+    {
+	// Current setting is still good. Only move if a better one has margin to spare
+	*config = p.current;
+	if (choose(quality, _targetMargin + _hysteresis, &candidate))
+	{
+	    uint32_t newCost = symbolCost(candidate.sf, candidate.bw);
+	    uint32_t oldCost = symbolCost(p.current.sf, p.current.bw);
+	    if (newCost < oldCost || (newCost == oldCost && candidate.power < p.current.power))
+		*config = candidate;
+	}
+    }
+    else if (!choose(quality, _targetMargin, config))
+    {
+	// Nothing meets the target: use the most robust setting available
+	config->sf = _maxSf;
+	config->bw = _minBw;
+	config->power = _maxPower;
+    }
+    p.current = *config;
+    p.haveCurrent = true;
+    return true;
+}
+
+bool RHAdaptiveRate::applyFor(RHAddress peer)
+{
+    LinkConfig config;
+    select(peer, &config);
+    return _driver.setLinkParams(config.sf, config.bw, config.power);
+}
+
+////////////////////////////////////////////////////////////////////
+// Protected methods
+int16_t RHAdaptiveRate::linkQuality(const PeerState& peer)
+{
+    int32_t sum = 0;
+    uint8_t i;
+    for (i = 0; i < peer.count; i++)
+	sum += peer.history[i];
+    return (sum / peer.count) - (peer.losses * RH_ADR_LOSS_PENALTY);
+}
+
+bool RHAdaptiveRate::choose(int16_t quality, int16_t wanted, LinkConfig* config)
+{
+    bool found = false;
+    uint32_t bestCost = 0;
+    uint8_t sf;
+    uint8_t i;
+
+    // Find the fastest sf/bw combination that makes the margin at full power
+    for (sf = _minSf; sf <= _maxSf; sf++)
+    {
+	for (i = 0; i < RH_ADR_NUM_BANDWIDTHS; i++)
+	{
+	    long bw = ADR_BANDWIDTHS[i];
+	    if (bw < _minBw || bw > _maxBw)
+		continue;
+	    int16_t base = quality - ADR_BANDWIDTH_DB[i] - snrFloor(sf);
+	    if (base + (_maxPower * 10) < wanted)
+		continue;
+	    uint32_t cost = symbolCost(sf, bw);
+	    if (found && cost >= bestCost)
+		continue;
+	    found = true;
+	    bestCost = cost;
+	    config->sf = sf;
+	    config->bw = bw;
+	    // Then the lowest power that still makes the margin, rounding up to the next whole dB
+	    int16_t needed = wanted - base;
+	    int16_t power = needed > 0 ? (needed + 9) / 10 : needed / 10;
+	    if (power < _minPower)
+		power = _minPower;
+	    config->power = power;
+	}
+    }
+    return found;
+}
+
+int16_t RHAdaptiveRate::bandwidthDb(long bw)
+{
+    uint8_t i;
+    for (i = 0; i < RH_ADR_NUM_BANDWIDTHS - 1; i++)
+	if (bw <= ADR_BANDWIDTHS[i])
+	    break;
+    return ADR_BANDWIDTH_DB[i];
+}
+
+int16_t RHAdaptiveRate::snrFloor(uint8_t sf)
+{
+    if (sf < 6)
+	sf = 6;
+    if (sf > 12)
+	sf = 12;
+    return ADR_SNR_FLOOR[sf - 6];
+}
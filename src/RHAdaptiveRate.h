@@ -0,0 +1,210 @@
+// RHAdaptiveRate.h
+//
+// Adaptive data rate controller for RH_RF95 and other LoRa drivers
+//
+// Selects spreading factor, bandwidth and transmitter power per destination
+// from a history of the SNR margins measured on the link to that destination.
+
+#ifndef RHAdaptiveRate_h
+#define RHAdaptiveRate_h
+
+#include <RHGenericDriver.h>
+#include <RHPeerTable.h>
+
+// Number of SNR samples remembered per peer
+#ifndef RH_ADR_HISTORY_LEN
+#define RH_ADR_HISTORY_LEN 8
+#endif
+
+// Number of peers whose link history is remembered. Beyond this the oldest are forgotten
+#ifndef RH_ADR_MAX_PEERS
+#define RH_ADR_MAX_PEERS 32
+#endif
+
+// Default SNR margin above the demodulation floor we aim for, in tenths of a dB. With RH_ADR_LOSS_PENALTY
+// and RH_ADR_DEFAULT_HYSTERESIS on top, 5 dB is enough: 10 dB kept most links on SF11 and SF12, see examples/adr_sim.cpp
+#ifndef RH_ADR_DEFAULT_TARGET_MARGIN
+#define RH_ADR_DEFAULT_TARGET_MARGIN 50
+#endif
+
+// Default extra margin required before switching to a faster rate or lower power, in tenths of a dB
+#define RH_ADR_DEFAULT_HYSTERESIS 30
+
+// Margin penalty added per consecutive delivery failure, in tenths of a dB
+#define RH_ADR_LOSS_PENALTY 30
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHAdaptiveRate RHAdaptiveRate.h <RHAdaptiveRate.h>
+/// \brief Adaptive data rate (ADR) controller for RH_RF95 and other LoRa drivers
+///
+/// Keeps a short history of the SNR of packets received from each peer and uses it to
+/// choose, per destination, the fastest spreading factor and bandwidth and then the lowest
+/// transmitter power that still leave a target SNR margin above the LoRa demodulation floor.
+/// The chosen settings are applied with the driver's setLinkParams(), which for RH_RF95 only writes the
+/// registers that change, so it is cheap to call before each packet. RHSimDriver implements it too, so the
+/// controller can be tried out in a simulated network (see examples/adr_sim.cpp).
+///
+/// SNR samples are normalised to the transmitter power and bandwidth they were measured with, so samples taken
+/// at one setting can predict the margin at any other. The path loss is the same both ways, but the power is
+/// the sender's, which this node does not know for a packet it receives:
+/// - recordSnr() with the SNR the peer measured of our own packets, reported back by the application, and our
+///   own settings, needs no assumption at all.
+/// - recordLastPacket(peer, peerPower) is right if the application knows the power the peer sent with.
+/// - recordLastPacket(peer) assumes the peer sent with our own current power, ie a symmetric link. It is
+///   wrong by the difference in power when that does not hold, for instance when the peer runs its own
+///   controller, and it then chooses too little or too much power for the link.
+///
+/// To avoid flapping between two settings, a faster rate or lower power is only adopted if it
+/// would still leave the target margin plus a hysteresis margin. If the margin of the current setting
+/// falls below the target, the controller falls back immediately.
+///
+/// Caution: the receiving node must be listening with the same spreading factor and
+/// bandwidth that this controller selects for it. This is usually arranged by having both ends run
+/// the same controller on the same link history, or by a receiver that can scan several spreading factors.
+///
+/// Typical use:
+/// \code
+/// RHAdaptiveRate adr(driver);
+/// ...
+/// adr.applyFor(dest);
+/// manager.sendtoWait(data, len, dest) ? adr.recordDelivery(dest) : adr.recordLoss(dest);
+/// ...
+/// if (manager.recvfromAck(buf, &len, &from))
+///     adr.recordLastPacket(from);
+/// \endcode
+class RHAdaptiveRate
+{
+public:
+    /// \brief A combination of link parameters chosen by the controller
+    typedef struct
+    {
+	uint8_t     sf;      ///< Spreading factor 6..12
+	long        bw;      ///< Signal bandwidth in Hz
+	int8_t      power;   ///< Transmitter power in dBm
+    } LinkConfig;
+
+    /// Constructor.
+    /// \param[in] driver The driver whose link parameters will be controlled. It must implement setLinkParams()
+    RHAdaptiveRate(RHGenericDriver& driver);
+
+    /// Sets the SNR margin above the demodulation floor the controller aims to keep.
+    /// \param[in] margin Target margin in tenths of a dB. Defaults to RH_ADR_DEFAULT_TARGET_MARGIN
+    void setTargetMargin(int16_t margin);
+
+    /// Sets the additional margin required before moving to a faster rate or a lower power
+    /// \param[in] hysteresis Hysteresis in tenths of a dB. Defaults to RH_ADR_DEFAULT_HYSTERESIS
+    void setHysteresis(int16_t hysteresis);
+
+    /// Limits the spreading factors the controller may choose. Defaults to 7..12
+    /// \param[in] minSf Fastest spreading factor permitted
+    /// \param[in] maxSf Slowest spreading factor permitted
+    void setSpreadingFactorRange(uint8_t minSf, uint8_t maxSf);
+
+    /// Limits the bandwidths the controller may choose. Defaults to 125000..125000,
+    /// ie the bandwidth is not adapted. Values are rounded as per RH_RF95::setSignalBandwidth().
+    /// \param[in] minBw Narrowest bandwidth permitted, in Hz
+    /// \param[in] maxBw Widest bandwidth permitted, in Hz
+    void setBandwidthRange(long minBw, long maxBw);
+
+    /// Limits the transmitter power the controller may choose. Defaults to 5..20 dBm.
+    /// \param[in] minPower Lowest power permitted in dBm
+    /// \param[in] maxPower Highest power permitted in dBm
+    void setPowerRange(int8_t minPower, int8_t maxPower);
+
+    /// Records an SNR measurement for a packet received from a peer.
+    /// \param[in] peer Address of the node the packet came from
+    /// \param[in] snr Measured SNR in tenths of a dB (as returned by RH_RF95::lastSNR())
+    /// \param[in] config The link parameters the packet was sent with: the sender's power, and the
+    /// spreading factor and bandwidth
+    void recordSnr(RHAddress peer, int16_t snr, const LinkConfig& config);
+
+    /// Records the SNR of the last packet received by the driver, measured with
+    /// the driver's current link parameters. Assumes the peer sent it with our own current power,
+    /// which only holds on a symmetric link
+    /// \param[in] peer Address of the node the packet came from
+    void recordLastPacket(RHAddress peer);
+
+    /// Records the SNR of the last packet received by the driver, measured with
+    /// the driver's current spreading factor and bandwidth, from a peer that sent it with a known power
+    /// \param[in] peer Address of the node the packet came from
+    /// \param[in] peerPower Power the peer sent the packet with, in dBm
+    void recordLastPacket(RHAddress peer, int8_t peerPower);
+
+    /// Records a failed delivery to a peer (eg sendtoWait() returned false). Each consecutive
+    /// failure reduces the estimated margin by RH_ADR_LOSS_PENALTY until the next delivery or received packet.
+    /// \param[in] peer Address of the destination
+    void recordLoss(RHAddress peer);
+
+    /// Records a successful delivery to a peer, clearing any loss penalty.
+    /// \param[in] peer Address of the destination
+    void recordDelivery(RHAddress peer);
+
+    /// Chooses the link parameters to use for the next packet to a peer, applying hysteresis against the
+    /// parameters last chosen for that peer. Does not change the radio.
+    /// \param[in] peer Address of the destination
+    /// \param[out] config The chosen parameters
+    /// \return false if nothing is yet known about the peer, in which case config is set to the slowest
+    /// permitted rate at the highest permitted power
+    bool select(RHAddress peer, LinkConfig* config);
+
+    /// Chooses the link parameters for a peer with select() and applies them to the radio.
+    /// \param[in] peer Address of the destination
+    /// \return true if any radio register was changed
+    bool applyFor(RHAddress peer);
+
+    /// Returns the estimated SNR margin for a peer with the given link parameters
+    /// \param[in] peer Address of the peer
+    /// \param[in] config The link parameters to evaluate
+    /// \return Estimated margin above the demodulation floor in tenths of a dB, or -32768 if nothing is known
+    int16_t margin(RHAddress peer, const LinkConfig& config);
+
+    /// Forgets everything known about all peers
+    void reset();
+
+protected:
+    /// \brief What we know about the link to one peer
+    typedef struct
+    {
+	int16_t     history[RH_ADR_HISTORY_LEN]; ///< Normalised SNR samples, tenths of a dB
+	uint8_t     count;                       ///< Number of valid samples in history
+	uint8_t     next;                        ///< Index in history for the next sample
+	uint8_t     losses;                      ///< Consecutive delivery failures
+	bool        haveCurrent;                 ///< true if current is valid
+	LinkConfig  current;                     ///< Parameters last chosen for this peer
+    } PeerState;
+
+    /// Returns the average normalised SNR for a peer, less any loss penalty
+    int16_t linkQuality(const PeerState& peer);
+
+    /// Finds the fastest rate then lowest power that gives at least the wanted margin
+    /// \return true if such a combination exists within the configured limits
+    bool choose(int16_t quality, int16_t wanted, LinkConfig* config);
+
+    /// Returns 10*log10(bw) in tenths of a dB for one of the RH_RF95 bandwidths
+    static int16_t bandwidthDb(long bw);
+
+    /// Returns the demodulation floor for a spreading factor in tenths of a dB
+    static int16_t snrFloor(uint8_t sf);
+
+    /// The driver we control
+    RHGenericDriver& _driver;
+
+    /// Target margin, tenths of a dB
+    int16_t         _targetMargin;
+
+    /// Hysteresis, tenths of a dB
+    int16_t         _hysteresis;
+
+    /// Permitted ranges
+    uint8_t         _minSf;
+    uint8_t         _maxSf;
+    long            _minBw;
+    long            _maxBw;
+    int8_t          _minPower;
+    int8_t          _maxPower;
+
+    /// Link state by peer address
+    RHPeerTable<PeerState, RH_ADR_MAX_PEERS> _peers;
+};
+
+#endif
@@ -0,0 +1,100 @@
+// RHAfc.cpp
+//
+// Automatic frequency correction for RH_RF95
+
+#include <RHAfc.h>
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHAfc::RHAfc(RH_RF95& driver, Mode mode)
+    :
+    _driver(driver),
+    _mode(mode),
+    _smoothing(RH_AFC_DEFAULT_SMOOTHING)
+{
+    reset();
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+void RHAfc::setMode(Mode mode)
+{
+    _mode = mode;
+}
+
+void RHAfc::setSmoothing(uint8_t shift)
+{
+    _smoothing = shift > 8 ? 8 : shift;
+}
+
+void RHAfc::reset()
+{
+    _peers.clear();
+}
+
+////////////////////////////////////////////////////////////////////
+void RHAfc::recordError(RHAddress peer, int32_t error, int32_t correction)
+{
+    PeerState& p = *_peers.insert(peer);
+    // The error is measured relative to where we were listening, so add back our own correction
+    int32_t sample = error + correction;
+    if (!p.known)
+    {
+	p.offset = sample;
+	p.known = true;
+    }
+    else
+    {
+	// Divide rather than shift so negative errors round the same way as positive ones
+	p.offset += (sample - p.offset) / (1L << _smoothing);
+    }
+}
+
+void RHAfc::recordLastPacket(RHAddress peer)
+{
+    // The PPM correction register does not move the centre frequency, so only a retune counts
+    recordError(peer, _driver.frequencyError(), _driver.frequencyCorrection());
+}
+
+int32_t RHAfc::offset(RHAddress peer)
+{
+    PeerState* p = _peers.find(peer);
+    return p && p->known ? p->offset : 0;
+}
+
+bool RHAfc::known(RHAddress peer)
+{
+    PeerState* p = _peers.find(peer);
+    return p && p->known;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHAfc::applyFor(RHAddress peer)
+{
+    switch (_mode)
+    {
+    case ModeRetune:
+	return _driver.setFrequencyCorrection(offset(peer));
+
+    case ModePpm:
+	return _driver.setPpmCorrection(offset(peer));
+
+    default:
+	return false;
+    }
+}
+
+bool RHAfc::applyNominal()
+{
+    switch (_mode)
+    {
+    case ModeRetune:
+	return _driver.setFrequencyCorrection(0);
+
+    case ModePpm:
+	return _driver.setPpmCorrection(0);
+
+    default:
+	return false;
+    }
+}
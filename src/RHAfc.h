@@ -0,0 +1,130 @@
+// RHAfc.h
+//
+// Automatic frequency correction for RH_RF95
+//
+// Tracks the centre frequency offset of each peer from the frequency error
+// measured on every packet received from it, and optionally retunes the radio to match.
+
+#ifndef RHAfc_h
+#define RHAfc_h
+
+#include <RH_RF95.h>
+#include <RHPeerTable.h>
+
+// Default EWMA weight of each new frequency error sample, as a right shift (ie 1/4)
+#ifndef RH_AFC_DEFAULT_SMOOTHING
+#define RH_AFC_DEFAULT_SMOOTHING 2
+#endif
+
+// Number of peers whose frequency offsets are remembered. Beyond this the oldest are forgotten
+#ifndef RH_AFC_MAX_PEERS
+#define RH_AFC_MAX_PEERS 32
+#endif
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHAfc RHAfc.h <RHAfc.h>
+/// \brief Automatic frequency correction (AFC) for RH_RF95
+///
+/// Cheap crystals drift with temperature, and at the narrow bandwidths (7.8 to 62.5kHz) an offset of
+/// a few kHz between two nodes is enough to lose packets. RH_RF95 captures the frequency error of each
+/// packet in the same SPI batch as the rest of the packet status, and this class keeps an exponentially weighted
+/// moving average of it for each peer. The estimate is the peer's offset from our nominal frequency, so it stays 
+/// valid whatever correction is currently applied.
+///
+/// Depending on the mode, applyFor() then does one of:
+/// - ModeEstimate: nothing. The estimates are just available from offset().
+/// - ModeRetune: moves our centre frequency onto the peer's with RH_RF95::setFrequencyCorrection(), 
+/// so that we both transmit to and receive from the peer on its frequency. 
+/// - ModePpm: sets RH_RF95_REG_27_PPM_CORRECTION with RH_RF95::setPpmCorrection(), which corrects the 
+/// receiver's timing drift for the peer without moving the centre frequency.
+///
+/// Typical use:
+/// \code
+/// RHAfc afc(driver, RHAfc::ModeRetune);
+/// ...
+/// if (manager.recvfromAck(buf, &len, &from))
+///     afc.recordLastPacket(from);
+/// ...
+/// afc.applyFor(dest);
+/// manager.sendtoWait(data, len, dest);
+/// \endcode
+class RHAfc
+{
+public:
+    /// \brief What applyFor() does with the estimate
+    typedef enum
+    {
+	ModeEstimate = 0, ///< Only estimate the peer offsets
+	ModeRetune,       ///< Retune the centre frequency to the peer
+	ModePpm           ///< Set the PPM correction register for the peer
+    } Mode;
+
+    /// Constructor.
+    /// \param[in] driver The RH_RF95 driver whose packets are measured
+    /// \param[in] mode What applyFor() should do
+    RHAfc(RH_RF95& driver, Mode mode = ModeEstimate);
+
+    /// Sets what applyFor() does
+    /// \param[in] mode The new mode
+    void setMode(Mode mode);
+
+    /// Sets the weight of each new sample in the moving average, as a power of 2.
+    /// \param[in] shift Each new sample has weight 1/2^shift. 0 means use only the latest sample.
+    /// Defaults to RH_AFC_DEFAULT_SMOOTHING
+    void setSmoothing(uint8_t shift);
+
+    /// Records a frequency error measured on a packet from a peer
+    /// \param[in] peer Address of the node the packet came from
+    /// \param[in] error The frequency error in Hz, as from RH_RF95::frequencyError()
+    /// \param[in] correction The correction in Hz that was applied when the packet was received
+    void recordError(RHAddress peer, int32_t error, int32_t correction);
+
+    /// Records the frequency error of the last packet received by the driver,
+    /// with the driver's current frequency correction.
+    /// \param[in] peer Address of the node the packet came from
+    void recordLastPacket(RHAddress peer);
+
+    /// Returns the estimated offset of a peer's centre frequency from our nominal frequency
+    /// \param[in] peer Address of the peer
+    /// \return Offset in Hz, positive if the peer is above us. 0 if nothing is known about the peer
+    int32_t offset(RHAddress peer);
+
+    /// Returns whether any packets from a peer have been measured
+    /// \param[in] peer Address of the peer
+    bool known(RHAddress peer);
+
+    /// Applies the correction for a peer to the radio, depending on the mode.
+    /// Peers with no estimate get no correction.
+    /// \param[in] peer Address of the peer about to be sent to or received from
+    /// \return true if the radio was changed
+    bool applyFor(RHAddress peer);
+
+    /// Removes any correction from the radio, eg before listening for any peer
+    /// \return true if the radio was changed
+    bool applyNominal();
+
+    /// Forgets everything known about all peers
+    void reset();
+
+protected:
+    /// \brief What we know about the frequency of one peer
+    typedef struct
+    {
+	int32_t     offset;  ///< EWMA of the offset in Hz
+	bool        known;   ///< true if offset is valid
+    } PeerState;
+
+    /// The driver we measure and control
+    RH_RF95&        _driver;
+
+    /// What applyFor() does
+    Mode            _mode;
+
+    /// EWMA weight as a right shift
+    uint8_t         _smoothing;
+
+    /// Frequency state by peer address
+    RHPeerTable<PeerState, RH_AFC_MAX_PEERS> _peers;
+};
+
+#endif
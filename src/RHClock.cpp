@@ -0,0 +1,132 @@
+// RHClock.cpp
+//
+// Time source behind millis(), micros(), delay() and YIELD on Linux hosts
+
+#include <RHClock.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#include <time.h>
+#include <errno.h>
+
+RHClock* RHClock::_instance = NULL;
+
+////////////////////////////////////////////////////////////////////
+RHClock* RHClock::instance()
+{
+    // Made on first use, so it is ready for anything that runs during static initialisation
+    static RHMonotonicClock defaultClock;
+    return _instance ? _instance : &defaultClock;
+}
+
+void RHClock::setInstance(RHClock* clock)
+{
+    _instance = clock;
+}
+
+////////////////////////////////////////////////////////////////////
+RHMonotonicClock::RHMonotonicClock()
+    :
+    _start(raw())
+{
+}
+
+uint64_t RHMonotonicClock::micros()
+{
+    return (raw() - _start) / 1000;
+}
+
+uint64_t RHMonotonicClock::nanos()
+{
+    return raw() - _start;
+}
+
+void RHMonotonicClock::delayMicros(uint64_t us)
+{
+    uint64_t deadline = raw() + us * 1000;
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    // Absolute deadline, so being interrupted by a signal does not cut the delay short
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	;
+}
+
+uint64_t RHMonotonicClock::raw()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////
+RHVirtualClock::RHVirtualClock(uint64_t start)
+    :
+    _now(start * 1000),
+    _yieldStep(1000)
+{
+}
+
+uint64_t RHVirtualClock::micros()
+{
+    return _now / 1000;
+}
+
+uint64_t RHVirtualClock::nanos()
+{
+    return _now;
+}
+
+void RHVirtualClock::delayMicros(uint64_t us)
+{
+    advance(us);
+}
+
+void RHVirtualClock::yield()
+{
+    advance(_yieldStep);
+}
+
+void RHVirtualClock::set(uint64_t us)
+{
+    if (us * 1000 > _now)
+	_now = us * 1000;
+}
+
+void RHVirtualClock::advance(uint64_t us)
+{
+    _now += us * 1000;
+}
+
+void RHVirtualClock::setYieldStep(uint32_t us)
+{
+    _yieldStep = us;
+}
+
+////////////////////////////////////////////////////////////////////
+// Arduino timing functions
+unsigned long millis()
+{
+    return RHClock::instance()->micros() / 1000;
+}
+
+unsigned long micros()
+{
+    return RHClock::instance()->micros();
+}
+
+void delay(unsigned long ms)
+{
+    RHClock::instance()->delayMicros((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    RHClock::instance()->delayMicros(us);
+}
+
+void yield()
+{
+    RHClock::instance()->yield();
+}
+
+#endif
@@ -0,0 +1,140 @@
+// RHClock.h
+//
+// Time source behind millis(), micros(), delay() and YIELD on Linux hosts
+//
+// On Raspberry Pi and in the Linux simulator the Arduino timing functions are implemented
+// here and forward to the installed RHClock, so that the whole library can run on the real
+// monotonic clock in production or on a controllable virtual clock in tests and simulations.
+
+#ifndef RHClock_h
+#define RHClock_h
+
+#include <RadioHead.h>
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHClock RHClock.h <RHClock.h>
+/// \brief Abstract time source used by millis(), micros(), delay() and YIELD
+///
+/// Every timeout in RadioHead (RHReliableDatagram retries, RHRouter and RHMesh timers, waitCAD() backoff,
+/// the driver wait functions) reads time with millis() and waits with delay() or a YIELD spin loop. On
+/// RH_PLATFORM_RASPI and RH_PLATFORM_UNIX those functions forward to RHClock::instance(), which is an
+/// RHMonotonicClock unless another clock has been installed with setInstance().
+///
+/// Subclasses must provide micros() and delayMicros(). A clock's micros() must never go backwards.
+class RHClock
+{
+public:
+    /// Destructor
+    virtual ~RHClock() {}
+
+    /// \return Microseconds since an arbitrary fixed point
+    virtual uint64_t micros() = 0;
+
+    /// \return Nanoseconds since the same point as micros(). The default has microsecond resolution
+    virtual uint64_t nanos() { return micros() * 1000; }
+
+    /// Blocks for at least the given time
+    /// \param[in] us Time to wait in microseconds
+    virtual void delayMicros(uint64_t us) = 0;
+
+    /// Called by YIELD in every spin loop that waits for time to pass or for the radio.
+    /// The default does nothing.
+    virtual void yield() {}
+
+    /// \return The clock used by millis(), micros(), delay() and YIELD
+    static RHClock* instance();
+
+    /// Installs the clock used by millis(), micros(), delay() and YIELD
+    /// \param[in] clock The clock to use, or NULL for the default RHMonotonicClock
+    static void setInstance(RHClock* clock);
+
+protected:
+    /// The installed clock, or NULL for the default
+    static RHClock* _instance;
+};
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHMonotonicClock RHClock.h <RHClock.h>
+/// \brief RHClock reading CLOCK_MONOTONIC, for production use
+///
+/// Unlike gettimeofday() this is not disturbed when NTP or the user sets the system time.
+/// Times count from when the clock was constructed. delayMicros() sleeps to an absolute deadline,
+/// so it is not shortened by signals.
+class RHMonotonicClock : public RHClock
+{
+public:
+    /// Constructor. Times count from now
+    RHMonotonicClock();
+
+    /// \return Microseconds since construction
+    virtual uint64_t micros();
+
+    /// \return Nanoseconds since construction
+    virtual uint64_t nanos();
+
+    /// Sleeps for at least the given time
+    /// \param[in] us Time to sleep in microseconds
+    virtual void delayMicros(uint64_t us);
+
+protected:
+    /// \return Raw CLOCK_MONOTONIC in nanoseconds
+    static uint64_t raw();
+
+    /// Raw time at construction, ns
+    uint64_t _start;
+};
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHVirtualClock RHClock.h <RHClock.h>
+/// \brief RHClock whose time only moves when told to, for tests
+///
+/// delayMicros() returns at once having advanced the clock, and each YIELD advances it by a
+/// configurable step, so timeouts and retry loops complete instantly and deterministically.
+/// \code
+/// RHVirtualClock clock;
+/// RHClock::setInstance(&clock);
+/// manager.sendtoWait(data, len, dest); // Retries and timeouts happen in virtual time
+/// clock.advance(60000000);             // Let a minute pass
+/// \endcode
+class RHVirtualClock : public RHClock
+{
+public:
+    /// Constructor
+    /// \param[in] start Initial time in microseconds
+    RHVirtualClock(uint64_t start = 0);
+
+    /// \return The current virtual time in microseconds
+    virtual uint64_t micros();
+
+    /// \return The current virtual time in nanoseconds
+    virtual uint64_t nanos();
+
+    /// Advances the clock. Does not block
+    /// \param[in] us Time to add in microseconds
+    virtual void delayMicros(uint64_t us);
+
+    /// Advances the clock by the yield step
+    virtual void yield();
+
+    /// Sets the time. Must not be earlier than the current time
+    /// \param[in] us New time in microseconds
+    void set(uint64_t us);
+
+    /// Advances the clock
+    /// \param[in] us Time to add in microseconds
+    void advance(uint64_t us);
+
+    /// Sets how far each YIELD advances the clock. Defaults to 1 ms. 0 stops YIELD moving time, in which case
+    /// loops that wait for a timeout will never end unless something else advances the clock.
+    /// \param[in] us Step in microseconds
+    void setYieldStep(uint32_t us);
+
+protected:
+    /// Virtual time, ns
+    uint64_t _now;
+
+    /// Step for yield(), us
+    uint32_t _yieldStep;
+};
+
+#endif
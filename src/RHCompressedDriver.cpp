@@ -0,0 +1,381 @@
+// RHCompressedDriver.cpp
+//
+// Transparent payload compression for RadioHead drivers
+
+#include <RHCompressedDriver.h>
+#include <RHClock.h>
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHCompressedDriver::RHCompressedDriver(RHGenericDriver& driver)
+    :
+    _driver(driver),
+    _dict(NULL),
+    _dictLen(0),
+    _dictId(0)
+{
+    memset(_dictHead, 0, sizeof(_dictHead));
+    clearStats();
+}
+
+bool RHCompressedDriver::init()
+{
+    if (!RHGenericDriver::init())
+	return false;
+    return _driver.init();
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+bool RHCompressedDriver::setDictionary(const uint8_t* dict, uint16_t len, uint8_t id)
+{
+    if (len > RH_COMPRESS_MAX_DICT || (len && !dict))
+	return false;
+    _dict = dict;
+    _dictLen = len;
+    _dictId = id;
+    // Chain every position of the dictionary once here, so that compressing a message only has to chain
+    // the positions of the message
+    memset(_dictHead, 0, sizeof(_dictHead));
+    uint16_t pos;
+    for (pos = 0; pos + RH_COMPRESS_MIN_MATCH <= len; pos++)
+    {
+	uint16_t h = hashAt(NULL, pos);
+	_prev[pos] = _dictHead[h];
+	_dictHead[h] = pos + 1;
+    }
+    return true;
+}
+
+uint8_t RHCompressedDriver::compress(const uint8_t* src, uint8_t len, uint8_t* dst, uint8_t cap)
+{
+    // Worth sending compressed only if shorter
+    uint16_t limit = len ? len - 1 : 0;
+    if (cap < limit)
+	limit = cap;
+    if (limit < 1)
+	return 0;
+    uint16_t out = 0;
+    dst[out++] = _dictId;
+
+    memcpy(_head, _dictHead, sizeof(_head));
+    uint16_t pos = 0;
+    uint16_t literals = 0; // Start of the literals not yet written
+    while (pos < len)
+    {
+	// Greedy: take the longest match among the last RH_COMPRESS_MAX_CHAIN positions with the same hash
+	uint16_t bestLen = 0;
+	uint16_t bestDist = 0;
+	uint16_t w = _dictLen + pos;
+	if (pos + RH_COMPRESS_MIN_MATCH <= len)
+	{
+	    uint16_t h = hashAt(src, w);
+	    uint16_t maxLen = len - pos < RH_COMPRESS_MAX_MATCH ? len - pos : RH_COMPRESS_MAX_MATCH;
+	    uint16_t cand = _head[h];
+	    uint8_t chain;
+	    for (chain = 0; cand && chain < RH_COMPRESS_MAX_CHAIN; chain++)
+	    {
+		uint16_t c = cand - 1;
+		if (w - c > RH_COMPRESS_MAX_OFFSET)
+		    break;
+		// A match may run on into the octets it is copying, as in all LZ77
+		uint16_t l = 0;
+		while (l < maxLen && windowAt(src, c + l) == src[pos + l])
+		    l++;
+		if (l > bestLen)
+		{
+		    bestLen = l;
+		    bestDist = w - c;
+		    if (l == maxLen)
+			break;
+		}
+		cand = _prev[c];
+	    }
+	    _prev[w] = _head[h];
+	    _head[h] = w + 1;
+	}
+
+	if (bestLen < RH_COMPRESS_MIN_MATCH)
+	{
+	    pos++;
+	    continue;
+	}
+
+	// Write the literals before the match, then the match
+	while (literals < pos)
+	{
+	    uint16_t n = pos - literals < RH_COMPRESS_MAX_LITERALS ? pos - literals : RH_COMPRESS_MAX_LITERALS;
+	    if (out + 1 + n > limit)
+		return 0;
+	    dst[out++] = n - 1;
+	    memcpy(dst + out, src + literals, n);
+	    out += n;
+	    literals += n;
+	}
+	if (out + 2 > limit)
+	    return 0;
+	dst[out++] = 0x80 | ((bestLen - RH_COMPRESS_MIN_MATCH) << 2) | ((bestDist - 1) >> 8);
+	dst[out++] = bestDist - 1;
+
+	// Chain the positions inside the match too, so later matches can start there
+	uint16_t end = pos + bestLen;
+	for (pos++; pos < end; pos++)
+	{
+	    if (pos + RH_COMPRESS_MIN_MATCH > len)
+		continue;
+	    w = _dictLen + pos;
+	    uint16_t h = hashAt(src, w);
+	    _prev[w] = _head[h];
+	    _head[h] = w + 1;
+	}
+	literals = pos;
+    }
+    while (literals < len)
+    {
+	uint16_t n = len - literals < RH_COMPRESS_MAX_LITERALS ? len - literals : RH_COMPRESS_MAX_LITERALS;
+	if (out + 1 + n > limit)
+	    return 0;
+	dst[out++] = n - 1;
+	memcpy(dst + out, src + literals, n);
+	out += n;
+	literals += n;
+    }
+    return out;
+}
+
+uint8_t RHCompressedDriver::decompress(const uint8_t* src, uint8_t len, uint8_t* dst, uint8_t cap)
+{
+    if (len < 2 || src[0] != _dictId)
+	return 0;
+    uint16_t in = 1;
+    uint16_t out = 0;
+    while (in < len)
+    {
+	uint8_t token = src[in++];
+	if (!(token & 0x80))
+	{
+	    uint16_t n = token + 1;
+	    if (in + n > len || out + n > cap)
+		return 0;
+	    memcpy(dst + out, src + in, n);
+	    in += n;
+	    out += n;
+	    continue;
+	}
+	if (in >= len)
+	    return 0;
+	uint16_t n = ((token >> 2) & 0x1f) + RH_COMPRESS_MIN_MATCH;
+	uint16_t dist = (((token & 0x03) << 8) | src[in++]) + 1;
+	if (dist > _dictLen + out || out + n > cap)
+	    return 0;
+	// Octet by octet, as the match may overlap what it writes. Before the message it copies from the dictionary
+	while (n--)
+	{
+	    dst[out] = out >= dist ? dst[out - dist] : _dict[_dictLen + out - dist];
+	    out++;
+	}
+    }
+    return out;
+}
+
+void RHCompressedDriver::clearStats()
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+bool RHCompressedDriver::available()
+{
+    return _driver.available();
+}
+
+bool RHCompressedDriver::recv(uint8_t* buf, uint8_t* len)
+{
+    if (!available())
+	return false;
+    if (!(_driver.headerFlags() & RH_COMPRESS_FLAGS_COMPRESSED))
+	return _driver.recv(buf, len);
+
+    uint8_t rxLen = sizeof(_rxFrame);
+    if (!_driver.recv(_rxFrame, &rxLen))
+	return false;
+    uint64_t start = RHClock::instance()->micros();
+    uint8_t n = decompress(_rxFrame, rxLen, _rxMessage, sizeof(_rxMessage));
+    _stats.cpuTime += RHClock::instance()->micros() - start;
+    if (!n)
+    {
+	_stats.dropped++;
+	return false;
+    }
+    _stats.received++;
+    // Truncated to the space given, as the drivers do
+    if (*len > n)
+	*len = n;
+    memcpy(buf, _rxMessage, *len);
+    return true;
+}
+
+bool RHCompressedDriver::send(const uint8_t* data, uint8_t len)
+{
+    if (len > maxMessageLength())
+	return false;
+    uint64_t start = RHClock::instance()->micros();
+    uint8_t n = compress(data, len, _txFrame, sizeof(_txFrame));
+    _stats.cpuTime += RHClock::instance()->micros() - start;
+
+    _stats.sent++;
+    _stats.octetsIn += len;
+    _stats.octetsOut += n ? n : len;
+    if (n)
+    {
+	_stats.compressed++;
+	_stats.airtimeSaved += _driver.timeOnAir(len) - _driver.timeOnAir(n);
+    }
+    _driver.setHeaderTo(_txHeaderTo);
+    _driver.setHeaderFrom(_txHeaderFrom);
+    _driver.setHeaderId(_txHeaderId);
+    if (n)
+	_driver.setHeaderFlags(_txHeaderFlags | RH_COMPRESS_FLAGS_COMPRESSED, 0xff);
+    else
+	_driver.setHeaderFlags(_txHeaderFlags & ~RH_COMPRESS_FLAGS_COMPRESSED, 0xff);
+    return n ? _driver.send(_txFrame, n) : _driver.send(data, len);
+}
+
+uint8_t RHCompressedDriver::maxMessageLength()
+{
+    return _driver.maxMessageLength();
+}
+
+void RHCompressedDriver::waitAvailable()
+{
+    _driver.waitAvailable();
+}
+
+bool RHCompressedDriver::waitAvailableTimeout(uint16_t timeout)
+{
+    return _driver.waitAvailableTimeout(timeout);
+}
+
+bool RHCompressedDriver::waitPacketSent()
+{
+    return _driver.waitPacketSent();
+}
+
+bool RHCompressedDriver::waitPacketSent(uint16_t timeout)
+{
+    return _driver.waitPacketSent(timeout);
+}
+
+bool RHCompressedDriver::isChannelActive()
+{
+    return _driver.isChannelActive();
+}
+
+uint32_t RHCompressedDriver::timeOnAir(uint8_t len)
+{
+    return _driver.timeOnAir(len);
+}
+
+uint64_t RHCompressedDriver::lastRxTime()
+{
+    return _driver.lastRxTime();
+}
+
+bool RHCompressedDriver::setLinkParams(uint8_t sf, long bw, int8_t power)
+{
+    return _driver.setLinkParams(sf, bw, power);
+}
+
+uint8_t RHCompressedDriver::spreadingFactor()
+{
+    return _driver.spreadingFactor();
+}
+
+long RHCompressedDriver::signalBandwidth()
+{
+    return _driver.signalBandwidth();
+}
+
+int8_t RHCompressedDriver::txPower()
+{
+    return _driver.txPower();
+}
+
+void RHCompressedDriver::setThisAddress(RHAddress thisAddress)
+{
+    RHGenericDriver::setThisAddress(thisAddress);
+    _driver.setThisAddress(thisAddress);
+}
+
+void RHCompressedDriver::setPromiscuous(bool promiscuous)
+{
+    RHGenericDriver::setPromiscuous(promiscuous);
+    _driver.setPromiscuous(promiscuous);
+}
+
+RHAddress RHCompressedDriver::headerTo()
+{
+    return _driver.headerTo();
+}
+
+RHAddress RHCompressedDriver::headerFrom()
+{
+    return _driver.headerFrom();
+}
+
+uint8_t RHCompressedDriver::headerId()
+{
+    return _driver.headerId();
+}
+
+uint8_t RHCompressedDriver::headerFlags()
+{
+    return _driver.headerFlags() & ~RH_COMPRESS_FLAGS_COMPRESSED;
+}
+
+int16_t RHCompressedDriver::lastRssi()
+{
+    return _driver.lastRssi();
+}
+
+int RHCompressedDriver::lastSNR()
+{
+    return _driver.lastSNR();
+}
+
+RHGenericDriver::RHMode RHCompressedDriver::mode()
+{
+    return _driver.mode();
+}
+
+void RHCompressedDriver::setMode(RHMode mode)
+{
+    _driver.setMode(mode);
+}
+
+bool RHCompressedDriver::sleep()
+{
+    return _driver.sleep();
+}
+
+uint16_t RHCompressedDriver::rxBad()
+{
+    return _driver.rxBad();
+}
+
+uint16_t RHCompressedDriver::rxGood()
+{
+    return _driver.rxGood();
+}
+
+uint16_t RHCompressedDriver::txGood()
+{
+    return _driver.txGood();
+}
+
+////////////////////////////////////////////////////////////////////
+// Protected methods
+uint16_t RHCompressedDriver::hashAt(const uint8_t* src, uint16_t pos)
+{
+    uint32_t x = ((uint32_t)windowAt(src, pos) << 16) | ((uint32_t)windowAt(src, pos + 1) << 8) | windowAt(src, pos + 2);
+    return ((x * 2654435761UL) >> 16) & (RH_COMPRESS_HASH_SIZE - 1);
+}
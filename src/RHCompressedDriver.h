@@ -0,0 +1,243 @@
+// RHCompressedDriver.h
+//
+// Transparent payload compression for RadioHead drivers
+//
+// Wraps any driver and compresses each message with LZ77 against a dictionary shared by all nodes,
+// sending it uncompressed when that would not make it shorter.
+
+#ifndef RHCompressedDriver_h
+#define RHCompressedDriver_h
+
+#include <RHGenericDriver.h>
+
+// Header flag marking a compressed message. Cleared again before the manager sees the flags
+#define RH_COMPRESS_FLAGS_COMPRESSED 0x20
+
+// Longest message the buffers hold, compressed or not
+#define RH_COMPRESS_MAX_MESSAGE_LEN 255
+
+// Longest dictionary. A match can reach back RH_COMPRESS_MAX_OFFSET octets, so the end of a longer
+// dictionary would be out of reach of the end of a long message
+#ifndef RH_COMPRESS_MAX_DICT
+#define RH_COMPRESS_MAX_DICT 768
+#endif
+
+// Entries in the hash table of 3 octet sequences, a power of 2
+#ifndef RH_COMPRESS_HASH_SIZE
+#define RH_COMPRESS_HASH_SIZE 256
+#endif
+
+// Most earlier occurrences of a sequence the compressor compares against for the longest match
+#ifndef RH_COMPRESS_MAX_CHAIN
+#define RH_COMPRESS_MAX_CHAIN 16
+#endif
+
+// Match lengths and distances a match token can hold: 1LLLLLDD DDDDDDDD, length L + 3, distance D + 1
+#define RH_COMPRESS_MIN_MATCH  3
+#define RH_COMPRESS_MAX_MATCH  34
+#define RH_COMPRESS_MAX_OFFSET 1024
+
+// Longest run of literals one literal token can hold: 0LLLLLLL, then L + 1 octets
+#define RH_COMPRESS_MAX_LITERALS 128
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHCompressedDriver RHCompressedDriver.h <RHCompressedDriver.h>
+/// \brief Driver wrapper that compresses messages to cut their time on air
+///
+/// At high spreading factors every octet costs milliseconds on air, and telemetry such as JSON or CBOR repeats
+/// the same keys and much the same values in every message. RHCompressedDriver sits between a manager (or the
+/// application) and the radio driver and compresses each message on its own with LZ77: runs of literal octets,
+/// and matches that copy 3 to 34 octets from up to 1024 octets earlier. The matches can reach into a dictionary
+/// that every node holds, so even the first message and short messages compress: put the keys and values
+/// that messages usually contain into the dictionary, the most common last.
+///
+/// A compressed message carries RH_COMPRESS_FLAGS_COMPRESSED in its header flags and starts with the
+/// dictionary ID, so a node with another dictionary drops it rather than delivering garbage. A message that
+/// would not get shorter is sent as it is, without the flag, so compression never costs more than the time
+/// to try it, and nodes without RHCompressedDriver can still receive it.
+///
+/// All memory is fixed: a hash table and chain of earlier positions, about
+/// 2 * (2 * RH_COMPRESS_HASH_SIZE + RH_COMPRESS_MAX_DICT + RH_COMPRESS_MAX_MESSAGE_LEN) octets, and send and receive buffers.
+/// The dictionary itself is not copied.
+///
+/// RHCompressedDriver is itself a driver, so any manager can run over it unchanged:
+/// \code
+/// static const uint8_t dict[] = "\"status\":\"ok\",\"bat\":3.\"t\":2\"h\":{\"id\":\"node-";
+/// RH_RF95 rf95;
+/// RHCompressedDriver compressed(rf95);
+/// RHReliableDatagram manager(compressed, MY_ADDRESS);
+/// compressed.setDictionary(dict, sizeof(dict) - 1, 1);
+/// manager.init();
+/// \endcode
+class RHCompressedDriver : public RHGenericDriver
+{
+public:
+    /// Counters of messages sent and received
+    typedef struct
+    {
+	uint32_t sent;          ///< Messages sent
+	uint32_t compressed;    ///< Messages sent compressed, the rest went as they were
+	uint32_t octetsIn;      ///< Octets given to send()
+	uint32_t octetsOut;     ///< Octets sent, after compression
+	uint64_t airtimeSaved;  ///< Time on air saved, microseconds, if the driver implements timeOnAir()
+	uint64_t cpuTime;       ///< Time spent compressing and decompressing, microseconds, from micros()
+	uint32_t received;      ///< Compressed messages received and decompressed
+	uint32_t dropped;       ///< Compressed messages dropped: made with another dictionary, or corrupt
+    } Stats;
+
+    /// Constructor
+    /// \param[in] driver The driver to send and receive with. Must not be used directly once RHCompressedDriver is in use.
+    RHCompressedDriver(RHGenericDriver& driver);
+
+    /// Initialises the underlying driver
+    /// \return true if the driver initialised
+    virtual bool init();
+
+    /// Sets the dictionary shared by all nodes. Without one, messages only compress against themselves.
+    /// \param[in] dict The dictionary. Not copied, so it must stay unchanged while in use
+    /// \param[in] len Its length, up to RH_COMPRESS_MAX_DICT
+    /// \param[in] id Identifies the dictionary, so that messages compressed with another are not decompressed
+    /// \return false if the dictionary is too long
+    bool setDictionary(const uint8_t* dict, uint16_t len, uint8_t id = 0);
+
+    /// Compresses a message, with the dictionary
+    /// \param[in] src The message
+    /// \param[in] len Its length
+    /// \param[out] dst Where to put the compressed message, starting with the dictionary ID
+    /// \param[in] cap Space in dst
+    /// \return Length of the compressed message, or 0 if it would be no shorter than the message or not fit
+    uint8_t compress(const uint8_t* src, uint8_t len, uint8_t* dst, uint8_t cap);
+
+    /// Decompresses a message made by compress()
+    /// \param[in] src The compressed message
+    /// \param[in] len Its length
+    /// \param[out] dst Where to put the message
+    /// \param[in] cap Space in dst
+    /// \return Length of the message, or 0 if it was made with another dictionary, is corrupt or does not fit
+    uint8_t decompress(const uint8_t* src, uint8_t len, uint8_t* dst, uint8_t cap);
+
+    /// \return The send and receive counters
+    const Stats& stats() { return _stats; }
+
+    /// Zeroes the counters
+    void clearStats();
+
+    /// Tests for a received message in the underlying driver
+    /// \return true if a message is available
+    virtual bool available();
+
+    /// Copies the received message, decompressed if it was compressed
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Available space in buf. Set to the number of octets copied
+    /// \return true if a message was copied to buf. false for a compressed message that cannot be decompressed
+    virtual bool recv(uint8_t* buf, uint8_t* len);
+
+    /// Compresses the message if that makes it shorter, then sends it with the underlying driver
+    /// \param[in] data Message to send
+    /// \param[in] len Length of the message, up to maxMessageLength()
+    /// \return true if the message was sent
+    virtual bool send(const uint8_t* data, uint8_t len);
+
+    /// \return The longest message of the underlying driver. Compression never makes a message longer
+    virtual uint8_t maxMessageLength();
+
+    /// Waits for a message in the underlying driver
+    virtual void waitAvailable();
+
+    /// Waits for a message in the underlying driver, or a timeout
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    /// \return true if a message is available
+    virtual bool waitAvailableTimeout(uint16_t timeout);
+
+    /// Waits for the underlying driver to finish transmitting
+    virtual bool waitPacketSent();
+
+    /// Waits for the underlying driver to finish transmitting, or a timeout
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    virtual bool waitPacketSent(uint16_t timeout);
+
+    /// \return Whether the underlying driver hears a transmission
+    virtual bool isChannelActive();
+
+    /// \param[in] len Message length, as sent
+    /// \return Time on air of the message from the underlying driver, in microseconds
+    virtual uint32_t timeOnAir(uint8_t len);
+
+    /// \return RxDone time of the last message from the underlying driver
+    virtual uint64_t lastRxTime();
+
+    /// Sets the link parameters of the underlying driver
+    virtual bool setLinkParams(uint8_t sf, long bw, int8_t power);
+
+    /// \return Link parameters of the underlying driver
+    virtual uint8_t spreadingFactor();
+    virtual long    signalBandwidth();
+    virtual int8_t  txPower();
+
+    /// Sets this node's address here and in the underlying driver
+    virtual void setThisAddress(RHAddress thisAddress);
+
+    /// Sets promiscuous mode in the underlying driver
+    virtual void setPromiscuous(bool promiscuous);
+
+    /// \return Headers of the last received message, from the underlying driver, without RH_COMPRESS_FLAGS_COMPRESSED
+    virtual RHAddress headerTo();
+    virtual RHAddress headerFrom();
+    virtual uint8_t   headerId();
+    virtual uint8_t   headerFlags();
+
+    /// \return Signal measurements of the last received message, from the underlying driver
+    virtual int16_t   lastRssi();
+    virtual int       lastSNR();
+
+    /// \return Mode of the underlying driver
+    virtual RHMode    mode();
+
+    /// Sets the mode of the underlying driver
+    virtual void      setMode(RHMode mode);
+
+    /// Puts the underlying driver to sleep
+    virtual bool      sleep();
+
+    /// \return Packet counters of the underlying driver
+    virtual uint16_t  rxBad();
+    virtual uint16_t  rxGood();
+    virtual uint16_t  txGood();
+
+protected:
+    /// \return The octet at a position in the dictionary followed by the message being compressed
+    uint8_t windowAt(const uint8_t* src, uint16_t pos)
+    {
+	return pos < _dictLen ? _dict[pos] : src[pos - _dictLen];
+    }
+
+    /// \return Hash table index for the 3 octets at a position of the dictionary and message
+    uint16_t hashAt(const uint8_t* src, uint16_t pos);
+
+    /// The driver we send and receive with
+    RHGenericDriver&    _driver;
+
+    /// The dictionary, its length and ID
+    const uint8_t*      _dict;
+    uint16_t            _dictLen;
+    uint8_t             _dictId;
+
+    /// Hash table of the dictionary alone: 1 + the last position of each hash in it, 0 for none
+    uint16_t            _dictHead[RH_COMPRESS_HASH_SIZE];
+
+    /// Hash table while compressing, starting as a copy of _dictHead
+    uint16_t            _head[RH_COMPRESS_HASH_SIZE];
+
+    /// 1 + the previous position with the same hash as each position, 0 for none
+    uint16_t            _prev[RH_COMPRESS_MAX_DICT + RH_COMPRESS_MAX_MESSAGE_LEN];
+
+    /// Frames being sent and received, and the received message decompressed
+    uint8_t             _txFrame[RH_COMPRESS_MAX_MESSAGE_LEN];
+    uint8_t             _rxFrame[RH_COMPRESS_MAX_MESSAGE_LEN];
+    uint8_t             _rxMessage[RH_COMPRESS_MAX_MESSAGE_LEN];
+
+    /// Counters
+    Stats               _stats;
+};
+
+#endif
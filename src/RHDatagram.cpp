@@ -5,7 +5,7 @@
 
 #include <RHDatagram.h>
 
-RHDatagram::RHDatagram(RHGenericDriver& driver, uint8_t thisAddress) 
+RHDatagram::RHDatagram(RHGenericDriver& driver, RHAddress thisAddress) 
     :
     _driver(driver),
     _thisAddress(thisAddress)
@@ -22,7 +22,7 @@ bool RHDatagram::init()
     return ret;
 }
 
-void RHDatagram::setThisAddress(uint8_t thisAddress)
+void RHDatagram::setThisAddress(RHAddress thisAddress)
 {
     _driver.setThisAddress(thisAddress);
     // Use this address in the transmitted FROM header
@@ -30,13 +30,13 @@ void RHDatagram::setThisAddress(uint8_t thisAddress)
     _thisAddress = thisAddress;
 }
 
-bool RHDatagram::sendto(uint8_t* buf, uint8_t len, uint8_t address)
+bool RHDatagram::sendto(uint8_t* buf, uint8_t len, RHAddress address)
 {
     setHeaderTo(address);
     return _driver.send(buf, len);
 }
 
-bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
 {
     if (_driver.recv(buf, len))
     {
@@ -74,17 +74,22 @@ bool RHDatagram::waitAvailableTimeout(uint16_t timeout)
     return _driver.waitAvailableTimeout(timeout);
 }
 
-uint8_t RHDatagram::thisAddress()
+RHAddress RHDatagram::thisAddress()
 {
     return _thisAddress;
 }
 
-void RHDatagram::setHeaderTo(uint8_t to)
+uint8_t RHDatagram::maxMessageLength()
+{
+    return _driver.maxMessageLength();
+}
+
+void RHDatagram::setHeaderTo(RHAddress to)
 {
     _driver.setHeaderTo(to);
 }
 
-void RHDatagram::setHeaderFrom(uint8_t from)
+void RHDatagram::setHeaderFrom(RHAddress from)
 {
     _driver.setHeaderFrom(from);
 }
@@ -99,12 +104,12 @@ void RHDatagram::setHeaderFlags(uint8_t set, uint8_t clear)
     _driver.setHeaderFlags(set, clear);
 }
 
-uint8_t RHDatagram::headerTo()
+RHAddress RHDatagram::headerTo()
 {
     return _driver.headerTo();
 }
 
-uint8_t RHDatagram::headerFrom()
+RHAddress RHDatagram::headerFrom()
 {
     return _driver.headerFrom();
 }
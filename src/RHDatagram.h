@@ -18,7 +18,8 @@
 ///
 /// Every RHDatagram node has an 8 bit address (defaults to 0).
 /// Addresses (DEST and SRC) are 8 bit integers with an address of RH_BROADCAST_ADDRESS (0xff) 
-/// reserved for broadcast.
+/// reserved for broadcast. If RH_WIDE_ADDRESSES is defined (see RadioHead.h), addresses are 16 bit 
+/// RHAddress values with RH_BROADCAST_ADDRESS 0xffff, and the RH_RF95 header carries 2 octets for each of TO and FROM.
 ///
 /// \par Media Access Strategy
 ///
@@ -48,7 +49,7 @@ public:
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHDatagram(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHDatagram(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Initialise this instance and the 
     /// driver connected to it.
@@ -59,7 +60,7 @@ public:
     /// In a conventional multinode system, all nodes will have a unique address 
     /// (which you could store in EEPROM).
     /// \param[in] thisAddress The address of this node
-    void setThisAddress(uint8_t thisAddress);
+    void setThisAddress(RHAddress thisAddress);
 
     /// Sends a message to the node(s) with the given address
     /// RH_BROADCAST_ADDRESS is a valid address which will cause the message
@@ -68,7 +69,7 @@ public:
     /// \param[in] len Number of octets to send (> 0)
     /// \param[in] address The address to send the message to.
     /// \return true if the message not too loing fot eh driver, and the message was transmitted.
-    bool sendto(uint8_t* buf, uint8_t len, uint8_t address);
+    bool sendto(uint8_t* buf, uint8_t len, RHAddress address);
 
     /// Turns the receiver on if it not already on.
     /// If there is a valid message available for this node, copy it to buf and return true
@@ -79,13 +80,13 @@ public:
     /// It is recommended that you call it in your main loop.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Pointer to available space in buf. Set to the actual number of octets copied.
-    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the FROM address
-    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the TO address
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the FROM address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the TO address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfrom(uint8_t* buf, uint8_t* len, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Tests whether a new message is available
     /// from the Driver.
@@ -114,13 +115,17 @@ public:
     /// \return true if a message is available
     bool            waitAvailableTimeout(uint16_t timeout);
 
+    /// Returns the longest message the driver can send
+    /// \return The driver's maxMessageLength()
+    uint8_t         maxMessageLength();
+
     /// Sets the TO header to be sent in all subsequent messages
     /// \param[in] to The new TO header value
-    void           setHeaderTo(uint8_t to);
+    void           setHeaderTo(RHAddress to);
 
     /// Sets the FROM header to be sent in all subsequent messages
     /// \param[in] from The new FROM header value
-    void           setHeaderFrom(uint8_t from);
+    void           setHeaderFrom(RHAddress from);
 
     /// Sets the ID header to be sent in all subsequent messages
     /// \param[in] id The new ID header value
@@ -133,11 +138,11 @@ public:
 
     /// Returns the TO header of the last received message
     /// \return The TO header of the most recently received message.
-    uint8_t        headerTo();
+    RHAddress      headerTo();
 
     /// Returns the FROM header of the last received message
     /// \return The FROM header of the most recently received message.
-    uint8_t        headerFrom();
+    RHAddress      headerFrom();
 
     /// Returns the ID header of the last received message
     /// \return The ID header of the most recently received message.
@@ -149,14 +154,14 @@ public:
 
     /// Returns the address of this node.
     /// \return The address of this node
-    uint8_t         thisAddress();
+    RHAddress       thisAddress();
 
 protected:
     /// The Driver we are to use
     RHGenericDriver&        _driver;
 
     /// The address of this node
-    uint8_t         _thisAddress;
+    RHAddress       _thisAddress;
 };
 
 #endif
@@ -0,0 +1,429 @@
+// RHFountain.cpp
+//
+// Broadcast bulk transfer with a rateless erasure code
+
+#include <RHFountain.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Bit i of a bitmap
+static inline bool testBit(const uint8_t* map, uint16_t i)
+{
+    return map[i >> 3] & (1 << (i & 7));
+}
+
+static inline void setBit(uint8_t* map, uint16_t i)
+{
+    map[i >> 3] |= (1 << (i & 7));
+}
+
+// First set bit of a bitmap at or after from, or count if there is none before count
+static uint16_t nextBit(const uint8_t* map, uint16_t from, uint16_t count)
+{
+    while (from < count)
+    {
+	uint8_t bits = map[from >> 3] >> (from & 7);
+	if (bits)
+	{
+	    while (!(bits & 1))
+	    {
+		bits >>= 1;
+		from++;
+	    }
+	    return from < count ? from : count;
+	}
+	from = (from | 7) + 1;
+    }
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHFountain::RHFountain(RHDatagram& manager)
+    :
+    _manager(manager),
+    _blockLength(0),
+    _window(RH_FOUNTAIN_FEEDBACK_WINDOW),
+    _burst(RH_FOUNTAIN_BURST),
+    _blocksSent(0),
+    _state(TransferNone),
+    _from(RH_BROADCAST_ADDRESS),
+    _id(0),
+    _length(0),
+    _rxBlockLength(0),
+    _count(0),
+    _rank(0),
+    _blocksReceived(0),
+    _heard(false),
+    _lastHeard(0)
+{
+    _txId = random(0, 256);
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+uint8_t RHFountain::maxBlockLength()
+{
+    uint8_t len = _manager.maxMessageLength();
+    return len > RH_FOUNTAIN_HEADER_LEN ? len - RH_FOUNTAIN_HEADER_LEN : 0;
+}
+
+void RHFountain::setBlockLength(uint8_t len)
+{
+    _blockLength = len;
+}
+
+uint8_t RHFountain::blockLength()
+{
+    uint8_t max = maxBlockLength();
+    return (_blockLength && _blockLength < max) ? _blockLength : max;
+}
+
+void RHFountain::setFeedback(uint16_t window, uint8_t burst)
+{
+    _window = window > 4080 ? 4080 : window;
+    _burst = burst ? burst : 1;
+}
+
+uint16_t RHFountain::broadcast(const uint8_t* data, uint32_t len, const RHAddress* receivers,
+			       uint16_t numReceivers, uint16_t maxBlocks)
+{
+    uint8_t blockLen = blockLength();
+    _blocksSent = 0;
+    if (!blockLen || !len || len > 0xffffff || (numReceivers && !receivers) || numReceivers > RH_FOUNTAIN_MAX_RECEIVERS)
+	return 0;
+    uint32_t count = (len + blockLen - 1) / blockLen;
+    if (count > RH_FOUNTAIN_MAX_BLOCKS)
+	return 0;
+    if (!maxBlocks)
+	maxBlocks = count * 4 > 0xffff ? 0xffff : count * 4;
+
+    _txId++;
+    memset(_done, 0, sizeof(_done));
+    uint16_t done = 0;
+    uint8_t* block = _txFrame + RH_FOUNTAIN_HEADER_LEN;
+    uint16_t index;
+    for (index = 0; index < maxBlocks; index++)
+    {
+	// The first count coded blocks are the blocks themselves, the rest XORs of some of them.
+	// The last block is padded with zeros
+	memset(block, 0, blockLen);
+	if (index < count)
+	{
+	    uint32_t offset = (uint32_t)index * blockLen;
+	    memcpy(block, data + offset, len - offset < blockLen ? len - offset : blockLen);
+	}
+	else
+	{
+	    coefficients(_work, _txId, index, count);
+	    uint16_t i;
+	    for (i = nextBit(_work, 0, count); i < count; i = nextBit(_work, i + 1, count))
+	    {
+		uint32_t offset = (uint32_t)i * blockLen;
+		xorBytes(block, data + offset, len - offset < blockLen ? len - offset : blockLen);
+	    }
+	}
+
+	// Ask for feedback once the receivers can have enough to decode, then after every burst
+	bool ask = numReceivers && (uint32_t)index + 1 >= count && (index + 1 - count) % _burst == 0;
+	// The window, in units of 16 ms, grows with the receivers yet to answer
+	uint32_t waiting = (numReceivers - done + RH_FOUNTAIN_WINDOW_RECEIVERS - 1) / RH_FOUNTAIN_WINDOW_RECEIVERS;
+	uint32_t window = (_window * waiting + 15) / 16;
+	if (window > 255)
+	    window = 255;
+	if (!window)
+	    window = 1;
+	_txFrame[0] = RH_FOUNTAIN_TYPE_DATA;
+	_txFrame[1] = _txId;
+	_txFrame[2] = len >> 16;
+	_txFrame[3] = len >> 8;
+	_txFrame[4] = len;
+	_txFrame[5] = blockLen;
+	_txFrame[6] = index >> 8;
+	_txFrame[7] = index;
+	_txFrame[8] = ask ? window : 0;
+	_manager.sendto(_txFrame, RH_FOUNTAIN_HEADER_LEN + blockLen, RH_BROADCAST_ADDRESS);
+	_manager.waitPacketSent();
+	_blocksSent++;
+	if (!ask)
+	    continue;
+
+	// Addresses heard in this window, to tell them they need not answer again
+	uint8_t heard = 0;
+	uint8_t maxHeard = (_manager.maxMessageLength() - 2) / sizeof(RHAddress);
+	unsigned long starttime = millis();
+	int32_t timeLeft;
+	while ((timeLeft = window * 16 - (millis() - starttime)) > 0)
+	{
+	    if (!_manager.waitAvailableTimeout(timeLeft))
+		break;
+	    uint8_t rxLen = sizeof(_rxFrame);
+	    RHAddress from;
+	    if (!_manager.recvfrom(_rxFrame, &rxLen, &from)
+		|| rxLen < 2 || _rxFrame[0] != RH_FOUNTAIN_TYPE_DONE || _rxFrame[1] != _txId)
+		continue;
+	    uint16_t i;
+	    for (i = 0; i < numReceivers; i++)
+	    {
+		if (receivers[i] != from)
+		    continue;
+		if (!testBit(_done, i))
+		{
+		    setBit(_done, i);
+		    done++;
+		}
+		// Also a receiver heard before, which missed being told
+		if (heard < maxHeard)
+		    memcpy(_txFrame + 2 + heard++ * sizeof(RHAddress), &from, sizeof(RHAddress));
+		break;
+	    }
+	}
+	if (done == numReceivers)
+	    break;
+	if (heard)
+	{
+	    _txFrame[0] = RH_FOUNTAIN_TYPE_HEARD;
+	    _txFrame[1] = _txId;
+	    _manager.sendto(_txFrame, 2 + heard * sizeof(RHAddress), RH_BROADCAST_ADDRESS);
+	    _manager.waitPacketSent();
+	}
+    }
+    return done;
+}
+
+uint16_t RHFountain::blocksSent()
+{
+    return _blocksSent;
+}
+
+bool RHFountain::recvfrom(uint8_t* buf, uint32_t* len, RHAddress* from)
+{
+    while (poll())
+	;
+    if (_state != TransferComplete)
+	return false;
+
+    uint16_t coeffLen = (_count + 7) / 8;
+    uint32_t copied = 0;
+    uint16_t i;
+    if (*len > _length)
+	*len = _length;
+    for (i = 0; copied < *len; i++)
+    {
+	uint32_t n = *len - copied < _rxBlockLength ? *len - copied : _rxBlockLength;
+	memcpy(buf + copied, _rows[i] + coeffLen, n);
+	copied += n;
+    }
+    if (from)
+	*from = _from;
+    // Kept so that feedback windows are still answered
+    _state = TransferCollected;
+    return true;
+}
+
+bool RHFountain::recvfromTimeout(uint8_t* buf, uint32_t* len, uint16_t timeout, RHAddress* from)
+{
+    unsigned long starttime = millis();
+    int32_t timeLeft;
+    while ((timeLeft = timeout - (millis() - starttime)) > 0)
+    {
+	if (recvfrom(buf, len, from))
+	    return true;
+	_manager.waitAvailableTimeout(timeLeft);
+	YIELD;
+    }
+    return recvfrom(buf, len, from);
+}
+
+uint16_t RHFountain::blocksReceived()
+{
+    return _blocksReceived;
+}
+
+uint16_t RHFountain::blockCount()
+{
+    return _count;
+}
+
+////////////////////////////////////////////////////////////////////
+// Protected methods
+void RHFountain::coefficients(uint8_t* coeffs, uint8_t id, uint16_t index, uint16_t count)
+{
+    // Each coefficient is 1 with probability 1/2, from xorshift32 seeded by the transfer and block,
+    // so that sender and receivers agree without sending the coefficients
+    uint16_t coeffLen = (count + 7) / 8;
+    uint32_t x = (((uint32_t)id << 16) | index) * 2654435761UL ^ 0x5bd1e995UL;
+    if (!x)
+	x = 1;
+    uint16_t i;
+    for (i = 0; i < coeffLen; i++)
+    {
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	coeffs[i] = x >> 24;
+    }
+    if (count & 7)
+	coeffs[coeffLen - 1] &= (1 << (count & 7)) - 1;
+    if (nextBit(coeffs, 0, count) == count)
+	setBit(coeffs, index % count);
+}
+
+void RHFountain::xorBytes(uint8_t* dst, const uint8_t* src, uint16_t len)
+{
+    uint16_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16)
+	_mm_storeu_si128((__m128i*)(dst + i),
+			 _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst + i)),
+				       _mm_loadu_si128((const __m128i*)(src + i))));
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= len; i += 16)
+	vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+#else
+    // Without vector instructions, a word at a time. memcpy keeps unaligned access safe
+    for (; i + 4 <= len; i += 4)
+    {
+	uint32_t a, b;
+	memcpy(&a, dst + i, 4);
+	memcpy(&b, src + i, 4);
+	a ^= b;
+	memcpy(dst + i, &a, 4);
+    }
+#endif
+    for (; i < len; i++)
+	dst[i] ^= src[i];
+}
+
+bool RHFountain::poll()
+{
+    uint8_t len = sizeof(_rxFrame);
+    RHAddress from;
+    if (!_manager.recvfrom(_rxFrame, &len, &from))
+	return false;
+    if (len >= RH_FOUNTAIN_HEADER_LEN && _rxFrame[0] == RH_FOUNTAIN_TYPE_DATA)
+	handleData(_rxFrame, len, from);
+    else if (len >= 2 && _rxFrame[0] == RH_FOUNTAIN_TYPE_HEARD)
+	handleHeard(_rxFrame, len, from);
+    return true;
+}
+
+void RHFountain::handleData(const uint8_t* msg, uint8_t len, RHAddress from)
+{
+    uint8_t  id = msg[1];
+    uint32_t length = ((uint32_t)msg[2] << 16) | (msg[3] << 8) | msg[4];
+    uint8_t  blockLen = msg[5];
+    uint16_t index = (msg[6] << 8) | msg[7];
+    uint8_t  window = msg[8];
+    if (!length || !blockLen || len - RH_FOUNTAIN_HEADER_LEN != blockLen)
+	return;
+    uint32_t count = (length + blockLen - 1) / blockLen;
+    if (count > RH_FOUNTAIN_MAX_BLOCKS)
+	return;
+
+    unsigned long now = millis();
+    if (_state == TransferNone || from != _from || id != _id || length != _length || blockLen != _rxBlockLength)
+    {
+	// Another transfer. Keep a decoded one until it is collected, and do not let another sender
+	// interrupt one in progress, unless the sender has gone quiet
+	if (_state == TransferComplete && now - _lastHeard < RH_FOUNTAIN_TIMEOUT)
+	    return;
+	if (_state == TransferReceiving && from != _from && now - _lastHeard < RH_FOUNTAIN_TIMEOUT)
+	    return;
+	_state = TransferReceiving;
+	_from = from;
+	_id = id;
+	_length = length;
+	_rxBlockLength = blockLen;
+	_count = count;
+	_rank = 0;
+	_blocksReceived = 0;
+	_heard = false;
+	memset(_pivots, 0, sizeof(_pivots));
+    }
+    _lastHeard = now;
+
+    if (_state == TransferReceiving)
+    {
+	_blocksReceived++;
+	uint16_t coeffLen = (count + 7) / 8;
+	if (index < count)
+	{
+	    memset(_work, 0, coeffLen);
+	    setBit(_work, index);
+	}
+	else
+	    coefficients(_work, id, index, count);
+	memcpy(_work + coeffLen, msg + RH_FOUNTAIN_HEADER_LEN, blockLen);
+	addRow();
+	if (_rank == _count)
+	{
+	    solve();
+	    _state = TransferComplete;
+	}
+    }
+
+    // Sparse feedback: only decoded receivers answer, at a random time in the first 3/4 of the window
+    // so that their DONE messages rarely collide and end before the sender stops listening. They answer
+    // every window until the sender says it heard them
+    if (_state != TransferReceiving && window && !_heard)
+    {
+	delay(random(0, window * 12));
+	_txFrame[0] = RH_FOUNTAIN_TYPE_DONE;
+	_txFrame[1] = id;
+	_manager.sendto(_txFrame, 2, from);
+	_manager.waitPacketSent();
+    }
+}
+
+void RHFountain::handleHeard(const uint8_t* msg, uint8_t len, RHAddress from)
+{
+    if (_state == TransferNone || from != _from || msg[1] != _id)
+	return;
+    RHAddress thisAddress = _manager.thisAddress();
+    uint8_t i;
+    for (i = 2; i + sizeof(RHAddress) <= len; i += sizeof(RHAddress))
+    {
+	if (!memcmp(msg + i, &thisAddress, sizeof(RHAddress)))
+	    _heard = true;
+    }
+}
+
+void RHFountain::addRow()
+{
+    // Gaussian elimination over GF(2): XOR the rows already held into the new one, lowest leading
+    // coefficient first, until its leading coefficient is one no row has, or nothing is left of it.
+    // A row has no coefficients before its leading one, so only the octets from there on need XORing
+    uint16_t coeffLen = (_count + 7) / 8;
+    uint16_t width = coeffLen + _rxBlockLength;
+    uint16_t lead;
+    for (lead = nextBit(_work, 0, _count); lead < _count; lead = nextBit(_work, lead + 1, _count))
+    {
+	if (!testBit(_pivots, lead))
+	{
+	    memcpy(_rows[lead], _work, width);
+	    setBit(_pivots, lead);
+	    _rank++;
+	    return;
+	}
+	xorBytes(_work + (lead >> 3), _rows[lead] + (lead >> 3), width - (lead >> 3));
+    }
+    // Else it was a combination of rows already held
+}
+
+void RHFountain::solve()
+{
+    // Back substitution: the rows are upper triangular, so from the last up, XOR out of each row the
+    // blocks of the later rows it still has coefficients for, which are already solved
+    uint16_t coeffLen = (_count + 7) / 8;
+    int16_t row;
+    for (row = _count - 1; row >= 0; row--)
+    {
+	uint16_t q;
+	for (q = nextBit(_rows[row], row + 1, _count); q < _count; q = nextBit(_rows[row], q + 1, _count))
+	    xorBytes(_rows[row] + coeffLen, _rows[q] + coeffLen, _rxBlockLength);
+    }
+}
@@ -0,0 +1,235 @@
+// RHFountain.h
+//
+// Broadcast bulk transfer with a rateless erasure code
+//
+// Sends one message, such as a firmware image, to many nodes at once: the sender broadcasts coded
+// blocks until every receiver has enough to decode, and receivers only say when they are done.
+
+#ifndef RHFountain_h
+#define RHFountain_h
+
+#include <RHDatagram.h>
+
+// Most blocks in one transfer, a multiple of 8. A receiver keeps one row of RH_FOUNTAIN_MAX_BLOCKS / 8
+// coefficient octets and one block for each, so the longest message is about RH_FOUNTAIN_MAX_BLOCKS * 240
+// octets and decoding takes about RH_FOUNTAIN_MAX_BLOCKS * RH_FOUNTAIN_ROW_LEN octets of memory
+#ifndef RH_FOUNTAIN_MAX_BLOCKS
+#define RH_FOUNTAIN_MAX_BLOCKS 256
+#endif
+
+// Most receivers a sender waits for
+#ifndef RH_FOUNTAIN_MAX_RECEIVERS
+#define RH_FOUNTAIN_MAX_RECEIVERS 256
+#endif
+
+// Default time the sender listens for DONE messages after each burst, ms, for up to
+// RH_FOUNTAIN_WINDOW_RECEIVERS receivers yet to answer. Should allow several times that many DONE messages
+// back to back at the data rate in use
+#ifndef RH_FOUNTAIN_FEEDBACK_WINDOW
+#define RH_FOUNTAIN_FEEDBACK_WINDOW 400
+#endif
+
+// Receivers yet to answer that one feedback window is sized for. With more, the window grows in
+// proportion, up to 4080 ms, so that their DONE messages rarely collide
+#ifndef RH_FOUNTAIN_WINDOW_RECEIVERS
+#define RH_FOUNTAIN_WINDOW_RECEIVERS 2
+#endif
+
+// Default number of coded blocks between feedback windows, once enough have been sent to decode
+#ifndef RH_FOUNTAIN_BURST
+#define RH_FOUNTAIN_BURST 16
+#endif
+
+// A receiver abandons a transfer it has heard nothing of for this long, ms
+#ifndef RH_FOUNTAIN_TIMEOUT
+#define RH_FOUNTAIN_TIMEOUT 30000
+#endif
+
+// Message types, the first octet of every fountain message
+#define RH_FOUNTAIN_TYPE_DATA 0
+#define RH_FOUNTAIN_TYPE_DONE 1
+#define RH_FOUNTAIN_TYPE_HEARD 2
+
+// Octets in front of each coded block: type, transfer ID, 24 bit message length, block length,
+// 16 bit block index and feedback window in units of 16 ms
+#define RH_FOUNTAIN_HEADER_LEN 9
+
+// Size of one decoder row: coefficient bitmap, then the block
+#define RH_FOUNTAIN_ROW_LEN (RH_FOUNTAIN_MAX_BLOCKS / 8 + RH_MAX_MESSAGE_LEN)
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHFountain RHFountain.h <RHFountain.h>
+/// \brief Broadcasts a long message to many nodes with a rateless erasure code
+///
+/// Sending the same message to N nodes one after another with RHFragmenter costs N times the airtime,
+/// and acknowledging broadcasts makes every receiver answer every frame. RHFountain instead cuts the
+/// message into K blocks and broadcasts coded blocks: first the K blocks themselves (the code is
+/// systematic, so a receiver that misses nothing has no decoding to do), then repair blocks, each the XOR
+/// of a pseudo random half of the K blocks. A receiver can decode as soon as it holds any K independent
+/// coded blocks, whichever ones it missed, which with random linear combinations over GF(2) takes on
+/// average fewer than 2 blocks more than K. So each extra block the sender broadcasts repairs a different
+/// loss at each receiver, and the airtime grows with the worst receiver's loss rather than with the number of
+/// receivers.
+///
+/// Receivers decode as blocks arrive, by Gaussian elimination over GF(2), keeping the rows in a fixed
+/// buffer: there is no memory allocation and the XOR kernel uses SSE2 or NEON when the compiler targets them.
+///
+/// The only feedback is a DONE message from each receiver that has decoded. After every burst of
+/// coded blocks the sender stops for a feedback window announced in the last block of the burst, and each
+/// receiver that has finished answers at a random time in the window. After the window the sender broadcasts
+/// the addresses it heard, and those receivers answer no more, so the window need only grow with the number
+/// of receivers the sender has not heard from for their answers to rarely collide. The sender stops when every
+/// receiver it was given has answered, or after a limit of blocks. Without a list of receivers it just sends
+/// the limit, open loop.
+///
+/// All messages go through RHDatagram::sendto() and recvfrom(), so the manager may be an RHDatagram or
+/// any manager derived from it, and the transfer reaches only nodes in range of the sender.
+///
+/// \code
+/// RHDatagram manager(driver, 1);
+/// RHFountain fountain(manager);
+/// manager.init();
+/// RHAddress nodes[] = { 2, 3, 4, 5 };
+/// fountain.broadcast(image, sizeof(image), nodes, 4);
+/// \endcode
+class RHFountain
+{
+public:
+    /// Constructor
+    /// \param[in] manager The manager that carries the coded blocks. Initialise it before use.
+    RHFountain(RHDatagram& manager);
+
+    /// Sets the length of each block. Defaults to the most the manager can carry.
+    /// \param[in] len Block length in octets, limited to maxBlockLength()
+    void setBlockLength(uint8_t len);
+
+    /// \return The block length used for sending
+    uint8_t blockLength();
+
+    /// \return The longest block the manager can carry in one message
+    uint8_t maxBlockLength();
+
+    /// Sets how the sender asks for feedback
+    /// \param[in] window How long to listen for DONE messages after each burst in ms, up to 4080, for up to
+    /// RH_FOUNTAIN_WINDOW_RECEIVERS receivers yet to answer
+    /// \param[in] burst Coded blocks sent between feedback windows once enough have been sent to decode
+    void setFeedback(uint16_t window, uint8_t burst);
+
+    /// Broadcasts a message until every given receiver has decoded it
+    /// \param[in] data The message
+    /// \param[in] len Its length, up to RH_FOUNTAIN_MAX_BLOCKS blocks
+    /// \param[in] receivers Addresses of the nodes that must receive the message, or NULL to send open loop
+    /// \param[in] numReceivers Number of addresses, up to RH_FOUNTAIN_MAX_RECEIVERS
+    /// \param[in] maxBlocks Most coded blocks to send, up to 65535. 0 for 4 times the number of blocks
+    /// \return The number of given receivers that reported the message decoded
+    uint16_t broadcast(const uint8_t* data, uint32_t len, const RHAddress* receivers = NULL,
+		       uint16_t numReceivers = 0, uint16_t maxBlocks = 0);
+
+    /// \return Coded blocks sent by the last broadcast()
+    uint16_t blocksSent();
+
+    /// Deals with any messages the manager has received, and returns the message if it has been decoded
+    /// \param[in] buf Where to copy the message
+    /// \param[in,out] len Available space in buf. Set to the number of octets copied
+    /// \param[out] from If present and not NULL, set to the address of the sender
+    /// \return true if a message was decoded and copied
+    bool recvfrom(uint8_t* buf, uint32_t* len, RHAddress* from = NULL);
+
+    /// Like recvfrom(), but waits for a message to be decoded
+    /// \param[in] buf Where to copy the message
+    /// \param[in,out] len Available space in buf. Set to the number of octets copied
+    /// \param[in] timeout Longest time to wait in ms
+    /// \param[out] from If present and not NULL, set to the address of the sender
+    /// \return true if a message was decoded and copied
+    bool recvfromTimeout(uint8_t* buf, uint32_t* len, uint16_t timeout, RHAddress* from = NULL);
+
+    /// \return Coded blocks received for the current or last transfer, up to when it was decoded
+    uint16_t blocksReceived();
+
+    /// \return Number of blocks the current or last transfer was cut into, 0 if none
+    uint16_t blockCount();
+
+protected:
+    /// \brief Progress of the transfer being received
+    typedef enum
+    {
+	TransferNone = 0,   ///< Nothing received
+	TransferReceiving,  ///< Some blocks received, not decodable yet
+	TransferComplete,   ///< Decoded, waiting for recvfrom()
+	TransferCollected   ///< Collected, remembered only to answer feedback windows
+    } TransferState;
+
+    /// Fills a bitmap with the coefficients of a coded block
+    /// \param[out] coeffs K bits, 1 for each block XORed into the coded block
+    /// \param[in] id Transfer ID
+    /// \param[in] index Index of the coded block
+    /// \param[in] count K, the number of blocks
+    static void coefficients(uint8_t* coeffs, uint8_t id, uint16_t index, uint16_t count);
+
+    /// dst ^= src, len octets
+    static void xorBytes(uint8_t* dst, const uint8_t* src, uint16_t len);
+
+    /// Takes one message from the manager and deals with it
+    /// \return true if there was a message
+    bool poll();
+
+    /// Deals with a coded block
+    void handleData(const uint8_t* msg, uint8_t len, RHAddress from);
+
+    /// Deals with the list of receivers the sender heard in a feedback window
+    void handleHeard(const uint8_t* msg, uint8_t len, RHAddress from);
+
+    /// Adds a coded block, in _work, to the decoder
+    void addRow();
+
+    /// Solves for the blocks once the decoder has K independent rows
+    void solve();
+
+    /// The manager
+    RHDatagram&         _manager;
+
+    /// Block length for sending, 0 for the most the manager can carry
+    uint8_t             _blockLength;
+
+    /// Feedback window in ms and coded blocks between windows
+    uint16_t            _window;
+    uint8_t             _burst;
+
+    /// ID of the last transfer sent
+    uint8_t             _txId;
+
+    /// Coded blocks sent by the last broadcast()
+    uint16_t            _blocksSent;
+
+    /// Receivers that have reported the message decoded, 1 bit each
+    uint8_t             _done[RH_FOUNTAIN_MAX_RECEIVERS / 8];
+
+    /// The transfer being received
+    TransferState       _state;
+    RHAddress           _from;
+    uint8_t             _id;
+    uint32_t            _length;
+    uint8_t             _rxBlockLength;
+    uint16_t            _count;
+    uint16_t            _rank;
+    uint16_t            _blocksReceived;
+
+    /// true once the sender has said it heard our DONE message
+    bool                _heard;
+    unsigned long       _lastHeard;
+
+    /// Rows of the decoder present, 1 bit for each leading coefficient
+    uint8_t             _pivots[RH_FOUNTAIN_MAX_BLOCKS / 8];
+
+    /// Decoder rows, row i having its first coefficient at i. Once solved, row i holds block i
+    uint8_t             _rows[RH_FOUNTAIN_MAX_BLOCKS][RH_FOUNTAIN_ROW_LEN];
+
+    /// Row being reduced, or coded block being built
+    uint8_t             _work[RH_FOUNTAIN_ROW_LEN];
+
+    /// Frames being sent and received
+    uint8_t             _txFrame[RH_MAX_MESSAGE_LEN];
+    uint8_t             _rxFrame[RH_MAX_MESSAGE_LEN];
+};
+
+#endif
@@ -0,0 +1,473 @@
+// RHFragmenter.cpp
+//
+// Fragmentation and reassembly of messages too long for one radio frame
+
+#include <RHFragmenter.h>
+
+// Bit i of a fragment bitmap
+static inline bool testBit(const uint8_t* map, uint16_t i)
+{
+    return map[i >> 3] & (1 << (i & 7));
+}
+
+static inline void setBit(uint8_t* map, uint16_t i)
+{
+    map[i >> 3] |= (1 << (i & 7));
+}
+
+static inline void clearBit(uint8_t* map, uint16_t i)
+{
+    map[i >> 3] &= ~(1 << (i & 7));
+}
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHFragmenter::RHFragmenter(RHReliableDatagram& manager)
+    :
+    _manager(&manager),
+    _router(NULL),
+    _mesh(NULL)
+{
+    setup();
+}
+
+RHFragmenter::RHFragmenter(RHRouter& router)
+    :
+    _manager(&router),
+    _router(&router),
+    _mesh(NULL)
+{
+    setup();
+}
+
+RHFragmenter::RHFragmenter(RHMesh& mesh)
+    :
+    _manager(&mesh),
+    _router(&mesh),
+    _mesh(&mesh)
+{
+    setup();
+}
+
+void RHFragmenter::setup()
+{
+    _fragmentLength = 0;
+    _sink = NULL;
+    _sinkArg = NULL;
+    memset(_contexts, 0, sizeof(_contexts));
+    _txId = random(0, 256);
+    _txDest = RH_BROADCAST_ADDRESS;
+    _sending = false;
+    _statusLen = 0;
+    _retransmissions = 0;
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+uint8_t RHFragmenter::maxFragmentLength()
+{
+    // The driver is only known after the manager has been initialised, so this is not cached
+    uint16_t len = _manager->maxMessageLength();
+    if (_mesh)
+    {
+	len = len > sizeof(RHRouter::RoutedMessageHeader) + sizeof(RHMesh::MeshMessageHeader)
+	    ? len - sizeof(RHRouter::RoutedMessageHeader) - sizeof(RHMesh::MeshMessageHeader) : 0;
+	if (len > RH_MESH_MAX_MESSAGE_LEN)
+	    len = RH_MESH_MAX_MESSAGE_LEN;
+    }
+    else if (_router)
+    {
+	len = len > sizeof(RHRouter::RoutedMessageHeader) ? len - sizeof(RHRouter::RoutedMessageHeader) : 0;
+	if (len > RH_ROUTER_MAX_MESSAGE_LEN)
+	    len = RH_ROUTER_MAX_MESSAGE_LEN;
+    }
+    return len > RH_FRAG_HEADER_LEN ? len - RH_FRAG_HEADER_LEN : 0;
+}
+
+void RHFragmenter::setFragmentLength(uint8_t len)
+{
+    _fragmentLength = len;
+}
+
+uint8_t RHFragmenter::fragmentLength()
+{
+    uint8_t max = maxFragmentLength();
+    return (_fragmentLength && _fragmentLength < max) ? _fragmentLength : max;
+}
+
+bool RHFragmenter::sendtoWait(const uint8_t* data, uint32_t len, RHAddress dest)
+{
+    return sendtoWait(readBuffer, (void*)data, len, dest);
+}
+
+bool RHFragmenter::sendtoWait(RHFragmentSource source, void* arg, uint32_t len, RHAddress dest)
+{
+    uint8_t fragLen = fragmentLength();
+    if (dest == RH_BROADCAST_ADDRESS || !fragLen || !source)
+	return false;
+    uint32_t count = len ? (len + fragLen - 1) / fragLen : 1;
+    if (count > RH_FRAG_MAX_FRAGMENTS)
+	return false;
+
+    _txId++;
+    _txDest = dest;
+    _sending = true;
+    memset(_pending, 0, sizeof(_pending));
+    uint16_t i;
+    for (i = 0; i < count; i++)
+	setBit(_pending, i);
+
+    // Progress is judged by how many fragments the destination says it is missing.
+    // Those past the end of its bitmap are counted as missing
+    uint32_t missing = count;
+    uint8_t  idleRounds = 0;
+    bool     first = true;
+    bool     done = false;
+    while (sendPending(source, arg, len, count, first) && pollStatus(dest, count)
+	   && _status[0] != RH_FRAG_TYPE_ABORT)
+    {
+	first = false;
+	if (_statusLen < 4)
+	{
+	    done = true;
+	    break;
+	}
+
+	// Selective negative acknowledgement: every fragment before base has arrived, and the bitmap
+	// says which of those after it are missing
+	uint16_t base = (_status[2] << 8) | _status[3];
+	uint16_t mapBits = (_statusLen - 4) * 8;
+	uint32_t nowMissing = 0;
+	for (i = 0; i < count; i++)
+	{
+	    if (i < base)
+		clearBit(_pending, i);
+	    else if (i - base < mapBits)
+	    {
+		if (testBit(_status + 4, i - base))
+		{
+		    setBit(_pending, i);
+		    nowMissing++;
+		}
+		else
+		    clearBit(_pending, i);
+	    }
+	    else
+		nowMissing++;
+	}
+	if (nowMissing < missing)
+	    idleRounds = 0;
+	else if (++idleRounds >= RH_FRAG_MAX_ROUNDS)
+	    break;
+	missing = nowMissing;
+    }
+    _sending = false;
+    return done;
+}
+
+void RHFragmenter::setSink(RHFragmentSink sink, void* arg)
+{
+    _sink = sink;
+    _sinkArg = arg;
+}
+
+bool RHFragmenter::recvfrom(uint8_t* buf, uint32_t* len, RHAddress* from)
+{
+    while (poll(0))
+	;
+    return collect(buf, len, from);
+}
+
+bool RHFragmenter::recvfromTimeout(uint8_t* buf, uint32_t* len, uint16_t timeout, RHAddress* from)
+{
+    unsigned long starttime = millis();
+    int32_t timeLeft;
+    while ((timeLeft = timeout - (millis() - starttime)) > 0)
+    {
+	if (collect(buf, len, from))
+	    return true;
+	poll(timeLeft);
+	YIELD;
+    }
+    return recvfrom(buf, len, from);
+}
+
+uint32_t RHFragmenter::retransmissions()
+{
+    return _retransmissions;
+}
+
+void RHFragmenter::resetRetransmissions()
+{
+    _retransmissions = 0;
+}
+
+////////////////////////////////////////////////////////////////////
+// Protected methods
+uint8_t RHFragmenter::readBuffer(uint32_t offset, uint8_t* buf, uint8_t len, void* arg)
+{
+    memcpy(buf, (const uint8_t*)arg + offset, len);
+    return len;
+}
+
+bool RHFragmenter::sendPending(RHFragmentSource source, void* arg, uint32_t len, uint16_t count, bool first)
+{
+    uint8_t fragLen = fragmentLength();
+    uint16_t i;
+    for (i = 0; i < count; i++)
+    {
+	if (!testBit(_pending, i))
+	    continue;
+	uint32_t offset = (uint32_t)i * fragLen;
+	uint8_t  n = (len - offset < fragLen) ? len - offset : fragLen;
+	_txFrame[0] = RH_FRAG_TYPE_DATA;
+	_txFrame[1] = _txId;
+	_txFrame[2] = i >> 4;
+	_txFrame[3] = ((i & 0x0f) << 4) | ((count - 1) >> 8);
+	_txFrame[4] = (count - 1) & 0xff;
+	_txFrame[5] = fragLen;
+	if (n && source(offset, _txFrame + RH_FRAG_HEADER_LEN, n, arg) != n)
+	    return false;
+	if (!first)
+	    _retransmissions++;
+	// A fragment the manager could not deliver stays pending for the next round
+	if (transmit(RH_FRAG_HEADER_LEN + n, _txDest))
+	    clearBit(_pending, i);
+    }
+    return true;
+}
+
+bool RHFragmenter::transmit(uint8_t len, RHAddress dest)
+{
+    // The managers' sendtoWait() are not virtual, so call the one of the most derived class
+    if (_mesh)
+	return _mesh->sendtoWait(_txFrame, len, dest) == RH_ROUTER_ERROR_NONE;
+    if (_router)
+	return _router->sendtoWait(_txFrame, len, dest) == RH_ROUTER_ERROR_NONE;
+    return _manager->sendtoWait(_txFrame, len, dest);
+}
+
+bool RHFragmenter::poll(uint16_t timeout)
+{
+    uint8_t len = sizeof(_rxFrame);
+    RHAddress from;
+    bool got;
+    if (_mesh)
+	got = timeout ? _mesh->recvfromAckTimeout(_rxFrame, &len, timeout, &from) : _mesh->recvfromAck(_rxFrame, &len, &from);
+    else if (_router)
+	got = timeout ? _router->recvfromAckTimeout(_rxFrame, &len, timeout, &from) : _router->recvfromAck(_rxFrame, &len, &from);
+    else
+	got = timeout ? _manager->recvfromAckTimeout(_rxFrame, &len, timeout, &from) : _manager->recvfromAck(_rxFrame, &len, &from);
+    if (got)
+	handle(_rxFrame, len, from);
+    return got;
+}
+
+void RHFragmenter::handle(const uint8_t* msg, uint8_t len, RHAddress from)
+{
+    if (len < 2)
+	return;
+    uint8_t type = msg[0];
+    uint8_t id = msg[1];
+
+    if (type == RH_FRAG_TYPE_STATUS || type == RH_FRAG_TYPE_ABORT)
+    {
+	// An answer to our poll
+	if (_sending && from == _txDest && id == _txId)
+	{
+	    memcpy(_status, msg, len);
+	    _statusLen = len;
+	}
+	return;
+    }
+
+    Context* c;
+    if (type == RH_FRAG_TYPE_POLL && len >= 5)
+    {
+	uint16_t count = ((msg[2] << 8) | msg[3]) + 1;
+	c = context(from, id, count, msg[4]);
+	if (c)
+	    sendStatus(c, from, id);
+	else if (!msg[4] || count > RH_FRAG_MAX_FRAGMENTS
+		 || (!_sink && (uint32_t)(count - 1) * msg[4] >= RH_FRAG_BUFFER_SIZE))
+	    sendAbort(from, id);
+	// Else there is no room at the moment. Stay silent and the sender polls again
+    }
+    else if (type == RH_FRAG_TYPE_DATA && len >= RH_FRAG_HEADER_LEN)
+    {
+	uint16_t index = (msg[2] << 4) | (msg[3] >> 4);
+	uint16_t count = (((msg[3] & 0x0f) << 8) | msg[4]) + 1;
+	uint8_t  fragLen = msg[5];
+	uint8_t  n = len - RH_FRAG_HEADER_LEN;
+	// Every fragment but the last is full
+	if (index >= count || n > fragLen || (n != fragLen && index != count - 1))
+	    return;
+	c = context(from, id, count, fragLen);
+	if (!c || c->state != ContextReceiving || testBit(c->bitmap, index))
+	    return;
+	uint32_t offset = (uint32_t)index * fragLen;
+	if (!_sink && offset + n > RH_FRAG_BUFFER_SIZE)
+	{
+	    // Only known to be too long now that the last fragment is in
+	    c->state = ContextFree;
+	    sendAbort(from, id);
+	    return;
+	}
+	if (_sink)
+	{
+	    if (!_sink(from, offset, msg + RH_FRAG_HEADER_LEN, n, _sinkArg))
+		return;
+	}
+	else
+	    memcpy(c->buf + offset, msg + RH_FRAG_HEADER_LEN, n);
+	setBit(c->bitmap, index);
+	if (index == count - 1)
+	    c->length = offset + n;
+	if (++c->received == count)
+	    c->state = ContextComplete;
+    }
+}
+
+RHFragmenter::Context* RHFragmenter::context(RHAddress from, uint8_t id, uint16_t count, uint8_t fragmentLength)
+{
+    unsigned long now = millis();
+    uint8_t i;
+    for (i = 0; i < RH_FRAG_MAX_TRANSFERS; i++)
+    {
+	Context* c = &_contexts[i];
+	if (c->state != ContextFree && c->from == from && c->id == id
+	    && c->count == count && c->fragmentLength == fragmentLength)
+	{
+	    c->lastHeard = now;
+	    return c;
+	}
+    }
+
+    // A new transfer. Without a sink it has to fit in the buffer
+    if (!fragmentLength || count > RH_FRAG_MAX_FRAGMENTS
+	|| (!_sink && (uint32_t)(count - 1) * fragmentLength >= RH_FRAG_BUFFER_SIZE))
+	return NULL;
+
+    // Use a free context, else one only kept to answer polls, else one whose sender has gone quiet,
+    // else an unfinished one from the same sender, which has moved on to another transfer
+    Context* found = NULL;
+    uint8_t  rank = 0;
+    for (i = 0; i < RH_FRAG_MAX_TRANSFERS; i++)
+    {
+	Context* c = &_contexts[i];
+	uint8_t r = 0;
+	if (c->state == ContextFree)
+	    r = 4;
+	else if (c->state == ContextCollected)
+	    r = 3;
+	else if (c->state == ContextReceiving && now - c->lastHeard > RH_FRAG_REASSEMBLY_TIMEOUT)
+	    r = 2;
+	else if (c->state == ContextReceiving && c->from == from)
+	    r = 1;
+	if (r > rank)
+	{
+	    rank = r;
+	    found = c;
+	}
+    }
+    if (!found)
+	return NULL;
+
+    found->state = ContextReceiving;
+    found->from = from;
+    found->id = id;
+    found->count = count;
+    found->received = 0;
+    found->fragmentLength = fragmentLength;
+    found->length = 0;
+    found->lastHeard = now;
+    memset(found->bitmap, 0, (count + 7) / 8);
+    return found;
+}
+
+void RHFragmenter::sendStatus(Context* c, RHAddress to, uint8_t id)
+{
+    _txFrame[0] = RH_FRAG_TYPE_STATUS;
+    _txFrame[1] = id;
+    if (c->state != ContextReceiving)
+    {
+	transmit(2, to);
+	return;
+    }
+
+    // Bitmap of missing fragments from the first missing one, as much as fits in one message
+    uint16_t base = 0;
+    while (testBit(c->bitmap, base))
+	base++;
+    uint16_t bytes = (c->count - base + 7) / 8;
+    uint16_t room = maxFragmentLength() + RH_FRAG_HEADER_LEN - 4;
+    if (bytes > room)
+	bytes = room;
+    _txFrame[2] = base >> 8;
+    _txFrame[3] = base & 0xff;
+    memset(_txFrame + 4, 0, bytes);
+    uint16_t i;
+    for (i = 0; i < bytes * 8 && base + i < c->count; i++)
+	if (!testBit(c->bitmap, base + i))
+	    setBit(_txFrame + 4, i);
+    transmit(4 + bytes, to);
+}
+
+void RHFragmenter::sendAbort(RHAddress to, uint8_t id)
+{
+    _txFrame[0] = RH_FRAG_TYPE_ABORT;
+    _txFrame[1] = id;
+    transmit(2, to);
+}
+
+bool RHFragmenter::pollStatus(RHAddress dest, uint16_t count)
+{
+    uint8_t tries;
+    for (tries = 0; tries < RH_FRAG_POLL_RETRIES; tries++)
+    {
+	_statusLen = 0;
+	_txFrame[0] = RH_FRAG_TYPE_POLL;
+	_txFrame[1] = _txId;
+	_txFrame[2] = (count - 1) >> 8;
+	_txFrame[3] = (count - 1) & 0xff;
+	_txFrame[4] = fragmentLength();
+	// Wait for the answer even if the poll was not acknowledged, as it may only be the
+	// acknowledgement that was lost. Go on reassembling for other nodes meanwhile
+	transmit(5, dest);
+	unsigned long starttime = millis();
+	int32_t timeLeft;
+	while (!_statusLen && (timeLeft = RH_FRAG_STATUS_TIMEOUT - (millis() - starttime)) > 0)
+	{
+	    poll(timeLeft);
+	    YIELD;
+	}
+	if (_statusLen)
+	    return true;
+    }
+    return false;
+}
+
+bool RHFragmenter::collect(uint8_t* buf, uint32_t* len, RHAddress* from)
+{
+    uint8_t i;
+    for (i = 0; i < RH_FRAG_MAX_TRANSFERS; i++)
+    {
+	Context* c = &_contexts[i];
+	if (c->state != ContextComplete)
+	    continue;
+	if (from)
+	    *from = c->from;
+	if (_sink)
+	    *len = c->length;
+	else
+	{
+	    if (*len > c->length)
+		*len = c->length;
+	    memcpy(buf, c->buf, *len);
+	}
+	// Kept until the context is needed, so that a repeated poll is still answered
+	c->state = ContextCollected;
+	return true;
+    }
+    return false;
+}
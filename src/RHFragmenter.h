@@ -0,0 +1,274 @@
+// RHFragmenter.h
+//
+// Fragmentation and reassembly of messages too long for one radio frame
+//
+// Splits a long message into fragments carried by an RHReliableDatagram, RHRouter or RHMesh,
+// reassembles them at the destination, and retransmits only the fragments the destination reports missing.
+
+#ifndef RHFragmenter_h
+#define RHFragmenter_h
+
+#include <RHMesh.h>
+
+// Most fragments in one transfer, up to 4096. Each transfer being sent or received keeps a bitmap
+// of 1 bit per fragment
+#ifndef RH_FRAG_MAX_FRAGMENTS
+#define RH_FRAG_MAX_FRAGMENTS 1024
+#endif
+
+// Size of the reassembly buffer of each receive context, octets. Longer transfers need a sink, see setSink()
+#ifndef RH_FRAG_BUFFER_SIZE
+#define RH_FRAG_BUFFER_SIZE 4096
+#endif
+
+// Number of transfers, from different senders, that can be reassembled at the same time
+#ifndef RH_FRAG_MAX_TRANSFERS
+#define RH_FRAG_MAX_TRANSFERS 2
+#endif
+
+// A transfer is forgotten when nothing has been heard from its sender for this long, ms
+#ifndef RH_FRAG_REASSEMBLY_TIMEOUT
+#define RH_FRAG_REASSEMBLY_TIMEOUT 30000
+#endif
+
+// How long the sender waits for the destination to answer a poll, ms
+#ifndef RH_FRAG_STATUS_TIMEOUT
+#define RH_FRAG_STATUS_TIMEOUT 2000
+#endif
+
+// Polls the sender makes without an answer before giving up
+#ifndef RH_FRAG_POLL_RETRIES
+#define RH_FRAG_POLL_RETRIES 3
+#endif
+
+// Retransmission rounds in a row that deliver nothing new before the sender gives up
+#ifndef RH_FRAG_MAX_ROUNDS
+#define RH_FRAG_MAX_ROUNDS 4
+#endif
+
+// Message types, the first octet of every fragmenter message
+#define RH_FRAG_TYPE_DATA   0
+#define RH_FRAG_TYPE_POLL   1
+#define RH_FRAG_TYPE_STATUS 2
+#define RH_FRAG_TYPE_ABORT  3
+
+// Octets in front of the data in each fragment: type, transfer ID, 12 bit index and 12 bit count-1, fragment length
+#define RH_FRAG_HEADER_LEN 6
+
+/// Reads part of the message being sent by RHFragmenter::sendtoWait(). Fragments are read in order,
+/// and then again, out of order, for any that have to be retransmitted.
+/// \param[in] offset Offset in the message of the first octet wanted
+/// \param[out] buf Where to put the octets
+/// \param[in] len Number of octets wanted
+/// \param[in] arg The argument given to RHFragmenter::sendtoWait()
+/// \return The number of octets put in buf, which must be len
+typedef uint8_t (*RHFragmentSource)(uint32_t offset, uint8_t* buf, uint8_t len, void* arg);
+
+/// Takes a fragment of a message as it is received by RHFragmenter, instead of the reassembly buffer.
+/// Fragments arrive in any order but each only once.
+/// \param[in] from Address of the sender
+/// \param[in] offset Offset in the message of the first octet of data
+/// \param[in] data The fragment
+/// \param[in] len Length of the fragment
+/// \param[in] arg The argument given to RHFragmenter::setSink()
+/// \return true if the fragment was stored. If false, it counts as not received and will be sent again
+typedef bool (*RHFragmentSink)(RHAddress from, uint32_t offset, const uint8_t* data, uint8_t len, void* arg);
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHFragmenter RHFragmenter.h <RHFragmenter.h>
+/// \brief Sends and receives messages longer than one frame over RHReliableDatagram, RHRouter or RHMesh
+///
+/// sendtoWait() cuts the message into fragments of up to fragmentLength() octets, each carried by the
+/// manager in one message with a 6 octet header. The message is never held in fragments: each is read from
+/// the caller's buffer, or from an RHFragmentSource callback, just before it is sent. After sending them all
+/// the sender polls the destination, which answers with a bitmap of the fragments it is still missing
+/// (a selective negative acknowledgement) or that it has them all. Only the missing fragments are sent again,
+/// and the sender polls again, until the destination has the whole message or no progress is being made.
+///
+/// The destination reassembles up to RH_FRAG_MAX_TRANSFERS messages at a time, each in a fixed buffer of
+/// RH_FRAG_BUFFER_SIZE octets, so memory use is bounded and known at compile time. Longer messages, up to
+/// RH_FRAG_MAX_FRAGMENTS fragments, can be received by setting a sink that stores each fragment as it arrives,
+/// for example straight into a file. A transfer the destination has not heard from for
+/// RH_FRAG_REASSEMBLY_TIMEOUT is abandoned and its buffer reused.
+///
+/// All messages of the manager are taken to be fragmenter messages, so an application that also
+/// sends short messages should give them to the fragmenter too: a message that fits in one fragment costs
+/// only the header and one poll more than sending it directly.
+/// sendtoWait() blocks until the transfer is complete, but goes on reassembling messages from other
+/// nodes while it waits for the destination to answer.
+///
+/// \code
+/// RHMesh mesh(driver, 1);
+/// RHFragmenter fragmenter(mesh);
+/// mesh.init();
+/// fragmenter.sendtoWait(image, sizeof(image), 2);
+/// \endcode
+class RHFragmenter
+{
+public:
+    /// Constructor for fragments sent directly to their destination
+    /// \param[in] manager The manager that carries the fragments. Initialise it before use.
+    RHFragmenter(RHReliableDatagram& manager);
+
+    /// Constructor for fragments sent over a route
+    /// \param[in] router The router that carries the fragments. Initialise it before use.
+    RHFragmenter(RHRouter& router);
+
+    /// Constructor for fragments sent over a mesh, discovering the route if necessary
+    /// \param[in] mesh The mesh that carries the fragments. Initialise it before use.
+    RHFragmenter(RHMesh& mesh);
+
+    /// Sets the longest fragment to send. Shorter fragments cost more header and more frames,
+    /// but less airtime is wasted when one is lost. Defaults to the most the manager can carry.
+    /// \param[in] len Fragment length in octets, limited to maxFragmentLength()
+    void setFragmentLength(uint8_t len);
+
+    /// \return The longest fragment sent
+    uint8_t fragmentLength();
+
+    /// \return The longest fragment the manager can carry in one message
+    uint8_t maxFragmentLength();
+
+    /// Sends a message, which may be too long for one frame, and waits until the destination has it all
+    /// \param[in] data The message
+    /// \param[in] len Its length, up to RH_FRAG_MAX_FRAGMENTS fragments
+    /// \param[in] dest Address of the destination, which may not be RH_BROADCAST_ADDRESS
+    /// \return true if the destination received the whole message
+    bool sendtoWait(const uint8_t* data, uint32_t len, RHAddress dest);
+
+    /// Sends a message read fragment by fragment from a callback, without holding the message in memory
+    /// \param[in] source Callback that reads the message
+    /// \param[in] arg Passed to source
+    /// \param[in] len Length of the message, up to RH_FRAG_MAX_FRAGMENTS fragments
+    /// \param[in] dest Address of the destination, which may not be RH_BROADCAST_ADDRESS
+    /// \return true if the destination received the whole message
+    bool sendtoWait(RHFragmentSource source, void* arg, uint32_t len, RHAddress dest);
+
+    /// Sets a callback to store fragments as they are received, instead of reassembling them in the
+    /// buffers. Then messages may be longer than RH_FRAG_BUFFER_SIZE, and recvfrom() only reports
+    /// that a message is complete.
+    /// \param[in] sink The callback, or NULL to reassemble in the buffers
+    /// \param[in] arg Passed to sink
+    void setSink(RHFragmentSink sink, void* arg = NULL);
+
+    /// Deals with any messages the manager has received, and returns a reassembled message if there is one
+    /// \param[in] buf Where to copy the message. Not used if a sink is set
+    /// \param[in,out] len Available space in buf. Set to the number of octets copied, or with a sink
+    /// the length of the message
+    /// \param[out] from If present and not NULL, set to the address of the sender
+    /// \return true if a message was complete
+    bool recvfrom(uint8_t* buf, uint32_t* len, RHAddress* from = NULL);
+
+    /// Like recvfrom(), but waits for a message to be complete
+    /// \param[in] buf Where to copy the message. Not used if a sink is set
+    /// \param[in,out] len Available space in buf. Set to the number of octets copied, or with a sink
+    /// the length of the message
+    /// \param[in] timeout Longest time to wait in ms
+    /// \param[out] from If present and not NULL, set to the address of the sender
+    /// \return true if a message was complete
+    bool recvfromTimeout(uint8_t* buf, uint32_t* len, uint16_t timeout, RHAddress* from = NULL);
+
+    /// \return The number of fragments sent more than once since the last resetRetransmissions()
+    uint32_t retransmissions();
+
+    /// Zeroes retransmissions()
+    void resetRetransmissions();
+
+protected:
+    /// \brief The progress of a message being received
+    typedef enum
+    {
+	ContextFree = 0,    ///< Not in use
+	ContextReceiving,   ///< Some fragments are still missing
+	ContextComplete,    ///< All received, waiting for recvfrom()
+	ContextCollected    ///< Collected, remembered only to answer polls
+    } ContextState;
+
+    /// \brief A message being received
+    typedef struct
+    {
+	ContextState    state;                              ///< Progress
+	RHAddress       from;                               ///< Sender
+	uint8_t         id;                                 ///< Transfer ID
+	uint16_t        count;                              ///< Number of fragments
+	uint16_t        received;                           ///< Fragments received so far
+	uint8_t         fragmentLength;                     ///< Length of every fragment but the last
+	uint32_t        length;                             ///< Length of the message, once the last fragment is in
+	unsigned long   lastHeard;                          ///< When the sender was last heard, ms
+	uint8_t         bitmap[RH_FRAG_MAX_FRAGMENTS / 8];  ///< Bit set for each fragment received
+	uint8_t         buf[RH_FRAG_BUFFER_SIZE];           ///< The message, if there is no sink
+    } Context;
+
+    /// Sends the fragments still pending of the transfer being sent
+    /// \param[in] first true on the first round, when no fragment is a retransmission
+    /// \return false if source did not supply a fragment
+    bool sendPending(RHFragmentSource source, void* arg, uint32_t len, uint16_t count, bool first);
+
+    /// Sends one message with the manager, waiting for it to be acknowledged
+    bool transmit(uint8_t len, RHAddress dest);
+
+    /// Takes one message from the manager and deals with it
+    /// \param[in] timeout Longest time to wait for one in ms, or 0 not to wait
+    /// \return true if there was a message
+    bool poll(uint16_t timeout);
+
+    /// Deals with a fragmenter message from another node
+    void handle(const uint8_t* msg, uint8_t len, RHAddress from);
+
+    /// Finds the context of a transfer, starting one if it is new and there is room
+    /// \return The context, or NULL if there is no room
+    Context* context(RHAddress from, uint8_t id, uint16_t count, uint8_t fragmentLength);
+
+    /// Tells the sender of a transfer what we still need of it
+    void sendStatus(Context* c, RHAddress to, uint8_t id);
+
+    /// Tells the sender of a transfer that it will not be received
+    void sendAbort(RHAddress to, uint8_t id);
+
+    /// Polls the destination until it answers, or RH_FRAG_POLL_RETRIES polls go unanswered
+    /// \return true if the answer is in _status
+    bool pollStatus(RHAddress dest, uint16_t count);
+
+    /// Returns the first reassembled message not yet collected, as for recvfrom()
+    bool collect(uint8_t* buf, uint32_t* len, RHAddress* from);
+
+    /// Reads from the caller's buffer for sendtoWait(const uint8_t*, ...)
+    static uint8_t readBuffer(uint32_t offset, uint8_t* buf, uint8_t len, void* arg);
+
+    /// Common part of the constructors
+    void setup();
+
+    /// The manager, and the same as a router or mesh if it is one
+    RHReliableDatagram* _manager;
+    RHRouter*           _router;
+    RHMesh*             _mesh;
+
+    /// Longest fragment sent
+    uint8_t             _fragmentLength;
+
+    /// Where fragments go as they are received, if not the context buffers
+    RHFragmentSink      _sink;
+    void*               _sinkArg;
+
+    /// Messages being received
+    Context             _contexts[RH_FRAG_MAX_TRANSFERS];
+
+    /// The transfer being sent: its ID, destination and the fragments still to send
+    uint8_t             _txId;
+    RHAddress           _txDest;
+    bool                _sending;
+    uint8_t             _pending[RH_FRAG_MAX_FRAGMENTS / 8];
+
+    /// The destination's answer to the last poll, _statusLen 0 until it comes
+    uint8_t             _status[RH_MAX_MESSAGE_LEN];
+    uint8_t             _statusLen;
+
+    /// Fragments sent more than once
+    uint32_t            _retransmissions;
+
+    /// Frames being sent and received
+    uint8_t             _txFrame[RH_MAX_MESSAGE_LEN];
+    uint8_t             _rxFrame[RH_MAX_MESSAGE_LEN];
+};
+
+#endif
@@ -9,15 +9,32 @@ RHGenericDriver::RHGenericDriver()
     :
     _mode(RHModeInitialising),
     _thisAddress(RH_BROADCAST_ADDRESS),
+    _promiscuous(false),
+    _rxHeaderTo(RH_BROADCAST_ADDRESS),
+    _rxHeaderFrom(RH_BROADCAST_ADDRESS),
+    _rxHeaderId(0),
+    _rxHeaderFlags(0),
     _txHeaderTo(RH_BROADCAST_ADDRESS),
     _txHeaderFrom(RH_BROADCAST_ADDRESS),
     _txHeaderId(0),
     _txHeaderFlags(0),
+    _lastRssi(0),
     _rxBad(0),
     _rxGood(0),
     _txGood(0),
-    _cad_timeout(0)
+    _cad(false),
+    _cad_timeout(0),
+    _cadMinBE(RH_CAD_DEFAULT_MIN_BE),
+    _cadMaxBE(RH_CAD_DEFAULT_MAX_BE),
+    _cadSlot(0),
+    _sfScanMask(0),
+    _sfScanSF(0),
+    _sfScanLastRx(0),
+    _sfScanFresh(0),
+    _sfScanStep(0)
 {
+    clearCADStats();
+    memset(_sfScanStats, 0, sizeof(_sfScanStats));
 }
 
 bool RHGenericDriver::init()
@@ -74,24 +91,185 @@ bool RHGenericDriver::waitCAD()
     if (!_cad_timeout)
 	return true;
 
-    // Wait for any channel activity to finish or timeout
-    // Sophisticated DCF function...
-    // DCF : BackoffTime = random() x aSlotTime
-    // 100 - 1000 ms
-    // 10 sec timeout
+    // Wait for any channel activity to finish or timeout, with binary exponential backoff:
+    // BackoffTime = random(1, 2^BE) x aSlotTime, BE growing after each busy CAD
+    uint32_t slot = _cadSlot ? _cadSlot : cadTime();
+    if (!slot)
+	slot = RH_CAD_DEFAULT_SLOT;
+    uint8_t be = _cadMinBE;
+    uint16_t cads = 0;
+    bool clear = true;
     unsigned long t = millis();
-    while (isChannelActive())
+    unsigned long start = micros();
+    while (true)
     {
-         if (millis() - t > _cad_timeout) 
-	     return false;
+	cads++;
+	if (!isChannelActive())
+	    break;
+	_cadStats.busy++;
+	if (millis() - t > _cad_timeout)
+	{
+	    clear = false;
+	    _cadStats.timeouts++;
+	    break;
+	}
+	// In 64 bits, as 2^20 slots of a long CAD overflow 32. No backoff need outlast the CAD timeout
 #if (RH_PLATFORM == RH_PLATFORM_STM32) // stdlib on STMF103 gets confused if random is redefined
-	 delay(_random(1, 10) * 100);
+	uint64_t backoff = (uint64_t)_random(1, (1L << be) + 1) * slot;
 #else
-         delay(random(1, 10) * 100); // Should these values be configurable? Macros?
+	uint64_t backoff = (uint64_t)random(1, (1L << be) + 1) * slot;
 #endif
+	if (backoff > (uint64_t)_cad_timeout * 1000)
+	    backoff = (uint64_t)_cad_timeout * 1000;
+	delay(backoff / 1000);
+	delayMicroseconds(backoff % 1000);
+	if (be < _cadMaxBE)
+	    be++;
     }
 
-    return true;
+    uint32_t elapsed = micros() - start;
+    _cadStats.attempts++;
+    _cadStats.cads += cads;
+    _cadStats.totalDelay += elapsed;
+    if (elapsed > _cadStats.maxDelay)
+	_cadStats.maxDelay = elapsed;
+    _cadStats.lastCads = cads;
+    _cadStats.lastDelay = elapsed;
+    return clear;
+}
+
+void RHGenericDriver::setCADBackoff(uint8_t minExponent, uint8_t maxExponent, uint32_t slotTime)
+{
+    if (maxExponent > 20)
+	maxExponent = 20;
+    if (minExponent > maxExponent)
+	minExponent = maxExponent;
+    _cadMinBE = minExponent;
+    _cadMaxBE = maxExponent;
+    _cadSlot = slotTime;
+}
+
+void RHGenericDriver::clearCADStats()
+{
+    memset(&_cadStats, 0, sizeof(_cadStats));
+}
+
+uint32_t RHGenericDriver::cadTime()
+{
+    return 0;
+}
+
+// Drivers that can change spreading factor override this
+bool RHGenericDriver::setSFScan(uint16_t sfMask, uint16_t)
+{
+    return !sfMask;
+}
+
+const RHGenericDriver::SFScanStats& RHGenericDriver::sfScanStats(uint8_t sf)
+{
+    if (sf < RH_SF_SCAN_MIN)
+	sf = RH_SF_SCAN_MIN;
+    if (sf > RH_SF_SCAN_MAX)
+	sf = RH_SF_SCAN_MAX;
+    return _sfScanStats[sf - RH_SF_SCAN_MIN];
+}
+
+void RHGenericDriver::clearSFScanStats()
+{
+    uint8_t i;
+    for (i = 0; i < RH_SF_SCAN_COUNT; i++)
+    {
+	uint32_t window = _sfScanStats[i].window;
+	memset(&_sfScanStats[i], 0, sizeof(_sfScanStats[i]));
+	_sfScanStats[i].window = window;
+    }
+}
+
+bool RHGenericDriver::planSFScan(uint16_t sfMask, uint16_t preamble, uint32_t symbolTime, uint8_t cadSymbols)
+{
+    _sfScanMask = sfMask & (((1 << RH_SF_SCAN_COUNT) - 1) << RH_SF_SCAN_MIN);
+    _sfScanSF = 0;
+    _sfScanLastRx = 0;
+    _sfScanFresh = 0;
+    _sfScanStep = 0;
+    memset(_sfScanStats, 0, sizeof(_sfScanStats));
+    if (!_sfScanMask)
+	return false;
+
+    // A CAD that starts after a preamble has begun catches it if RH_SF_SCAN_LOCK_SYMBOLS of the preamble 
+    // are still to come when the CAD is done. So the CADs on each spreading factor must start no further 
+    // apart than the rest of the preamble
+    uint32_t usable = preamble > cadSymbols + RH_SF_SCAN_LOCK_SYMBOLS ? preamble - cadSymbols - RH_SF_SCAN_LOCK_SYMBOLS : 0;
+    uint8_t sf, lowest = 0, highest = 0, count = 0;
+    for (sf = RH_SF_SCAN_MIN; sf <= RH_SF_SCAN_MAX; sf++)
+    {
+	if (!(_sfScanMask & (1 << sf)))
+	    continue;
+	uint8_t i = sf - RH_SF_SCAN_MIN;
+	uint64_t window = ((uint64_t)symbolTime << i) * usable;
+	_sfScanStats[i].window = window > 0x7fffffff ? 0x7fffffff : window;
+	if (!lowest)
+	    lowest = sf;
+	highest = sf;
+	count++;
+    }
+
+    // See nextScanSF(): a CAD on the fastest spreading factor and one on the slowest must fit in the 
+    // window of the fastest
+    if (count == 1)
+	return usable >= cadSymbols;
+    return usable >= (uint32_t)cadSymbols * ((1 << (highest - lowest)) + 1);
+}
+
+// Every other CAD is on the fastest spreading factor. The ones in between go through the others in the
+// pattern of the marks on a ruler, so that the n'th of the others comes round every 2^(n+1) of them and
+// the slowest takes what is left over. The windows double with each spreading factor, so if a CAD on the
+// fastest and one on the slowest fit in the window of the fastest, every window is met. No timing is needed,
+// so the CADs can follow each other without a break
+uint8_t RHGenericDriver::nextScanSF()
+{
+    uint32_t now = micros();
+    uint8_t sf, best = 0;
+    for (sf = RH_SF_SCAN_MIN; !best && sf <= RH_SF_SCAN_MAX; sf++)
+	if (_sfScanMask & (1 << sf))
+	    best = sf;
+    if (_sfScanStep & 1)
+    {
+	// The trailing zeros of the pair number give the rank among the others
+	uint16_t pair = (_sfScanStep >> 1) + 1;
+	uint8_t rank = 0;
+	while (!(pair & 1))
+	{
+	    pair >>= 1;
+	    rank++;
+	}
+	for (sf = best + 1; sf <= RH_SF_SCAN_MAX; sf++)
+	{
+	    if (!(_sfScanMask & (1 << sf)))
+		continue;
+	    best = sf;
+	    if (!rank--)
+		break;
+	}
+    }
+    _sfScanStep++;
+
+    SFScanStats& stats = _sfScanStats[best - RH_SF_SCAN_MIN];
+    uint32_t gap = now - _sfScanLast[best - RH_SF_SCAN_MIN];
+    if ((_sfScanFresh & (1 << best)) && gap > stats.maxGap)
+	stats.maxGap = gap;
+    stats.cads++;
+    _sfScanFresh |= (1 << best);
+    _sfScanLast[best - RH_SF_SCAN_MIN] = now;
+    _sfScanSF = best;
+    return best;
+}
+
+void RHGenericDriver::sfScanDetected()
+{
+    _sfScanStats[_sfScanSF - RH_SF_SCAN_MIN].detections++;
+    // Nothing can be heard on the other spreading factors while receiving, which is no fault of the schedule
+    _sfScanFresh = 0;
 }
 
 // subclasses are expected to override if CAD is available for that radio
@@ -105,17 +283,17 @@ void RHGenericDriver::setPromiscuous(bool promiscuous)
     _promiscuous = promiscuous;
 }
 
-void RHGenericDriver::setThisAddress(uint8_t address)
+void RHGenericDriver::setThisAddress(RHAddress address)
 {
     _thisAddress = address;
 }
 
-void RHGenericDriver::setHeaderTo(uint8_t to)
+void RHGenericDriver::setHeaderTo(RHAddress to)
 {
     _txHeaderTo = to;
 }
 
-void RHGenericDriver::setHeaderFrom(uint8_t from)
+void RHGenericDriver::setHeaderFrom(RHAddress from)
 {
     _txHeaderFrom = from;
 }
@@ -131,17 +309,17 @@ void RHGenericDriver::setHeaderFlags(uint8_t set, uint8_t clear)
     _txHeaderFlags |= set;
 }
 
-uint8_t RHGenericDriver::thisAddress()
+RHAddress RHGenericDriver::thisAddress()
 {
     return _thisAddress;
 }
 
-uint8_t RHGenericDriver::headerTo()
+RHAddress RHGenericDriver::headerTo()
 {
     return _rxHeaderTo;
 }
 
-uint8_t RHGenericDriver::headerFrom()
+RHAddress RHGenericDriver::headerFrom()
 {
     return _rxHeaderFrom;
 }
@@ -161,6 +339,45 @@ int16_t RHGenericDriver::lastRssi()
     return _lastRssi;
 }
 
+int RHGenericDriver::lastSNR()
+{
+    return RH_SNR_UNKNOWN;
+}
+
+uint32_t RHGenericDriver::timeOnAir(uint8_t len)
+{
+    (void)len;
+    return 0;
+}
+
+uint64_t RHGenericDriver::lastRxTime()
+{
+    return 0;
+}
+
+bool RHGenericDriver::setLinkParams(uint8_t sf, long bw, int8_t power)
+{
+    (void)sf;
+    (void)bw;
+    (void)power;
+    return false;
+}
+
+uint8_t RHGenericDriver::spreadingFactor()
+{
+    return 0;
+}
+
+long RHGenericDriver::signalBandwidth()
+{
+    return 0;
+}
+
+int8_t RHGenericDriver::txPower()
+{
+    return 0;
+}
+
 RHGenericDriver::RHMode  RHGenericDriver::mode()
 {
     return _mode;
@@ -17,6 +17,31 @@
 // Default timeout for waitCAD() in ms
 #define RH_CAD_DEFAULT_TIMEOUT            10000
 
+// Default bounds of the backoff exponent in waitCAD(): after the n'th busy CAD it waits
+// 1 to 2^min(RH_CAD_DEFAULT_MIN_BE + n - 1, RH_CAD_DEFAULT_MAX_BE) backoff slots
+#ifndef RH_CAD_DEFAULT_MIN_BE
+#define RH_CAD_DEFAULT_MIN_BE             3
+#endif
+#ifndef RH_CAD_DEFAULT_MAX_BE
+#define RH_CAD_DEFAULT_MAX_BE             8
+#endif
+
+// Backoff slot in microseconds for drivers that cannot say how long CAD takes
+#define RH_CAD_DEFAULT_SLOT               100000
+
+// Spreading factors a multi-SF scan can cover, see setSFScan()
+#define RH_SF_SCAN_MIN                    7
+#define RH_SF_SCAN_MAX                    12
+#define RH_SF_SCAN_COUNT                  (RH_SF_SCAN_MAX - RH_SF_SCAN_MIN + 1)
+
+// Preamble symbols that must still be to come after the CAD that detected it, for the receiver to lock on
+#ifndef RH_SF_SCAN_LOCK_SYMBOLS
+#define RH_SF_SCAN_LOCK_SYMBOLS           4
+#endif
+
+// Returned by lastSNR() for drivers that cannot measure SNR
+#define RH_SNR_UNKNOWN                    0x7fff
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHGenericDriver RHGenericDriver.h <RHGenericDriver.h>
 /// \brief Abstract base class for a RadioHead driver.
@@ -124,7 +149,8 @@ public:
     /// Channel Activity Detection (CAD).
     /// Blocks until channel activity is finished or CAD timeout occurs.
     /// Uses the radio's CAD function (if supported) to detect channel activity.
-    /// Implements random delays of 100 to 1000ms while activity is detected and until timeout.
+    /// While activity is detected and until timeout, backs off for a random number of slots
+    /// with binary exponential backoff, as configured by setCADBackoff().
     /// Caution: the random() function is not seeded. If you want non-deterministic behaviour, consider
     /// using something like randomSeed(analogRead(A0)); in your sketch.
     /// Permits the implementation of listen-before-talk mechanism (Collision Avoidance).
@@ -140,6 +166,75 @@ public:
     /// CAD detection depends on support for isChannelActive() by your particular radio.
     void setCADTimeout(unsigned long cad_timeout);
 
+    /// Configures the binary exponential backoff in waitCAD(). Each time CAD finds the channel busy,
+    /// waitCAD() waits a random 1 to 2^BE backoff slots before trying again, where BE starts at minExponent
+    /// and grows by one after each busy CAD up to maxExponent. The backoff slot defaults to the time CAD takes
+    /// with the current radio settings (see cadTime()), so the backoff scales with spreading factor and bandwidth.
+    /// \param[in] minExponent Backoff exponent after the first busy CAD. Defaults to RH_CAD_DEFAULT_MIN_BE
+    /// \param[in] maxExponent Largest backoff exponent, up to 20. Defaults to RH_CAD_DEFAULT_MAX_BE
+    /// \param[in] slotTime Backoff slot in microseconds, or 0 to use cadTime()
+    void setCADBackoff(uint8_t minExponent, uint8_t maxExponent, uint32_t slotTime = 0);
+
+    /// Counters kept by waitCAD(). An attempt is one call to waitCAD() with CAD enabled.
+    typedef struct
+    {
+	uint32_t attempts;     ///< Calls to waitCAD() that ran CAD
+	uint32_t cads;         ///< CADs run, at least one per attempt
+	uint32_t busy;         ///< CADs that found the channel busy
+	uint32_t timeouts;     ///< Attempts that gave up when the CAD timeout expired
+	uint64_t totalDelay;   ///< Time spent in all attempts, microseconds
+	uint32_t maxDelay;     ///< Longest time spent in one attempt, microseconds
+	uint16_t lastCads;     ///< CADs run in the most recent attempt
+	uint32_t lastDelay;    ///< Time spent in the most recent attempt, microseconds
+    } CADStats;
+
+    /// \return The waitCAD() counters
+    const CADStats& cadStats() { return _cadStats; }
+
+    /// Zeroes the waitCAD() counters
+    void clearCADStats();
+
+    /// Starts or stops scanning for messages on several spreading factors with one radio.
+    /// The receiver runs CAD on each spreading factor in turn, the faster spreading factors more often
+    /// than the slower ones, in proportion to their symbol time.
+    /// When CAD detects a preamble the receiver stays on that spreading factor to receive the message, then goes
+    /// on scanning after the message or the receive timeout. lastRxSpreadingFactor() says which spreading factor
+    /// a message came on. Messages are sent with the spreading factor configured before scanning started.
+    /// Only drivers that can change spreading factor support this.
+    /// \param[in] sfMask Bit n set to scan spreading factor n, RH_SF_SCAN_MIN to RH_SF_SCAN_MAX. 0 stops scanning
+    /// \param[in] preamble The shortest preamble the senders use, in symbols. If 0, our own preamble length
+    /// \return false if scanning could not be started, or if it will miss some preambles because the CADs 
+    /// needed to look at every spreading factor within the preamble do not fit in the time available
+    virtual bool            setSFScan(uint16_t sfMask, uint16_t preamble = 0);
+
+    /// \return The spreading factors being scanned, as passed to setSFScan(), or 0 if not scanning
+    uint16_t                sfScanMask() { return _sfScanMask; }
+
+    /// \return The spreading factor of the last message received while scanning, or 0 if none
+    uint8_t                 lastRxSpreadingFactor() { return _sfScanLastRx; }
+
+    /// Counters kept for each spreading factor while scanning
+    typedef struct
+    {
+	uint32_t cads;         ///< CADs run on this spreading factor
+	uint32_t detections;   ///< CADs that detected a preamble
+	uint32_t received;     ///< Messages received after a detection
+	uint32_t maxGap;       ///< Longest time between the starts of two CADs with no receive between, microseconds
+	uint32_t window;       ///< Longest gap that cannot miss a preamble, microseconds
+    } SFScanStats;
+
+    /// \param[in] sf Spreading factor RH_SF_SCAN_MIN to RH_SF_SCAN_MAX
+    /// \return The scan counters for the spreading factor
+    const SFScanStats&      sfScanStats(uint8_t sf);
+
+    /// Zeroes the scan counters
+    void                    clearSFScanStats();
+
+    /// Returns how long one Channel Activity Detection takes with the current radio settings.
+    /// This is the default backoff slot for waitCAD()
+    /// \return CAD duration in microseconds, or 0 if the driver does not know
+    virtual uint32_t        cadTime();
+
     /// Determine if the currently selected radio channel is active.
     /// This is expected to be subclassed by specific radios to implement their Channel Activity Detection
     /// if supported. If the radio does not support CAD, returns true immediately. If a RadioHead radio 
@@ -149,7 +244,7 @@ public:
     /// current radio channel as active, else false. If there is no radio-specific CAD, returns false.
     virtual bool            isChannelActive();
 
-    /// Sets the address of this node. Defaults to 0xFF. Subclasses or the user may want to change this.
+    /// Sets the address of this node. Defaults to RH_BROADCAST_ADDRESS. Subclasses or the user may want to change this.
     /// This will be used to test the adddress in incoming messages. In non-promiscuous mode,
     /// only messages with a TO header the same as thisAddress or the broadcast addess (0xFF) will be accepted.
     /// In promiscuous mode, all messages will be accepted regardless of the TO header.
@@ -158,15 +253,15 @@ public:
     /// You would normally set the header FROM address to be the same as thisAddress (though you dont have to, 
     /// allowing the possibilty of address spoofing).
     /// \param[in] thisAddress The address of this node.
-    virtual void setThisAddress(uint8_t thisAddress);
+    virtual void setThisAddress(RHAddress thisAddress);
 
     /// Sets the TO header to be sent in all subsequent messages
     /// \param[in] to The new TO header value
-    virtual void           setHeaderTo(uint8_t to);
+    virtual void           setHeaderTo(RHAddress to);
 
     /// Sets the FROM header to be sent in all subsequent messages
     /// \param[in] from The new FROM header value
-    virtual void           setHeaderFrom(uint8_t from);
+    virtual void           setHeaderFrom(RHAddress from);
 
     /// Sets the ID header to be sent in all subsequent messages
     /// \param[in] id The new ID header value
@@ -187,15 +282,15 @@ public:
     virtual void           setPromiscuous(bool promiscuous);
 
     /// Returns the address set for this node
-    virtual uint8_t        thisAddress();
+    virtual RHAddress      thisAddress();
 
     /// Returns the TO header of the last received message
     /// \return The TO header
-    virtual uint8_t        headerTo();
+    virtual RHAddress      headerTo();
 
     /// Returns the FROM header of the last received message
     /// \return The FROM header
-    virtual uint8_t        headerFrom();
+    virtual RHAddress      headerFrom();
 
     /// Returns the ID header of the last received message
     /// \return The ID header
@@ -211,6 +306,38 @@ public:
     /// \return The most recent RSSI measurement in dBm.
     virtual int16_t        lastRssi();
 
+    /// Returns the Signal-to-noise ratio (SNR) of the last received message, for drivers
+    /// whose radios measure it.
+    /// \return SNR in tenths of a dB, or RH_SNR_UNKNOWN if the driver cannot measure it
+    virtual int            lastSNR();
+
+    /// Returns the time on air of a message with the current radio settings, for drivers that can compute it.
+    /// \param[in] len Length of the message, not including the driver's own headers
+    /// \return Time on air in microseconds, or 0 if the driver cannot compute it
+    virtual uint32_t       timeOnAir(uint8_t len);
+
+    /// Returns when the last message was received, for drivers that timestamp reception.
+    /// \return Time of the end of the last received message in ns on the RHClock::nanos() timebase,
+    /// or 0 if the driver does not timestamp reception
+    virtual uint64_t       lastRxTime();
+
+    /// Sets the spreading factor, bandwidth and transmitter power together, for drivers of LoRa radios
+    /// that can change them. This is what RHAdaptiveRate drives.
+    /// \param[in] sf Spreading factor 6..12
+    /// \param[in] bw Signal bandwidth in Hz
+    /// \param[in] power Transmitter power in dBm
+    /// \return true if any setting changed. false if none did, or if the driver cannot change them
+    virtual bool           setLinkParams(uint8_t sf, long bw, int8_t power);
+
+    /// \return The spreading factor, or 0 if the driver has none
+    virtual uint8_t        spreadingFactor();
+
+    /// \return The signal bandwidth in Hz, or 0 if the driver does not know it
+    virtual long           signalBandwidth();
+
+    /// \return The transmitter power in dBm, or 0 if the driver does not know it
+    virtual int8_t         txPower();
+
     /// Returns the operating mode of the library.
     /// \return the current mode, one of RF69_MODE_*
     virtual RHMode          mode();
@@ -256,16 +383,16 @@ protected:
     volatile RHMode     _mode;
 
     /// This node id
-    uint8_t             _thisAddress;
+    RHAddress           _thisAddress;
     
     /// Whether the transport is in promiscuous mode
     bool                _promiscuous;
 
     /// TO header in the last received mesasge
-    volatile uint8_t    _rxHeaderTo;
+    volatile RHAddress  _rxHeaderTo;
 
     /// FROM header in the last received mesasge
-    volatile uint8_t    _rxHeaderFrom;
+    volatile RHAddress  _rxHeaderFrom;
 
     /// ID header in the last received mesasge
     volatile uint8_t    _rxHeaderId;
@@ -274,10 +401,10 @@ protected:
     volatile uint8_t    _rxHeaderFlags;
 
     /// TO header to send in all messages
-    uint8_t             _txHeaderTo;
+    RHAddress           _txHeaderTo;
 
     /// FROM header to send in all messages
-    uint8_t             _txHeaderFrom;
+    RHAddress           _txHeaderFrom;
 
     /// ID header to send in all messages
     uint8_t             _txHeaderId;
@@ -303,6 +430,54 @@ protected:
     /// Channel activity timeout in ms
     unsigned int        _cad_timeout;
 
+    /// Backoff exponent bounds for waitCAD()
+    uint8_t             _cadMinBE;
+    uint8_t             _cadMaxBE;
+
+    /// Backoff slot for waitCAD() in microseconds, 0 for cadTime()
+    uint32_t            _cadSlot;
+
+    /// waitCAD() counters
+    CADStats            _cadStats;
+
+    /// Works out the scan windows for setSFScan(). Sets _sfScanMask, which is 0 if sfMask holds no
+    /// spreading factor that can be scanned.
+    /// \param[in] sfMask Spreading factors to scan
+    /// \param[in] preamble Shortest preamble to catch, in symbols
+    /// \param[in] symbolTime Symbol time at RH_SF_SCAN_MIN with the current bandwidth, microseconds
+    /// \param[in] cadSymbols Duration of CAD, in symbols
+    /// \return true if the schedule can look at every spreading factor in time
+    bool                planSFScan(uint16_t sfMask, uint16_t preamble, uint32_t symbolTime, uint8_t cadSymbols);
+
+    /// Chooses the spreading factor for the next scan CAD.
+    /// Sets _sfScanSF and counts the CAD.
+    /// \return The spreading factor
+    uint8_t             nextScanSF();
+
+    /// Counts a preamble detected by the scan CAD on _sfScanSF, before receiving on it
+    void                sfScanDetected();
+
+    /// Spreading factors being scanned, 0 if not scanning
+    uint16_t            _sfScanMask;
+
+    /// Spreading factor of the scan CAD or receive in progress, 0 if none
+    uint8_t             _sfScanSF;
+
+    /// Spreading factor of the last message received while scanning
+    uint8_t             _sfScanLastRx;
+
+    /// Bit n set if spreading factor n has had a CAD since the last receive, so the next gap can be measured
+    uint16_t            _sfScanFresh;
+
+    /// Scan CADs run since the scan started, for the order of the spreading factors
+    uint16_t            _sfScanStep;
+
+    /// Start of the last CAD on each spreading factor, microseconds
+    uint32_t            _sfScanLast[RH_SF_SCAN_COUNT];
+
+    /// Scan counters and windows for each spreading factor
+    SFScanStats         _sfScanStats[RH_SF_SCAN_COUNT];
+
 private:
 
 };
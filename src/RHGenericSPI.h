@@ -124,6 +124,9 @@ public:
     /// \param[in] frequency The data rate to use: one of RHGenericSPI::Frequency
     virtual void setFrequency(Frequency frequency);
 
+    /// \return The SPI bus frequency last set, one of RHGenericSPI::Frequency
+    Frequency frequency() { return _frequency; }
+
     /// Signal the start of an SPI transaction that must not be interrupted by other SPI actions
     /// In subclasses that support transactions this will ensure that other SPI transactions
     /// are blocked until this one is completed by endTransaction().
@@ -13,22 +13,91 @@
 
 #include <RHMesh.h>
 
-uint8_t RHMesh::_tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
 
 ////////////////////////////////////////////////////////////////////
 // Constructors
-RHMesh::RHMesh(RHGenericDriver& driver, uint8_t thisAddress) 
-    : RHRouter(driver, thisAddress)
+RHMesh::RHMesh(RHGenericDriver& driver, RHAddress thisAddress) 
+    : RHRouter(driver, thisAddress),
+      _discoveryId(0),
+      _discoveryWindow(RH_MESH_DISCOVERY_WINDOW),
+      _rebroadcastJitter(RH_MESH_REBROADCAST_JITTER),
+      _suppressionThreshold(RH_MESH_SUPPRESSION_THRESHOLD),
+      _cachedReplyAge(RH_MESH_CACHED_REPLY_AGE),
+      _suppressedRebroadcasts(0),
+      _arpTimeout(RH_MESH_ARP_TIMEOUT),
+      _droppedMessages(0),
+      _nextDiscovery(0),
+      _held(false)
 {
+    uint8_t i;
+    // Learned routes go stale as nodes move, unlike the hand set routes of RHRouter
+    setRouteLifetime(RH_DEFAULT_ROUTE_LIFETIME);
+    for (i = 0; i < RH_MESH_MAX_PENDING_DISCOVERIES; i++)
+	_pending[i].active = false;
+    for (i = 0; i < RH_MESH_MAX_PENDING_REBROADCASTS; i++)
+	_rebroadcasts[i].active = false;
+    // A cost of 0xff means nothing seen yet
+    memset(_discoveries, 0xff, sizeof(_discoveries));
 }
 
 ////////////////////////////////////////////////////////////////////
 // Public methods
+void RHMesh::setDiscoveryWindow(uint16_t window)
+{
+    _discoveryWindow = window;
+}
+
+void RHMesh::setArpTimeout(uint16_t timeout)
+{
+    _arpTimeout = timeout;
+}
+
+uint16_t RHMesh::droppedMessages()
+{
+    return _droppedMessages;
+}
+
+void RHMesh::setRebroadcastJitter(uint16_t jitter)
+{
+    _rebroadcastJitter = jitter;
+}
+
+uint32_t RHMesh::rebroadcastJitter()
+{
+    if (_rebroadcastJitter != RH_MESH_REBROADCAST_JITTER_AUTO)
+	return _rebroadcastJitter;
+    uint32_t airtime = _driver.timeOnAir(sizeof(RoutedMessageHeader) + RH_MESH_ROUTE_DISCOVERY_LEN);
+    if (!airtime)
+	return 100;
+    uint32_t copies = _suppressionThreshold ? _suppressionThreshold : 1;
+    return (airtime * RH_MESH_REBROADCAST_SLOTS * copies + 999) / 1000;
+}
+
+void RHMesh::setSuppressionThreshold(uint8_t threshold)
+{
+    _suppressionThreshold = threshold;
+}
+
+void RHMesh::setCachedReplyAge(uint32_t age)
+{
+    _cachedReplyAge = age;
+}
+
+uint16_t RHMesh::suppressedRebroadcasts()
+{
+    return _suppressedRebroadcasts;
+}
+
+uint8_t RHMesh::queuedMessages(RHAddress dest)
+{
+    PendingDiscovery* d = pendingDiscovery(dest, false);
+    return d ? d->count - d->sent : 0;
+}
 
 ////////////////////////////////////////////////////////////////////
 // Discovers a route to the destination (if necessary), sends and 
 // waits for delivery to the next hop (but not for delivery to the final destination)
-uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t flags)
+uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags)
 {
     if (len > RH_MESH_MAX_MESSAGE_LEN)
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
@@ -36,55 +105,271 @@ uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t f
     if (address != RH_BROADCAST_ADDRESS)
     {
 	RoutingTableEntry* route = getRouteTo(address);
-	if (!route && !doArp(address))
+	if ((!route || route->state != Valid) && !doArp(address))
 	    return RH_ROUTER_ERROR_NO_ROUTE;
     }
 
-    // Now have a route. Contruct an application layer message and send it via that route
-    MeshApplicationMessage* a = (MeshApplicationMessage*)&_tmpMessage;
+    // Now have a route. Contruct an application layer message in place and send it via that route
+    MeshApplicationMessage* a = (MeshApplicationMessage*)payload();
     a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
-    memcpy(a->data, buf, len);
-    return RHRouter::sendtoWait(_tmpMessage, sizeof(RHMesh::MeshMessageHeader) + len, address, flags);
+    memmove(a->data, buf, len);
+    return RHRouter::sendtoWait((uint8_t*)a, sizeof(RHMesh::MeshMessageHeader) + len, address, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+// Sends now if there is a route, else queues the message and starts discovery
+uint8_t RHMesh::sendtoQueued(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags)
+{
+    if (len > RH_MESH_MAX_MESSAGE_LEN)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    if (address != RH_BROADCAST_ADDRESS)
+    {
+	// Queue behind any messages still waiting to be sent, to keep them in order
+	RoutingTableEntry* route = getRouteTo(address);
+	if (!route || route->state != Valid || queuedMessages(address))
+	{
+	    PendingDiscovery* d = pendingDiscovery(address, true);
+	    if (!d || d->count >= RH_MESH_PENDING_QUEUE_LEN)
+		return RH_ROUTER_ERROR_NO_ROUTE;
+	    PendingMessage* m = &d->queue[d->count++];
+	    m->len = len;
+	    m->flags = flags;
+	    memcpy(m->data, buf, len);
+	    return RH_ROUTER_ERROR_QUEUED;
+	}
+    }
+    return sendtoWait(buf, len, address, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::doArp(RHAddress address)
+{
+    // Start discovering the route, unless sendtoQueued() already has
+    PendingDiscovery* d = pendingDiscovery(address, true);
+    if (!d)
+	return false;
+
+    // Wait for replies, which will be unicast back to us
+    // They contain the complete route to the destination, and peekAtMessage() 
+    // installs the route from the cheapest one. service() ends the discovery
+    // when the time to collect responses is up
+    while (d->active && !d->flushing && d->dest == address)
+    {
+	int32_t timeLeft = d->timeout - (millis() - d->started);
+	// Wake up in time for any rebroadcasts that fall due meanwhile
+	uint32_t due = serviceDue();
+	if (timeLeft > 0 && (uint32_t)timeLeft > due)
+	    timeLeft = due;
+	if (timeLeft > 0 && waitAvailableTimeout(timeLeft))
+	{
+	    uint8_t scratch[RH_MESH_MAX_MESSAGE_LEN];
+	    uint8_t len = sizeof(_heldData);
+	    RHAddress source, dest;
+	    uint8_t id, flags;
+	    if (receive(_held ? scratch : _heldData, &len, &source, &dest, &id, &flags))
+	    {
+		// Keep an application message for the next recvfromAck(), if there is room
+		if (_held)
+		    _droppedMessages++;
+		else
+		{
+		    _held = true;
+		    _heldLen = len;
+		    _heldSource = source;
+		    _heldDest = dest;
+		    _heldId = id;
+		    _heldFlags = flags;
+		}
+	    }
+	}
+	service();
+	serviceForwardQueue();
+	YIELD;
+    }
+
+    RoutingTableEntry* route = getRouteTo(address);
+    return route && route->state == Valid;
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::doArp(uint8_t address)
+RHMesh::PendingDiscovery* RHMesh::pendingDiscovery(RHAddress address, bool start)
 {
+    uint8_t i;
+    PendingDiscovery* free = NULL;
+    for (i = 0; i < RH_MESH_MAX_PENDING_DISCOVERIES; i++)
+    {
+	if (_pending[i].active && _pending[i].dest == address)
+	    return &_pending[i];
+	if (!_pending[i].active && !free)
+	    free = &_pending[i];
+    }
+    if (!start || !free)
+	return NULL;
+
     // Need to discover a route
+    // Mark the route as being discovered, so it is not used in the meantime
+    addRouteTo(address, RH_BROADCAST_ADDRESS, Discovering);
+
+    // Remember the discovery, so our own rebroadcast copies and the responses can be recognised
+    uint8_t id = ++_discoveryId;
+    findDiscovery(_thisAddress, id, true)->requestCost = 0;
+
     // Broadcast a route discovery message with nothing in it
-    MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)&_tmpMessage;
+    MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)payload();
     p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST;
-    p->destlen = 1; 
+    p->destlen = sizeof(RHAddress); 
     p->dest = address; // Who we are looking for
-    uint8_t error = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 2, RH_BROADCAST_ADDRESS);
+    p->id = id;
+    p->cost = 0;
+    uint8_t error = RHRouter::sendtoWait((uint8_t*)p, RH_MESH_ROUTE_DISCOVERY_LEN, RH_BROADCAST_ADDRESS);
     if (error !=  RH_ROUTER_ERROR_NONE)
-	return false;
-    
-    // Wait for a reply, which will be unicast back to us
-    // It will contain the complete route to the destination
-    uint8_t messageLen = sizeof(_tmpMessage);
-    // FIXME: timeout should be configurable
-    unsigned long starttime = millis();
-    int32_t timeLeft;
-    while ((timeLeft = RH_MESH_ARP_TIMEOUT - (millis() - starttime)) > 0)
     {
-	if (waitAvailableTimeout(timeLeft))
+	deleteRouteTo(address);
+	return NULL;
+    }
+
+    free->active = true;
+    free->dest = address;
+    free->id = id;
+    free->answered = false;
+    free->flushing = false;
+    free->sent = 0;
+    free->started = millis();
+    free->timeout = _arpTimeout;
+    free->count = 0;
+    return free;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::service()
+{
+    uint8_t i, j;
+
+    // Rebroadcast discovery requests that are due, unless enough neighbours already have
+    for (i = 0; i < RH_MESH_MAX_PENDING_REBROADCASTS; i++)
+    {
+	PendingRebroadcast* r = &_rebroadcasts[i];
+	if (!r->active || (int32_t)(millis() - r->due) < 0)
+	    continue;
+	r->active = false;
+	if (_suppressionThreshold && r->copies >= _suppressionThreshold)
 	{
-	    if (RHRouter::recvfromAck(_tmpMessage, &messageLen))
+	    _suppressedRebroadcasts++;
+	    continue;
+	}
+	// Have to impersonate the source
+	// REVISIT: if this fails what can we do?
+	RHRouter::sendtoFromSourceWait(r->message, r->len, RH_BROADCAST_ADDRESS, r->source);
+    }
+    for (i = 0; i < RH_MESH_MAX_PENDING_DISCOVERIES; i++)
+    {
+	PendingDiscovery* d = &_pending[i];
+	if (!d->active || (!d->flushing && millis() - d->started < d->timeout))
+	    continue;
+
+	// Finished collecting responses, or timed out, or sending the queue
+	RoutingTableEntry* route = getRouteTo(d->dest);
+	if (!route || route->state != Valid)
+	{
+	    // Discovery failed, or the route has gone since
+	    if (route && !d->flushing)
+		deleteRouteTo(d->dest);
+	    _droppedMessages += d->count - d->sent;
+	    d->active = false;
+	    continue;
+	}
+	d->flushing = true;
+	if (d->sent < d->count)
+	{
+	    // Send the oldest queued message. A failure here means the new route is already broken:
+	    // RHMesh::route() will have dealt with it, and the rest of the queue goes the same way
+	    j = d->sent++;
+	    if (sendtoWait(d->queue[j].data, d->queue[j].len, d->dest, d->queue[j].flags) != RH_ROUTER_ERROR_NONE)
 	    {
-		if (   messageLen > 1
-		       && p->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
-		{
-		    // Got a reply, now add the next hop to the dest to the routing table
-		    // The first hop taken is the first octet
-		    addRouteTo(address, headerFrom());
-		    return true;
-		}
+		_droppedMessages += d->count - d->sent;
+		d->sent = d->count;
 	    }
 	}
-	YIELD;
+	if (d->sent >= d->count)
+	    d->active = false;
     }
-    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHMesh::serviceDue()
+{
+    uint32_t due = forwardDue();
+    uint32_t now = millis();
+    uint8_t i;
+    for (i = 0; i < RH_MESH_MAX_PENDING_REBROADCASTS; i++)
+    {
+	if (!_rebroadcasts[i].active)
+	    continue;
+	int32_t left = _rebroadcasts[i].due - now;
+	if (left <= 0)
+	    return 0;
+	if ((uint32_t)left < due)
+	    due = left;
+    }
+    for (i = 0; i < RH_MESH_MAX_PENDING_DISCOVERIES; i++)
+    {
+	if (!_pending[i].active)
+	    continue;
+	uint32_t elapsed = now - _pending[i].started;
+	if (elapsed >= _pending[i].timeout)
+	    return 0;
+	if (_pending[i].timeout - elapsed < due)
+	    due = _pending[i].timeout - elapsed;
+    }
+    return due;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::scheduleRebroadcast(RHAddress source, uint8_t id, uint8_t* message, uint8_t len)
+{
+    uint8_t i;
+    PendingRebroadcast* r = NULL;
+    for (i = 0; i < RH_MESH_MAX_PENDING_REBROADCASTS; i++)
+    {
+	if (_rebroadcasts[i].active && _rebroadcasts[i].source == source && _rebroadcasts[i].id == id)
+	{
+	    // A copy over a cheaper path: send that instead, but keep our place and count
+	    r = &_rebroadcasts[i];
+	    break;
+	}
+	if (!_rebroadcasts[i].active && !r)
+	    r = &_rebroadcasts[i];
+    }
+    uint32_t jitter = rebroadcastJitter();
+    if (!r || !jitter)
+    {
+	// No room to wait, or no waiting wanted
+	RHRouter::sendtoFromSourceWait(message, len, RH_BROADCAST_ADDRESS, source);
+	return;
+    }
+    if (!r->active)
+    {
+	r->active = true;
+	r->source = source;
+	r->id = id;
+	r->copies = 1;
+	r->due = millis() + random(0, jitter + 1);
+    }
+    r->len = len;
+    memcpy(r->message, message, len);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::countRequestCopy(RHAddress source, uint8_t id)
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_MAX_PENDING_REBROADCASTS; i++)
+	if (   _rebroadcasts[i].active
+	    && _rebroadcasts[i].source == source
+	    && _rebroadcasts[i].id == id
+	    && _rebroadcasts[i].copies < 0xff)
+	    _rebroadcasts[i].copies++;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -99,8 +384,36 @@ void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 	// being routed back to the originator here. Want to scrape some routing data out of the response
 	// We can find the routes to all the nodes between here and the responding node
 	MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)message->data;
+	if (messageLen < sizeof(RoutedMessageHeader) + RH_MESH_ROUTE_DISCOVERY_LEN)
+	    return;
+	// Only take routes from the cheapest response to each discovery
+	DiscoveryCacheEntry* e = findDiscovery(message->header.dest, d->id, true);
+	if (d->cost >= e->responseCost)
+	{
+	    // Not the best path, but worth keeping in reserve
+	    addBackupRouteTo(d->dest, headerFrom());
+	    return;
+	}
+	e->responseCost = d->cost;
 	addRouteTo(d->dest, headerFrom());
-	uint8_t numRoutes = messageLen - sizeof(RoutedMessageHeader) - sizeof(MeshMessageHeader) - 2;
+
+	if (message->header.dest == _thisAddress)
+	{
+	    // A response to our own discovery. Give other paths a little longer to reply
+	    uint8_t j;
+	    for (j = 0; j < RH_MESH_MAX_PENDING_DISCOVERIES; j++)
+	    {
+		PendingDiscovery* p = &_pending[j];
+		if (p->active && p->dest == d->dest && p->id == d->id && !p->answered)
+		{
+		    p->answered = true;
+		    uint32_t collect = (millis() - p->started) + _discoveryWindow;
+		    if (collect < p->timeout)
+			p->timeout = collect;
+		}
+	    }
+	}
+	uint8_t numRoutes = (messageLen - sizeof(RoutedMessageHeader) - RH_MESH_ROUTE_DISCOVERY_LEN) / sizeof(RHAddress);
 	uint8_t i;
 	// Find us in the list of nodes that were traversed to get to the responding node
 	for (i = 0; i < numRoutes; i++)
@@ -122,22 +435,25 @@ void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 // This is called when a message is to be delivered to the next hop
 uint8_t RHMesh::route(RoutedMessage* message, uint8_t messageLen)
 {
-    uint8_t from = headerFrom(); // Might get clobbered during call to superclass route()
+    RHAddress from = headerFrom(); // Might get clobbered during call to superclass route()
     uint8_t ret = RHRouter::route(message, messageLen);
     if (   ret == RH_ROUTER_ERROR_NO_ROUTE
 	|| ret == RH_ROUTER_ERROR_UNABLE_TO_DELIVER)
     {
 	// Cant deliver to the next hop. Delete the route
-	deleteRouteTo(message->header.dest);
-	if (message->header.source != _thisAddress)
+	RHAddress source = message->header.source;
+	RHAddress dest = message->header.dest;
+	deleteRouteTo(dest);
+	if (source != _thisAddress)
 	{
-	    // This is being proxied, so tell the originator about it
-	    MeshRouteFailureMessage* p = (MeshRouteFailureMessage*)&_tmpMessage;
+	    // This is being proxied, so tell the originator about it.
+	    // message may be in our buffer, so everything needed from it has been saved above
+	    MeshRouteFailureMessage* p = (MeshRouteFailureMessage*)payload();
 	    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
-	    p->dest = message->header.dest; // Who you were trying to deliver to
+	    p->dest = dest; // Who you were trying to deliver to
 	    // Make sure there is a route back towards whoever sent the original message
-	    addRouteTo(message->header.source, from);
-	    ret = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 1, message->header.source);
+	    addRouteTo(source, from);
+	    ret = RHRouter::sendtoWait((uint8_t*)p, sizeof(MeshRouteFailureMessage), source);
 	}
     }
     return ret;
@@ -147,21 +463,44 @@ uint8_t RHMesh::route(RoutedMessage* message, uint8_t messageLen)
 // Subclasses may want to override
 bool RHMesh::isPhysicalAddress(uint8_t* address, uint8_t addresslen)
 {
-    // Can only handle physical addresses 1 octet long, which is the physical node address
-    return addresslen == 1 && address[0] == _thisAddress;
+    // Can only handle physical addresses sizeof(RHAddress) octets long, which is the physical node address
+    return addresslen == sizeof(RHAddress) && memcmp(address, &_thisAddress, sizeof(RHAddress)) == 0;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags)
+{
+    service();
+
+    // Deliver any message that arrived while we were blocked in doArp()
+    if (_held)
+    {
+	_held = false;
+	if (source) *source = _heldSource;
+	if (dest)   *dest   = _heldDest;
+	if (id)     *id     = _heldId;
+	if (flags)  *flags  = _heldFlags;
+	if (*len > _heldLen)
+	    *len = _heldLen;
+	memcpy(buf, _heldData, *len);
+	return true;
+    }
+    return receive(buf, len, source, dest, id, flags);
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+bool RHMesh::receive(uint8_t* buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags)
 {     
-    uint8_t tmpMessageLen = sizeof(_tmpMessage);
-    uint8_t _source;
-    uint8_t _dest;
+    uint8_t* message;
+    uint8_t tmpMessageLen;
+    RHAddress _source;
+    RHAddress _dest;
     uint8_t _id;
     uint8_t _flags;
-    if (RHRouter::recvfromAck(_tmpMessage, &tmpMessageLen, &_source, &_dest, &_id, &_flags))
+    if (recvSlice(&message, &tmpMessageLen, &_source, &_dest, &_id, &_flags))
     {
-	MeshMessageHeader* p = (MeshMessageHeader*)&_tmpMessage;
+	// The message is still in the router's buffer: it is handled (and any reply built) there
+	MeshMessageHeader* p = (MeshMessageHeader*)message;
 
 	if (   tmpMessageLen >= 1 
 	    && p->msgType == RH_MESH_MESSAGE_TYPE_APPLICATION)
@@ -180,7 +519,7 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 	    return true;
 	}
 	else if (   _dest == RH_BROADCAST_ADDRESS 
-		 && tmpMessageLen > 1 
+		 && tmpMessageLen >= RH_MESH_ROUTE_DISCOVERY_LEN 
 		 && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST)
 	{
 	    MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)p;
@@ -189,19 +528,33 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 	    // If it originally came from us, ignore it
 	    if (_source == _thisAddress)
 		return false;
+
+	    // Every copy heard counts towards suppressing our own rebroadcast
+	    countRequestCopy(_source, d->id);
 	    
-	    uint8_t numRoutes = tmpMessageLen - sizeof(MeshMessageHeader) - 2;
+	    uint8_t numRoutes = (tmpMessageLen - RH_MESH_ROUTE_DISCOVERY_LEN) / sizeof(RHAddress);
 	    uint8_t i;
 	    // Are we already mentioned?
 	    for (i = 0; i < numRoutes; i++)
 		if (d->route[i] == _thisAddress)
 		    return false; // Already been through us. Discard
+
+	    // Add the cost of the hop it just came over. Only handle it if that is 
+	    // cheaper than any copy of the same request we have already handled
+	    uint16_t cost = d->cost + linkCost();
+	    if (cost > 0xff)
+		cost = 0xff;
+	    DiscoveryCacheEntry* e = findDiscovery(_source, d->id, true);
+	    if (cost >= e->requestCost)
+		return false;
+	    e->requestCost = cost;
+	    d->cost = cost;
 	    
-	    // Hasnt been past us yet, record routes back to the earlier nodes
+	    // Hasnt been past us yet by a cheaper path, record routes back to the earlier nodes
 	    addRouteTo(_source, headerFrom()); // The originator
 	    for (i = 0; i < numRoutes; i++)
 		addRouteTo(d->route[i], headerFrom());
-	    if (isPhysicalAddress(&d->dest, d->destlen))
+	    if (isPhysicalAddress((uint8_t*)&d->dest, d->destlen))
 	    {
 		// This route discovery is for us. Unicast the whole route back to the originator
 		// as a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
@@ -211,12 +564,29 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 	    }
 	    else if (i < _max_hops)
 	    {
-		// Its for someone else, rebroadcast it, after adding ourselves to the list
+		// Its for someone else, add ourselves to the list
 		d->route[numRoutes] = _thisAddress;
-		tmpMessageLen++;
-		// Have to impersonate the source
-		// REVISIT: if this fails what can we do?
-		RHRouter::sendtoFromSourceWait(_tmpMessage, tmpMessageLen, RH_BROADCAST_ADDRESS, _source);
+		tmpMessageLen += sizeof(RHAddress);
+
+		RoutingTableEntry* cached = getRouteTo(d->dest);
+		if (   _cachedReplyAge
+		    && cached
+		    && cached->state == Valid
+		    && cached->next_hop != headerFrom()
+		    && millis() - cached->lastUsed <= _cachedReplyAge)
+		{
+		    // We have recently used a route to the destination, so answer for it 
+		    // instead of flooding the request any further
+		    cost += RH_MESH_CACHED_REPLY_COST;
+		    d->cost = cost > 0xff ? 0xff : cost;
+		    d->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE;
+		    RHRouter::sendtoWait((uint8_t*)d, tmpMessageLen, _source);
+		}
+		else
+		{
+		    // Rebroadcast it after a random delay, unless enough neighbours do so first
+		    scheduleRebroadcast(_source, d->id, message, tmpMessageLen);
+		}
 	    }
 	}
     }
@@ -224,18 +594,59 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+uint8_t RHMesh::linkCost()
+{
+    int snr = _driver.lastSNR();
+    uint8_t cost = RH_MESH_HOP_COST;
+    if (snr != RH_SNR_UNKNOWN && snr < RH_MESH_GOOD_SNR)
+    {
+	int penalty = (RH_MESH_GOOD_SNR - snr + RH_MESH_SNR_COST_STEP - 1) / RH_MESH_SNR_COST_STEP;
+	cost += penalty > 0xff - RH_MESH_HOP_COST ? 0xff - RH_MESH_HOP_COST : penalty;
+    }
+    return cost;
+}
+
+////////////////////////////////////////////////////////////////////
+RHMesh::DiscoveryCacheEntry* RHMesh::findDiscovery(RHAddress source, uint8_t id, bool create)
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_DISCOVERY_CACHE_SIZE; i++)
+	if (_discoveries[i].source == source && _discoveries[i].id == id)
+	    return &_discoveries[i];
+    if (!create)
+	return NULL;
+
+    DiscoveryCacheEntry* e = &_discoveries[_nextDiscovery];
+    _nextDiscovery = (_nextDiscovery + 1) % RH_MESH_DISCOVERY_CACHE_SIZE;
+    e->source = source;
+    e->id = id;
+    e->requestCost = 0xff;
+    e->responseCost = 0xff;
+    return e;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
 {  
     unsigned long starttime = millis();
     int32_t timeLeft;
     while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
-	if (waitAvailableTimeout(timeLeft))
+	// Wake up in time for any scheduled rebroadcasts or discovery timeouts
+	uint32_t due = serviceDue();
+	if ((uint32_t)timeLeft > due)
+	    timeLeft = due;
+	if (_held || (timeLeft > 0 && waitAvailableTimeout(timeLeft)))
 	{
 	    if (recvfromAck(buf, len, from, to, id, flags))
 		return true;
 	    YIELD;
 	}
+	else
+	{
+	    service();
+	    serviceForwardQueue();
+	}
     }
     return false;
 }
@@ -15,9 +15,72 @@
 #define RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE       2
 #define RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE                  3
 
-// Timeout for address resolution in milliecs
+// Default timeout for address resolution in milliecs, see RHMesh::setArpTimeout()
 #define RH_MESH_ARP_TIMEOUT 4000
 
+// Maximum number of destinations whose routes can be discovered at the same time
+#ifndef RH_MESH_MAX_PENDING_DISCOVERIES
+#define RH_MESH_MAX_PENDING_DISCOVERIES 4
+#endif
+
+// Maximum random delay in millisecs before rebroadcasting a route discovery request, see RHMesh::setRebroadcastJitter().
+// RH_MESH_REBROADCAST_JITTER_AUTO derives it from the time on air of a request, see RH_MESH_REBROADCAST_SLOTS
+#define RH_MESH_REBROADCAST_JITTER_AUTO 0xffff
+#ifndef RH_MESH_REBROADCAST_JITTER
+#define RH_MESH_REBROADCAST_JITTER RH_MESH_REBROADCAST_JITTER_AUTO
+#endif
+
+// With RH_MESH_REBROADCAST_JITTER_AUTO, the rebroadcast delay is up to this many request times on air for each
+// copy the suppression threshold counts, so that a waiting node can hear that many copies before its turn
+#ifndef RH_MESH_REBROADCAST_SLOTS
+#define RH_MESH_REBROADCAST_SLOTS 2
+#endif
+
+// Default number of copies of a route discovery request that, once heard, make a rebroadcast unnecessary.
+// Including the first, so 2 means one neighbour rebroadcasting first is enough
+#ifndef RH_MESH_SUPPRESSION_THRESHOLD
+#define RH_MESH_SUPPRESSION_THRESHOLD 2
+#endif
+
+// Maximum number of route discovery requests that can be awaiting rebroadcast at the same time
+#ifndef RH_MESH_MAX_PENDING_REBROADCASTS
+#define RH_MESH_MAX_PENDING_REBROADCASTS 4
+#endif
+
+// Default maximum age in millisecs of a route that may be used to answer route discovery requests
+// on behalf of their destination. 0 disables such replies. Off by default, as the replies are sent as well
+// as the flood they answer, see examples/density_sim.cpp
+#ifndef RH_MESH_CACHED_REPLY_AGE
+#define RH_MESH_CACHED_REPLY_AGE 0
+#endif
+
+// Cost added to replies from cached routes, since the cost beyond the replying node is unknown
+#define RH_MESH_CACHED_REPLY_COST (2 * RH_MESH_HOP_COST)
+
+// Maximum number of messages that can be queued for each destination awaiting route discovery
+#ifndef RH_MESH_PENDING_QUEUE_LEN
+#define RH_MESH_PENDING_QUEUE_LEN 4
+#endif
+
+// Time in millisecs after the first route discovery response to wait for responses over better paths
+#ifndef RH_MESH_DISCOVERY_WINDOW
+#define RH_MESH_DISCOVERY_WINDOW 300
+#endif
+
+// Route cost of one hop over a good link. Poorer links cost more, see RHMesh::linkCost()
+#define RH_MESH_HOP_COST 4
+
+// SNR in tenths of a dB at or above which a link is considered good
+#define RH_MESH_GOOD_SNR 50
+
+// Each RH_MESH_SNR_COST_STEP tenths of a dB below RH_MESH_GOOD_SNR adds 1 to the cost of a hop
+#define RH_MESH_SNR_COST_STEP 25
+
+// Number of recent route discoveries remembered, to recognise copies arriving over other paths
+#ifndef RH_MESH_DISCOVERY_CACHE_SIZE
+#define RH_MESH_DISCOVERY_CACHE_SIZE 16
+#endif
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHMesh RHMesh.h <RHMesh.h>
 /// \brief RHRouter subclass for sending addressed, optionally acknowledged datagrams
@@ -65,9 +128,49 @@
 /// RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE together ensure the original requester and all 
 /// the intermediate nodes know how to route to the source and destination nodes and every node along the path.
 ///
-/// Note that there is a race condition here that can effect routing on multipath routes. For example, 
-/// if the route to the destination can traverse several paths, last reply from the destination 
-/// will be the one used.
+/// Each discovery carries an id chosen by the originator and the accumulated cost of the path so far.
+/// Every node that receives a request adds the cost of the hop it arrived over (see linkCost(), 
+/// which penalises low SNR links), so a path of several good hops can beat one long, flaky hop.
+/// A node only handles another copy of the same request (same originator and id) if it arrived over 
+/// a cheaper path, in which case it updates its route back to the originator and rebroadcasts or 
+/// replies again. Likewise, nodes only take routes from a response if it is cheaper than earlier responses 
+/// to the same request. The originator keeps collecting responses for RH_MESH_DISCOVERY_WINDOW ms 
+/// (see setDiscoveryWindow()) after the first one, and uses the cheapest.
+///
+/// \par Flood Suppression
+///
+/// In a dense network, every node rebroadcasting every request would flood the channel. So instead
+/// of rebroadcasting at once, a node waits a random time (see setRebroadcastJitter()), by default up to 
+/// RH_MESH_REBROADCAST_SLOTS times the time on air of a request for each copy the threshold counts,
+/// counting the copies of the same request it hears from its neighbours meanwhile. 
+/// If it hears RH_MESH_SUPPRESSION_THRESHOLD or more, its neighbourhood is already covered and 
+/// the rebroadcast is dropped (see setSuppressionThreshold()). Copies over cheaper paths replace the 
+/// pending one, but do not restart the wait.
+///
+/// A node that has recently used a route to the destination of a request also answers it 
+/// itself with a response listing itself as the last hop, rather than rebroadcasting it. 
+/// Because the rest of the path is unknown, such replies cost RH_MESH_CACHED_REPLY_COST more, 
+/// so a reply over a better path from the destination itself can still win. See setCachedReplyAge().
+/// This is off by default: the replies go out as well as the flood, and add airtime rather than save it.
+///
+/// \par Asynchronous Route Discovery
+///
+/// sendtoWait() blocks while it discovers a route, for up to the ARP timeout (see setArpTimeout()).
+/// sendtoQueued() does not wait for discovery: if there is no route, it parks the message in a small queue
+/// for the destination (up to RH_MESH_PENDING_QUEUE_LEN messages), broadcasts a route discovery request
+/// and returns RH_ROUTER_ERROR_QUEUED. Up to RH_MESH_MAX_PENDING_DISCOVERIES destinations can be discovered 
+/// at once. Discovery then proceeds as responses are received by recvfromAck(), and once the route is
+/// known the queued messages are sent in order, or they are dropped if discovery times out.
+/// This is all driven by service(), which recvfromAck() calls, so a main loop that keeps
+/// calling recvfromAck() need do nothing else.
+///
+/// Only the wait for discovery is taken off the caller. Each message is still delivered to the next
+/// hop with RHReliableDatagram::sendtoWait(), which blocks until it is acknowledged or the retries run out:
+/// sendtoQueued() does so itself when the route is already known, and service() sends one queued message 
+/// per call, so a call to recvfromAck() blocks for at most one hop by hop delivery.
+///
+/// Application messages for this node that arrive while sendtoWait() is blocked in route 
+/// discovery are held and returned by the next call to recvfromAck().
 ///
 /// \par Route Failure
 ///
@@ -84,6 +187,10 @@
 /// (either because an intermediate node is off the air, or has moved out of range) a new route 
 /// will be established the next time a message is to be sent.
 ///
+/// Routes that have been neither used nor refreshed for RH_DEFAULT_ROUTE_LIFETIME ms are also 
+/// expired, so a route left behind by a node that has moved is usually rediscovered rather than 
+/// costing a full retry cycle first. See RHRouter::setRouteLifetime().
+///
 /// \par Message Format
 ///
 /// RHMesh uses a number of message formats layered on top of RHRouter:
@@ -132,26 +239,35 @@ public:
 	uint8_t             data[RH_MESH_MAX_MESSAGE_LEN]; ///< Application layer payload data
     } MeshApplicationMessage;
 
-    /// Signals a route discovery request or reply (At present only supports physical dest addresses of length 1 octet)
-    typedef struct
+    /// Signals a route discovery request or reply (At present only supports physical dest addresses of length sizeof(RHAddress))
+    typedef struct RH_PACKED
     {
 	MeshMessageHeader   header;  ///< msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_*
-	uint8_t             destlen; ///< Reserved. Must be 1
-	uint8_t             dest;    ///< The address of the destination node whose route is being sought
-	uint8_t             route[RH_MESH_MAX_MESSAGE_LEN - 2]; ///< List of node addresses visited so far. Length is implcit
+	uint8_t             destlen; ///< Reserved. Must be sizeof(RHAddress)
+	RHAddress           dest;    ///< The address of the destination node whose route is being sought
+	uint8_t             id;      ///< Discovery id chosen by the originator
+	uint8_t             cost;    ///< Accumulated path cost from the originator, see linkCost()
+	RHAddress           route[(RH_MESH_MAX_MESSAGE_LEN - 3 - sizeof(RHAddress)) / sizeof(RHAddress)]; ///< List of node addresses visited so far. Length is implcit
     } MeshRouteDiscoveryMessage;
 
+    /// Length of a MeshRouteDiscoveryMessage with an empty route list
+    #define RH_MESH_ROUTE_DISCOVERY_LEN (sizeof(RHMesh::MeshMessageHeader) + 3 + sizeof(RHAddress))
+
     /// Signals a route failure
-    typedef struct
+    typedef struct RH_PACKED
     {
 	MeshMessageHeader   header; ///< msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE
-	uint8_t             dest; ///< The address of the destination towards which the route failed
+	RHAddress           dest; ///< The address of the destination towards which the route failed
     } MeshRouteFailureMessage;
 
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHMesh(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHMesh(RHGenericDriver& driver, RHAddress thisAddress = 0);
+
+    /// Sets how long route discovery keeps waiting for responses over better paths after the first response
+    /// \param [in] window Time in milliseconds. Defaults to RH_MESH_DISCOVERY_WINDOW. 0 takes the first response.
+    void setDiscoveryWindow(uint16_t window);
 
     /// Sends a message to the destination node. Initialises the RHRouter message header 
     /// (the SOURCE address is set to the address of this node, HOPS to 0) and calls 
@@ -172,7 +288,63 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
-    uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+    uint8_t sendtoWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags = 0);
+
+    /// Sends a message to the destination node without waiting for route discovery.
+    /// If a route is known and no messages are queued for dest, the message is sent as with sendtoWait(), 
+    /// blocking until the next hop acknowledges it. If not, it is queued and route discovery is started 
+    /// (if not already in progress). The queued message is sent by service() once the route is known.
+    /// \param [in] buf The application message data
+    /// \param [in] len Number of octets in the application message data. 0 is permitted
+    /// \param [in] dest The destination node address
+    /// \param [in] flags Optional flags as for sendtoWait()
+    /// \return The result code:
+    ///         - RH_ROUTER_ERROR_QUEUED The message was queued awaiting route discovery
+    ///         - RH_ROUTER_ERROR_NO_ROUTE The queue for dest is full, or too many discoveries are in progress
+    ///         - Otherwise as for sendtoWait()
+    uint8_t sendtoQueued(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags = 0);
+
+    /// Runs the route discovery state machine: sends the next queued message for each destination whose
+    /// route has been found, and drops those whose discovery has timed out. Sending a message blocks until
+    /// the next hop acknowledges it, so this blocks for at most one hop by hop delivery per destination.
+    /// Called by recvfromAck(), so need only be called directly if recvfromAck() is not being called often.
+    void service();
+
+    /// Sets the time allowed for route discovery
+    /// \param [in] timeout Timeout in milliseconds. Defaults to RH_MESH_ARP_TIMEOUT
+    void setArpTimeout(uint16_t timeout);
+
+    /// \return The number of queued messages dropped because route discovery failed
+    uint16_t droppedMessages();
+
+    /// Sets the maximum random delay before rebroadcasting a route discovery request
+    /// \param [in] jitter Maximum delay in milliseconds. Defaults to RH_MESH_REBROADCAST_JITTER.
+    /// 0 rebroadcasts at once, with no suppression. RH_MESH_REBROADCAST_JITTER_AUTO derives the delay from
+    /// the time on air of a request and the suppression threshold, or uses 100 ms if the driver cannot
+    /// compute time on air.
+    void setRebroadcastJitter(uint16_t jitter);
+
+    /// \return The maximum rebroadcast delay in milliseconds in use with the current radio settings
+    uint32_t rebroadcastJitter();
+
+    /// Sets how many copies of a route discovery request must be heard during the rebroadcast delay
+    /// for our rebroadcast to be dropped
+    /// \param [in] threshold Number of copies, including the first. Defaults to RH_MESH_SUPPRESSION_THRESHOLD.
+    /// 0 never drops rebroadcasts.
+    void setSuppressionThreshold(uint8_t threshold);
+
+    /// Sets the maximum age of a route that may be used to answer route discovery requests on behalf 
+    /// of their destination.
+    /// \param [in] age Maximum time since the route was last used or refreshed in milliseconds.
+    /// Defaults to RH_MESH_CACHED_REPLY_AGE. 0 never answers for other nodes.
+    void setCachedReplyAge(uint32_t age);
+
+    /// \return The number of route discovery rebroadcasts dropped because enough copies were heard
+    uint16_t suppressedRebroadcasts();
+
+    /// \param [in] dest A destination node address
+    /// \return The number of messages queued for dest that have not been sent yet
+    uint8_t queuedMessages(RHAddress dest);
 
     /// Starts the receiver if it is not running already, processes and possibly routes any received messages
     /// addressed to other nodes
@@ -196,7 +368,7 @@ public:
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was received for this node and copied to buf
-    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid application layer 
@@ -211,7 +383,7 @@ public:
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
 protected:
 
@@ -229,11 +401,11 @@ protected:
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
     /// Try to resolve a route for the given address. Blocks while discovering the route
-    /// which may take up to 4000 msec.
+    /// which may take up to the ARP timeout (RH_MESH_ARP_TIMEOUT by default).
     /// Virtual so subclasses can override.
     /// \param [in] address The physical address to resolve
     /// \return true if the address was resolved and added to the local routing table
-    virtual bool doArp(uint8_t address);
+    virtual bool doArp(RHAddress address);
 
     /// Tests if the given address of length addresslen is indentical to the
     /// physical address of this node.
@@ -247,9 +419,130 @@ protected:
     /// \return true if the physical address of this node is identical to address
     virtual bool isPhysicalAddress(uint8_t* address, uint8_t addresslen);
 
+    /// Returns the cost of the hop the message just received arrived over. 
+    /// The default is RH_MESH_HOP_COST plus 1 for each RH_MESH_SNR_COST_STEP the SNR is below 
+    /// RH_MESH_GOOD_SNR, or just RH_MESH_HOP_COST if the driver cannot measure SNR.
+    /// Subclasses can override this to use other link metrics.
+    /// \return The cost of the hop
+    virtual uint8_t linkCost();
+
+    /// \brief What we know about a recent route discovery
+    typedef struct
+    {
+	RHAddress           source;       ///< Originator of the discovery
+	uint8_t             id;           ///< Discovery id
+	uint8_t             requestCost;  ///< Cheapest path cost of the requests handled here
+	uint8_t             responseCost; ///< Cheapest path cost of the responses seen here
+    } DiscoveryCacheEntry;
+
+    /// Finds a discovery in the discovery cache
+    /// \param [in] source The originator of the discovery
+    /// \param [in] id The discovery id
+    /// \param [in] create If true and the discovery is not in the cache, replace the oldest entry with it
+    /// \return Pointer to the entry, or NULL if not found and not created
+    DiscoveryCacheEntry* findDiscovery(RHAddress source, uint8_t id, bool create);
+
+    /// Id of the last route discovery we originated
+    uint8_t             _discoveryId;
+
+    /// Time to collect discovery responses
+    uint16_t            _discoveryWindow;
+
+    /// \brief A message waiting for route discovery
+    typedef struct
+    {
+	uint8_t             len;   ///< Length of the application data
+	uint8_t             flags; ///< Flags to send with it
+	uint8_t             data[RH_MESH_MAX_MESSAGE_LEN]; ///< Application data
+    } PendingMessage;
+
+    /// \brief A route discovery in progress
+    typedef struct
+    {
+	bool                active;   ///< true if this discovery is in progress
+	RHAddress           dest;     ///< Destination whose route is being discovered
+	uint8_t             id;       ///< Our discovery id
+	bool                answered; ///< true once a response has been received
+	bool                flushing; ///< true once the route is known and the queue is being sent
+	uint8_t             sent;     ///< Number of queued messages sent so far
+	uint32_t            started;  ///< millis() when the request was sent
+	uint32_t            timeout;  ///< ms after started to stop waiting for responses
+	uint8_t             count;    ///< Number of queued messages
+	PendingMessage      queue[RH_MESH_PENDING_QUEUE_LEN]; ///< Queued messages, oldest first
+    } PendingDiscovery;
+
+    /// Returns the discovery in progress for dest, optionally starting a new one
+    /// \param [in] dest The destination node address
+    /// \param [in] start If true and no discovery is in progress, broadcast a request and start one
+    /// \return The discovery, or NULL if none (or no free slot, or the request could not be sent)
+    PendingDiscovery* pendingDiscovery(RHAddress dest, bool start);
+
+    /// Handles a received message: routes and discovery messages are dealt with here,
+    /// application messages for us are copied to buf
+    /// \return true if an application message was copied to buf
+    bool receive(uint8_t* buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags);
+
+    /// \brief A route discovery request waiting to be rebroadcast
+    typedef struct
+    {
+	bool                active; ///< true if waiting
+	RHAddress           source; ///< Originator of the discovery
+	uint8_t             id;     ///< Discovery id
+	uint8_t             copies; ///< Copies of the request heard so far
+	uint32_t            due;    ///< millis() when it is to be sent
+	uint8_t             len;    ///< Length of message
+	uint8_t             message[RH_ROUTER_MAX_MESSAGE_LEN]; ///< The request, with us added to the route
+    } PendingRebroadcast;
+
+    /// Schedules a route discovery request for rebroadcast after a random delay,
+    /// or replaces one for the same discovery already scheduled
+    void scheduleRebroadcast(RHAddress source, uint8_t id, uint8_t* message, uint8_t len);
+
+    /// Counts a copy of a route discovery request against its pending rebroadcast, if any
+    void countRequestCopy(RHAddress source, uint8_t id);
+
+    /// \return The time in ms until service() or serviceForwardQueue() next has something to do
+    uint32_t serviceDue();
+
+    /// Rebroadcast delay
+    uint16_t            _rebroadcastJitter;
+
+    /// Suppression threshold
+    uint8_t             _suppressionThreshold;
+
+    /// Maximum age of cached routes used to answer requests
+    uint32_t            _cachedReplyAge;
+
+    /// Number of suppressed rebroadcasts
+    uint16_t            _suppressedRebroadcasts;
+
+    /// Route discovery timeout
+    uint16_t            _arpTimeout;
+
+    /// Number of queued messages dropped
+    uint16_t            _droppedMessages;
+
 private:
-    /// Temporary message buffer
-    static uint8_t _tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
+    /// Recent route discoveries, used as a ring
+    DiscoveryCacheEntry _discoveries[RH_MESH_DISCOVERY_CACHE_SIZE];
+
+    /// Next entry in _discoveries to replace
+    uint8_t             _nextDiscovery;
+
+    /// Route discoveries in progress
+    PendingDiscovery    _pending[RH_MESH_MAX_PENDING_DISCOVERIES];
+
+    /// Route discovery requests waiting to be rebroadcast
+    PendingRebroadcast  _rebroadcasts[RH_MESH_MAX_PENDING_REBROADCASTS];
+
+    /// An application message received while blocked in doArp(), for the next recvfromAck()
+    bool                _held;
+    uint8_t             _heldLen;
+    RHAddress           _heldSource;
+    RHAddress           _heldDest;
+    uint8_t             _heldId;
+    uint8_t             _heldFlags;
+    uint8_t             _heldData[RH_MESH_MAX_MESSAGE_LEN];
 
 };
 
@@ -0,0 +1,161 @@
+// RHPeerTable.h
+//
+// Small fixed size hash table keyed by node address
+//
+// Used for per-peer state, so that memory scales with the number of peers
+// actually heard from rather than with the size of the address space.
+
+#ifndef RHPeerTable_h
+#define RHPeerTable_h
+
+#include <RadioHead.h>
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHPeerTable RHPeerTable.h <RHPeerTable.h>
+/// \brief Fixed size open addressing hash table from RHAddress to T
+///
+/// Holds up to N entries, with no dynamic memory. Lookups probe linearly from the slot the address hashes to,
+/// and stop at the first empty slot. erase() moves later entries of the probe run back into the freed slot
+/// (backward shift deletion), so removals leave no tombstones and a miss costs no more after many of them.
+/// When the table is full, insert() evicts the entry in the next slot of a round robin over the slots to
+/// make room. That is not necessarily the peer least recently heard from, so the table suits caches of
+/// per-peer state where forgetting any one peer is harmless. Callers that cannot tolerate eviction must
+/// make N larger than the number of entries they will ever hold.
+/// Pointers returned by find() and insert() are only valid until the next insert() or erase().
+///
+/// With 8 bit addresses a table of 256 entries would be a plain array, but with RH_WIDE_ADDRESSES
+/// that would be 65536 entries, hence this.
+template <typename T, uint16_t N>
+class RHPeerTable
+{
+public:
+    /// Constructor. The table starts empty
+    RHPeerTable() { clear(); }
+
+    /// Removes all entries
+    void clear()
+    {
+	memset(_state, Empty, sizeof(_state));
+	_count = 0;
+	_nextEvict = 0;
+    }
+
+    /// Looks up an address
+    /// \param[in] address The address to look for
+    /// \return Pointer to the value for address, or NULL if there is none
+    T* find(RHAddress address)
+    {
+	uint16_t i = lookup(address);
+	return i < N ? &_values[i] : NULL;
+    }
+
+    /// Looks up an address, adding it if it is not there. A new value is zeroed.
+    /// \param[in] address The address to look for
+    /// \param[out] created If not NULL, set to true if the entry was added by this call
+    /// \return Pointer to the value for address
+    T* insert(RHAddress address, bool* created = NULL)
+    {
+	uint16_t i = lookup(address);
+	if (created)
+	    *created = i >= N;
+	if (i < N)
+	    return &_values[i];
+
+	if (_count == N)
+	{
+	    // Full: forget whoever is in the next slot round robin
+	    erase(_keys[_nextEvict]);
+	    _nextEvict = (_nextEvict + 1) % N;
+	}
+	// Use the first empty slot on its probe sequence
+	i = hash(address);
+	while (_state[i] != Empty)
+	    i = (i + 1) % N;
+	_state[i] = Used;
+	_keys[i] = address;
+	memset(&_values[i], 0, sizeof(T));
+	_count++;
+	return &_values[i];
+    }
+
+    /// Removes an address, if it is present
+    /// \param[in] address The address to remove
+    void erase(RHAddress address)
+    {
+	uint16_t i = lookup(address);
+	if (i >= N)
+	    return;
+	_state[i] = Empty;
+	_count--;
+
+	// Close the hole: any later entry in the run whose probe sequence passes through the hole moves
+	// back into it, leaving a new hole where it was, until the run ends at an empty slot
+	uint16_t j = i;
+	while (true)
+	{
+	    j = (j + 1) % N;
+	    if (_state[j] == Empty)
+		break;
+	    uint16_t h = hash(_keys[j]);
+	    if ((j + N - h) % N >= (j + N - i) % N)
+	    {
+		_state[i] = Used;
+		_keys[i] = _keys[j];
+		_values[i] = _values[j];
+		_state[j] = Empty;
+		i = j;
+	    }
+	}
+    }
+
+    /// \return The number of entries in the table
+    uint16_t count() { return _count; }
+
+protected:
+    /// Slot states
+    typedef enum
+    {
+	Empty = 0,
+	Used
+    } SlotState;
+
+    /// \return The slot an address hashes to
+    static uint16_t hash(RHAddress address)
+    {
+	// Multiplicative hash spreads consecutive addresses
+	return (uint16_t)((uint32_t)address * 40503UL >> 3) % N;
+    }
+
+    /// \return The slot holding address, or N if it is not present
+    uint16_t lookup(RHAddress address)
+    {
+	uint16_t h = hash(address);
+	uint16_t n;
+	for (n = 0; n < N; n++)
+	{
+	    uint16_t i = (h + n) % N;
+	    if (_state[i] == Empty)
+		break;
+	    if (_keys[i] == address)
+		return i;
+	}
+	return N;
+    }
+
+    /// Slot states
+    uint8_t     _state[N];
+
+    /// Addresses
+    RHAddress   _keys[N];
+
+    /// Values
+    T           _values[N];
+
+    /// Number of entries in use
+    uint16_t    _count;
+
+    /// Next slot to evict when full
+    uint16_t    _nextEvict;
+};
+
+#endif
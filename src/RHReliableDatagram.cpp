@@ -15,14 +15,16 @@
 
 ////////////////////////////////////////////////////////////////////
 // Constructors
-RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddress) 
+RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, RHAddress thisAddress) 
     : RHDatagram(driver, thisAddress)
 {
     _retransmissions = 0;
     _lastSequenceNumber = 0;
     _timeout = RH_DEFAULT_TIMEOUT;
     _retries = RH_DEFAULT_RETRIES;
+#ifndef RH_WIDE_ADDRESSES
     memset(_seenIds, 0, sizeof(_seenIds));
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -45,7 +47,7 @@ uint8_t RHReliableDatagram::retries()
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
+bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, RHAddress address)
 {
     // Assemble the message
     uint8_t thisSequenceNumber = ++_lastSequenceNumber;
@@ -93,7 +95,8 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 	{
 	    if (waitAvailableTimeout(timeLeft))
 	    {
-		uint8_t from, to, id, flags;
+		RHAddress from, to;
+		uint8_t id, flags;
 		if (recvfrom(0, 0, &from, &to, &id, &flags)) // Discards the message
 		{
 		    // Now have a message: is it our ACK?
@@ -106,7 +109,7 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 			return true;
 		    }
 		    else if (   !(flags & RH_FLAGS_ACK)
-				&& (id == _seenIds[from]))
+				&& (id == seenId(from)))
 		    {
 			// This is a request we have already received. ACK it again
 			acknowledge(id, from);
@@ -125,12 +128,13 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
 {  
-    uint8_t _from;
-    uint8_t _to;
+    RHAddress _from;
+    RHAddress _to;
     uint8_t _id;
     uint8_t _flags;
+    uint8_t _len = len ? *len : 0;
     // Get the message before its clobbered by the ACK (shared rx and tx buffer in some drivers
     if (available() && recvfrom(buf, len, &_from, &_to, &_id, &_flags))
     {
@@ -151,23 +155,30 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
             // shuts down between transmissions. Devices that do this will report the
             // the same ID each time since their internal sequence number will reset
             // to zero each time the device starts up.
-	    if ((RH_ENABLE_EXPLICIT_RETRY_DEDUP && !(_flags & RH_FLAGS_RETRY)) || _id != _seenIds[_from])
+	    if ((RH_ENABLE_EXPLICIT_RETRY_DEDUP && !(_flags & RH_FLAGS_RETRY)) || _id != seenId(_from))
 	    {
 		if (from)  *from =  _from;
 		if (to)    *to =    _to;
 		if (id)    *id =    _id;
 		if (flags) *flags = _flags;
+#ifdef RH_WIDE_ADDRESSES
+		*_seenIds.insert(_from) = _id;
+#else
 		_seenIds[_from] = _id;
+#endif
 		return true;
 	    }
 	    // Else just re-ack it and wait for a new one
 	}
     }
-    // No message for us available
+    // No message for us available. Give the caller back its buffer length, as recvfromAckTimeout()
+    // passes it on to the next try, and a short message we dropped would cut the next one short
+    if (len)
+	*len = _len;
     return false;
 }
 
-bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
 {
     unsigned long starttime = millis();
     int32_t timeLeft;
@@ -193,7 +204,18 @@ void RHReliableDatagram::resetRetransmissions()
     _retransmissions = 0;
 }
  
-void RHReliableDatagram::acknowledge(uint8_t id, uint8_t from)
+uint8_t RHReliableDatagram::seenId(RHAddress from)
+{
+#ifdef RH_WIDE_ADDRESSES
+    uint8_t* seen = _seenIds.find(from);
+    return seen ? *seen : 0;
+#else
+    return _seenIds[from];
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::acknowledge(uint8_t id, RHAddress from)
 {
     setHeaderId(id);
     setHeaderFlags(RH_FLAGS_ACK);
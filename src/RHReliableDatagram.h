@@ -8,6 +8,7 @@
 #define RHReliableDatagram_h
 
 #include <RHDatagram.h>
+#include <RHPeerTable.h>
 
 /// The acknowledgement bit in the header FLAGS. This indicates if the payload is for an
 /// ack for a successfully received message.
@@ -29,6 +30,14 @@
 /// do not support the RETRY header. If you do, deduping of messages will be broken.
 #define RH_ENABLE_EXPLICIT_RETRY_DEDUP 0
 
+/// With RH_WIDE_ADDRESSES, the number of nodes whose last sequence number is remembered for duplicate
+/// detection. If more nodes than this are heard from, one is forgotten to make room, round robin by slot
+/// rather than the least recently heard (see RHPeerTable), and a retry from it may be delivered twice.
+/// With 8 bit addresses every node is remembered and this is not used.
+#ifndef RH_SEEN_IDS_SIZE
+#define RH_SEEN_IDS_SIZE 64
+#endif
+
 /// the default retry timeout in milliseconds
 #define RH_DEFAULT_TIMEOUT 200
 
@@ -96,7 +105,7 @@ public:
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHReliableDatagram(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Sets the minimum retransmit timeout. If sendtoWait is waiting for an ack 
     /// longer than this time (in milliseconds), 
@@ -132,7 +141,7 @@ public:
     /// \param[in] buf Pointer to the binary message to send
     /// \param[in] len Number of octets to send
     /// \return true if the message was transmitted and an acknowledgement was received.
-    bool sendtoWait(uint8_t* buf, uint8_t len, uint8_t address);
+    bool sendtoWait(uint8_t* buf, uint8_t len, RHAddress address);
 
     /// If there is a valid message available for this node, send an acknowledgement to the SRC
     /// address (blocking until this is complete), then copy the message to buf and return true
@@ -146,13 +155,13 @@ public:
     /// It is recommended that you call it in your main loop.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
-    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the SRC address
-    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
     /// or the timeout expires. Starts the receiver automatically.
@@ -161,13 +170,13 @@ public:
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
     /// \param[in] timeout Maximum time to wait in milliseconds
-    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the SRC address
-    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Returns the number of retransmissions 
     /// we have had to send since starting or since the last call to resetRetransmissions().
@@ -181,13 +190,16 @@ public:
 protected:
     /// Send an ACK for the message id to the given from address
     /// Blocks until the ACK has been sent
-    void acknowledge(uint8_t id, uint8_t from);
+    void acknowledge(uint8_t id, RHAddress from);
 
     /// Checks whether the message currently in the Rx buffer is a new message, not previously received
     /// based on the from address and the sequence.  If it is new, it is acknowledged and returns true
     /// \return true if there is a message received and it is a new message
     bool haveNewMessage();
 
+    /// \return The last sequence number seen from a node, 0 if none
+    uint8_t seenId(RHAddress from);
+
 private:
     /// Count of retransmissions we have had to send
     uint32_t _retransmissions;
@@ -204,11 +216,15 @@ private:
     /// Defaults to 3
     uint8_t _retries;
 
-    /// Array of the last seen sequence number indexed by node address that sent it
+    /// The last seen sequence number from each node address that sent one
     /// It is used for duplicate detection. Duplicated messages are re-acknowledged when received 
     /// (this is generally due to lost ACKs, causing the sender to retransmit, even though we have already
     /// received that message)
+#ifdef RH_WIDE_ADDRESSES
+    RHPeerTable<uint8_t, RH_SEEN_IDS_SIZE> _seenIds;
+#else
     uint8_t _seenIds[256];
+#endif
 };
 
 /// @example rf22_reliable_datagram_client.pde
@@ -13,14 +13,24 @@
 
 #include <RHRouter.h>
 
-RHRouter::RoutedMessage RHRouter::_tmpMessage;
-
 ////////////////////////////////////////////////////////////////////
 // Constructors
-RHRouter::RHRouter(RHGenericDriver& driver, uint8_t thisAddress) 
+RHRouter::RHRouter(RHGenericDriver& driver, RHAddress thisAddress) 
     : RHReliableDatagram(driver, thisAddress)
 {
     _max_hops = RH_DEFAULT_MAX_HOPS;
+    _routeLifetime = 0;
+    _storeAndForward = false;
+    _forwardMaxAge = RH_ROUTER_FORWARD_MAX_AGE;
+    _forwardDropped = 0;
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_FORWARD_QUEUE_SIZE; i++)
+	_forwardQueue[i].active = false;
+    memset(_receipts, 0, sizeof(_receipts));
+    _deliveryTimeout = RH_ROUTER_E2E_TIMEOUT;
+    _deliveryTimeouts = 0;
+    memset(_seen, 0xff, sizeof(_seen));
+    _seenNext = 0;
     clearRoutingTable();
 }
 
@@ -41,156 +51,630 @@ void RHRouter::setMaxHops(uint8_t max_hops)
 }
 
 ////////////////////////////////////////////////////////////////////
-void RHRouter::addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state)
+void RHRouter::addRouteTo(RHAddress dest, RHAddress next_hop, uint8_t state)
 {
-    uint8_t i;
+    uint8_t i = routeIndex(dest);
+    uint8_t k;
 
-    // First look for an existing entry we can update
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    if (i == RH_ROUTE_NONE)
     {
-	if (_routes[i].dest == dest)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
-	}
+	// Need a new entry, making room if there is none free
+	if (_freeHead == RH_ROUTE_NONE)
+	    retireOldestRoute();
+	i = _freeHead;
+	_freeHead = _lruNext[i];
+	*_routeIndex.insert(dest) = i;
+    }
+    else
+    {
+	unlinkRoute(i);
+    }
+    if (_routes[i].state == Invalid || state != Valid)
+    {
+	// No candidates worth keeping
+	memset(_routes[i].hops, RH_BROADCAST_ADDRESS, sizeof(_routes[i].hops));
+	memset(_routes[i].score, 0, sizeof(_routes[i].score));
     }
 
-    // Look for an invalid entry we can use
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    // Make next_hop the primary, keeping the others as backups
+    uint8_t score = RH_ROUTER_PRIMARY_SCORE;
+    for (k = 0; k < RH_ROUTER_NEXT_HOPS - 1; k++)
+	if (_routes[i].hops[k] == next_hop)
+	    break;
+    if (_routes[i].hops[k] == next_hop && _routes[i].score[k] > score)
+	score = _routes[i].score[k];
+    for (; k > 0; k--)
     {
-	if (_routes[i].state == Invalid)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
-	}
+	_routes[i].hops[k] = _routes[i].hops[k - 1];
+	_routes[i].score[k] = _routes[i].score[k - 1];
     }
+    _routes[i].hops[0] = next_hop;
+    _routes[i].score[0] = score;
 
-    // Need to make room for a new one
-    retireOldestRoute();
-    // Should be an invalid slot now
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    _routes[i].dest = dest;
+    _routes[i].next_hop = next_hop;
+    _routes[i].state = state;
+
+    // Link in as the most recently used
+    _lruPrev[i] = RH_ROUTE_NONE;
+    _lruNext[i] = _lruHead;
+    if (_lruHead != RH_ROUTE_NONE)
+	_lruPrev[_lruHead] = i;
+    _lruHead = i;
+    if (_lruTail == RH_ROUTE_NONE)
+	_lruTail = i;
+    _routes[i].lastUsed = millis();
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::addBackupRouteTo(RHAddress dest, RHAddress next_hop)
+{
+    uint8_t i = routeIndex(dest);
+    uint8_t k;
+    if (i == RH_ROUTE_NONE || _routes[i].state != Valid || next_hop == RH_BROADCAST_ADDRESS)
+	return false;
+    for (k = 0; k < RH_ROUTER_NEXT_HOPS; k++)
     {
-	if (_routes[i].state == Invalid)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	}
+	if (_routes[i].hops[k] == next_hop)
+	    return true;
+	if (_routes[i].hops[k] == RH_BROADCAST_ADDRESS)
+	    break;
     }
+    if (k == RH_ROUTER_NEXT_HOPS)
+    {
+	// Full: replace the worst, if it is doing badly
+	k = RH_ROUTER_NEXT_HOPS - 1;
+	if (k == 0 || _routes[i].score[k] >= RH_ROUTER_BACKUP_SCORE)
+	    return false;
+    }
+    _routes[i].hops[k] = next_hop;
+    _routes[i].score[k] = RH_ROUTER_BACKUP_SCORE;
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////
-RHRouter::RoutingTableEntry* RHRouter::getRouteTo(uint8_t dest)
+void RHRouter::scoreNextHop(uint8_t index, uint8_t candidate, bool delivered)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
-	if (_routes[i].dest == dest && _routes[i].state != Invalid)
-	    return &_routes[i];
-    return NULL;
+    RoutingTableEntry* r = &_routes[index];
+    int16_t score = r->score[candidate];
+    // Moving average with weight 1/4
+    score += ((delivered ? 255 : 0) - score) / 4;
+    // A long record of success would otherwise keep a hop that has just failed ahead of the next 
+    // candidate for several more messages, each costing a full retry cycle. So one failure puts it 
+    // behind the next candidate, which then gets the next message
+    if (   !delivered
+	&& candidate + 1 < RH_ROUTER_NEXT_HOPS
+	&& r->hops[candidate + 1] != RH_BROADCAST_ADDRESS
+	&& score >= r->score[candidate + 1])
+	score = r->score[candidate + 1] > 0 ? r->score[candidate + 1] - 1 : 0;
+    r->score[candidate] = score;
+
+    // Bubble it into place, best first
+    while (candidate > 0 && r->score[candidate] > r->score[candidate - 1])
+    {
+	RHAddress hop = r->hops[candidate];
+	r->hops[candidate] = r->hops[candidate - 1];
+	r->hops[candidate - 1] = hop;
+	r->score[candidate] = r->score[candidate - 1];
+	r->score[candidate - 1] = score;
+	candidate--;
+    }
+    while (   candidate + 1 < RH_ROUTER_NEXT_HOPS
+	   && r->hops[candidate + 1] != RH_BROADCAST_ADDRESS
+	   && r->score[candidate + 1] > r->score[candidate])
+    {
+	RHAddress hop = r->hops[candidate];
+	r->hops[candidate] = r->hops[candidate + 1];
+	r->hops[candidate + 1] = hop;
+	r->score[candidate] = r->score[candidate + 1];
+	r->score[candidate + 1] = score;
+	candidate++;
+    }
+    r->next_hop = r->hops[0];
+}
+
+////////////////////////////////////////////////////////////////////
+RHRouter::RoutingTableEntry* RHRouter::getRouteTo(RHAddress dest)
+{
+    expireRoutes();
+    uint8_t i = routeIndex(dest);
+    if (i == RH_ROUTE_NONE || _routes[i].state == Invalid)
+	return NULL;
+    return &_routes[i];
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::routeIndex(RHAddress dest)
+{
+    uint8_t* i = _routeIndex.find(dest);
+    return i ? *i : RH_ROUTE_NONE;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::unlinkRoute(uint8_t index)
+{
+    if (_lruPrev[index] != RH_ROUTE_NONE)
+	_lruNext[_lruPrev[index]] = _lruNext[index];
+    else
+	_lruHead = _lruNext[index];
+    if (_lruNext[index] != RH_ROUTE_NONE)
+	_lruPrev[_lruNext[index]] = _lruPrev[index];
+    else
+	_lruTail = _lruPrev[index];
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::touchRoute(uint8_t index)
+{
+    _routes[index].lastUsed = millis();
+    if (_lruHead == index)
+	return;
+    unlinkRoute(index);
+    _lruPrev[index] = RH_ROUTE_NONE;
+    _lruNext[index] = _lruHead;
+    _lruPrev[_lruHead] = index;
+    _lruHead = index;
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::deleteRoute(uint8_t index)
 {
-    // Delete a route by copying following routes on top of it
-    memcpy(&_routes[index], &_routes[index+1], 
-	   sizeof(RoutingTableEntry) * (RH_ROUTING_TABLE_SIZE - index - 1));
-    _routes[RH_ROUTING_TABLE_SIZE - 1].state = Invalid;
+    // Unlink the entry and put it on the free list
+    unlinkRoute(index);
+    _routeIndex.erase(_routes[index].dest);
+    _routes[index].state = Invalid;
+    _lruNext[index] = _freeHead;
+    _freeHead = index;
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::printRoutingTable()
 {
 #ifdef RH_HAVE_SERIAL
+    // Most recently used first
     uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    for (i = _lruHead; i != RH_ROUTE_NONE; i = _lruNext[i])
     {
 	Serial.print(i, DEC);
 	Serial.print(" Dest: ");
-	Serial.print(_routes[i].dest, DEC);
+	Serial.print((unsigned int)_routes[i].dest, DEC);
 	Serial.print(" Next Hop: ");
-	Serial.print(_routes[i].next_hop, DEC);
+	Serial.print((unsigned int)_routes[i].next_hop, DEC);
+	Serial.print(" Backups:");
+	uint8_t k;
+	for (k = 1; k < RH_ROUTER_NEXT_HOPS && _routes[i].hops[k] != RH_BROADCAST_ADDRESS; k++)
+	{
+	    Serial.print(" ");
+	    Serial.print((unsigned int)_routes[i].hops[k], DEC);
+	}
 	Serial.print(" State: ");
-	Serial.println(_routes[i].state, DEC);
+	Serial.print(_routes[i].state, DEC);
+	Serial.print(" Last Used: ");
+	Serial.println(_routes[i].lastUsed, DEC);
     }
 #endif
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHRouter::deleteRouteTo(uint8_t dest)
+bool RHRouter::deleteRouteTo(RHAddress dest)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    uint8_t i = routeIndex(dest);
+    if (i == RH_ROUTE_NONE)
+	return false;
+    deleteRoute(i);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::retireOldestRoute()
+{
+    // The tail of the LRU list is the least recently used
+    if (_lruTail != RH_ROUTE_NONE)
+	deleteRoute(_lruTail);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setRouteLifetime(uint32_t lifetime)
+{
+    _routeLifetime = lifetime;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::expireRoutes()
+{
+    if (!_routeLifetime)
+	return;
+    // The LRU list is in lastUsed order, so the expired routes are all at the tail
+    uint32_t now = millis();
+    while (_lruTail != RH_ROUTE_NONE && now - _routes[_lruTail].lastUsed > _routeLifetime)
+	deleteRoute(_lruTail);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::refreshRouteTo(RHAddress dest, RHAddress next_hop)
+{
+    uint8_t i = routeIndex(dest);
+    uint8_t k;
+    if (i == RH_ROUTE_NONE || _routes[i].state != Valid)
+	return false;
+    for (k = 0; k < RH_ROUTER_NEXT_HOPS; k++)
     {
-	if (_routes[i].dest == dest)
+	if (_routes[i].hops[k] == next_hop)
 	{
-	    deleteRoute(i);
+	    touchRoute(i);
 	    return true;
 	}
     }
     return false;
 }
 
-////////////////////////////////////////////////////////////////////
-void RHRouter::retireOldestRoute()
-{
-    // We just obliterate the first in the table and clear the last
-    deleteRoute(0);
-}
-
 ////////////////////////////////////////////////////////////////////
 void RHRouter::clearRoutingTable()
 {
     uint8_t i;
+    _routeIndex.clear();
     for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    {
 	_routes[i].state = Invalid;
+	_lruNext[i] = (i + 1 < RH_ROUTING_TABLE_SIZE) ? i + 1 : RH_ROUTE_NONE;
+    }
+    _freeHead = 0;
+    _lruHead = RH_ROUTE_NONE;
+    _lruTail = RH_ROUTE_NONE;
 }
 
 
-uint8_t RHRouter::sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags)
+uint8_t RHRouter::sendtoWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags)
 {
     return sendtoFromSourceWait(buf, len, dest, _thisAddress, flags);
 }
 
 ////////////////////////////////////////////////////////////////////
 // Waits for delivery to the next hop (but not for delivery to the final destination)
-uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags)
+uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, RHAddress dest, RHAddress source, uint8_t flags)
 {
     if (((uint16_t)len + sizeof(RoutedMessageHeader)) > _driver.maxMessageLength())
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
 
-    // Construct a RH RouterMessage message
+    // Construct a RH RouterMessage message. Subclasses may have built it in place already
     _tmpMessage.header.source = source;
     _tmpMessage.header.dest = dest;
     _tmpMessage.header.hops = 0;
     _tmpMessage.header.id = _lastE2ESequenceNumber++;
-    _tmpMessage.header.flags = flags;
-    memcpy(_tmpMessage.data, buf, len);
+    _tmpMessage.header.flags = flags & ~RH_ROUTER_FLAGS_E2E_RECEIPT;
+    if (buf != _tmpMessage.data)
+	memcpy(_tmpMessage.data, buf, len);
+
+    uint8_t id = _tmpMessage.header.id;
+    uint8_t ret = route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+    if (   ret == RH_ROUTER_ERROR_NONE
+	&& (flags & RH_ROUTER_FLAGS_E2E_ACK)
+	&& source == _thisAddress
+	&& dest != RH_BROADCAST_ADDRESS)
+	awaitReceipt(dest, id);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::lastSentId()
+{
+    return _lastE2ESequenceNumber - 1;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setDeliveryTimeout(uint32_t timeout)
+{
+    _deliveryTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHRouter::deliveryTimeouts()
+{
+    return _deliveryTimeouts;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::deliveriesPending()
+{
+    uint8_t i, count = 0;
+    for (i = 0; i < RH_ROUTER_E2E_PENDING; i++)
+	if (_receipts[i].state == 1)
+	    count++;
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::awaitReceipt(RHAddress dest, uint8_t id)
+{
+    // Use a free slot if there is one, else give up on the oldest
+    uint8_t i, slot = 0;
+    uint32_t now = millis();
+    uint32_t oldest = 0;
+    for (i = 0; i < RH_ROUTER_E2E_PENDING; i++)
+    {
+	if (_receipts[i].state == 0)
+	{
+	    slot = i;
+	    break;
+	}
+	uint32_t age = _receipts[i].state == 1 ? now - _receipts[i].time : 0xffffffff;
+	if (age >= oldest)
+	{
+	    oldest = age;
+	    slot = i;
+	}
+    }
+    if (_receipts[slot].state == 1)
+	_deliveryTimeouts++;
+    _receipts[slot].state = 1;
+    _receipts[slot].dest = dest;
+    _receipts[slot].id = id;
+    _receipts[slot].time = now;
+}
 
-    return route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+////////////////////////////////////////////////////////////////////
+void RHRouter::receiptReceived(RHAddress source, uint8_t id)
+{
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_E2E_PENDING; i++)
+    {
+	if (   _receipts[i].state == 1
+	    && _receipts[i].dest == source
+	    && _receipts[i].id == id)
+	{
+	    _receipts[i].state = 2;
+	    _receipts[i].time = millis() - _receipts[i].time;
+	    return;
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::deliveryReceipt(RHAddress* dest, uint8_t* id, uint32_t* rtt)
+{
+    uint8_t i;
+    uint32_t now = millis();
+    for (i = 0; i < RH_ROUTER_E2E_PENDING; i++)
+    {
+	if (_receipts[i].state == 1 && now - _receipts[i].time > _deliveryTimeout)
+	{
+	    _receipts[i].state = 0;
+	    _deliveryTimeouts++;
+	}
+    }
+    for (i = 0; i < RH_ROUTER_E2E_PENDING; i++)
+    {
+	if (_receipts[i].state == 2)
+	{
+	    if (dest) *dest = _receipts[i].dest;
+	    if (id)   *id   = _receipts[i].id;
+	    if (rtt)  *rtt  = _receipts[i].time;
+	    _receipts[i].state = 0;
+	    return true;
+	}
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::sendReceipt(RHAddress source, uint8_t id)
+{
+    // A bare header: the id says which message is acknowledged
+    _tmpMessage.header.source = _thisAddress;
+    _tmpMessage.header.dest = source;
+    _tmpMessage.header.hops = 0;
+    _tmpMessage.header.id = id;
+    _tmpMessage.header.flags = RH_ROUTER_FLAGS_E2E_RECEIPT;
+    route(&_tmpMessage, sizeof(RoutedMessageHeader));
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::seenMessage(RHAddress source, uint8_t id)
+{
+    uint32_t key = ((uint32_t)source << 8) | id;
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_E2E_DEDUP_SIZE; i++)
+	if (_seen[i] == key)
+	    return true;
+    _seen[_seenNext] = key;
+    _seenNext = (_seenNext + 1) % RH_ROUTER_E2E_DEDUP_SIZE;
+    return false;
 }
 
 ////////////////////////////////////////////////////////////////////
 uint8_t RHRouter::route(RoutedMessage* message, uint8_t messageLen)
 {
+    if (message->header.dest == RH_BROADCAST_ADDRESS)
+    {
+	if (!RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, RH_BROADCAST_ADDRESS))
+	    return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
+	return RH_ROUTER_ERROR_NONE;
+    }
+
     // Reliably deliver it if possible. See if we have a route:
-    uint8_t next_hop = RH_BROADCAST_ADDRESS;
-    if (message->header.dest != RH_BROADCAST_ADDRESS)
+    RoutingTableEntry* route = getRouteTo(message->header.dest);
+    if (!route || route->state != Valid)
+	return RH_ROUTER_ERROR_NO_ROUTE;
+    uint8_t i = routeIndex(message->header.dest);
+
+    // Try each candidate next hop in turn, best first. Scoring re-ranks them as we go, 
+    // so remember which ones have been tried
+    RHAddress tried[RH_ROUTER_NEXT_HOPS];
+    uint8_t numTried = 0;
+    while (numTried < RH_ROUTER_NEXT_HOPS)
     {
-	RoutingTableEntry* route = getRouteTo(message->header.dest);
-	if (!route)
-	    return RH_ROUTER_ERROR_NO_ROUTE;
-	next_hop = route->next_hop;
+	uint8_t k, t;
+	for (k = 0; k < RH_ROUTER_NEXT_HOPS && _routes[i].hops[k] != RH_BROADCAST_ADDRESS; k++)
+	{
+	    for (t = 0; t < numTried; t++)
+		if (tried[t] == _routes[i].hops[k])
+		    break;
+	    if (t == numTried)
+		break;
+	}
+	if (k == RH_ROUTER_NEXT_HOPS || _routes[i].hops[k] == RH_BROADCAST_ADDRESS)
+	    break; // None left to try
+	RHAddress next_hop = _routes[i].hops[k];
+	tried[numTried++] = next_hop;
+
+	bool delivered = RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, next_hop);
+	scoreNextHop(i, k, delivered);
+	if (delivered)
+	{
+	    // Traffic got through, so keep this route away from eviction
+	    touchRoute(i);
+	    return RH_ROUTER_ERROR_NONE;
+	}
     }
 
-    if (!RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, next_hop))
-	return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
+    // Nobody answered. If we are forwarding for someone else, maybe hold it until the next hop is back
+    if (   message->header.source != _thisAddress
+	&& holdForForward(message, messageLen, _routes[i].hops[0]))
+	return RH_ROUTER_ERROR_QUEUED;
+    return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
+}
 
-    return RH_ROUTER_ERROR_NONE;
+////////////////////////////////////////////////////////////////////
+void RHRouter::setStoreAndForward(bool enable, uint32_t maxAge)
+{
+    _storeAndForward = enable;
+    _forwardMaxAge = maxAge;
+    if (!enable)
+    {
+	uint8_t i;
+	for (i = 0; i < RH_ROUTER_FORWARD_QUEUE_SIZE; i++)
+	    _forwardQueue[i].active = false;
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::forwardQueueLength()
+{
+    uint8_t i, count = 0;
+    for (i = 0; i < RH_ROUTER_FORWARD_QUEUE_SIZE; i++)
+	if (_forwardQueue[i].active)
+	    count++;
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHRouter::forwardDropped()
+{
+    return _forwardDropped;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::holdForForward(RoutedMessage* message, uint8_t messageLen, RHAddress next_hop)
+{
+    if (!_storeAndForward)
+	return false;
+
+    uint8_t i, count = 0;
+    ForwardSlot* slot = NULL;
+    for (i = 0; i < RH_ROUTER_FORWARD_QUEUE_SIZE; i++)
+    {
+	if (!_forwardQueue[i].active)
+	{
+	    if (!slot)
+		slot = &_forwardQueue[i];
+	}
+	else if (_forwardQueue[i].next_hop == next_hop)
+	    count++;
+    }
+    if (!slot || count >= RH_ROUTER_FORWARD_QUEUE_PER_HOP)
+	return false;
+
+    slot->active = true;
+    slot->next_hop = next_hop;
+    slot->len = messageLen;
+    slot->retries = 0;
+    slot->held = millis();
+    slot->nextTry = slot->held + RH_ROUTER_FORWARD_BACKOFF;
+    memcpy(&slot->message, message, messageLen);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::sendHeld(uint8_t slot)
+{
+    ForwardSlot* f = &_forwardQueue[slot];
+    if (!RHReliableDatagram::sendtoWait((uint8_t*)&f->message, f->len, f->next_hop))
+	return false;
+    f->active = false;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::drainForwardQueue(RHAddress next_hop)
+{
+    // Only make them due: sending them all here would hold up the message that showed next_hop is back
+    uint8_t i;
+    uint32_t now = millis();
+    for (i = 0; i < RH_ROUTER_FORWARD_QUEUE_SIZE; i++)
+	if (_forwardQueue[i].active && _forwardQueue[i].next_hop == next_hop)
+	    _forwardQueue[i].nextTry = now;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::serviceForwardQueue()
+{
+    if (!_storeAndForward)
+	return;
+    uint8_t i;
+    uint8_t due = RH_ROUTER_FORWARD_QUEUE_SIZE;
+    uint32_t now = millis();
+    for (i = 0; i < RH_ROUTER_FORWARD_QUEUE_SIZE; i++)
+    {
+	ForwardSlot* f = &_forwardQueue[i];
+	if (!f->active)
+	    continue;
+	if (now - f->held > _forwardMaxAge)
+	{
+	    f->active = false;
+	    _forwardDropped++;
+	}
+	else if (due == RH_ROUTER_FORWARD_QUEUE_SIZE && (int32_t)(now - f->nextTry) >= 0)
+	    due = i;
+    }
+
+    // Send one at most, so that the caller is not held up for long
+    if (due == RH_ROUTER_FORWARD_QUEUE_SIZE || sendHeld(due))
+	return;
+    ForwardSlot* f = &_forwardQueue[due];
+    if (++f->retries >= RH_ROUTER_FORWARD_MAX_RETRIES)
+    {
+	f->active = false;
+	_forwardDropped++;
+	return;
+    }
+    f->nextTry = millis() + ((uint32_t)RH_ROUTER_FORWARD_BACKOFF << f->retries);
+    // The next hop has probably gone away again, so hold back the others for it as well
+    for (i = 0; i < RH_ROUTER_FORWARD_QUEUE_SIZE; i++)
+	if (   _forwardQueue[i].active
+	    && _forwardQueue[i].next_hop == f->next_hop
+	    && (int32_t)(_forwardQueue[i].nextTry - f->nextTry) < 0)
+	    _forwardQueue[i].nextTry = f->nextTry;
+}
+
+////////////////////////////////////////////////////////////////////
+uint32_t RHRouter::forwardDue()
+{
+    uint32_t due = 0xffffffff;
+    if (!_storeAndForward)
+	return due;
+    uint32_t now = millis();
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_FORWARD_QUEUE_SIZE; i++)
+    {
+	if (!_forwardQueue[i].active)
+	    continue;
+	int32_t left = _forwardQueue[i].nextTry - now;
+	if (left <= 0)
+	    return 0;
+	if ((uint32_t)left < due)
+	    due = left;
+    }
+    return due;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -203,13 +687,27 @@ void RHRouter::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags)
+{  
+    uint8_t* data;
+    uint8_t msgLen;
+    if (!recvSlice(&data, &msgLen, source, dest, id, flags))
+	return false;
+    if (*len > msgLen)
+	*len = msgLen;
+    memcpy(buf, data, *len);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::recvSlice(uint8_t** data, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags)
 {  
     uint8_t tmpMessageLen = sizeof(_tmpMessage);
-    uint8_t _from;
-    uint8_t _to;
+    RHAddress _from;
+    RHAddress _to;
     uint8_t _id;
     uint8_t _flags;
+    serviceForwardQueue();
     if (RHReliableDatagram::recvfromAck((uint8_t*)&_tmpMessage, &tmpMessageLen, &_from, &_to, &_id, &_flags))
     {
 	// Here we simulate networks with limited visibility between nodes
@@ -261,19 +759,50 @@ bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t*
 	}
 #endif
 
+	// The neighbour is evidently back, so send it anything we have been holding for it
+	drainForwardQueue(_from);
+
+	// Hearing from a node through a neighbour shows the route that way still works
+	expireRoutes();
+	refreshRouteTo(_from, _from);
+	refreshRouteTo(_tmpMessage.header.source, _from);
+	// And if there is another way there, it may serve as a backup
+	addBackupRouteTo(_from, _from);
+	if (_tmpMessage.header.source != _thisAddress)
+	    addBackupRouteTo(_tmpMessage.header.source, _from);
+
 	peekAtMessage(&_tmpMessage, tmpMessageLen);
 	// See if its for us or has to be routed
 	if (_tmpMessage.header.dest == _thisAddress || _tmpMessage.header.dest == RH_BROADCAST_ADDRESS)
 	{
+	    uint8_t e2eFlags = _tmpMessage.header.flags;
+	    RHAddress e2eSource = _tmpMessage.header.source;
+	    uint8_t e2eId = _tmpMessage.header.id;
+	    if (e2eFlags & RH_ROUTER_FLAGS_E2E_RECEIPT)
+	    {
+		// Someone confirming delivery of one of ours: nothing for the caller
+		if (_tmpMessage.header.dest == _thisAddress)
+		    receiptReceived(e2eSource, e2eId);
+		return false;
+	    }
+	    bool wantsReceipt = (e2eFlags & RH_ROUTER_FLAGS_E2E_ACK) && _tmpMessage.header.dest == _thisAddress;
+	    if (wantsReceipt && seenMessage(e2eSource, e2eId))
+	    {
+		// Delivered already, but our receipt must have been lost
+		sendReceipt(e2eSource, e2eId);
+		return false;
+	    }
+
 	    // Deliver it here
 	    if (source) *source  = _tmpMessage.header.source;
 	    if (dest)   *dest    = _tmpMessage.header.dest;
 	    if (id)     *id      = _tmpMessage.header.id;
 	    if (flags)  *flags   = _tmpMessage.header.flags;
-	    uint8_t msgLen = tmpMessageLen - sizeof(RoutedMessageHeader);
-	    if (*len > msgLen)
-		*len = msgLen;
-	    memcpy(buf, _tmpMessage.data, *len);
+	    *data = _tmpMessage.data;
+	    *len = tmpMessageLen - sizeof(RoutedMessageHeader);
+	    // The receipt is a bare header, so sending it leaves the payload intact
+	    if (wantsReceipt)
+		sendReceipt(e2eSource, e2eId);
 	    return true; // Its for you!
 	}
 	else if (   _tmpMessage.header.dest != RH_BROADCAST_ADDRESS
@@ -290,17 +819,23 @@ bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t*
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags)
 {  
     unsigned long starttime = millis();
     int32_t timeLeft;
     while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
-	if (waitAvailableTimeout(timeLeft))
+	// Wake up in time for any held messages that fall due
+	uint32_t due = forwardDue();
+	if ((uint32_t)timeLeft > due)
+	    timeLeft = due;
+	if (timeLeft > 0 && waitAvailableTimeout(timeLeft))
 	{
 	    if (recvfromAck(buf, len, source, dest, id, flags))
 		return true;
 	}
+	else
+	    serviceForwardQueue();
 	YIELD;
     }
     return false;
@@ -8,12 +8,87 @@
 #define RHRouter_h
 
 #include <RHReliableDatagram.h>
+#include <RHPeerTable.h>
 
 // Default max number of hops we will route
 #define RH_DEFAULT_MAX_HOPS 30
 
-// The default size of the routing table we keep
+// The default size of the routing table we keep. May be set at build time to anything up to 255,
+// so that a route to every other node in an 8 bit address space can be kept. With RH_WIDE_ADDRESSES
+// this is the number of destinations kept, least recently used first out
+#ifndef RH_ROUTING_TABLE_SIZE
 #define RH_ROUTING_TABLE_SIZE 10
+#endif
+#if RH_ROUTING_TABLE_SIZE > 255
+#error RH_ROUTING_TABLE_SIZE must be 255 or less
+#endif
+
+// Marks an unused entry in the routing table index and LRU links
+#define RH_ROUTE_NONE 0xff
+
+// Size of the hash index from destination address to routing table entry. 
+// Must be larger than RH_ROUTING_TABLE_SIZE, so that no entry is ever evicted from it
+#ifndef RH_ROUTE_INDEX_SIZE
+#define RH_ROUTE_INDEX_SIZE (2 * RH_ROUTING_TABLE_SIZE)
+#endif
+#if RH_ROUTE_INDEX_SIZE <= RH_ROUTING_TABLE_SIZE
+#error RH_ROUTE_INDEX_SIZE must be larger than RH_ROUTING_TABLE_SIZE
+#endif
+
+// Number of ranked next hops kept for each destination: the primary and its backups
+#ifndef RH_ROUTER_NEXT_HOPS
+#define RH_ROUTER_NEXT_HOPS 3
+#endif
+
+// Initial delivery score of a next hop learned from route discovery, and of a backup next hop,
+// out of 255. See RHRouter::RoutingTableEntry
+#define RH_ROUTER_PRIMARY_SCORE 192
+#define RH_ROUTER_BACKUP_SCORE  128
+
+// Store-and-forward queue: total number of messages that can be held, which caps its memory use
+// at about RH_ROUTER_FORWARD_QUEUE_SIZE * RH_MAX_MESSAGE_LEN bytes
+#ifndef RH_ROUTER_FORWARD_QUEUE_SIZE
+#define RH_ROUTER_FORWARD_QUEUE_SIZE 8
+#endif
+
+// Store-and-forward queue: maximum number of messages held for any one next hop
+#ifndef RH_ROUTER_FORWARD_QUEUE_PER_HOP
+#define RH_ROUTER_FORWARD_QUEUE_PER_HOP 4
+#endif
+
+// Store-and-forward queue: first retry delay in milliseconds, doubled after each failed retry
+#define RH_ROUTER_FORWARD_BACKOFF 1000
+
+// Store-and-forward queue: default age in milliseconds after which a held message is dropped
+#define RH_ROUTER_FORWARD_MAX_AGE 60000
+
+// Store-and-forward queue: default number of timed retries before a held message is dropped
+#define RH_ROUTER_FORWARD_MAX_RETRIES 6
+
+// Routed message flag: the sender wants an end-to-end delivery receipt from the destination
+#define RH_ROUTER_FLAGS_E2E_ACK     0x80
+
+// Routed message flag: this message is an end-to-end delivery receipt
+#define RH_ROUTER_FLAGS_E2E_RECEIPT 0x40
+
+// Number of messages sent with RH_ROUTER_FLAGS_E2E_ACK that can await receipts at once
+#ifndef RH_ROUTER_E2E_PENDING
+#define RH_ROUTER_E2E_PENDING 8
+#endif
+
+// Number of (source, id) pairs remembered by a destination to suppress duplicate end-to-end deliveries
+#ifndef RH_ROUTER_E2E_DEDUP_SIZE
+#define RH_ROUTER_E2E_DEDUP_SIZE 16
+#endif
+
+// Default time in milliseconds to wait for an end-to-end delivery receipt
+#define RH_ROUTER_E2E_TIMEOUT 10000
+
+// Default time in milliseconds after which a route learned by RHMesh that has been neither used nor
+// refreshed expires. RHRouter routes, which are set by hand, do not expire unless setRouteLifetime() is called
+#ifndef RH_DEFAULT_ROUTE_LIFETIME
+#define RH_DEFAULT_ROUTE_LIFETIME 300000
+#endif
 
 // Error codes
 #define RH_ROUTER_ERROR_NONE              0
@@ -22,6 +97,7 @@
 #define RH_ROUTER_ERROR_TIMEOUT           3
 #define RH_ROUTER_ERROR_NO_REPLY          4
 #define RH_ROUTER_ERROR_UNABLE_TO_DELIVER 5
+#define RH_ROUTER_ERROR_QUEUED            6
 
 // This size of RH_ROUTER_MAX_MESSAGE_LEN is OK for Arduino Mega, but too big for
 // Duemilanove. Size of 50 works with the sample router programs on Duemilanove.
@@ -90,9 +166,50 @@
 /// You can also use addRouteTo() to change a route and 
 /// deleteRouteTo() to delete a route at run time. Youcan also clear the entire routing table
 ///
-/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 10)
-/// if more than RH_ROUTING_TABLE_SIZE are added, the oldest (first) one will be removed by calling 
-/// retireOldestRoute()
+/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which defaults to 10
+/// and may be set at build time up to 255).
+/// if more than RH_ROUTING_TABLE_SIZE are added, the least recently used one will be removed by calling 
+/// retireOldestRoute(). A route counts as used when it is learned or refreshed with addRouteTo(), 
+/// and when route() successfully sends traffic over it.
+/// Routes are found through an index by destination address, so lookups take the same time
+/// however large the table is.
+///
+/// Each route has up to RH_ROUTER_NEXT_HOPS candidate next hops: the primary set by addRouteTo(), and backups
+/// learned with addBackupRouteTo() (for example when traffic from the destination arrives through another neighbour). 
+/// If delivery through the primary fails, route() fails over to the next candidate straight away, 
+/// rather than giving up. Each candidate has a moving average of its delivery success, and the 
+/// candidates are re-ranked by it after every attempt. A failure always drops a candidate behind the 
+/// next one, however good its record, so the next message goes to the best backup first.
+///
+/// Optionally (see setStoreAndForward()), a message being forwarded for another node that cannot be delivered to 
+/// any next hop is held in a small queue for its primary next hop instead of being dropped. 
+/// The queue is retried with exponential backoff from RH_ROUTER_FORWARD_BACKOFF ms, and made due at once 
+/// whenever any message is received from that next hop, since it is evidently awake and in range again.
+/// Held messages are sent one per call of recvfromAck(), so receiving is never held up by more than one 
+/// hop by hop delivery, and recvfromAckTimeout() wakes up when a retry falls due.
+/// Messages are dropped after RH_ROUTER_FORWARD_MAX_RETRIES timed retries or once older than the maximum age.
+/// This suits intermittently connected networks with sleeping nodes. Messages from this node itself
+/// are never queued: sendtoWait() reports the failure to the caller as before.
+///
+/// Delivery to the next hop says nothing about delivery to a distant destination. If a message is sent 
+/// with RH_ROUTER_FLAGS_E2E_ACK, the destination answers with a delivery receipt: a routed message with no 
+/// payload, RH_ROUTER_FLAGS_E2E_RECEIPT and the id of the message it acknowledges, sent back along the 
+/// reverse route. sendtoWait() does not wait for it. Instead the application polls deliveryReceipt() 
+/// for completed deliveries and their round trip times. Receipts are consumed by recvfromAck() and 
+/// never delivered to the application. The destination remembers the (source, id) of recent acknowledged 
+/// messages, so a retransmission whose receipt was lost is acknowledged again but not delivered twice.
+/// Applications should therefore keep their own flags within RH_FLAGS_APPLICATION_SPECIFIC.
+///
+/// Each RHRouter has its own message buffer, so several instances (eg on different radios) can 
+/// be used in one process. Subclasses build their messages in place in that buffer (see payload())
+/// and receive them as slices of it (see recvSlice()), so a message is not copied between layers.
+///
+/// Routes can be made to expire if they are not used or refreshed for a route lifetime (see setRouteLifetime()).
+/// RHRouter routes never expire by default, since they are set by hand with addRouteTo(), but RHMesh, 
+/// which learns its routes, gives them a lifetime of RH_DEFAULT_ROUTE_LIFETIME.
+/// A route is refreshed whenever a message from its destination arrives through its next hop, 
+/// so routes that carry traffic in either direction stay alive, while stale ones are 
+/// dropped before they cost a full retry cycle of airtime.
 ///
 /// \par Message Format
 ///
@@ -134,10 +251,10 @@ class RHRouter : public RHReliableDatagram
 public:
 
     /// Defines the structure of the RHRouter message header, used to keep track of end-to-end delivery parameters
-    typedef struct
+    typedef struct RH_PACKED
     {
-	uint8_t    dest;       ///< Destination node address
-	uint8_t    source;     ///< Originator node address
+	RHAddress  dest;       ///< Destination node address
+	RHAddress  source;     ///< Originator node address
 	uint8_t    hops;       ///< Hops traversed so far
 	uint8_t    id;         ///< Originator sequence number
 	uint8_t    flags;      ///< Originator flags
@@ -145,7 +262,7 @@ public:
     } RoutedMessageHeader;
 
     /// Defines the structure of a RHRouter message
-    typedef struct
+    typedef struct RH_PACKED
     {
 	RoutedMessageHeader header;    ///< end-to-end delivery header
 	uint8_t             data[RH_ROUTER_MAX_MESSAGE_LEN]; ///< Application payload data
@@ -155,22 +272,25 @@ public:
     typedef enum
     {
 	Invalid = 0,           ///< No valid route is known
-	Discovering,           ///< Discovering a route (not currently used)
+	Discovering,           ///< Discovering a route. Not used for sending
 	Valid                  ///< Route is valid
     } RouteState;
 
     /// Defines an entry in the routing table
     typedef struct
     {
-	uint8_t      dest;      ///< Destination node address
-	uint8_t      next_hop;  ///< Send via this next hop address
+	RHAddress    dest;      ///< Destination node address
+	RHAddress    next_hop;  ///< Send via this next hop address
 	uint8_t      state;     ///< State of this route, one of RouteState
+	uint32_t     lastUsed;  ///< millis() when the route was last learned, refreshed or used to send traffic
+	RHAddress    hops[RH_ROUTER_NEXT_HOPS];  ///< Candidate next hops, best first, so hops[0] == next_hop. RH_BROADCAST_ADDRESS if unused
+	uint8_t      score[RH_ROUTER_NEXT_HOPS]; ///< Moving average of delivery success through each candidate, 0 to 255
     } RoutingTableEntry;
 
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHRouter(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHRouter(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Initialises this instance and the radio module connected to it.
     /// Overrides the init() function in RH.
@@ -185,26 +305,94 @@ public:
     void setMaxHops(uint8_t max_hops);
 
     /// Adds a route to the local routing table, or updates it if already present.
-    /// If there is not enough room the oldest (first) route will be deleted by calling retireOldestRoute().
+    /// If there is not enough room the least recently used route will be deleted by calling retireOldestRoute().
     /// \param [in] dest The destination node address. RH_BROADCAST_ADDRESS is permitted.
     /// \param [in] next_hop The address of the next hop to send messages destined for dest
     /// \param [in] state The satte of the route. Defaults to Valid
-    void addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state = Valid);
+    void addRouteTo(RHAddress dest, RHAddress next_hop, uint8_t state = Valid);
+
+    /// Adds a backup next hop to an existing route, to be tried if the better ranked ones fail.
+    /// If the table is full of candidates, the worst ranked one is replaced if it is doing worse than
+    /// RH_ROUTER_BACKUP_SCORE.
+    /// \param [in] dest The destination node address
+    /// \param [in] next_hop The backup next hop
+    /// \return true if next_hop is now a candidate for dest
+    bool addBackupRouteTo(RHAddress dest, RHAddress next_hop);
 
     /// Finds and returns a RoutingTableEntry for the given destination node
     /// \param [in] dest The desired destination node address.
     /// \return pointer to a RoutingTableEntry for dest
-    RoutingTableEntry* getRouteTo(uint8_t dest);
+    RoutingTableEntry* getRouteTo(RHAddress dest);
 
     /// Deletes from the local routing table any route for the destination node.
     /// \param [in] dest The destination node address
     /// \return true if the route was present
-    bool deleteRouteTo(uint8_t dest);
+    bool deleteRouteTo(RHAddress dest);
 
-    /// Deletes the oldest (first) route from the 
+    /// Deletes the least recently used route from the 
     /// local routing table
     void retireOldestRoute();
 
+    /// Sets how long a route lives without being used or refreshed
+    /// \param [in] lifetime Lifetime in milliseconds. 0 means routes never expire. 
+    /// Defaults to 0, or to RH_DEFAULT_ROUTE_LIFETIME in RHMesh
+    void setRouteLifetime(uint32_t lifetime);
+
+    /// Deletes all routes that have outlived the route lifetime. This is called automatically by 
+    /// recvfromAck() and getRouteTo(), but may also be called from an idle loop.
+    void expireRoutes();
+
+    /// Refreshes the route to dest if it goes via the given next hop, for example because a message from dest
+    /// has just been received from that next hop.
+    /// \param [in] dest The destination node address
+    /// \param [in] next_hop The node the evidence came from
+    /// \return true if a route was refreshed
+    bool refreshRouteTo(RHAddress dest, RHAddress next_hop);
+
+    /// Enables or disables store-and-forward of messages routed through this node.
+    /// Disabling it drops any messages being held.
+    /// \param [in] enable true to hold undeliverable messages for later retries. Defaults to false
+    /// \param [in] maxAge Age in milliseconds after which held messages are dropped
+    void setStoreAndForward(bool enable, uint32_t maxAge = RH_ROUTER_FORWARD_MAX_AGE);
+
+    /// Drops held messages that are too old, and retries the first held message that is due, if any.
+    /// The retry blocks until the next hop acknowledges it or the retries run out, so each call blocks for
+    /// at most one hop by hop delivery. Called by recvfromAck() and recvfromAckTimeout(), so need only be 
+    /// called directly if neither is being called often.
+    void serviceForwardQueue();
+
+    /// \return The time in ms until serviceForwardQueue() next has a held message to retry, 
+    /// or 0xffffffff if there is none
+    uint32_t forwardDue();
+
+    /// \return The number of messages currently held for forwarding
+    uint8_t forwardQueueLength();
+
+    /// \return The number of held messages dropped because of age or retries
+    uint16_t forwardDropped();
+
+    /// \return The end-to-end id given to the last message sent by this node. Use it to match 
+    /// a message sent with RH_ROUTER_FLAGS_E2E_ACK to its receipt
+    uint8_t lastSentId();
+
+    /// Returns a completed end-to-end delivery, if any. Does not block.
+    /// Also discards messages that have waited longer than the receipt timeout.
+    /// \param [out] dest If not NULL, set to the destination that confirmed delivery
+    /// \param [out] id If not NULL, set to the end-to-end id of the delivered message
+    /// \param [out] rtt If not NULL, set to the time in milliseconds from sending to receipt
+    /// \return true if a delivery receipt was available
+    bool deliveryReceipt(RHAddress* dest = NULL, uint8_t* id = NULL, uint32_t* rtt = NULL);
+
+    /// \return The number of messages still awaiting delivery receipts
+    uint8_t deliveriesPending();
+
+    /// \return The number of messages whose delivery receipts never arrived
+    uint16_t deliveryTimeouts();
+
+    /// Sets how long to wait for an end-to-end delivery receipt
+    /// \param [in] timeout Time in milliseconds. Defaults to RH_ROUTER_E2E_TIMEOUT
+    void setDeliveryTimeout(uint32_t timeout);
+
     /// Clears all entries from the 
     /// local routing table
     void clearRoutingTable();
@@ -223,13 +411,14 @@ public:
     /// \param [in] dest The destination node address
     /// \param [in] flags Optional flags for use by subclasses or application layer, 
     ///             delivered end-to-end to the dest address. The receiver can recover the flags with recvFromAck().
+    ///             Include RH_ROUTER_FLAGS_E2E_ACK to request a delivery receipt from dest (see deliveryReceipt())
     /// \return The result code:
     ///         - RH_ROUTER_ERROR_NONE Message was routed and delivered to the next hop 
     ///           (not necessarily to the final dest address)
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
-    uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+    uint8_t sendtoWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags = 0);
 
     /// Similar to sendtoWait() above, but spoofs the source address.
     /// For internal use only during routing
@@ -245,7 +434,7 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Noyt able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
-    uint8_t sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags = 0);
+    uint8_t sendtoFromSourceWait(uint8_t* buf, uint8_t len, RHAddress dest, RHAddress source, uint8_t flags = 0);
 
     /// Starts the receiver if it is not running already.
     /// If there is a valid message available for this node (or RH_BROADCAST_ADDRESS), 
@@ -267,7 +456,7 @@ public:
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was recvived for this node copied to buf
-    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
@@ -281,7 +470,7 @@ public:
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
 protected:
 
@@ -299,10 +488,67 @@ protected:
     /// \param [in] messageLen Length of message in octets
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
+    /// Returns the payload area of this router's message buffer. A subclass can build its message 
+    /// there and pass it to sendtoWait() or sendtoFromSourceWait(), which then do not copy it.
+    /// The contents are only valid until the next send or receive.
+    /// \return Pointer to RH_ROUTER_MAX_MESSAGE_LEN octets
+    uint8_t* payload() { return _tmpMessage.data; }
+
+    /// Like recvfromAck(), but instead of copying the message out, returns a pointer to it 
+    /// in this router's message buffer (see payload()).
+    /// \param[out] data Set to the start of the received message
+    /// \param[out] len Set to the length of the received message
+    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a valid message was received for this node
+    bool recvSlice(uint8_t** data, uint8_t* len, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
     /// Deletes a specific rout entry from therouting table
     /// \param [in] index The 0 based index of the routing table entry to delete
     void deleteRoute(uint8_t index);
 
+    /// Marks a routing table entry as the most recently used
+    /// \param [in] index The 0 based index of the routing table entry
+    void touchRoute(uint8_t index);
+
+    /// Updates the delivery score of a candidate next hop and re-ranks the candidates
+    /// \param [in] index The 0 based index of the routing table entry
+    /// \param [in] candidate The index of the next hop in hops[]
+    /// \param [in] delivered true if delivery through the next hop succeeded
+    void scoreNextHop(uint8_t index, uint8_t candidate, bool delivered);
+
+    /// Unlinks a routing table entry from the LRU list
+    void unlinkRoute(uint8_t index);
+
+    /// \return The index of the routing table entry for dest, or RH_ROUTE_NONE if there is none
+    uint8_t routeIndex(RHAddress dest);
+
+    /// Holds an undeliverable message for later forwarding to next_hop
+    /// \return true if there was room to hold it
+    bool holdForForward(RoutedMessage* message, uint8_t messageLen, RHAddress next_hop);
+
+    /// Makes every held message for next_hop due at once, for serviceForwardQueue() to send one per call
+    void drainForwardQueue(RHAddress next_hop);
+
+    /// Sends one held message
+    /// \return true if it was delivered to its next hop
+    bool sendHeld(uint8_t slot);
+
+    /// Remembers that a message to dest is awaiting an end-to-end receipt
+    void awaitReceipt(RHAddress dest, uint8_t id);
+
+    /// Handles a receipt from source for message id
+    void receiptReceived(RHAddress source, uint8_t id);
+
+    /// Sends a delivery receipt to source for message id
+    void sendReceipt(RHAddress source, uint8_t id);
+
+    /// Records an acknowledged message from source
+    /// \return true if it has been seen before
+    bool seenMessage(RHAddress source, uint8_t id);
+
     /// The last end-to-end sequence number to be used
     /// Defaults to 0
     uint8_t _lastE2ESequenceNumber;
@@ -311,13 +557,75 @@ protected:
     /// If a routed message would exceed this number of hops it is dropped and ignored.
     uint8_t              _max_hops;
 
+    /// Route lifetime in milliseconds, 0 for no expiry
+    uint32_t             _routeLifetime;
+
+    /// \brief A message held for forwarding
+    typedef struct
+    {
+	bool                 active;    ///< true if this slot holds a message
+	RHAddress            next_hop;  ///< The next hop it is waiting for
+	uint8_t              len;       ///< Length of message
+	uint8_t              retries;   ///< Timed retries so far
+	uint32_t             held;      ///< millis() when it was first held
+	uint32_t             nextTry;   ///< millis() of the next timed retry
+	RoutedMessage        message;   ///< The message
+    } ForwardSlot;
+
+    /// true if store-and-forward is enabled
+    bool                 _storeAndForward;
+
+    /// Maximum age of held messages in milliseconds
+    uint32_t             _forwardMaxAge;
+
+    /// Number of held messages dropped
+    uint16_t             _forwardDropped;
+
+    /// Held messages
+    ForwardSlot          _forwardQueue[RH_ROUTER_FORWARD_QUEUE_SIZE];
+
+    /// \brief A message awaiting an end-to-end receipt
+    typedef struct
+    {
+	uint8_t              state;     ///< 0 free, 1 awaiting receipt, 2 delivered
+	RHAddress            dest;      ///< Where it was sent
+	uint8_t              id;        ///< Its end-to-end id
+	uint32_t             time;      ///< millis() when it was sent, or the round trip time once delivered
+    } PendingReceipt;
+
+    /// Messages awaiting receipts
+    PendingReceipt       _receipts[RH_ROUTER_E2E_PENDING];
+
+    /// Receipt timeout in milliseconds
+    uint32_t             _deliveryTimeout;
+
+    /// Number of receipts that never arrived
+    uint16_t             _deliveryTimeouts;
+
+    /// Recently seen (source, id) pairs of acknowledged messages, as source << 8 | id
+    uint32_t             _seen[RH_ROUTER_E2E_DEDUP_SIZE];
+
+    /// Next entry in _seen to overwrite
+    uint8_t              _seenNext;
+
 private:
 
-    /// Temporary mesage buffer
-    static RoutedMessage _tmpMessage;
+    /// Message buffer
+    RoutedMessage        _tmpMessage;
 
     /// Local routing table
     RoutingTableEntry    _routes[RH_ROUTING_TABLE_SIZE];
+
+    /// Index into _routes by destination address
+    RHPeerTable<uint8_t, RH_ROUTE_INDEX_SIZE> _routeIndex;
+
+    /// Doubly linked list of the entries in use, most recently used first.
+    /// Unused entries are kept on a free list through _lruNext
+    uint8_t              _lruPrev[RH_ROUTING_TABLE_SIZE];
+    uint8_t              _lruNext[RH_ROUTING_TABLE_SIZE];
+    uint8_t              _lruHead;
+    uint8_t              _lruTail;
+    uint8_t              _freeHead;
 };
 
 /// @example rf22_router_client.pde
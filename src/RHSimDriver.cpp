@@ -0,0 +1,384 @@
+// RHSimDriver.cpp
+//
+// Simulated LoRa radio driver for RHSimNetwork
+
+#include <RHSimDriver.h>
+#include <RHSimNetwork.h>
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHSimDriver::RHSimDriver(RHSimNetwork& network)
+    :
+    _network(network),
+    _node(0),
+    _sf(7),
+    _bw(125000),
+    _cr(5),
+    _preambleLength(8),
+    _frequency(868.0),
+    _power(13),
+    _lastSNR(RH_SNR_UNKNOWN),
+    _lastRxTime(0),
+    _bufLen(0),
+    _rxBufValid(false),
+    _sfScanHome(7),
+    _sfScanTimeout(8)
+{
+}
+
+bool RHSimDriver::init()
+{
+    if (!RHGenericDriver::init())
+	return false;
+    setModeIdle();
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+bool RHSimDriver::available()
+{
+    if (_sfScanMask)
+	return scan(RH_SIM_POLL_TIME);
+    if (_mode != RHModeTx)
+    {
+	if (_rxBufValid)
+	    return true;
+	setModeRx();
+    }
+    // Nothing yet: let virtual time pass, as it would while polling real hardware
+    _network.sleep(RH_SIM_POLL_TIME, RH_SIM_WAKE_RX | RH_SIM_WAKE_TX);
+    return _mode != RHModeTx && _rxBufValid;
+}
+
+bool RHSimDriver::recv(uint8_t* buf, uint8_t* len)
+{
+    if (!available())
+	return false;
+    if (buf && len)
+    {
+	uint8_t bufLen = _bufLen - RH_SIM_HEADER_LEN;
+	if (*len > bufLen)
+	    *len = bufLen;
+	memcpy(buf, _buf + RH_SIM_HEADER_LEN, *len);
+    }
+    _rxBufValid = false;
+    return true;
+}
+
+bool RHSimDriver::send(const uint8_t* data, uint8_t len)
+{
+    if (len > RH_SIM_MAX_MESSAGE_LEN)
+	return false;
+
+    waitPacketSent(); // Make sure we dont interrupt an outgoing message
+    pauseSFScan();
+    if (!waitCAD())
+	return false;  // Check channel activity
+
+    // Header MSB first, as RH_RF95 sends it
+    uint8_t frame[RH_SIM_FIFO_SIZE];
+    uint8_t i = 0;
+#ifdef RH_WIDE_ADDRESSES
+    frame[i++] = _txHeaderTo >> 8;
+#endif
+    frame[i++] = _txHeaderTo;
+#ifdef RH_WIDE_ADDRESSES
+    frame[i++] = _txHeaderFrom >> 8;
+#endif
+    frame[i++] = _txHeaderFrom;
+    frame[i++] = _txHeaderId;
+    frame[i++] = _txHeaderFlags;
+    memcpy(frame + i, data, len);
+
+    _rxBufValid = false;
+    _mode = RHModeTx;
+    _network.startTransmit(_node, frame, RH_SIM_HEADER_LEN + len, timeOnAir(len));
+    return true;
+}
+
+uint8_t RHSimDriver::maxMessageLength()
+{
+    return RH_SIM_MAX_MESSAGE_LEN;
+}
+
+void RHSimDriver::waitAvailable()
+{
+    if (_sfScanMask)
+    {
+	scan(RH_SIM_FOREVER);
+	return;
+    }
+    while (true)
+    {
+	if (_mode != RHModeTx)
+	{
+	    if (_rxBufValid)
+		return;
+	    setModeRx();
+	}
+	_network.sleep(RH_SIM_FOREVER, RH_SIM_WAKE_RX | RH_SIM_WAKE_TX);
+    }
+}
+
+bool RHSimDriver::waitAvailableTimeout(uint16_t timeout)
+{
+    if (_sfScanMask)
+	return scan((uint64_t)timeout * 1000);
+    uint64_t deadline = _network.nodeMicros(_node) + (uint64_t)timeout * 1000;
+    while (true)
+    {
+	if (_mode != RHModeTx)
+	{
+	    if (_rxBufValid)
+		return true;
+	    setModeRx();
+	}
+	uint64_t now = _network.nodeMicros(_node);
+	if (now >= deadline)
+	    return false;
+	_network.sleep(deadline - now, RH_SIM_WAKE_RX | RH_SIM_WAKE_TX);
+    }
+}
+
+bool RHSimDriver::waitPacketSent()
+{
+    while (_mode == RHModeTx)
+	_network.sleep(RH_SIM_FOREVER, RH_SIM_WAKE_TX);
+    return true;
+}
+
+bool RHSimDriver::waitPacketSent(uint16_t timeout)
+{
+    uint64_t deadline = _network.nodeMicros(_node) + (uint64_t)timeout * 1000;
+    while (_mode == RHModeTx)
+    {
+	uint64_t now = _network.nodeMicros(_node);
+	if (now >= deadline)
+	    return false;
+	_network.sleep(deadline - now, RH_SIM_WAKE_TX);
+    }
+    return true;
+}
+
+bool RHSimDriver::isChannelActive()
+{
+    pauseSFScan();
+    setModeIdle();
+    _mode = RHModeCad;
+    _network.sleep(cadTime());
+    _cad = _network.channelActive(_node);
+    _mode = RHModeIdle;
+    return _cad;
+}
+
+uint32_t RHSimDriver::cadTime()
+{
+    return 2 * symbolTime();
+}
+
+bool RHSimDriver::setSFScan(uint16_t sfMask, uint16_t preamble)
+{
+    if (_sfScanMask)
+    {
+	pauseSFScan();
+	_sfScanMask = 0;
+    }
+    if (!sfMask)
+	return true;
+
+    if (!preamble)
+	preamble = _preambleLength;
+    bool covered = planSFScan(sfMask, preamble, ((uint64_t)1000000 << RH_SF_SCAN_MIN) / _bw, 2);
+    if (!_sfScanMask)
+	return false;
+    _sfScanHome = _sf;
+    _sfScanTimeout = preamble;
+    setModeIdle();
+    return covered;
+}
+
+bool RHSimDriver::sleep()
+{
+    _network.abortReception(_node);
+    _mode = RHModeSleep;
+    return true;
+}
+
+int RHSimDriver::lastSNR()
+{
+    return _lastSNR;
+}
+
+void RHSimDriver::setModeRx()
+{
+    if (_mode == RHModeRx)
+	return;
+    _mode = RHModeRx;
+    // A receiver that starts listening during a preamble can still lock onto it, as a reply sent
+    // the moment the frame it answers ends must be heard by its sender turning round from transmit
+    _network.lockOnAir(_node, RH_SF_SCAN_LOCK_SYMBOLS);
+}
+
+void RHSimDriver::setModeIdle()
+{
+    if (_mode == RHModeRx)
+	_network.abortReception(_node);
+    if (_mode != RHModeTx)
+	_mode = RHModeIdle;
+}
+
+void RHSimDriver::setModemParams(uint8_t sf, long bw, uint8_t cr)
+{
+    _sf = sf;
+    _bw = bw;
+    _cr = cr;
+}
+
+bool RHSimDriver::setLinkParams(uint8_t sf, long bw, int8_t power)
+{
+    if (sf == _sf && bw == _bw && power == _power)
+	return false;
+    _sf = sf;
+    _bw = bw;
+    _power = power;
+    return true;
+}
+
+void RHSimDriver::setPreambleLength(uint16_t symbols)
+{
+    _preambleLength = symbols;
+}
+
+void RHSimDriver::setFrequency(float centre)
+{
+    _frequency = centre;
+}
+
+void RHSimDriver::setTxPower(int8_t power)
+{
+    _power = power;
+}
+
+uint32_t RHSimDriver::symbolTime()
+{
+    return (uint32_t)(((uint64_t)1000000 << _sf) / _bw);
+}
+
+// Same formula as RH_RF95::timeOnAir(), with explicit header and CRC on
+uint32_t RHSimDriver::timeOnAir(uint8_t len)
+{
+    uint32_t tsym = symbolTime();
+    int32_t  sf   = _sf;
+    int32_t  cr   = _cr - 4;
+    int32_t  de   = tsym > 16000 ? 1 : 0; // Low data rate optimisation, as RH_RF95 sets it
+    int32_t  pl   = len + RH_SIM_HEADER_LEN;
+
+    uint32_t preamble = (_preambleLength * tsym) + (17 * tsym) / 4;
+    int32_t num = 8 * pl - 4 * sf + 28 + 16;
+    int32_t den = 4 * (sf - 2 * de);
+    int32_t symbols = 8;
+    if (num > 0)
+	symbols += ((num + den - 1) / den) * (cr + 4);
+
+    return preamble + (uint32_t)symbols * tsym;
+}
+
+uint64_t RHSimDriver::lastRxTime()
+{
+    return _lastRxTime;
+}
+
+////////////////////////////////////////////////////////////////////
+// Protected methods
+bool RHSimDriver::receive(const uint8_t* frame, uint8_t len, int16_t rssi, int snr)
+{
+    if (_mode != RHModeRx || len < RH_SIM_HEADER_LEN)
+	return false;
+
+    uint8_t i = 0;
+    RHAddress to = frame[i++];
+#ifdef RH_WIDE_ADDRESSES
+    to = (to << 8) | frame[i++];
+#endif
+    RHAddress from = frame[i++];
+#ifdef RH_WIDE_ADDRESSES
+    from = (from << 8) | frame[i++];
+#endif
+    if (!_promiscuous && to != _thisAddress && to != RH_BROADCAST_ADDRESS)
+	return false; // Not for us: stay listening
+
+    _rxHeaderTo = to;
+    _rxHeaderFrom = from;
+    _rxHeaderId = frame[i++];
+    _rxHeaderFlags = frame[i++];
+    memcpy(_buf, frame, len);
+    _bufLen = len;
+    _lastRssi = rssi;
+    _lastSNR = snr;
+    _lastRxTime = _network.nodeMicros(_node) * 1000;
+    _rxBufValid = true;
+    _rxGood++;
+    // Like RH_RF95, the receiver stops after a good packet until it is asked for the next
+    _mode = RHModeIdle;
+    return true;
+}
+
+void RHSimDriver::transmitted()
+{
+    _txGood++;
+    _mode = RHModeIdle;
+}
+
+bool RHSimDriver::scan(uint64_t duration)
+{
+    uint64_t start = _network.nodeMicros(_node);
+    while (!_rxBufValid)
+    {
+	uint64_t elapsed = _network.nodeMicros(_node) - start;
+	if (elapsed >= duration)
+	    return false;
+	if (_mode == RHModeTx)
+	    _network.sleep(duration == RH_SIM_FOREVER ? RH_SIM_FOREVER : duration - elapsed, RH_SIM_WAKE_TX);
+	else
+	    scanStep();
+    }
+    return true;
+}
+
+void RHSimDriver::scanStep()
+{
+    uint8_t sf = nextScanSF();
+    SFScanStats& stats = _sfScanStats[sf - RH_SF_SCAN_MIN];
+    _sf = sf;
+    _mode = RHModeCad;
+    _network.sleep(cadTime());
+    _mode = RHModeIdle;
+    if (!_network.channelActive(_node))
+	return;
+    sfScanDetected();
+
+    // Single receive: lock onto the frame CAD heard if enough of its preamble is left, else listen out
+    // the symbol timeout in case a new one starts. Once locked, the receiver stays on to the end of the frame
+    _mode = RHModeRx;
+    if (!_network.lockOnAir(_node, RH_SF_SCAN_LOCK_SYMBOLS))
+	_network.sleep((uint64_t)_sfScanTimeout * symbolTime(), RH_SIM_WAKE_RX);
+    uint32_t remaining;
+    while (_mode == RHModeRx && (remaining = _network.receiving(_node)))
+	_network.sleep(remaining + 1, RH_SIM_WAKE_RX);
+    if (_rxBufValid)
+    {
+	stats.received++;
+	_sfScanLastRx = sf;
+    }
+    else
+	setModeIdle();
+}
+
+void RHSimDriver::pauseSFScan()
+{
+    if (!_sfScanMask)
+	return;
+    _sfScanSF = 0;
+    _sf = _sfScanHome;
+}
@@ -0,0 +1,242 @@
+// RHSimDriver.h
+//
+// Simulated LoRa radio driver for RHSimNetwork
+//
+// Lets unmodified RadioHead managers (RHDatagram, RHReliableDatagram, RHRouter, RHMesh)
+// run in a discrete event network simulation on a Linux host.
+
+#ifndef RHSimDriver_h
+#define RHSimDriver_h
+
+#include <RHGenericDriver.h>
+
+// Header octets carried in front of every frame: TO, FROM, ID, FLAGS, as RH_RF95 sends them
+#define RH_SIM_HEADER_LEN (2 + 2 * sizeof(RHAddress))
+
+// Largest frame on air, same as the FIFO of an SX1276
+#define RH_SIM_FIFO_SIZE 255
+
+// Largest message the driver can carry
+#define RH_SIM_MAX_MESSAGE_LEN (RH_SIM_FIFO_SIZE - RH_SIM_HEADER_LEN)
+
+// Virtual time consumed by a call to available() that finds nothing, in microseconds.
+// This is what lets sketches that busy-poll the driver make progress in virtual time.
+#ifndef RH_SIM_POLL_TIME
+#define RH_SIM_POLL_TIME 1000
+#endif
+
+class RHSimNetwork;
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHSimDriver RHSimDriver.h <RHSimDriver.h>
+/// \brief RadioHead driver for a simulated LoRa radio in an RHSimNetwork
+///
+/// Behaves like a half-duplex RH_RF95 in LoRa mode: it has a spreading factor, bandwidth, coding rate,
+/// preamble length, frequency and transmitter power, frames take the LoRa time on air to send, and the
+/// receiver goes idle after each good packet until available() or recv() is called again.
+/// What each receiver hears, with what RSSI and SNR, and whether packets collide, is decided by the RHSimNetwork
+/// the driver is attached to.
+///
+/// The blocking functions (waitAvailableTimeout(), waitPacketSent(), waitCAD() etc) suspend the calling
+/// node's task until something happens in virtual time, rather than spinning, so a simulated network
+/// of hundreds of nodes runs much faster than real time.
+///
+/// Subclass it and override receive() or transmitted() to model other radio behaviour.
+class RHSimDriver : public RHGenericDriver
+{
+public:
+    /// Constructor.
+    /// \param[in] network The network this radio will transmit and receive on
+    RHSimDriver(RHSimNetwork& network);
+
+    /// Initialises the driver. Leaves the radio idle.
+    /// \return true
+    virtual bool init();
+
+    /// Tests whether a new message is available, turning the receiver on if necessary.
+    /// If there is none, consumes RH_SIM_POLL_TIME of virtual time before returning.
+    /// \return true if a new, complete, error-free uncollected message is available to be retrieved by recv().
+    virtual bool available();
+
+    /// If there is a valid message available, copy it to buf and return true
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Pointer to available space in buf. Set to the actual number of octets copied.
+    /// \return true if a valid message was copied to buf
+    virtual bool recv(uint8_t* buf, uint8_t* len);
+
+    /// Waits until any previous transmission is finished, optionally waits for the channel to be clear
+    /// then starts transmitting a message.
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send
+    /// \return true if the message length was valid and the transmission was started
+    virtual bool send(const uint8_t* data, uint8_t len);
+
+    /// \return The maximum message length supported by this driver
+    virtual uint8_t maxMessageLength();
+
+    /// Suspends the node until a message is available
+    virtual void waitAvailable();
+
+    /// Suspends the node until a message is available or a timeout
+    /// \param[in] timeout Maximum time to wait in milliseconds of node time
+    /// \return true if a message is available
+    virtual bool waitAvailableTimeout(uint16_t timeout);
+
+    /// Suspends the node until the current transmission is finished
+    /// \return true
+    virtual bool waitPacketSent();
+
+    /// Suspends the node until the current transmission is finished or a timeout
+    /// \param[in] timeout Maximum time to wait in milliseconds of node time
+    /// \return true if the transmission finished in time
+    virtual bool waitPacketSent(uint16_t timeout);
+
+    /// Channel activity detection. Takes two symbol times of virtual time.
+    /// \return true if a LoRa transmission on our frequency and spreading factor is being heard
+    virtual bool isChannelActive();
+
+    /// \return How long isChannelActive() takes, two symbol times, in microseconds
+    virtual uint32_t cadTime();
+
+    /// Starts or stops scanning several spreading factors for messages, see RHGenericDriver::setSFScan().
+    /// Behaves like RH_RF95: CADs follow each other without a break, and after a detection the receiver
+    /// locks onto the frame if at least RH_SF_SCAN_LOCK_SYMBOLS of its preamble are still to come, else
+    /// listens for a new preamble for the length of the preamble before going back to CAD.
+    /// The scan runs while the node's task is in available(), recv() or one of the wait functions.
+    /// \param[in] sfMask Bit n set to scan spreading factor n, 7 to 12. 0 stops scanning
+    /// \param[in] preamble The shortest preamble the senders use, in symbols. If 0, our own preamble length
+    /// \return false if sfMask holds no spreading factor that can be scanned, or if the scan cannot
+    /// look at every spreading factor before the preamble is over
+    virtual bool setSFScan(uint16_t sfMask, uint16_t preamble = 0);
+
+    /// Sets the radio to low power sleep mode. Any packet being received is lost.
+    /// \return true
+    virtual bool sleep();
+
+    /// \return SNR of the last received message in tenths of a dB
+    virtual int lastSNR();
+
+    /// Turns the receiver on
+    void setModeRx();
+
+    /// Turns the receiver and transmitter off. Any packet being received is lost.
+    void setModeIdle();
+
+    /// Sets the LoRa modem parameters. Only radios with matching frequency, spreading factor and
+    /// bandwidth can hear each other.
+    /// \param[in] sf Spreading factor 6..12
+    /// \param[in] bw Signal bandwidth in Hz
+    /// \param[in] cr Coding rate denominator 5..8, ie 4/5 .. 4/8
+    void setModemParams(uint8_t sf, long bw, uint8_t cr);
+
+    /// Sets the number of preamble symbols sent before each frame. Defaults to 8.
+    void setPreambleLength(uint16_t symbols);
+
+    /// Sets the centre frequency. Defaults to 868.0 MHz
+    /// \param[in] centre Frequency in MHz
+    void setFrequency(float centre);
+
+    /// Sets the transmitter power. Defaults to 13 dBm
+    /// \param[in] power Transmitter power in dBm
+    void setTxPower(int8_t power);
+
+    /// Sets the spreading factor, bandwidth and transmitter power together, as RH_RF95::setLinkParams().
+    /// The coding rate is kept
+    /// \return true if any of them changed
+    virtual bool setLinkParams(uint8_t sf, long bw, int8_t power);
+
+    /// \return The spreading factor
+    virtual uint8_t spreadingFactor() { return _sf; }
+
+    /// \return The signal bandwidth in Hz
+    virtual long signalBandwidth() { return _bw; }
+
+    /// \return The coding rate denominator 5..8
+    uint8_t codingRate() { return _cr; }
+
+    /// \return The centre frequency in MHz
+    float frequency() { return _frequency; }
+
+    /// \return The transmitter power in dBm
+    virtual int8_t txPower() { return _power; }
+
+    /// \return The duration of one LoRa symbol in microseconds
+    uint32_t symbolTime();
+
+    /// Computes the time on air of a message with the current modem parameters
+    /// \param[in] len Length of the message, not including the RadioHead header
+    /// \return Time on air in microseconds
+    virtual uint32_t timeOnAir(uint8_t len);
+
+    /// \return When the last received message ended, in ns of this node's clock
+    virtual uint64_t lastRxTime();
+
+    /// \return The index of this radio's node in the network, valid after RHSimNetwork::addNode()
+    uint16_t node() { return _node; }
+
+    /// \return The network this radio belongs to
+    RHSimNetwork& network() { return _network; }
+
+protected:
+    friend class RHSimNetwork;
+
+    /// Called by the network at the end of a frame that this radio received without error.
+    /// Applies address filtering and makes the message available to recv().
+    /// \param[in] frame The frame, header first
+    /// \param[in] len Length of the frame including the header
+    /// \param[in] rssi Received signal strength in dBm
+    /// \param[in] snr Signal to noise ratio in tenths of a dB
+    /// \return true if the message was accepted
+    virtual bool receive(const uint8_t* frame, uint8_t len, int16_t rssi, int snr);
+
+    /// Called by the network when the transmission started by send() has finished
+    virtual void transmitted();
+
+    /// Runs the scan until there is a message or for a time
+    /// \param[in] duration Longest time to scan in microseconds of node time, or RH_SIM_FOREVER
+    /// \return true if a message is available
+    bool scan(uint64_t duration);
+
+    /// One CAD of the scan, and the receive after it if it detects a preamble
+    void scanStep();
+
+    /// Goes back to the configured spreading factor to transmit or run CAD for ourselves
+    void pauseSFScan();
+
+    /// The network we are attached to
+    RHSimNetwork&       _network;
+
+    /// Our index in the network
+    uint16_t            _node;
+
+    /// Modem parameters
+    uint8_t             _sf;
+    long                _bw;
+    uint8_t             _cr;
+    uint16_t            _preambleLength;
+    float               _frequency;
+    int8_t              _power;
+
+    /// SNR of the last received message, tenths of a dB
+    int                 _lastSNR;
+
+    /// When the last received message ended, ns of node time
+    uint64_t            _lastRxTime;
+
+    /// Number of octets in the receive buffer, including the header
+    uint8_t             _bufLen;
+
+    /// The receive buffer, header first
+    uint8_t             _buf[RH_SIM_FIFO_SIZE];
+
+    /// True when there is a valid message in the buffer
+    bool                _rxBufValid;
+
+    /// Spreading factor to go back to when the scan stops or pauses
+    uint8_t             _sfScanHome;
+
+    /// How long the receiver listens for a preamble after a detection while scanning, symbols
+    uint16_t            _sfScanTimeout;
+};
+
+#endif
@@ -0,0 +1,603 @@
+// RHSimNetwork.cpp
+//
+// Discrete event simulator for networks of RadioHead nodes
+
+#include <RHSimNetwork.h>
+#include <math.h>
+#include <sys/time.h>
+
+RHSimNetwork* RHSimNetwork::_current = NULL;
+
+// Monotonic enough for measuring how long run() took
+static uint64_t wallMicros()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int compareLatency(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHSimNetwork::RHSimNetwork(uint32_t seed)
+    :
+    _nodes(NULL),
+    _numNodes(0),
+    _maxNodes(0),
+    _onAir(NULL),
+    _numOnAir(0),
+    _events(NULL),
+    _numEvents(0),
+    _maxEvents(0),
+    _eventSeq(0),
+    _now(0),
+    _running(-1),
+    _random(((uint64_t)seed << 32) ^ 0x9e3779b97f4a7c15ULL),
+    _referenceLoss(RH_SIM_DEFAULT_REFERENCE_LOSS),
+    _pathLossExponent(RH_SIM_DEFAULT_PATH_LOSS_EXPONENT),
+    _shadowing(0),
+    _captureThreshold(RH_SIM_CAPTURE_THRESHOLD),
+    _framesSent(0),
+    _airtime(0),
+    _framesReceived(0),
+    _collisions(0),
+    _captures(0),
+    _aborted(0),
+    _sentTimes(NULL),
+    _messagesSent(0),
+    _maxMessages(0),
+    _messagesDelivered(0),
+    _bytesDelivered(0),
+    _latencies(NULL),
+    _wallTime(0)
+{
+    _current = this;
+    RHClock::setInstance(this);
+}
+
+RHSimNetwork::~RHSimNetwork()
+{
+    uint16_t i;
+    for (i = 0; i < _numNodes; i++)
+    {
+	free(_nodes[i]->stack);
+	delete _nodes[i];
+    }
+    free(_nodes);
+    free(_onAir);
+    free(_events);
+    free(_sentTimes);
+    free(_latencies);
+    if (_current == this)
+	_current = NULL;
+    if (RHClock::instance() == this)
+	RHClock::setInstance(NULL);
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+uint16_t RHSimNetwork::addNode(RHSimDriver& driver, float x, float y, RHSimTask task, void* arg)
+{
+    if (_numNodes == _maxNodes)
+    {
+	_maxNodes = _maxNodes ? _maxNodes * 2 : 16;
+	_nodes = (Node**)realloc(_nodes, _maxNodes * sizeof(Node*));
+	_onAir = (uint16_t*)realloc(_onAir, _maxNodes * sizeof(uint16_t));
+    }
+    // Nodes are never moved once made: a ucontext_t points into itself
+    Node* n = new Node;
+    memset(n, 0, sizeof(Node));
+    n->driver = &driver;
+    n->task = task;
+    n->arg = arg;
+    n->x = x;
+    n->y = y;
+    n->clockOffset = (int64_t)(nextRandom() % 1000000) * 1000;
+    n->clockPpm = random(-RH_SIM_DEFAULT_CLOCK_PPM, RH_SIM_DEFAULT_CLOCK_PPM + 1);
+    n->lockedOn = -1;
+    n->stack = (uint8_t*)malloc(RH_SIM_STACK_SIZE);
+
+    uint16_t index = _numNodes++;
+    _nodes[index] = n;
+    driver._node = index;
+    wakeAt(index, _now);
+    return index;
+}
+
+void RHSimNetwork::setPosition(uint16_t node, float x, float y)
+{
+    _nodes[node]->x = x;
+    _nodes[node]->y = y;
+}
+
+void RHSimNetwork::setClock(uint16_t node, unsigned long offset, int32_t ppm)
+{
+    _nodes[node]->clockOffset = (int64_t)offset * 1000;
+    _nodes[node]->clockPpm = ppm;
+}
+
+void RHSimNetwork::setPathLoss(float reference, float exponent, float shadowing)
+{
+    _referenceLoss = reference;
+    _pathLossExponent = exponent;
+    _shadowing = shadowing;
+}
+
+void RHSimNetwork::setCaptureThreshold(float threshold)
+{
+    _captureThreshold = threshold;
+}
+
+void RHSimNetwork::run(unsigned long duration)
+{
+    uint64_t start = wallMicros();
+    uint64_t end = _now + (uint64_t)duration * 1000;
+    while (_numEvents && _events[0].time <= end)
+    {
+	Event e = nextEvent();
+	_now = e.time;
+	if (e.kind == EventTxEnd)
+	    endTransmit(e.node, e.generation);
+	else if (e.generation == _nodes[e.node]->generation && !_nodes[e.node]->done)
+	    resume(e.node);
+    }
+    _now = end;
+    _wallTime += wallMicros() - start;
+}
+
+uint64_t RHSimNetwork::nodeMicros(uint16_t node)
+{
+    Node* n = _nodes[node];
+    return n->clockOffset + _now + ((int64_t)_now * n->clockPpm) / 1000000;
+}
+
+uint64_t RHSimNetwork::micros()
+{
+    return _running < 0 ? _now : nodeMicros(_running);
+}
+
+void RHSimNetwork::delayMicros(uint64_t us)
+{
+    sleep(us);
+}
+
+void RHSimNetwork::sleep(uint64_t duration, uint8_t wakeOn)
+{
+    if (_running < 0)
+	return;
+    uint16_t index = _running;
+    Node* n = _nodes[index];
+    n->generation++;
+    n->wakeOn = wakeOn;
+    if (duration != RH_SIM_FOREVER)
+    {
+	// Convert from node time to virtual time, rounding up so the node's clock has always
+	// advanced by at least duration when it wakes
+	uint64_t ticks = (duration * 1000000 + (1000000 + n->clockPpm) - 1) / (1000000 + n->clockPpm);
+	schedule(_now + ticks, EventWake, index, n->generation);
+    }
+    swapcontext(&n->context, &_schedulerContext);
+}
+
+long RHSimNetwork::random(long min, long max)
+{
+    if (max <= min)
+	return min;
+    return min + (long)(nextRandom() % (uint32_t)(max - min));
+}
+
+float RHSimNetwork::pathLoss(uint16_t from, uint16_t to)
+{
+    Node* a = _nodes[from];
+    Node* b = _nodes[to];
+    float dx = a->x - b->x;
+    float dy = a->y - b->y;
+    float d = sqrtf(dx * dx + dy * dy);
+    if (d < 1.0)
+	d = 1.0;
+    float loss = _referenceLoss + 10.0 * _pathLossExponent * log10f(d);
+    if (_shadowing > 0)
+    {
+	// Fixed per link and the same in both directions: derive a normal deviate from a hash of the pair
+	uint32_t lo = from < to ? from : to;
+	uint32_t hi = from < to ? to : from;
+	uint64_t h = ((uint64_t)hi << 16 | lo) * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+	float u1 = ((h & 0xffffff) + 1) / 16777217.0;
+	float u2 = ((h >> 24) & 0xffffff) / 16777216.0;
+	loss += _shadowing * sqrtf(-2.0 * logf(u1)) * cosf(2.0 * M_PI * u2);
+    }
+    return loss;
+}
+
+uint32_t RHSimNetwork::messageSent()
+{
+    if (_messagesSent == _maxMessages)
+    {
+	_maxMessages = _maxMessages ? _maxMessages * 2 : 1024;
+	_sentTimes = (uint64_t*)realloc(_sentTimes, _maxMessages * sizeof(uint64_t));
+	_latencies = (uint32_t*)realloc(_latencies, _maxMessages * sizeof(uint32_t));
+    }
+    _sentTimes[_messagesSent] = _now;
+    return _messagesSent++;
+}
+
+void RHSimNetwork::messageDelivered(uint32_t tag, uint16_t len)
+{
+    if (tag >= _messagesSent || _sentTimes[tag] == RH_SIM_FOREVER)
+	return;
+    _latencies[_messagesDelivered++] = _now - _sentTimes[tag];
+    _bytesDelivered += len;
+    _sentTimes[tag] = RH_SIM_FOREVER;
+}
+
+void RHSimNetwork::printReport(FILE* out)
+{
+    double seconds = _now / 1000000.0;
+    double wall = _wallTime / 1000000.0;
+    fprintf(out, "Simulated %.3f s with %u nodes in %.3f s (%.0fx real time)\n",
+	    seconds, _numNodes, wall, wall > 0 ? seconds / wall : 0);
+    fprintf(out, "Frames: %u sent, %u received, %u lost to collisions, %u received despite overlap, %u lost to half duplex\n",
+	    _framesSent, _framesReceived, _collisions, _captures, _aborted);
+    fprintf(out, "Airtime: %.3f s total, %.1f%% of elapsed time summed over nodes\n",
+	    _airtime / 1000000.0, seconds > 0 ? 100.0 * _airtime / _now : 0);
+    fprintf(out, "Messages: %u sent, %u delivered (%.1f%%)\n", _messagesSent, _messagesDelivered,
+	    _messagesSent ? 100.0 * _messagesDelivered / _messagesSent : 0);
+    fprintf(out, "Throughput: %.2f bytes/s delivered\n", seconds > 0 ? _bytesDelivered / seconds : 0);
+    if (_messagesDelivered)
+    {
+	uint64_t sum = 0;
+	uint32_t i;
+	for (i = 0; i < _messagesDelivered; i++)
+	    sum += _latencies[i];
+	qsort(_latencies, _messagesDelivered, sizeof(uint32_t), compareLatency);
+	fprintf(out, "Latency: mean %.1f ms, median %.1f ms, 95th percentile %.1f ms, max %.1f ms\n",
+		sum / 1000.0 / _messagesDelivered,
+		_latencies[_messagesDelivered / 2] / 1000.0,
+		_latencies[(_messagesDelivered * 95) / 100] / 1000.0,
+		_latencies[_messagesDelivered - 1] / 1000.0);
+	fprintf(out, "Airtime per delivered byte: %.3f ms\n", _airtime / 1000.0 / _bytesDelivered);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+// Radio channel
+void RHSimNetwork::startTransmit(uint16_t node, const uint8_t* frame, uint8_t len, uint32_t airtime)
+{
+    Node* t = _nodes[node];
+    abortReception(node);
+    t->transmitting = true;
+    t->txSeq++;
+    t->txStart = _now;
+    t->txEnd = _now + airtime;
+    t->txLen = len;
+    memcpy(t->txFrame, frame, len);
+    _onAir[_numOnAir++] = node;
+    _framesSent++;
+    _airtime += airtime;
+    schedule(_now + airtime, EventTxEnd, node, t->txSeq);
+
+    uint32_t preamble = t->driver->_preambleLength * t->driver->symbolTime();
+    uint16_t i;
+    for (i = 0; i < _numNodes; i++)
+    {
+	Node* r = _nodes[i];
+	if (i == node || r->driver->_mode != RHGenericDriver::RHModeRx || !compatible(node, i))
+	    continue;
+	float s = rssi(node, i);
+	bool decodable = s - noiseFloor(i) >= snrFloor(t->driver->_sf);
+	if (r->lockedOn < 0)
+	{
+	    // Idle receiver: locks onto the preamble if it can hear it, but anything already on air may spoil it
+	    if (decodable)
+	    {
+		r->lockedOn = node;
+		r->lockedSeq = t->txSeq;
+		r->lockedRssi = s;
+		r->lockedCorrupt = !clearOfInterference(node, i, s, &r->lockedOverlapped);
+	    }
+	    continue;
+	}
+	Node* q = _nodes[r->lockedOn];
+	if (decodable && s >= r->lockedRssi + _captureThreshold && _now < q->txStart + preamble)
+	{
+	    // Much stronger frame during the preamble of the current one: the receiver switches to it
+	    _collisions++;
+	    r->lockedOn = node;
+	    r->lockedSeq = t->txSeq;
+	    r->lockedRssi = s;
+	    r->lockedCorrupt = !clearOfInterference(node, i, s, &r->lockedOverlapped);
+	    r->lockedOverlapped = true;
+	}
+	else if (r->lockedRssi >= s + _captureThreshold)
+	    r->lockedOverlapped = true; // Current frame survives
+	else
+	    r->lockedCorrupt = true;
+    }
+}
+
+void RHSimNetwork::endTransmit(uint16_t node, uint32_t seq)
+{
+    Node* t = _nodes[node];
+    if (!t->transmitting || t->txSeq != seq)
+	return;
+    t->transmitting = false;
+    uint16_t i;
+    for (i = 0; i < _numOnAir; i++)
+    {
+	if (_onAir[i] == node)
+	{
+	    _onAir[i] = _onAir[--_numOnAir];
+	    break;
+	}
+    }
+
+    for (i = 0; i < _numNodes; i++)
+    {
+	Node* r = _nodes[i];
+	if (r->lockedOn != node || r->lockedSeq != seq)
+	    continue;
+	r->lockedOn = -1;
+	if (r->lockedCorrupt)
+	{
+	    _collisions++;
+	    continue;
+	}
+	_framesReceived++;
+	if (r->lockedOverlapped)
+	    _captures++;
+	float s = r->lockedRssi;
+	if (r->driver->receive(t->txFrame, t->txLen, (int16_t)floorf(s + 0.5), (int)((s - noiseFloor(i)) * 10)))
+	    wakeIf(i, RH_SIM_WAKE_RX);
+    }
+
+    t->driver->transmitted();
+    wakeIf(node, RH_SIM_WAKE_TX);
+}
+
+void RHSimNetwork::abortReception(uint16_t node)
+{
+    Node* r = _nodes[node];
+    if (r->lockedOn >= 0)
+    {
+	r->lockedOn = -1;
+	_aborted++;
+    }
+}
+
+bool RHSimNetwork::channelActive(uint16_t node)
+{
+    uint16_t i;
+    for (i = 0; i < _numOnAir; i++)
+    {
+	uint16_t t = _onAir[i];
+	if (t != node && compatible(t, node)
+	    && rssi(t, node) - noiseFloor(node) >= snrFloor(_nodes[t]->driver->_sf))
+	    return true;
+    }
+    return false;
+}
+
+uint32_t RHSimNetwork::lockOnAir(uint16_t node, uint16_t minSymbols)
+{
+    Node* r = _nodes[node];
+    if (r->lockedOn >= 0)
+	return receiving(node);
+
+    int32_t best = -1;
+    float bestRssi = 0;
+    uint16_t i;
+    for (i = 0; i < _numOnAir; i++)
+    {
+	uint16_t t = _onAir[i];
+	if (t == node || !compatible(t, node))
+	    continue;
+	RHSimDriver* driver = _nodes[t]->driver;
+	uint32_t tsym = driver->symbolTime();
+	float s = rssi(t, node);
+	if (s - noiseFloor(node) < snrFloor(driver->_sf)
+	    || _now + (uint64_t)minSymbols * tsym > _nodes[t]->txStart + (uint64_t)driver->_preambleLength * tsym)
+	    continue;
+	if (best < 0 || s > bestRssi)
+	{
+	    best = t;
+	    bestRssi = s;
+	}
+    }
+    if (best < 0)
+	return 0;
+    r->lockedOn = best;
+    r->lockedSeq = _nodes[best]->txSeq;
+    r->lockedRssi = bestRssi;
+    r->lockedCorrupt = !clearOfInterference(best, node, bestRssi, &r->lockedOverlapped);
+    return receiving(node);
+}
+
+uint32_t RHSimNetwork::receiving(uint16_t node)
+{
+    Node* r = _nodes[node];
+    if (r->lockedOn < 0)
+	return 0;
+    Node* t = _nodes[r->lockedOn];
+    return t->txEnd > _now ? t->txEnd - _now : 0;
+}
+
+float RHSimNetwork::rssi(uint16_t from, uint16_t to)
+{
+    return _nodes[from]->driver->_power - pathLoss(from, to);
+}
+
+bool RHSimNetwork::compatible(uint16_t a, uint16_t b)
+{
+    RHSimDriver* x = _nodes[a]->driver;
+    RHSimDriver* y = _nodes[b]->driver;
+    return x->_sf == y->_sf && x->_bw == y->_bw && fabsf(x->_frequency - y->_frequency) < 0.001;
+}
+
+bool RHSimNetwork::clearOfInterference(uint16_t from, uint16_t to, float rssi, bool* overlapped)
+{
+    *overlapped = false;
+    uint16_t i;
+    for (i = 0; i < _numOnAir; i++)
+    {
+	uint16_t t = _onAir[i];
+	if (t == from || t == to || !compatible(t, to))
+	    continue;
+	*overlapped = true;
+	if (rssi < this->rssi(t, to) + _captureThreshold)
+	    return false;
+    }
+    return true;
+}
+
+float RHSimNetwork::noiseFloor(uint16_t node)
+{
+    return -174.0 + 10.0 * log10f((float)_nodes[node]->driver->_bw) + RH_SIM_NOISE_FIGURE;
+}
+
+float RHSimNetwork::snrFloor(uint8_t sf)
+{
+    // Per SX1276 datasheet table 13, SF6..SF12
+    static const float floors[] = { -5.0, -7.5, -10.0, -12.5, -15.0, -17.5, -20.0 };
+    if (sf < 6)
+	sf = 6;
+    if (sf > 12)
+	sf = 12;
+    return floors[sf - 6];
+}
+
+////////////////////////////////////////////////////////////////////
+// Scheduling
+void RHSimNetwork::wakeAt(uint16_t node, uint64_t time)
+{
+    Node* n = _nodes[node];
+    n->generation++;
+    n->wakeOn = 0;
+    schedule(time, EventWake, node, n->generation);
+}
+
+void RHSimNetwork::wakeIf(uint16_t node, uint8_t events)
+{
+    if (_nodes[node]->wakeOn & events)
+	wakeAt(node, _now);
+}
+
+void RHSimNetwork::schedule(uint64_t time, uint8_t kind, uint16_t node, uint32_t generation)
+{
+    if (_numEvents == _maxEvents)
+    {
+	_maxEvents = _maxEvents ? _maxEvents * 2 : 256;
+	_events = (Event*)realloc(_events, _maxEvents * sizeof(Event));
+    }
+    Event e;
+    e.time = time;
+    e.seq = _eventSeq++;
+    e.generation = generation;
+    e.node = node;
+    e.kind = kind;
+
+    // Sift up
+    uint32_t i = _numEvents++;
+    while (i > 0)
+    {
+	uint32_t parent = (i - 1) / 2;
+	Event& p = _events[parent];
+	if (p.time < e.time || (p.time == e.time && (p.kind < e.kind || (p.kind == e.kind && p.seq < e.seq))))
+	    break;
+	_events[i] = p;
+	i = parent;
+    }
+    _events[i] = e;
+}
+
+RHSimNetwork::Event RHSimNetwork::nextEvent()
+{
+    Event top = _events[0];
+    Event last = _events[--_numEvents];
+
+    // Sift down
+    uint32_t i = 0;
+    while (true)
+    {
+	uint32_t child = 2 * i + 1;
+	if (child >= _numEvents)
+	    break;
+	if (child + 1 < _numEvents)
+	{
+	    Event& a = _events[child];
+	    Event& b = _events[child + 1];
+	    if (b.time < a.time || (b.time == a.time && (b.kind < a.kind || (b.kind == a.kind && b.seq < a.seq))))
+		child++;
+	}
+	Event& c = _events[child];
+	if (last.time < c.time || (last.time == c.time && (last.kind < c.kind || (last.kind == c.kind && last.seq < c.seq))))
+	    break;
+	_events[i] = c;
+	i = child;
+    }
+    if (_numEvents)
+	_events[i] = last;
+    return top;
+}
+
+void RHSimNetwork::resume(uint16_t node)
+{
+    Node* n = _nodes[node];
+    if (!n->started)
+    {
+	n->started = true;
+	getcontext(&n->context);
+	n->context.uc_stack.ss_sp = n->stack;
+	n->context.uc_stack.ss_size = RH_SIM_STACK_SIZE;
+	n->context.uc_link = &_schedulerContext;
+	makecontext(&n->context, taskEntry, 0);
+    }
+    _running = node;
+    swapcontext(&_schedulerContext, &n->context);
+    _running = -1;
+}
+
+void RHSimNetwork::taskEntry()
+{
+    RHSimNetwork* network = _current;
+    Node* n = network->_nodes[network->_running];
+    n->task(*n->driver, n->arg);
+    // Returning resumes the scheduler through uc_link
+    n->done = true;
+}
+
+uint32_t RHSimNetwork::nextRandom()
+{
+    // xorshift64*
+    _random ^= _random >> 12;
+    _random ^= _random << 25;
+    _random ^= _random >> 27;
+    return (uint32_t)((_random * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+////////////////////////////////////////////////////////////////////
+// Arduino functions for sketches running in the simulator. The timing ones are in RHClock
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+SerialSimulator Serial;
+int    _simulator_argc = 0;
+char** _simulator_argv = NULL;
+
+long random(long to)
+{
+    return random(0, to);
+}
+
+long random(long from, long to)
+{
+    RHSimNetwork* network = RHSimNetwork::current();
+    return network ? network->random(from, to) : from;
+}
+#endif
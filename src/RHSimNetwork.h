@@ -0,0 +1,375 @@
+// RHSimNetwork.h
+//
+// Discrete event simulator for networks of RadioHead nodes
+//
+// Runs many RadioHead nodes in one process on virtual time, with simulated LoRa radios
+// (RHSimDriver), a path loss model, collisions computed from overlapping airtime and the
+// LoRa capture effect. Linux only: build without RASPBERRY_PI so RadioHead.h selects RH_PLATFORM_UNIX.
+
+#ifndef RHSimNetwork_h
+#define RHSimNetwork_h
+
+#include <RHSimDriver.h>
+#include <RHClock.h>
+#include <ucontext.h>
+
+// Stack size for each node's task
+#ifndef RH_SIM_STACK_SIZE
+#define RH_SIM_STACK_SIZE 65536
+#endif
+
+// A signal this many dB stronger than all the others overlapping it is still received
+#ifndef RH_SIM_CAPTURE_THRESHOLD
+#define RH_SIM_CAPTURE_THRESHOLD 6.0
+#endif
+
+// Default path loss at 1 metre, dB. Free space at 868 MHz
+#define RH_SIM_DEFAULT_REFERENCE_LOSS 31.2
+
+// Default path loss exponent. 2 is free space, 2.7 to 3.5 is typical of suburban and urban LoRa links
+#define RH_SIM_DEFAULT_PATH_LOSS_EXPONENT 2.9
+
+// Receiver noise figure, dB
+#define RH_SIM_NOISE_FIGURE 6.0
+
+// Default maximum random crystal error given to each node's clock, ppm
+#ifndef RH_SIM_DEFAULT_CLOCK_PPM
+#define RH_SIM_DEFAULT_CLOCK_PPM 20
+#endif
+
+// Flags for RHSimNetwork::sleep(): what ends a sleep early
+#define RH_SIM_WAKE_RX 0x01
+#define RH_SIM_WAKE_TX 0x02
+
+// Sleep without a time limit
+#define RH_SIM_FOREVER 0xffffffffffffffffULL
+
+/// Function run as the main program of a simulated node.
+/// It usually initialises a manager for the driver and then loops forever.
+/// \param[in] driver The node's radio
+/// \param[in] arg The argument given to RHSimNetwork::addNode()
+typedef void (*RHSimTask)(RHSimDriver& driver, void* arg);
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHSimNetwork RHSimNetwork.h <RHSimNetwork.h>
+/// \brief Discrete event simulation of a network of RadioHead nodes on virtual time
+///
+/// Each node is an RHSimDriver at a position in the plane, with a task function that runs as the node's
+/// main program. The task runs as a coroutine with its own stack, so ordinary blocking RadioHead code
+/// (RHMesh::sendtoWait(), recvfromAckTimeout() and so on) works unchanged. Whenever a node blocks in the
+/// driver or calls delay(), its task is suspended and the simulator jumps straight to the next event in
+/// virtual time, so long idle periods cost nothing and the simulation runs far faster than real time.
+///
+/// Each node has its own clock, with an offset and a crystal error in ppm, and millis() called from a
+/// node's task reads that node's clock. random() is deterministic for a given seed, so runs are repeatable.
+///
+/// Radio model:
+/// - Received power is transmitter power less pathLoss(), which by default is a log distance model with
+///   optional log-normal shadowing fixed per link. Subclass and override pathLoss() for other models.
+/// - A frame can only be received by an idle receiver that is listening (RHModeRx) when its preamble starts,
+///   on the same frequency, spreading factor and bandwidth, with an SNR above the demodulation floor for
+///   the spreading factor.
+/// - Frames overlapping in time at a receiver collide unless one is at least RH_SIM_CAPTURE_THRESHOLD dB
+///   stronger than the other (the capture effect). A stronger frame arriving during the preamble of the
+///   one being received takes over the receiver; one arriving later can only destroy it.
+/// - Radios are half duplex: transmitting or leaving receive mode loses the frame being received.
+/// - Different spreading factors are treated as orthogonal.
+///
+/// The application can report end to end traffic with messageSent() and messageDelivered(), and
+/// printReport() summarises delivery ratio, throughput, latency and airtime per delivered byte.
+///
+/// The network is an RHClock and installs itself with RHClock::setInstance() while it exists, which is how
+/// millis() and delay() reach it. So only one RHSimNetwork may exist at a time.
+///
+/// \code
+/// RHSimNetwork network(1);
+/// for (i = 0; i < 100; i++)
+/// {
+///     RHSimDriver* driver = new RHSimDriver(network);
+///     network.addNode(*driver, x[i], y[i], nodeTask, new RHMesh(*driver, i + 1));
+/// }
+/// network.run(3600000); // One hour
+/// network.printReport(stdout);
+/// \endcode
+class RHSimNetwork : public RHClock
+{
+public:
+    /// Constructor
+    /// \param[in] seed Seed for random() and the default node clocks
+    RHSimNetwork(uint32_t seed = 1);
+
+    /// Destructor. Frees the node stacks. Tasks that have not finished are abandoned
+    virtual ~RHSimNetwork();
+
+    /// Adds a node. The node's task first runs at virtual time 0, or when run() is next called.
+    /// Its clock is given a random offset and a random error within +/- RH_SIM_DEFAULT_CLOCK_PPM.
+    /// \param[in] driver The node's radio. Must not already be in a network
+    /// \param[in] x Position in metres
+    /// \param[in] y Position in metres
+    /// \param[in] task Main program of the node
+    /// \param[in] arg Passed to task
+    /// \return The index of the new node
+    uint16_t addNode(RHSimDriver& driver, float x, float y, RHSimTask task, void* arg);
+
+    /// \return The number of nodes
+    uint16_t numNodes() { return _numNodes; }
+
+    /// \return The driver of a node
+    RHSimDriver& driver(uint16_t node) { return *_nodes[node]->driver; }
+
+    /// Moves a node
+    /// \param[in] node Index of the node
+    /// \param[in] x Position in metres
+    /// \param[in] y Position in metres
+    void setPosition(uint16_t node, float x, float y);
+
+    /// Sets a node's clock
+    /// \param[in] node Index of the node
+    /// \param[in] offset Reading of the node's clock in ms at virtual time 0
+    /// \param[in] ppm Crystal error in parts per million. Positive runs fast
+    void setClock(uint16_t node, unsigned long offset, int32_t ppm);
+
+    /// Sets the parameters of the default path loss model,
+    /// loss = reference + 10 * exponent * log10(distance) + shadowing
+    /// \param[in] reference Loss at 1 metre in dB
+    /// \param[in] exponent Path loss exponent
+    /// \param[in] shadowing Standard deviation of the log-normal shadowing in dB. Each link gets a fixed,
+    /// symmetric shadowing value drawn from this distribution. 0 for none
+    void setPathLoss(float reference, float exponent, float shadowing = 0);
+
+    /// Sets how much stronger one frame must be than another overlapping it to be received
+    /// \param[in] threshold Capture threshold in dB. Defaults to RH_SIM_CAPTURE_THRESHOLD
+    void setCaptureThreshold(float threshold);
+
+    /// Runs the simulation
+    /// \param[in] duration Virtual time to run for, in ms. The simulation can be continued by calling run() again
+    void run(unsigned long duration);
+
+    /// \return Total time on air of all frames sent so far, in microseconds
+    uint64_t airtime() { return _airtime; }
+
+    /// \return The number of end to end messages reported with messageSent() so far
+    uint32_t messagesSent() { return _messagesSent; }
+
+    /// \return The number of those reported delivered with messageDelivered() so far
+    uint32_t messagesDelivered() { return _messagesDelivered; }
+
+    /// \return Virtual time in microseconds since the start of the simulation
+    uint64_t now() { return _now; }
+
+    /// \return A node's clock in microseconds
+    uint64_t nodeMicros(uint16_t node);
+
+    /// \return The clock of the node whose task is running in microseconds, or virtual time if none is
+    virtual uint64_t micros();
+
+    /// Suspends the task of the node that is running, for a time measured by its own clock
+    /// \param[in] us Time to sleep in microseconds
+    virtual void delayMicros(uint64_t us);
+
+    /// Suspends the task of the node that is running for a time measured by its own clock, or until
+    /// one of the events in wakeOn happens. Does nothing if called from outside a node's task.
+    /// \param[in] duration Time to sleep in microseconds, or RH_SIM_FOREVER
+    /// \param[in] wakeOn Bitmask of RH_SIM_WAKE_RX (a frame is received) and RH_SIM_WAKE_TX (a transmission finishes)
+    void sleep(uint64_t duration, uint8_t wakeOn = 0);
+
+    /// \return A pseudo random number, uniform in [min, max)
+    long random(long min, long max);
+
+    /// Computes the path loss between two nodes with the default model.
+    /// Subclasses may override this for other propagation models or to add obstacles.
+    /// \param[in] from Index of the transmitting node
+    /// \param[in] to Index of the receiving node
+    /// \return Path loss in dB
+    virtual float pathLoss(uint16_t from, uint16_t to);
+
+    /// Records that the application has sent an end to end message, for the report
+    /// \return A tag identifying the message, to be carried in it and passed to messageDelivered()
+    uint32_t messageSent();
+
+    /// Records that the application has received an end to end message. Duplicates are ignored
+    /// \param[in] tag The tag returned by messageSent() for the message
+    /// \param[in] len Length of the application payload in octets
+    void messageDelivered(uint32_t tag, uint16_t len);
+
+    /// Prints a summary of the simulation so far: frames, collisions, airtime, delivery ratio,
+    /// throughput, latency and airtime per delivered byte
+    /// \param[in] out Where to print it
+    void printReport(FILE* out);
+
+    /// \return The network that exists now, if any
+    static RHSimNetwork* current() { return _current; }
+
+protected:
+    friend class RHSimDriver;
+
+    /// \brief State of one simulated node
+    typedef struct
+    {
+	RHSimDriver*    driver;         ///< The node's radio
+	RHSimTask       task;           ///< The node's main program
+	void*           arg;            ///< Argument to task
+	float           x;              ///< Position in metres
+	float           y;
+	int64_t         clockOffset;    ///< Node clock at virtual time 0, us
+	int32_t         clockPpm;       ///< Node clock error, ppm
+	ucontext_t      context;        ///< Saved task context
+	uint8_t*        stack;          ///< Task stack
+	bool            started;        ///< Task has run
+	bool            done;           ///< Task has returned
+	uint8_t         wakeOn;         ///< Events that end the current sleep
+	uint32_t        generation;     ///< Incremented at each sleep, to recognise stale wake events
+
+	int32_t         lockedOn;       ///< Index of the transmitting node being received, or -1
+	uint32_t        lockedSeq;      ///< Sequence number of the frame being received
+	float           lockedRssi;     ///< Its strength, dBm
+	bool            lockedCorrupt;  ///< It has collided
+	bool            lockedOverlapped; ///< Another frame has overlapped it
+
+	bool            transmitting;   ///< A frame is on air
+	uint32_t        txSeq;          ///< Sequence number of the last frame sent
+	uint64_t        txStart;        ///< When it started, us of virtual time
+	uint64_t        txEnd;          ///< When it will end, us of virtual time
+	uint8_t         txLen;          ///< Its length including the header
+	uint8_t         txFrame[RH_SIM_FIFO_SIZE]; ///< The frame
+    } Node;
+
+    /// \brief Kinds of event, in the order they are handled when simultaneous
+    typedef enum
+    {
+	EventTxEnd = 0,                 ///< A transmission ends
+	EventWake                       ///< A node's task resumes
+    } EventKind;
+
+    /// \brief A scheduled event
+    typedef struct
+    {
+	uint64_t        time;           ///< When, us of virtual time
+	uint32_t        seq;            ///< Order of scheduling, to break ties
+	uint32_t        generation;     ///< Node generation or frame sequence number it applies to
+	uint16_t        node;           ///< Node it applies to
+	uint8_t         kind;           ///< EventKind
+    } Event;
+
+    /// Starts transmitting a frame from a node and works out which receivers lock onto it.
+    /// Called by RHSimDriver::send()
+    /// \param[in] node The transmitting node
+    /// \param[in] frame The frame including the header
+    /// \param[in] len Length of the frame
+    /// \param[in] airtime Time on air in microseconds
+    void startTransmit(uint16_t node, const uint8_t* frame, uint8_t len, uint32_t airtime);
+
+    /// Loses any frame a node is part way through receiving, because it stopped listening
+    void abortReception(uint16_t node);
+
+    /// \return true if a node can detect a LoRa transmission in progress
+    bool channelActive(uint16_t node);
+
+    /// Locks a receiver that has just started listening onto the strongest frame it can hear whose
+    /// preamble is not yet over, as after CAD. Anything already on air may spoil it.
+    /// \param[in] node The receiving node, in RHModeRx
+    /// \param[in] minSymbols Preamble symbols that must still be to come for the receiver to lock on
+    /// \return As receiving()
+    uint32_t lockOnAir(uint16_t node, uint16_t minSymbols);
+
+    /// \return Time until the end of the frame a node is receiving in us of virtual time, or 0 if none
+    uint32_t receiving(uint16_t node);
+
+    /// Ends a transmission, delivering the frame to each receiver that received it intact
+    void endTransmit(uint16_t node, uint32_t seq);
+
+    /// \return Received power at one node of the transmission in progress from another, dBm
+    float rssi(uint16_t from, uint16_t to);
+
+    /// \return true if the two radios can hear each other
+    bool compatible(uint16_t a, uint16_t b);
+
+    /// \return true if the frame from node from, received at to with strength rssi, is at least the capture
+    /// threshold stronger than every other transmission on air at to
+    /// \param[out] overlapped Set to true if any other transmission that to can hear is on air
+    bool clearOfInterference(uint16_t from, uint16_t to, float rssi, bool* overlapped);
+
+    /// \return Noise power in the bandwidth of a node's receiver, dBm
+    float noiseFloor(uint16_t node);
+
+    /// \return Lowest SNR a node's receiver can demodulate at its spreading factor, dB
+    static float snrFloor(uint8_t sf);
+
+    /// Wakes a node's task at a virtual time
+    void wakeAt(uint16_t node, uint64_t time);
+
+    /// Wakes a node's task now if it is sleeping until one of events
+    void wakeIf(uint16_t node, uint8_t events);
+
+    /// Adds an event to the queue
+    void schedule(uint64_t time, uint8_t kind, uint16_t node, uint32_t generation);
+
+    /// Removes the earliest event from the queue
+    Event nextEvent();
+
+    /// Runs a node's task until it next sleeps or returns
+    void resume(uint16_t node);
+
+    /// Entry point of every task coroutine
+    static void taskEntry();
+
+    /// \return The next pseudo random number
+    uint32_t nextRandom();
+
+    /// The nodes
+    Node**              _nodes;
+    uint16_t            _numNodes;
+    uint16_t            _maxNodes;
+
+    /// Indexes of the nodes transmitting now
+    uint16_t*           _onAir;
+    uint16_t            _numOnAir;
+
+    /// Event queue, a binary heap ordered by time, kind and seq
+    Event*              _events;
+    uint32_t            _numEvents;
+    uint32_t            _maxEvents;
+    uint32_t            _eventSeq;
+
+    /// Virtual time now, us
+    uint64_t            _now;
+
+    /// Node whose task is running, or -1
+    int32_t             _running;
+
+    /// Context the scheduler runs in
+    ucontext_t          _schedulerContext;
+
+    /// Random number generator state
+    uint64_t            _random;
+
+    /// Propagation model
+    float               _referenceLoss;
+    float               _pathLossExponent;
+    float               _shadowing;
+    float               _captureThreshold;
+
+    /// Frame statistics
+    uint32_t            _framesSent;
+    uint64_t            _airtime;
+    uint32_t            _framesReceived;
+    uint32_t            _collisions;
+    uint32_t            _captures;      ///< Frames received despite being overlapped
+    uint32_t            _aborted;
+
+    /// End to end statistics. _sentTimes holds the send time of each message, or RH_SIM_FOREVER once it is delivered
+    uint64_t*           _sentTimes;
+    uint32_t            _messagesSent;
+    uint32_t            _maxMessages;
+    uint32_t            _messagesDelivered;
+    uint64_t            _bytesDelivered;
+    uint32_t*           _latencies;
+
+    /// Real time spent in run(), us
+    uint64_t            _wallTime;
+
+    /// The network that exists now
+    static RHSimNetwork* _current;
+};
+
+#endif
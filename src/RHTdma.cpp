@@ -0,0 +1,501 @@
+// RHTdma.cpp
+//
+// Beacon synchronised TDMA medium access for RadioHead drivers
+
+#include <RHTdma.h>
+#include <RHClock.h>
+
+#define RH_TDMA_NEVER 0xffffffffffffffffULL
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHTdma::RHTdma(RHGenericDriver& driver)
+    :
+    _driver(driver),
+    _coordinator(false),
+    _synced(false),
+    _numSlots(0),
+    _maxLen(0),
+    _slotTime(0),
+    _guard(RH_TDMA_DEFAULT_GUARD),
+    _frameStart(0),
+    _rate(1.0),
+    _beaconSeq(0),
+    _clockError(0),
+    _beacons(0),
+    _slots(0),
+    _coordinatorAddress(RH_BROADCAST_ADDRESS),
+    _joining(false),
+    _joinPending(false),
+    _rxPending(false),
+    _grantNext(0)
+{
+    uint8_t i;
+    for (i = 0; i <= RH_TDMA_MAX_SLOTS; i++)
+	_owner[i] = RH_BROADCAST_ADDRESS;
+    memset(_grants, 0, sizeof(_grants));
+}
+
+bool RHTdma::init()
+{
+    if (!RHGenericDriver::init())
+	return false;
+    return _driver.init();
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+bool RHTdma::setCoordinator(uint8_t numSlots, uint8_t maxLen, uint32_t guard)
+{
+    if (numSlots < 1 || numSlots > RH_TDMA_MAX_SLOTS || maxLen > _driver.maxMessageLength())
+	return false;
+    _coordinator = true;
+    _numSlots = numSlots;
+    _maxLen = maxLen;
+    _guard = guard;
+    uint32_t airtime = _driver.timeOnAir(maxLen);
+    uint32_t beaconAirtime = _driver.timeOnAir(sizeof(Beacon));
+    _slotTime = (airtime > beaconAirtime ? airtime : beaconAirtime) + guard;
+    _rate = 1.0;
+    _slots |= (1UL << 1); // Slot 1 is for the coordinator's own messages
+    _frameStart = RHClock::instance()->micros();
+    _beacons = 0;
+    return true;
+}
+
+void RHTdma::addSlot(uint8_t slot)
+{
+    if (slot >= 1 && slot <= RH_TDMA_MAX_SLOTS)
+	_slots |= (1UL << slot);
+}
+
+bool RHTdma::assignSlot(RHAddress address, uint8_t slot)
+{
+    if (!_coordinator || slot < 1 || slot > _numSlots || (_slots & (1UL << slot))
+	|| _owner[slot] != RH_BROADCAST_ADDRESS)
+	return false;
+    _owner[slot] = address;
+    announce(address, slot);
+    return true;
+}
+
+void RHTdma::join()
+{
+    if (!_coordinator)
+	_joining = true;
+}
+
+uint32_t RHTdma::superframeTime()
+{
+    // Beacon slot, data slots and contention slot
+    return (_numSlots + 2) * _slotTime;
+}
+
+bool RHTdma::available()
+{
+    if (_rxPending)
+	return true;
+    service();
+    while (_driver.available())
+    {
+	if (!(_driver.headerFlags() & RH_TDMA_FLAGS_CONTROL))
+	{
+	    _rxPending = true;
+	    return true;
+	}
+	handleControl();
+    }
+    return false;
+}
+
+bool RHTdma::recv(uint8_t* buf, uint8_t* len)
+{
+    if (!available())
+	return false;
+    _rxPending = false;
+    return _driver.recv(buf, len);
+}
+
+bool RHTdma::send(const uint8_t* data, uint8_t len)
+{
+    _driver.waitPacketSent();
+    uint64_t deadline = RHClock::instance()->micros() + (uint64_t)RH_TDMA_SEND_TIMEOUT * 1000;
+    while (true)
+    {
+	service();
+	uint64_t now = RHClock::instance()->micros();
+	uint64_t next = RH_TDMA_NEVER;
+	if (synchronised() && _slots)
+	{
+	    if (len > _maxLen)
+		return false;
+	    next = nextSlot(now, _slots, len);
+	    if (next <= now)
+		break;
+	}
+	else if (now >= deadline)
+	    return false; // Never heard a beacon, or never given a slot
+	else
+	    next = deadline;
+	uint64_t event = nextEvent();
+	waitUntil(event < next ? event : next);
+    }
+
+    _driver.setHeaderTo(_txHeaderTo);
+    _driver.setHeaderFrom(_txHeaderFrom);
+    _driver.setHeaderId(_txHeaderId);
+    _driver.setHeaderFlags(_txHeaderFlags & ~RH_TDMA_FLAGS_CONTROL, 0xff);
+    return _driver.send(data, len);
+}
+
+uint8_t RHTdma::maxMessageLength()
+{
+    return synchronised() ? _maxLen : _driver.maxMessageLength();
+}
+
+void RHTdma::waitAvailable()
+{
+    while (!available())
+	waitUntil(nextEvent());
+}
+
+bool RHTdma::waitAvailableTimeout(uint16_t timeout)
+{
+    uint64_t deadline = RHClock::instance()->micros() + (uint64_t)timeout * 1000;
+    while (!available())
+    {
+	if (RHClock::instance()->micros() >= deadline)
+	    return false;
+	uint64_t next = nextEvent();
+	waitUntil(next < deadline ? next : deadline);
+    }
+    return true;
+}
+
+bool RHTdma::waitPacketSent()
+{
+    return _driver.waitPacketSent();
+}
+
+bool RHTdma::waitPacketSent(uint16_t timeout)
+{
+    return _driver.waitPacketSent(timeout);
+}
+
+uint32_t RHTdma::timeOnAir(uint8_t len)
+{
+    return _driver.timeOnAir(len);
+}
+
+uint64_t RHTdma::lastRxTime()
+{
+    return _driver.lastRxTime();
+}
+
+void RHTdma::setThisAddress(RHAddress thisAddress)
+{
+    RHGenericDriver::setThisAddress(thisAddress);
+    _driver.setThisAddress(thisAddress);
+}
+
+void RHTdma::setPromiscuous(bool promiscuous)
+{
+    RHGenericDriver::setPromiscuous(promiscuous);
+    _driver.setPromiscuous(promiscuous);
+}
+
+RHAddress RHTdma::headerTo()
+{
+    return _driver.headerTo();
+}
+
+RHAddress RHTdma::headerFrom()
+{
+    return _driver.headerFrom();
+}
+
+uint8_t RHTdma::headerId()
+{
+    return _driver.headerId();
+}
+
+uint8_t RHTdma::headerFlags()
+{
+    return _driver.headerFlags();
+}
+
+int16_t RHTdma::lastRssi()
+{
+    return _driver.lastRssi();
+}
+
+int RHTdma::lastSNR()
+{
+    return _driver.lastSNR();
+}
+
+RHGenericDriver::RHMode RHTdma::mode()
+{
+    return _driver.mode();
+}
+
+void RHTdma::setMode(RHMode mode)
+{
+    _driver.setMode(mode);
+}
+
+bool RHTdma::sleep()
+{
+    return _driver.sleep();
+}
+
+uint16_t RHTdma::rxBad()
+{
+    return _driver.rxBad();
+}
+
+uint16_t RHTdma::rxGood()
+{
+    return _driver.rxGood();
+}
+
+uint16_t RHTdma::txGood()
+{
+    return _driver.txGood();
+}
+
+////////////////////////////////////////////////////////////////////
+// Protected methods
+void RHTdma::service()
+{
+    uint64_t now = RHClock::instance()->micros();
+    if (_coordinator)
+    {
+	uint64_t period = superframeTime();
+	if (_beacons && now < _frameStart + period)
+	    return;
+	// Start the superframe that is now running, even if we were too busy to start some before it
+	if (now >= _frameStart + period)
+	    _frameStart += ((now - _frameStart) / period) * period;
+	uint32_t lateness = now - _frameStart;
+	// A beacon that would run into slot 1 is skipped. Nodes carry on from the one before
+	if (lateness + _driver.timeOnAir(sizeof(Beacon)) + _guard / 2 <= _slotTime)
+	    sendBeacon(lateness);
+	return;
+    }
+
+    if (!_synced)
+	return;
+    if (now > _frameStart + (uint64_t)(superframeTime() * _rate * (RH_TDMA_MAX_MISSED_BEACONS + 1)))
+    {
+	// Lost the coordinator. Stay quiet until we hear it again
+	_synced = false;
+	_joinPending = false;
+	return;
+    }
+    if (_joinPending && nextSlot(now, 1UL << (_numSlots + 1), 1) <= now)
+    {
+	uint8_t type = RH_TDMA_TYPE_JOIN;
+	sendControl(_coordinatorAddress, &type, sizeof(type));
+	_joinPending = false;
+    }
+}
+
+void RHTdma::handleControl()
+{
+    Beacon beacon;
+    uint8_t len = sizeof(beacon);
+    uint64_t rxTime = _driver.lastRxTime();
+    rxTime = rxTime ? rxTime / 1000 : RHClock::instance()->micros();
+    RHAddress from = _driver.headerFrom();
+    if (!_driver.recv((uint8_t*)&beacon, &len) || len < 1)
+	return;
+
+    if (beacon.type == RH_TDMA_TYPE_BEACON && !_coordinator)
+    {
+	_coordinatorAddress = from;
+	handleBeacon(&beacon, len, rxTime);
+    }
+    else if (beacon.type == RH_TDMA_TYPE_JOIN && _coordinator)
+	handleJoin(from);
+}
+
+void RHTdma::handleBeacon(const Beacon* beacon, uint8_t len, uint64_t rxTime)
+{
+    if (len < sizeof(Beacon) - sizeof(beacon->grants) || beacon->numSlots < 1 || beacon->numSlots > RH_TDMA_MAX_SLOTS)
+	return;
+
+    // The superframe started when the beacon started, less the coordinator's lateness in sending it
+    uint64_t start = rxTime - _driver.timeOnAir(len) - beacon->lateness;
+
+    if (_synced && beacon->numSlots == _numSlots && beacon->slotTime == _slotTime)
+    {
+	uint8_t frames = beacon->seq - _beaconSeq;
+	if (frames == 0)
+	    return;
+	uint64_t elapsed = (uint64_t)frames * superframeTime();
+	_clockError = (int64_t)start - (int64_t)(_frameStart + (uint64_t)(elapsed * _rate));
+	// Frequency: how many local microseconds there were per coordinator microsecond
+	float measured = (float)(start - _frameStart) / elapsed;
+	_rate += (measured - _rate) * RH_TDMA_RATE_GAIN;
+	if (_rate > 1.0 + RH_TDMA_MAX_DRIFT * 1e-6)
+	    _rate = 1.0 + RH_TDMA_MAX_DRIFT * 1e-6;
+	else if (_rate < 1.0 - RH_TDMA_MAX_DRIFT * 1e-6)
+	    _rate = 1.0 - RH_TDMA_MAX_DRIFT * 1e-6;
+    }
+    else
+    {
+	// First beacon, or the coordinator changed the superframe: start again
+	_numSlots = beacon->numSlots;
+	_maxLen = beacon->maxLen;
+	_slotTime = beacon->slotTime;
+	_rate = 1.0;
+	_clockError = 0;
+	_synced = true;
+    }
+    _frameStart = start;
+    _beaconSeq = beacon->seq;
+    _beacons++;
+
+    uint8_t i;
+    for (i = 0; i < beacon->numGrants && i < RH_TDMA_BEACON_GRANTS; i++)
+    {
+	if (beacon->grants[i].address == _thisAddress)
+	{
+	    addSlot(beacon->grants[i].slot);
+	    _joining = false;
+	}
+    }
+    if (_joining)
+	_joinPending = (random(0, RH_TDMA_JOIN_BACKOFF) == 0);
+}
+
+void RHTdma::handleJoin(RHAddress address)
+{
+    uint8_t slot;
+    for (slot = 1; slot <= _numSlots; slot++)
+	if (_owner[slot] == address)
+	    break;
+    if (slot > _numSlots)
+    {
+	for (slot = 1; slot <= _numSlots; slot++)
+	    if (_owner[slot] == RH_BROADCAST_ADDRESS && !(_slots & (1UL << slot)))
+		break;
+	if (slot > _numSlots)
+	    return; // Full. The node will keep asking
+	_owner[slot] = address;
+    }
+    announce(address, slot);
+}
+
+void RHTdma::announce(RHAddress address, uint8_t slot)
+{
+    uint8_t i;
+    for (i = 0; i < RH_TDMA_BEACON_GRANTS; i++)
+	if (_grants[i].repeats == 0 || _grants[i].address == address)
+	    break;
+    if (i == RH_TDMA_BEACON_GRANTS)
+    {
+	// All in use: the oldest gives way
+	i = _grantNext;
+	_grantNext = (_grantNext + 1) % RH_TDMA_BEACON_GRANTS;
+    }
+    _grants[i].address = address;
+    _grants[i].slot = slot;
+    _grants[i].repeats = RH_TDMA_GRANT_REPEATS;
+}
+
+void RHTdma::sendBeacon(uint32_t lateness)
+{
+    Beacon beacon;
+    beacon.type = RH_TDMA_TYPE_BEACON;
+    beacon.seq = ++_beaconSeq;
+    beacon.numSlots = _numSlots;
+    beacon.maxLen = _maxLen;
+    beacon.slotTime = _slotTime;
+    beacon.lateness = lateness;
+    beacon.numGrants = 0;
+    uint8_t i;
+    for (i = 0; i < RH_TDMA_BEACON_GRANTS; i++)
+    {
+	if (_grants[i].repeats)
+	{
+	    beacon.grants[beacon.numGrants].address = _grants[i].address;
+	    beacon.grants[beacon.numGrants].slot = _grants[i].slot;
+	    beacon.numGrants++;
+	    _grants[i].repeats--;
+	}
+    }
+    // The time on air depends on the length, so nodes need the exact length actually sent
+    uint8_t len = sizeof(Beacon) - sizeof(beacon.grants) + beacon.numGrants * sizeof(beacon.grants[0]);
+    if (sendControl(RH_BROADCAST_ADDRESS, (uint8_t*)&beacon, len))
+	_beacons++;
+}
+
+bool RHTdma::sendControl(RHAddress to, const uint8_t* data, uint8_t len)
+{
+    _driver.waitPacketSent();
+    _driver.setHeaderTo(to);
+    _driver.setHeaderFrom(_thisAddress);
+    _driver.setHeaderId(0);
+    _driver.setHeaderFlags(RH_TDMA_FLAGS_CONTROL, 0xff);
+    return _driver.send(data, len);
+}
+
+uint64_t RHTdma::nextSlot(uint64_t now, uint32_t mask, uint8_t len)
+{
+    // Messages start a quarter of the guard time into the slot, or later if there is still room
+    // to finish half a guard time before the slot ends. The longest message has a quarter guard time to spare
+    uint32_t airtime = _driver.timeOnAir(len);
+    uint32_t lead = _guard / 4;
+    uint32_t room = _slotTime > lead + _guard / 2 + airtime ? _slotTime - lead - _guard / 2 - airtime : 0;
+    uint64_t period = superframeTime() * _rate;
+    uint64_t frame = now > _frameStart ? (now - _frameStart) / period : 0;
+    uint8_t  lastSlot = _numSlots + 1;
+    while (true)
+    {
+	uint64_t base = _frameStart + frame * period;
+	uint8_t slot;
+	for (slot = 1; slot <= lastSlot; slot++)
+	{
+	    if (!(mask & (1UL << slot)))
+		continue;
+	    uint64_t open = base + (uint64_t)((slot * _slotTime + lead) * _rate);
+	    if (now <= open + (uint64_t)(room * _rate))
+		return open > now ? open : now;
+	}
+	frame++;
+    }
+}
+
+uint64_t RHTdma::nextEvent()
+{
+    if (_coordinator)
+	return _frameStart + superframeTime();
+    if (_synced && _joinPending)
+	return nextSlot(RHClock::instance()->micros(), 1UL << (_numSlots + 1), 1);
+    return RH_TDMA_NEVER;
+}
+
+void RHTdma::waitUntil(uint64_t until)
+{
+    uint64_t now = RHClock::instance()->micros();
+    if (until <= now)
+	return;
+    uint64_t wait = until - now;
+    if (wait < 1000 || _rxPending)
+    {
+	// Less than a ms, or the receiver is holding a message for the manager and so cannot hear anything else
+	RHClock::instance()->delayMicros(wait);
+	return;
+    }
+    // Listen in whole ms, so as not to overshoot. Deal with whatever arrives without polling again,
+    // since polling can take time the caller does not have
+    if (_driver.waitAvailableTimeout(wait > 60000000 ? 60000 : wait / 1000))
+    {
+	if (_driver.headerFlags() & RH_TDMA_FLAGS_CONTROL)
+	    handleControl();
+	else
+	    _rxPending = true;
+    }
+}
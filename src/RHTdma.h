@@ -0,0 +1,343 @@
+// RHTdma.h
+//
+// Beacon synchronised TDMA medium access for RadioHead drivers
+//
+// Wraps any driver that can report time on air and receive timestamps (RH_RF95, RHSimDriver)
+// and holds every transmission until one of this node's slots is open.
+
+#ifndef RHTdma_h
+#define RHTdma_h
+
+#include <RHGenericDriver.h>
+
+// Header flag marking TDMA beacons and join requests, which are consumed by RHTdma and never
+// reach the manager above it
+#define RH_TDMA_FLAGS_CONTROL 0x10
+
+// Largest number of data slots in a superframe. The superframe also holds the beacon slot (0)
+// and the contention slot used for join requests (numSlots + 1)
+#define RH_TDMA_MAX_SLOTS 30
+
+// Default guard time added to the time on air of the longest message to make a slot, in microseconds.
+// Each transmission starts a quarter of the guard time after its slot opens, or up to a quarter later
+// if the node was busy, and ends at least half the guard time before the slot closes.
+#ifndef RH_TDMA_DEFAULT_GUARD
+#define RH_TDMA_DEFAULT_GUARD 4000
+#endif
+
+// Number of slot grants a beacon can carry
+#define RH_TDMA_BEACON_GRANTS 4
+
+// Number of beacons that repeat each slot grant, in case some are not heard
+#ifndef RH_TDMA_GRANT_REPEATS
+#define RH_TDMA_GRANT_REPEATS 3
+#endif
+
+// Consecutive beacons a node may miss before it stops transmitting until it hears another
+#ifndef RH_TDMA_MAX_MISSED_BEACONS
+#define RH_TDMA_MAX_MISSED_BEACONS 4
+#endif
+
+// A joining node sends its request in the contention slot of a random one in this many superframes
+#ifndef RH_TDMA_JOIN_BACKOFF
+#define RH_TDMA_JOIN_BACKOFF 4
+#endif
+
+// How long send() waits for synchronisation or a slot grant before giving up, in milliseconds
+#ifndef RH_TDMA_SEND_TIMEOUT
+#define RH_TDMA_SEND_TIMEOUT 30000
+#endif
+
+// Largest clock rate error a node will correct for, in parts per million
+#define RH_TDMA_MAX_DRIFT 200
+
+// Each beacon moves the estimated clock rate this fraction of the way to the newly measured rate
+#define RH_TDMA_RATE_GAIN 0.25
+
+// Control frame types, the first octet of the payload
+#define RH_TDMA_TYPE_BEACON 1
+#define RH_TDMA_TYPE_JOIN   2
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHTdma RHTdma.h <RHTdma.h>
+/// \brief Time division medium access for a star or cluster of nodes sharing one coordinator
+///
+/// Listen-before-talk with random backoff (waitCAD()) wastes more and more of the channel in collisions
+/// and backoff as the number of contending nodes grows. RHTdma divides time into superframes of
+/// equal slots instead, and gives each node its own slots to transmit in:
+/// \code
+/// | beacon | slot 1 | slot 2 | ... | slot numSlots | contention |
+/// \endcode
+/// Each slot is the time on air of the longest message plus a guard time. The coordinator sends a beacon
+/// at the start of every superframe. Other nodes take the superframe timing from the RxDone timestamp of
+/// each beacon (RHGenericDriver::lastRxTime()), and correct both the phase and the rate of their own clock
+/// against it, so the guard time only has to cover timestamp error and one superframe of residual drift.
+///
+/// RHTdma is itself a driver, so any manager can run over it unchanged:
+/// \code
+/// RH_RF95 rf95;
+/// RHTdma tdma(rf95);
+/// RHReliableDatagram manager(tdma, MY_ADDRESS);
+/// manager.init();
+/// manager.setTimeout(2 * tdma.superframeTime() / 1000); // ACKs wait for the receiver's slot
+/// tdma.join();                 // or tdma.addSlot(3) for a statically configured slot
+/// \endcode
+/// and on the coordinator:
+/// \code
+/// tdma.setCoordinator(10, 32); // 10 data slots for messages up to 32 octets
+/// tdma.assignSlot(7, 2);       // Optional static table: node 7 always has slot 2
+/// \endcode
+/// send() blocks until one of this node's slots is open with enough of it left for the message. Received
+/// messages are delivered as soon as they arrive. Beacons and join requests are handled inside available(),
+/// so the application must keep calling available(), recv() or one of the wait functions, as managers do.
+///
+/// Nodes that have not been given a slot statically send a join request in the contention slot, choosing a
+/// random superframe to spread out requests from nodes that start together. The coordinator grants the
+/// lowest free slot (or the slot already assigned to that node) and announces the grant in the next
+/// RH_TDMA_GRANT_REPEATS beacons. The coordinator owns slot 1 for its own messages.
+///
+/// The underlying driver must implement timeOnAir(), and should implement lastRxTime() with an accurate
+/// timestamp (for RH_RF95, see setEdgeTimestamps()). CAD should be left disabled on the underlying driver.
+class RHTdma : public RHGenericDriver
+{
+public:
+    /// Describes the superframe and carries slot grants. Sent by the coordinator in slot 0
+    typedef struct RH_PACKED
+    {
+	uint8_t    type;        ///< RH_TDMA_TYPE_BEACON
+	uint8_t    seq;         ///< Superframe sequence number
+	uint8_t    numSlots;    ///< Number of data slots
+	uint8_t    maxLen;      ///< Longest message a slot is sized for
+	uint32_t   slotTime;    ///< Slot length in microseconds
+	uint32_t   lateness;    ///< Microseconds between the start of the superframe and the start of this beacon
+	uint8_t    numGrants;   ///< Number of valid entries in grants
+	struct RH_PACKED
+	{
+	    RHAddress address;  ///< Node given the slot
+	    uint8_t   slot;     ///< Slot number
+	} grants[RH_TDMA_BEACON_GRANTS];
+    } Beacon;
+
+    /// Constructor
+    /// \param[in] driver The driver to send and receive with. Must not be used directly once RHTdma is in use.
+    RHTdma(RHGenericDriver& driver);
+
+    /// Initialises the underlying driver
+    /// \return true if the driver initialised
+    virtual bool init();
+
+    /// Makes this node the coordinator, which sends the beacons and grants slots. Starts the first superframe now.
+    /// \param[in] numSlots Number of data slots per superframe, 1 to RH_TDMA_MAX_SLOTS
+    /// \param[in] maxLen Length of the longest message that will be sent, which sizes the slots
+    /// \param[in] guard Guard time added to each slot, in microseconds
+    /// \return false if numSlots is out of range or maxLen is too long for the driver
+    bool setCoordinator(uint8_t numSlots, uint8_t maxLen, uint32_t guard = RH_TDMA_DEFAULT_GUARD);
+
+    /// Gives this node a slot, as part of a static slot plan
+    /// \param[in] slot Slot number, 1 to RH_TDMA_MAX_SLOTS
+    void addSlot(uint8_t slot);
+
+    /// Records a static slot assignment on the coordinator. The node is told about it in the next beacons,
+    /// and again whenever it sends a join request.
+    /// \param[in] address Node to give the slot to
+    /// \param[in] slot Slot number, 1 to the number of slots
+    /// \return false if not coordinator, the slot is out of range, or it is already assigned
+    bool assignSlot(RHAddress address, uint8_t slot);
+
+    /// Starts asking the coordinator for a slot. Requests continue until a grant is heard.
+    void join();
+
+    /// \return Bit mask of the slots this node may transmit in, bit n for slot n
+    uint32_t slots() { return _slots; }
+
+    /// \return true if this node is the coordinator or is following the coordinator's beacons
+    bool synchronised() { return _coordinator || _synced; }
+
+    /// \return Nominal length of a superframe in microseconds, or 0 before the first beacon is heard
+    uint32_t superframeTime();
+
+    /// \return Length of a slot in microseconds, or 0 before the first beacon is heard
+    uint32_t slotTime() { return _slotTime; }
+
+    /// \return Difference between where the last beacon was heard and where it was predicted, in microseconds
+    int32_t clockError() { return _clockError; }
+
+    /// \return Estimated rate error of this node's clock relative to the coordinator, in parts per million
+    float clockDrift() { return (_rate - 1.0) * 1e6; }
+
+    /// \return Number of beacons sent (by the coordinator) or received (by other nodes)
+    uint16_t beacons() { return _beacons; }
+
+    /// Sends beacons, join requests and handles received control frames, then tests for a received message
+    /// \return true if a message for the manager is available
+    virtual bool available();
+
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Available space in buf. Set to the number of octets copied
+    /// \return true if a message was copied to buf
+    virtual bool recv(uint8_t* buf, uint8_t* len);
+
+    /// Waits until one of this node's slots is open with time left in it for the message, then sends it.
+    /// Beacons and received control frames are handled while waiting.
+    /// \param[in] data Message to send
+    /// \param[in] len Length of the message, no more than the slot was sized for
+    /// \return false if the message is too long, or there was no synchronisation or slot within RH_TDMA_SEND_TIMEOUT
+    virtual bool send(const uint8_t* data, uint8_t len);
+
+    /// \return The longest message a slot is sized for, or the driver's maximum before the first beacon
+    virtual uint8_t maxMessageLength();
+
+    /// Waits for a message while keeping the superframe running
+    virtual void waitAvailable();
+
+    /// Waits for a message or a timeout while keeping the superframe running
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    /// \return true if a message is available
+    virtual bool waitAvailableTimeout(uint16_t timeout);
+
+    /// Waits for the underlying driver to finish transmitting
+    virtual bool waitPacketSent();
+
+    /// Waits for the underlying driver to finish transmitting, or a timeout
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    virtual bool waitPacketSent(uint16_t timeout);
+
+    /// \param[in] len Message length
+    /// \return Time on air of the message from the underlying driver, in microseconds
+    virtual uint32_t timeOnAir(uint8_t len);
+
+    /// \return RxDone time of the last message from the underlying driver
+    virtual uint64_t lastRxTime();
+
+    /// Sets this node's address here and in the underlying driver
+    virtual void setThisAddress(RHAddress thisAddress);
+
+    /// Sets promiscuous mode in the underlying driver
+    virtual void setPromiscuous(bool promiscuous);
+
+    /// \return Headers of the last received message, from the underlying driver
+    virtual RHAddress headerTo();
+    virtual RHAddress headerFrom();
+    virtual uint8_t   headerId();
+    virtual uint8_t   headerFlags();
+
+    /// \return Signal measurements of the last received message, from the underlying driver
+    virtual int16_t   lastRssi();
+    virtual int       lastSNR();
+
+    /// \return Mode of the underlying driver
+    virtual RHMode    mode();
+
+    /// Sets the mode of the underlying driver
+    virtual void      setMode(RHMode mode);
+
+    /// Puts the underlying driver to sleep. Beacons are missed while asleep.
+    virtual bool      sleep();
+
+    /// \return Packet counters of the underlying driver
+    virtual uint16_t  rxBad();
+    virtual uint16_t  rxGood();
+    virtual uint16_t  txGood();
+
+protected:
+    /// Sends a beacon if one is due, sends a pending join request if the contention slot is open,
+    /// and notices loss of synchronisation
+    void service();
+
+    /// Reads and acts on the control frame in the underlying driver's receive buffer
+    void handleControl();
+
+    /// Takes the superframe timing and any slot grant for us from a received beacon
+    /// \param[in] beacon The beacon
+    /// \param[in] len Length of the beacon
+    /// \param[in] rxTime When its RxDone was signalled, local microseconds
+    void handleBeacon(const Beacon* beacon, uint8_t len, uint64_t rxTime);
+
+    /// Grants a slot to a node that asked for one
+    /// \param[in] address The node
+    void handleJoin(RHAddress address);
+
+    /// Queues a slot grant for the next beacons
+    void announce(RHAddress address, uint8_t slot);
+
+    /// Sends a beacon for the superframe that has just started
+    /// \param[in] lateness Microseconds since the superframe started
+    void sendBeacon(uint32_t lateness);
+
+    /// Sends a control frame with the control flag and our own address
+    bool sendControl(RHAddress to, const uint8_t* data, uint8_t len);
+
+    /// Finds when a message can next be started in one of the given slots
+    /// \param[in] now Current local time in microseconds
+    /// \param[in] mask Bit mask of acceptable slots
+    /// \param[in] len Length of the message
+    /// \return now if one of the slots is open with room for the message, else when the next one opens
+    uint64_t nextSlot(uint64_t now, uint32_t mask, uint8_t len);
+
+    /// \return When service() next has something to do, local microseconds
+    uint64_t nextEvent();
+
+    /// Waits until a local time, or less if a message arrives while the receiver is free
+    void waitUntil(uint64_t until);
+
+    /// The driver we send and receive with
+    RHGenericDriver&    _driver;
+
+    /// True if this node sends the beacons
+    bool                _coordinator;
+
+    /// True while following the coordinator's beacons
+    bool                _synced;
+
+    /// Superframe layout, from setCoordinator() or the last beacon
+    uint8_t             _numSlots;
+    uint8_t             _maxLen;
+    uint32_t            _slotTime;
+    uint32_t            _guard;
+
+    /// Local time the current superframe started, microseconds
+    uint64_t            _frameStart;
+
+    /// Local microseconds per coordinator microsecond
+    float               _rate;
+
+    /// Sequence number of the last beacon sent or received
+    uint8_t             _beaconSeq;
+
+    /// Phase error measured at the last beacon, microseconds
+    int32_t             _clockError;
+
+    /// Beacons sent or received
+    uint16_t            _beacons;
+
+    /// Slots we may transmit in, bit n for slot n
+    uint32_t            _slots;
+
+    /// Address of the coordinator, from its beacons
+    RHAddress           _coordinatorAddress;
+
+    /// True while asking for a slot
+    bool                _joining;
+
+    /// True if a join request is to be sent in the next contention slot
+    bool                _joinPending;
+
+    /// True while a message for the manager is waiting in the underlying driver
+    bool                _rxPending;
+
+    /// Coordinator's slot table: the node owning each slot, RH_BROADCAST_ADDRESS if free
+    RHAddress           _owner[RH_TDMA_MAX_SLOTS + 1];
+
+    /// Coordinator's grants still to be announced
+    struct
+    {
+	RHAddress address;
+	uint8_t   slot;
+	uint8_t   repeats;
+    }                   _grants[RH_TDMA_BEACON_GRANTS];
+
+    /// Next grant entry to reuse when all are in use
+    uint8_t             _grantNext;
+};
+
+#endif
@@ -4,6 +4,7 @@
 // $Id: RH_RF95.cpp,v 1.19 2018/09/23 23:54:01 mikem Exp $
 
 #include <RH_RF95.h>
+#include <RHClock.h>
 #include <math.h>
 
 /// just testing
@@ -31,11 +32,49 @@ PROGMEM static const RH_RF95::ModemConfig MODEM_CONFIG_TABLE[] =
     
 };
 
+// Signal bandwidth in Hz, indexed by the BW bits (7..4) of RH_RF95_REG_1D_MODEM_CONFIG1
+PROGMEM static const uint32_t BANDWIDTH_TABLE[] =
+{
+    7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000
+};
+#define RH_RF95_NUM_BANDWIDTHS (sizeof(BANDWIDTH_TABLE) / sizeof(uint32_t))
+
 RH_RF95::RH_RF95(uint8_t slaveSelectPin, uint8_t interruptPin, RHGenericSPI& spi)
     :
     RHSPIDriver(slaveSelectPin, spi),
-    _rxBufValid(0)
+    _rxBufValid(0),
+    _rxFifoPending(false),
+    _rxFifoAddr(0),
+    _txPower(13),
+    _useRFO(false),
+    _preambleLength(8),
+    _lastFreqError(0),
+    _frf(0),
+    _frequencyCorrection(0),
+    _ppmCorrection(0),
+    _rxSingle(false),
+    _sniffing(false),
+    _sniffInterval(0),
+    _sniffLastWake(0),
+    _sniffActive(false),
+    _rxStart(0),
+    _rxOnTime(0),
+    _wakeCount(0),
+    _cadDetections(0),
+    _symbolTimeout(0x64),
+    _sfScanHome(7),
+    _sfScanHomeTimeout(0x64),
+    _rxWindowState(RxWindowNone),
+    _rxWindowStart(0),
+    _rxWindowSymbols(0),
+    _rxTimeouts(0),
+    _lastRxTime(0),
+    _lastTxTime(0),
+    _pendingEdge(0),
+    _edgeCut(0),
+    _edgeFd(-1)
 {
+    memcpy_P(&_modemConfig, &MODEM_CONFIG_TABLE[Bw125Cr45Sf128], sizeof(ModemConfig));
 #ifndef RH_RF95_IRQLESS
     _interruptPin = interruptPin;
     _myInterruptIndex = 0xff; // Not allocated yet
@@ -163,93 +202,185 @@ bool RH_RF95::init()
 //#ifndef RH_RF95_IRQLESS
 void RH_RF95::handleInterrupt()
 {
-    // Read the interrupt register
+    // Read the DIO0 edges before the interrupt register. An edge that rises just after the register
+    // is read is then kept for the flag it signals, which the next call sees, rather than read now
+    // with no flag to claim it
+    pollEdges();
+    uint64_t flagsRead = RHClock::instance()->nanos();
     uint8_t irq_flags = spiRead(RH_RF95_REG_12_IRQ_FLAGS);
-    // Read the RegHopChannel register to check if CRC presence is signalled
-    // in the header. If not it might be a stray (noise) packet.*
-    bool crc_present = spiRead(RH_RF95_REG_1C_HOP_CHANNEL) & RH_RF95_RX_PAYLOAD_CRC_IS_ON;
     bool rx_timeout = irq_flags & RH_RF95_RX_TIMEOUT;
     bool crc_error = irq_flags & RH_RF95_PAYLOAD_CRC_ERROR;
+
+    // Time RxDone and TxDone as near to the DIO0 edge as we can: from the edge itself if the kernel
+    // recorded it, else when the flag was seen. CadDone claims its edge too, so it never times a packet
+    if (_mode == RHModeRx && (irq_flags & RH_RF95_RX_DONE))
+	_lastRxTime = claimEdge(flagsRead);
+    else if (_mode == RHModeTx && (irq_flags & RH_RF95_TX_DONE))
+	_lastTxTime = claimEdge(flagsRead);
+    else if (_mode == RHModeCad && (irq_flags & RH_RF95_CAD_DONE))
+	claimEdge(flagsRead);
     
-    uint8_t modem_config = spiRead(RH_RF95_REG_01_OP_MODE) & RH_RF95_MODE;
-    
-    //printf("ModemConfig: %d\n",modem_config);
-    
-    if (_mode == RHModeRx && _checkCrc && (rx_timeout || crc_error | !crc_present))
-//    if (_mode == RHModeRx && irq_flags & (RH_RF95_RX_TIMEOUT | RH_RF95_PAYLOAD_CRC_ERROR))
+    if (_mode == RHModeRx && (irq_flags & (RH_RF95_RX_DONE | RH_RF95_RX_TIMEOUT)))
     {
+	// Fetch the packet status registers RegFifoRxCurrentAddr to RegHopChannel in one burst,
+	// and the frequency error in another, so they all describe this same packet
+	uint8_t status[RH_RF95_REG_1C_HOP_CHANNEL - RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR + 1];
+	uint8_t fei[3];
+	bool single = _rxSingle;
+	spiBurstRead(RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR, status, sizeof(status));
+	spiBurstRead(RH_RF95_REG_28_FEI_MSB, fei, sizeof(fei));
+#define RH_RF95_STATUS(reg) status[(reg) - RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR]
+
+	// Check the RegHopChannel register to see if CRC presence is signalled
+	// in the header. If not it might be a stray (noise) packet.*
+	bool crc_present = RH_RF95_STATUS(RH_RF95_REG_1C_HOP_CHANNEL) & RH_RF95_RX_PAYLOAD_CRC_IS_ON;
+
+	if (rx_timeout)
+	{
+	    // Only happens in single receive mode: no preamble within the symbol timeout.
+	    // Nothing was received, so this is not a bad packet
+	    _rxTimeouts++;
+	}
+	else if (_checkCrc && (crc_error || !crc_present))
+	{
 	    _rxBad++;
-    }
-    else if (_mode == RHModeRx && irq_flags & RH_RF95_RX_DONE)
-    {
-    	// get length of received packet
-    	uint8_t len = spiRead(RH_RF95_REG_13_RX_NB_BYTES);
+	}
+	else if (irq_flags & RH_RF95_RX_DONE)
+	{
+	    // get length of received packet
+	    uint8_t len = RH_RF95_STATUS(RH_RF95_REG_13_RX_NB_BYTES);
 
-        // if implicit header mode is used, we need to set the payload length manually
-        if(getImplicitHeaderMode()) {
-            len = RH_RF95_IMPLICIT_HEADER_MODE_EXPECTED_PAYLOAD_LENGTH;
-        }
+	    // if implicit header mode is used, we need to set the payload length manually
+	    if(getImplicitHeaderMode()) {
+		len = RH_RF95_IMPLICIT_HEADER_MODE_EXPECTED_PAYLOAD_LENGTH;
+	    }
        
-        printf("Received Bytes: %i\n", len);
-
-    	// Reset the fifo read ptr to the beginning of the packet
-    	spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, spiRead(RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR));
-    	spiBurstRead(RH_RF95_REG_00_FIFO, _buf, len);
-    	_bufLen = len;
-
-        printf("Buf Len: %i\n", _bufLen);
-
-    	spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
-
-    	// Remember the last signal to noise ratio, LORA mode
-    	// Per page 111, SX1276/77/78/79 datasheet
-    	_lastSNR = ((int8_t)spiRead(RH_RF95_REG_19_PKT_SNR_VALUE)) * 10 / 4;
-
-    	// Remember the RSSI of this packet, LORA mode
-    	// this is according to the doc, but is it really correct?
-    	// weakest receiveable signals are reported RSSI at about -66
-    	_lastRawRssi = spiRead(RH_RF95_REG_1A_PKT_RSSI_VALUE);
+	    printf("Received Bytes: %i\n", len);
+
+	    // Reset the fifo read ptr to the beginning of the packet. With the full header, read only the header:
+	    // the payload stays in the FIFO until recv() reads it into the caller's buffer, and is never read
+	    // at all if the message is for another node
+	    _rxFifoAddr = RH_RF95_STATUS(RH_RF95_REG_10_FIFO_RX_CURRENT_ADDR);
+	    spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, _rxFifoAddr);
+	    if (_explicitHeaderMode == 2)
+		spiBurstRead(RH_RF95_REG_00_FIFO, _buf, len < RH_RF95_HEADER_LEN ? len : RH_RF95_HEADER_LEN);
+	    else
+		spiBurstRead(RH_RF95_REG_00_FIFO, _buf, len);
+	    _bufLen = len;
+
+	    printf("Buf Len: %i\n", _bufLen);
+
+	    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
+
+	    // Remember the last signal to noise ratio, LORA mode
+	    // Per page 111, SX1276/77/78/79 datasheet
+	    _lastSNR = ((int8_t)RH_RF95_STATUS(RH_RF95_REG_19_PKT_SNR_VALUE)) * 10 / 4;
+
+	    // Remember the RSSI of this packet, LORA mode
+	    // this is according to the doc, but is it really correct?
+	    // weakest receiveable signals are reported RSSI at about -66
+	    _lastRawRssi = RH_RF95_STATUS(RH_RF95_REG_1A_PKT_RSSI_VALUE);
     	
-        // Adjust the RSSI, datasheet page 87
-    	if (_lastSNR < 0) {
-    	    _lastRssi = _lastRawRssi + _lastSNR / 10;
-    	} else {
-    	    _lastRssi = (int)_lastRawRssi * 16 / 15;
-    	}
+	    // Adjust the RSSI, datasheet page 87
+	    if (_lastSNR < 0) {
+		_lastRssi = _lastRawRssi + _lastSNR / 10;
+	    } else {
+		_lastRssi = (int)_lastRawRssi * 16 / 15;
+	    }
     	
-        if (_usingHFport){
-    	    _lastRawRssi -= 157;
-    	    _lastRssi -= 157;
-    	} else {
-    	    _lastRawRssi -= 164;
-    	    _lastRssi -= 164;
-    	}
-    	// We have received a message.
-    	validateRxBuf(); 
-    	if (_rxBufValid)
-    	    setModeIdle(); // Got one 
-    	    
+	    if (_usingHFport){
+		_lastRawRssi -= 157;
+		_lastRssi -= 157;
+	    } else {
+		_lastRawRssi -= 164;
+		_lastRssi -= 164;
+	    }
+
+	    // Convert 2.5 bytes (5 nibbles, 20 bits) of FEI to 32 bit signed int
+	    _lastFreqError = ((int32_t)fei[0] << 16) | ((int32_t)fei[1] << 8) | fei[2];
+	    // Sign extension into top 3 nibbles
+	    if (_lastFreqError & 0x80000)
+		_lastFreqError |= 0xfff00000;
+
+	    // We have received a message.
+	    validateRxBuf(); 
+	    _rxFifoPending = _rxBufValid && _explicitHeaderMode == 2 && len > RH_RF95_HEADER_LEN;
+	    if (_rxBufValid)
+		setModeIdle(); // Got one. Standby keeps the FIFO
     	
-    	_lastCrcOk = !crc_error && crc_present;
+	    _lastCrcOk = !crc_error && crc_present;
     	
-        printf("RxGood: %i, RxBad: %i\n", _rxGood, _rxBad);
-    	if(crc_error){
-    	    printf("CRC ERROR\n");
-    	}
+	    printf("RxGood: %i, RxBad: %i\n", _rxGood, _rxBad);
+	    if(crc_error){
+		printf("CRC ERROR\n");
+	    }
+
+	    if(crc_present){
+		printf("CRC Present\n");
+	    }
+	}
+#undef RH_RF95_STATUS
 
-    	if(crc_present){
-    	    printf("CRC Present\n");
-    	}
+	if (single)
+	{
+	    // The radio returns to standby by itself after a single receive
+	    _rxOnTime += (millis() - _rxStart) * 1000;
+	    setModeIdle();
+	    if (_sfScanSF)
+	    {
+		// Scanning: back to CAD, unless there is a message to collect first
+		if (!_rxBufValid)
+		    startScanCAD();
+		else
+		{
+		    _sfScanStats[_sfScanSF - RH_SF_SCAN_MIN].received++;
+		    _sfScanLastRx = _sfScanSF;
+		}
+	    }
+	    else if (_sniffActive)
+	    {
+		_sniffActive = false;
+		if (!_rxBufValid)
+		    sleep();
+	    }
+	}
     }
     else if (_mode == RHModeTx && irq_flags & RH_RF95_TX_DONE)
     {
     	_txGood++;
     	setModeIdle();
+	if (_sniffing)
+	    sleep(); // Back to duty cycled receive, which send() paused
     }
-    else if (_mode == RHModeCad && (irq_flags & RH_RF95_CAD_DONE || (modem_config != RH_RF95_MODE_CAD)))
+    else if (_mode == RHModeCad && (irq_flags & RH_RF95_CAD_DONE || ((spiRead(RH_RF95_REG_01_OP_MODE) & RH_RF95_MODE) != RH_RF95_MODE_CAD)))
     {
         _cad = irq_flags & RH_RF95_CAD_DETECTED;
         setModeIdle();
+	if (_sfScanSF)
+	{
+	    // Scanning: receive on the spreading factor that heard a preamble, else on to the next CAD
+	    if (_cad)
+	    {
+		sfScanDetected();
+		setModeRxSingle();
+	    }
+	    else
+		startScanCAD();
+	}
+	else if (_sniffActive)
+	{
+	    // Go straight on to receive while the preamble is still on the air
+	    if (_cad)
+	    {
+		_cadDetections++;
+		setModeRxSingle();
+	    }
+	    else
+	    {
+		_sniffActive = false;
+		sleep();
+	    }
+	}
     }
 
     // Sigh: on some processors, for some unknown reason, doing this only once does not actually
@@ -285,14 +416,22 @@ void RH_RF95::validateRxBuf()
 {
     if(_explicitHeaderMode == 2) {
         // Header is TO FROM ID FLAGS 
-        if (_bufLen < 4)
+        if (_bufLen < RH_RF95_HEADER_LEN)
             return; // Too short even for the header
         
         // Extract the 4 headers
+#ifdef RH_WIDE_ADDRESSES
+        // Addresses are sent most significant octet first
+        _rxHeaderTo    = ((RHAddress)_buf[0] << 8) | _buf[1];
+        _rxHeaderFrom  = ((RHAddress)_buf[2] << 8) | _buf[3];
+        _rxHeaderId    = _buf[4];
+        _rxHeaderFlags = _buf[5];
+#else
         _rxHeaderTo    = _buf[0];
         _rxHeaderFrom  = _buf[1];
         _rxHeaderId    = _buf[2];
         _rxHeaderFlags = _buf[3];
+#endif
         
         // check if we do not care for addresses, if we were addressed by this message, or this message is a broadcast
         if (_promiscuous || _rxHeaderTo == _thisAddress || _rxHeaderTo == RH_BROADCAST_ADDRESS)
@@ -303,11 +442,15 @@ void RH_RF95::validateRxBuf()
     }
     else if (_explicitHeaderMode == 1) {
         // Header is FROM 
-        if (_bufLen < 1)
+        if (_bufLen < RH_RF95_HEADER_LEN)
             return; // Too short even for the header
 
         // Extract the FROM header field        
+#ifdef RH_WIDE_ADDRESSES
+        _rxHeaderFrom  = ((RHAddress)_buf[0] << 8) | _buf[1];
+#else
         _rxHeaderFrom  = _buf[0];
+#endif
 
         printf("[Mode 1] Header From: %#x \n", _rxHeaderFrom);
 
@@ -332,6 +475,21 @@ void RH_RF95::validateRxBuf()
 bool RH_RF95::available()
 {
     handleInterrupt();
+    if (_rxWindowState == RxWindowPending || _rxWindowState == RxWindowOpen)
+    {
+	pollRxWindow();
+	return _rxBufValid;
+    }
+    if (_sfScanMask)
+    {
+	pollSFScan();
+	return _rxBufValid;
+    }
+    if (_sniffing)
+    {
+	pollSniff();
+	return _rxBufValid;
+    }
 //#ifdef RH_RF95_IRQLESS
     //// Read the interrupt register
     //uint8_t irq_flags = spiRead(RH_RF95_REG_12_IRQ_FLAGS);
@@ -369,6 +527,9 @@ bool RH_RF95::available()
 
     if (_mode == RHModeTx)
 	return false;
+    // Stay in standby while a message waits, so its payload can still be read from the FIFO
+    if (_rxBufValid)
+	return true;
     setModeRx();
     return _rxBufValid; // Will be set by the interrupt handler when a good message is received
 }
@@ -377,10 +538,20 @@ void RH_RF95::clearRxBuf()
 {
     ATOMIC_BLOCK_START;
     _rxBufValid = false;
+    _rxFifoPending = false;
     _bufLen = 0;
     ATOMIC_BLOCK_END;
 }
 
+void RH_RF95::fetchRxPayload()
+{
+    if (!_rxFifoPending)
+	return;
+    spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, _rxFifoAddr + RH_RF95_HEADER_LEN);
+    spiBurstRead(RH_RF95_REG_00_FIFO, _buf + RH_RF95_HEADER_LEN, _bufLen - RH_RF95_HEADER_LEN);
+    _rxFifoPending = false;
+}
+
 bool RH_RF95::recv(uint8_t* buf, uint8_t* len)
 {
     if (!available())
@@ -400,20 +571,119 @@ bool RH_RF95::recv(uint8_t* buf, uint8_t* len)
        
     	printf("Len: %i\n", *len);
 
-        memcpy(buf, _buf + RH_RF95_HEADER_LEN, *len);
+	// Straight from the FIFO if the payload is still there, else from where it was fetched to
+	if (_rxFifoPending)
+	{
+	    spiWrite(RH_RF95_REG_0D_FIFO_ADDR_PTR, _rxFifoAddr + RH_RF95_HEADER_LEN);
+	    spiBurstRead(RH_RF95_REG_00_FIFO, buf, *len);
+	}
+	else
+	    memcpy(buf, _buf + RH_RF95_HEADER_LEN, *len);
     	ATOMIC_BLOCK_END;
     }
     clearRxBuf(); // This message accepted and cleared
     return true;
 }
 
+bool RH_RF95::recv(uint8_t* buf, uint8_t* len, RxMetadata* meta)
+{
+    if (!available())
+	return false;
+    if (meta)
+    {
+	// Capture before recv() clears the buffer
+	meta->timestamp = _lastRxTime;
+	meta->rssi = _lastRssi;
+	meta->snr = _lastSNR;
+	meta->freqError = frequencyError();
+	meta->to = _rxHeaderTo;
+	meta->from = _rxHeaderFrom;
+	meta->id = _rxHeaderId;
+	meta->flags = _rxHeaderFlags;
+    }
+    return recv(buf, len);
+}
+
+uint64_t RH_RF95::lastRxTime()
+{
+    return _lastRxTime;
+}
+
+uint64_t RH_RF95::lastTxTime()
+{
+    return _lastTxTime;
+}
+
+bool RH_RF95::setEdgeTimestamps(uint8_t pin)
+{
+#if (RH_PLATFORM == RH_PLATFORM_RASPI)
+    gpioEdgeClose(_edgeFd);
+    _edgeFd = gpioEdgeOpen(pin);
+    return _edgeFd >= 0;
+#else
+    return false;
+#endif
+}
+
+void RH_RF95::waitIrq(uint32_t timeout)
+{
+#if (RH_PLATFORM == RH_PLATFORM_RASPI)
+    if (_edgeFd >= 0)
+    {
+	gpioEdgeWait(_edgeFd, timeout);
+	return;
+    }
+#endif
+    delayMicroseconds(timeout);
+}
+
+uint64_t RH_RF95::edgeTime()
+{
+#if (RH_PLATFORM == RH_PLATFORM_RASPI)
+    uint64_t age;
+    if (_edgeFd >= 0 && gpioEdgeRead(_edgeFd, &age))
+    {
+	uint64_t now = RHClock::instance()->nanos();
+	return now > age ? now - age : 1;
+    }
+#endif
+    return 0;
+}
+
+void RH_RF95::pollEdges()
+{
+    uint64_t edge = edgeTime();
+    // Edges from before the last claim signalled flags that have been handled already
+    if (edge > _edgeCut)
+	_pendingEdge = edge;
+}
+
+uint64_t RH_RF95::claimEdge(uint64_t flagsRead)
+{
+    uint64_t edge = _pendingEdge ? _pendingEdge : flagsRead;
+    _pendingEdge = 0;
+    _edgeCut = flagsRead;
+    return edge;
+}
+
+void RH_RF95::mapDio0(uint8_t mapping)
+{
+    spiWrite(RH_RF95_REG_40_DIO_MAPPING1, mapping);
+    // Any edge so far signalled an interrupt of the old mapping
+    _pendingEdge = 0;
+    _edgeCut = RHClock::instance()->nanos();
+}
+
 bool RH_RF95::send(const uint8_t* data, uint8_t len)
 {
     if (len > RH_RF95_MAX_MESSAGE_LEN)
 	   return false;
 
     waitPacketSent(); // Make sure we dont interrupt an outgoing message
+    pauseSniff();
     setModeIdle();
+    pauseSFScan();
+    fetchRxPayload(); // The packet we send overwrites the FIFO
 
     if (!waitCAD()) 
 	   return false;  // Check channel activity
@@ -423,14 +693,21 @@ bool RH_RF95::send(const uint8_t* data, uint8_t len)
 
 
     if(_explicitHeaderMode == 2) {
-        // Header is TO FROM ID FLAGS 
-        spiWrite(RH_RF95_REG_00_FIFO, _txHeaderTo);
-        spiWrite(RH_RF95_REG_00_FIFO, _txHeaderFrom);
-        spiWrite(RH_RF95_REG_00_FIFO, _txHeaderId);
-        spiWrite(RH_RF95_REG_00_FIFO, _txHeaderFlags);
+        // Header is TO FROM ID FLAGS, in one burst rather than a transfer per octet
+#ifdef RH_WIDE_ADDRESSES
+        uint8_t header[6] = { (uint8_t)(_txHeaderTo >> 8), (uint8_t)_txHeaderTo, 
+                              (uint8_t)(_txHeaderFrom >> 8), (uint8_t)_txHeaderFrom,
+                              _txHeaderId, _txHeaderFlags };
+#else
+        uint8_t header[4] = { _txHeaderTo, _txHeaderFrom, _txHeaderId, _txHeaderFlags };
+#endif
+        spiBurstWrite(RH_RF95_REG_00_FIFO, header, sizeof(header));
     }
     else if (_explicitHeaderMode == 1) {
         // Header is FROM 
+#ifdef RH_WIDE_ADDRESSES
+        spiWrite(RH_RF95_REG_00_FIFO, _txHeaderFrom >> 8);
+#endif
         spiWrite(RH_RF95_REG_00_FIFO, _txHeaderFrom);
     }
     else if (_explicitHeaderMode == 0) {
@@ -458,15 +735,25 @@ bool RH_RF95::waitPacketSent()
     if (_mode != RHModeTx)
     return false;
     
-    while (!(spiRead(RH_RF95_REG_12_IRQ_FLAGS) & RH_RF95_TX_DONE)){
-      YIELD;
+    // Edges are read before the flags, as in handleInterrupt()
+    uint64_t flagsRead;
+    while (true)
+    {
+	pollEdges();
+	flagsRead = RHClock::instance()->nanos();
+	if (spiRead(RH_RF95_REG_12_IRQ_FLAGS) & RH_RF95_TX_DONE)
+	    break;
+	YIELD;
     }
+    _lastTxTime = claimEdge(flagsRead);
     // Reset the TX Done flag by writing a 1 at RH_RF95_TX_DONE bit position
     spiWrite(RH_RF95_REG_12_IRQ_FLAGS, RH_RF95_TX_DONE);
 
     // A transmitter message has been fully sent
     _txGood++;
     setModeIdle(); // Clears FIFO
+    if (_sniffing)
+	sleep(); // Back to duty cycled receive, which send() paused
     return true;
 }
 #endif // defined RH_RF95_IRQLESS
@@ -496,21 +783,65 @@ bool RH_RF95::setFrequency(float centre)
 {    
     setModeIdle();
     // Frf = FRF / FSTEP
-    uint32_t frf = (centre * 1000000.0) / RH_RF95_FSTEP;
-    spiWrite(RH_RF95_REG_06_FRF_MSB, (frf >> 16) & 0xff);
-    spiWrite(RH_RF95_REG_07_FRF_MID, (frf >> 8) & 0xff);
-    spiWrite(RH_RF95_REG_08_FRF_LSB, frf & 0xff);
+    _frf = (centre * 1000000.0) / RH_RF95_FSTEP;
+    _frequencyCorrection = 0;
+    writeFrf(_frf);
     _usingHFport = (centre >= 779.0);
 
     return true;
 }
 
+void RH_RF95::writeFrf(uint32_t frf)
+{
+    uint8_t regs[3];
+    regs[0] = (frf >> 16) & 0xff;
+    regs[1] = (frf >> 8) & 0xff;
+    regs[2] = frf & 0xff;
+    spiBurstWrite(RH_RF95_REG_06_FRF_MSB, regs, sizeof(regs));
+}
+
+bool RH_RF95::setFrequencyCorrection(int32_t hz)
+{
+    // Round to the nearest synthesizer step
+    int32_t steps = (int32_t)((hz >= 0 ? hz + RH_RF95_FSTEP / 2 : hz - RH_RF95_FSTEP / 2) / RH_RF95_FSTEP);
+    if (steps == _frequencyCorrection)
+	return false;
+    setModeIdle();
+    _frequencyCorrection = steps;
+    writeFrf(_frf + steps);
+    return true;
+}
+
+int32_t RH_RF95::frequencyCorrection()
+{
+    return (int32_t)(_frequencyCorrection * RH_RF95_FSTEP);
+}
+
+bool RH_RF95::setPpmCorrection(int32_t hz)
+{
+    // Semtech recommend RegPpmCorrection = 0.95 * offset in ppm
+    int64_t centre = (int64_t)(_frf * RH_RF95_FSTEP);
+    int32_t value = centre ? (int32_t)(((int64_t)hz * 95000000LL) / (centre * 100)) : 0;
+    if (value > 127)
+	value = 127;
+    if (value < -128)
+	value = -128;
+    if (value == _ppmCorrection)
+	return false;
+    _ppmCorrection = value;
+    spiWrite(RH_RF95_REG_27_PPM_CORRECTION, (uint8_t)(int8_t)value);
+    return true;
+}
+
+// Every write of RegOpMode keeps the LoRa bit set. The chip only takes that bit in sleep, so a mode
+// written without it straight after sleep (eg when sniffing, see setSniffMode()) would switch it to FSK
 void RH_RF95::setModeIdle()
 {
     if (_mode != RHModeIdle)
     {
-	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_STDBY);
+	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_LONG_RANGE_MODE | RH_RF95_MODE_STDBY);
 	_mode = RHModeIdle;
+	_rxSingle = false;
     }
 }
 
@@ -518,34 +849,54 @@ bool RH_RF95::sleep()
 {
     if (_mode != RHModeSleep)
     {
-	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_SLEEP);
+	fetchRxPayload(); // The FIFO is cleared in sleep
+	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_LONG_RANGE_MODE | RH_RF95_MODE_SLEEP);
 	_mode = RHModeSleep;
+	_rxSingle = false;
     }
     return true;
 }
 
 void RH_RF95::setModeRx()
 {
-    if (_mode != RHModeRx)
+    if (_mode != RHModeRx || _rxSingle)
     {
-	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_RXCONTINUOUS);
-	spiWrite(RH_RF95_REG_40_DIO_MAPPING1, 0x00); // Interrupt on RxDone
+	fetchRxPayload(); // The next packet received may overwrite the FIFO
+	mapDio0(0x00); // Interrupt on RxDone
+	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_LONG_RANGE_MODE | RH_RF95_MODE_RXCONTINUOUS);
 	_mode = RHModeRx;
+	_rxSingle = false;
     }
 }
 
+// Receives a single packet, or times out after RH_RF95_REG_1F_SYMB_TIMEOUT_LSB symbols
+// without finding a preamble. Either way the radio then returns to standby by itself.
+void RH_RF95::setModeRxSingle()
+{
+    fetchRxPayload();
+    mapDio0(0x00); // Interrupt on RxDone
+    spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_LONG_RANGE_MODE | RH_RF95_MODE_RXSINGLE);
+    _mode = RHModeRx;
+    _rxSingle = true;
+    _rxStart = millis();
+}
+
 void RH_RF95::setModeTx()
 {
     if (_mode != RHModeTx)
     {
-	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_TX);
-	spiWrite(RH_RF95_REG_40_DIO_MAPPING1, 0x40); // Interrupt on TxDone
+	mapDio0(0x40); // Interrupt on TxDone
+	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_LONG_RANGE_MODE | RH_RF95_MODE_TX);
 	_mode = RHModeTx;
     }
 }
 
 void RH_RF95::setTxPower(int8_t power, bool useRFO)
 {
+    // Remember what was asked for, so setLinkParams() can skip redundant writes
+    _txPower = power;
+    _useRFO = useRFO;
+
     // Sigh, different behaviours depending on whther the module use PA_BOOST or the RFO pin
     // for the transmitter output
     if (useRFO)
@@ -592,6 +943,30 @@ void RH_RF95::setModemRegisters(const ModemConfig* config)
     spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1,       config->reg_1d);
     spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2,       config->reg_1e);
     spiWrite(RH_RF95_REG_26_MODEM_CONFIG3,       config->reg_26);
+    _modemConfig = *config;
+    // reg_1e also holds the top bits of the symbol timeout
+    _symbolTimeout = ((config->reg_1e & RH_RF95_SYM_TIMEOUT_MSB) << 8) | (_symbolTimeout & 0xff);
+}
+
+// Writes only those modem configuration registers that differ from the shadow copy
+// The caller is responsible for having the radio in a mode where this is allowed
+void RH_RF95::updateModemRegisters(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26)
+{
+    if (reg_1d != _modemConfig.reg_1d)
+    {
+	spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1, reg_1d);
+	_modemConfig.reg_1d = reg_1d;
+    }
+    if (reg_1e != _modemConfig.reg_1e)
+    {
+	spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2, reg_1e);
+	_modemConfig.reg_1e = reg_1e;
+    }
+    if (reg_26 != _modemConfig.reg_26)
+    {
+	spiWrite(RH_RF95_REG_26_MODEM_CONFIG3, reg_26);
+	_modemConfig.reg_26 = reg_26;
+    }
 }
 
 // Set one of the canned FSK Modem configs
@@ -610,24 +985,34 @@ bool RH_RF95::setModemConfig(ModemConfigChoice index)
 
 void RH_RF95::setPreambleLength(uint16_t bytes)
 {
+    _preambleLength = bytes;
     spiWrite(RH_RF95_REG_20_PREAMBLE_MSB, bytes >> 8);
     spiWrite(RH_RF95_REG_21_PREAMBLE_LSB, bytes & 0xff);
 }
 
 bool RH_RF95::isChannelActive()
 {
+    pauseSFScan();
+    pauseSniff();
+
     // Set mode RHModeCad
     if (_mode != RHModeCad)
     {
-        spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_MODE_CAD);
-        //spiWrite(RH_RF95_REG_40_DIO_MAPPING1, 0x80); // Interrupt on CadDone
+        mapDio0(0x80); // Interrupt on CadDone
+        spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_LONG_RANGE_MODE | RH_RF95_MODE_CAD);
         _mode = RHModeCad;
     }
 
+#ifdef RH_RF95_IRQLESS
+    // Sleep through the CAD instead of reading the IRQ flags over SPI all the while
+    uint32_t expected = cadTime();
+    unsigned long start = micros();
+#endif
     while (_mode == RHModeCad){
 #ifdef RH_RF95_IRQLESS
+	uint32_t elapsed = micros() - start;
+	waitIrq(elapsed < expected ? expected - elapsed : RH_RF95_IRQ_POLL_INTERVAL);
 	handleInterrupt();
-	fflush(stdout);
 #else
         YIELD;
 #endif
@@ -636,6 +1021,12 @@ bool RH_RF95::isChannelActive()
     return _cad;
 }
 
+// CAD listens for about 1 symbol and then processes for most of another
+uint32_t RH_RF95::cadTime()
+{
+    return 2 * symbolTime();
+}
+
 void RH_RF95::enableTCXO()
 {
     while ((spiRead(RH_RF95_REG_4B_TCXO) & RH_RF95_TCXO_TCXO_INPUT_ON) != RH_RF95_TCXO_TCXO_INPUT_ON)
@@ -647,31 +1038,15 @@ void RH_RF95::enableTCXO()
 
 // From section 4.1.5 of SX1276/77/78/79
 // Ferror = FreqError * 2**24 * BW / Fxtal / 500
+// The FEI registers are captured together with each received packet in handleInterrupt()
 int RH_RF95::frequencyError()
 {
-    int32_t freqerror = 0;
-
-    // Convert 2.5 bytes (5 nibbles, 20 bits) to 32 bit signed int
-    // Caution: some C compilers make errors with eg:
-    // freqerror = spiRead(RH_RF95_REG_28_FEI_MSB) << 16
-    // so we go more carefully.
-    freqerror = spiRead(RH_RF95_REG_28_FEI_MSB);
-    freqerror <<= 8;
-    freqerror |= spiRead(RH_RF95_REG_29_FEI_MID);
-    freqerror <<= 8;
-    freqerror |= spiRead(RH_RF95_REG_2A_FEI_LSB);
-    // Sign extension into top 3 nibbles
-    if (freqerror & 0x80000)
-	freqerror |= 0xfff00000;
-
-    int error = 0; // In hertz
-    float bw_tab[] = {7.8, 10.4, 15.6, 20.8, 31.25, 41.7, 62.5, 125, 250, 500};
-    uint8_t bwindex = spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) >> 4;
-    if (bwindex < (sizeof(bw_tab) / sizeof(float)))
-	error = (float)freqerror * bw_tab[bwindex] * ((float)(1L << 24) / (float)RH_RF95_FXOSC / 500.0);
-    // else not defined
+    long bw = signalBandwidth();
+    if (!bw)
+	return 0; // not defined
 
-    return error;
+    // 2**24 / 32MHz reduces to 8192 / 15625, and BW is in Hz rather than kHz
+    return (int)(((int64_t)_lastFreqError * bw * 8192) / (15625LL * 500000));
 }
 
 int RH_RF95::lastSNR()
@@ -693,59 +1068,68 @@ int RH_RF95::lastSNR()
  {
     printf("Setting SpreadingFactor to %d\n", sf);
     setModeIdle();
-    
+
+   // set the new spreading factor
+   uint8_t reg_1e = (_modemConfig.reg_1e & ~RH_RF95_SPREADING_FACTOR) | spreadingFactorBits(sf);
+   updateModemRegisters(_modemConfig.reg_1d, reg_1e, _modemConfig.reg_26);
+   // check if Low data Rate bit should be set or cleared
+   setLowDatarate();
+ }
+
+// Maps a spreading factor 6..12 to the RH_RF95_REG_1E_MODEM_CONFIG2 SF bits, clamping out of range values
+uint8_t RH_RF95::spreadingFactorBits(uint8_t sf)
+{
     if (sf <= 6) 
-        sf = RH_RF95_SPREADING_FACTOR_64CPS;
+        return RH_RF95_SPREADING_FACTOR_64CPS;
     else if (sf == 7) 
-        sf = RH_RF95_SPREADING_FACTOR_128CPS;
+        return RH_RF95_SPREADING_FACTOR_128CPS;
     else if (sf == 8) 
-        sf = RH_RF95_SPREADING_FACTOR_256CPS;
+        return RH_RF95_SPREADING_FACTOR_256CPS;
     else if (sf == 9)
-        sf = RH_RF95_SPREADING_FACTOR_512CPS;
+        return RH_RF95_SPREADING_FACTOR_512CPS;
     else if (sf == 10)
-        sf = RH_RF95_SPREADING_FACTOR_1024CPS;
+        return RH_RF95_SPREADING_FACTOR_1024CPS;
     else if (sf == 11) 
-        sf = RH_RF95_SPREADING_FACTOR_2048CPS;
-    else if (sf >= 12)
-        sf =  RH_RF95_SPREADING_FACTOR_4096CPS;
-
-   // set the new spreading factor
-   spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2, (spiRead(RH_RF95_REG_1E_MODEM_CONFIG2) & ~RH_RF95_SPREADING_FACTOR) | sf);
-   // check if Low data Rate bit should be set or cleared
-   setLowDatarate();
- }
+        return RH_RF95_SPREADING_FACTOR_2048CPS;
+    else
+        return RH_RF95_SPREADING_FACTOR_4096CPS;
+}
  
 void RH_RF95::setSignalBandwidth(long sbw)
 {
     printf("Setting Bandwidth to %ld\n", sbw);
     setModeIdle();
-    uint8_t bw; //register bit pattern
- 
+     
+    // top 4 bits of reg 1D control bandwidth
+    uint8_t reg_1d = (_modemConfig.reg_1d & ~RH_RF95_BW) | bandwidthBits(sbw);
+    updateModemRegisters(reg_1d, _modemConfig.reg_1e, _modemConfig.reg_26);
+    // check if low data rate bit should be set or cleared
+    setLowDatarate();
+}
+
+// Maps a bandwidth in Hz to the RH_RF95_REG_1D_MODEM_CONFIG1 BW bits, rounding up to the next supported value
+uint8_t RH_RF95::bandwidthBits(long sbw)
+{
     if (sbw <= 7800)
-	   bw = RH_RF95_BW_7_8KHZ;
+	   return RH_RF95_BW_7_8KHZ;
     else if (sbw <= 10400)
-	   bw =  RH_RF95_BW_10_4KHZ;
+	   return RH_RF95_BW_10_4KHZ;
     else if (sbw <= 15600)
-	   bw = RH_RF95_BW_15_6KHZ ;
+	   return RH_RF95_BW_15_6KHZ ;
     else if (sbw <= 20800)
-    	bw = RH_RF95_BW_20_8KHZ;
+    	return RH_RF95_BW_20_8KHZ;
     else if (sbw <= 31250)
-	   bw = RH_RF95_BW_31_25KHZ;
+	   return RH_RF95_BW_31_25KHZ;
     else if (sbw <= 41700)
-	   bw = RH_RF95_BW_41_7KHZ;
+	   return RH_RF95_BW_41_7KHZ;
     else if (sbw <= 62500)
-	   bw = RH_RF95_BW_62_5KHZ;
+	   return RH_RF95_BW_62_5KHZ;
     else if (sbw <= 125000)
-	   bw = RH_RF95_BW_125KHZ;
+	   return RH_RF95_BW_125KHZ;
     else if (sbw <= 250000)
-	   bw = RH_RF95_BW_250KHZ;
+	   return RH_RF95_BW_250KHZ;
     else 
-       bw = RH_RF95_BW_500KHZ;
-     
-    // top 4 bits of reg 1D control bandwidth
-    spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1, (spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) & ~RH_RF95_BW) | bw);
-    // check if low data rate bit should be set or cleared
-    setLowDatarate();
+       return RH_RF95_BW_500KHZ;
 }
  
 void RH_RF95::setCodingRate4(uint8_t denominator)
@@ -764,7 +1148,7 @@ void RH_RF95::setCodingRate4(uint8_t denominator)
 	cr = RH_RF95_CODING_RATE_4_8;
  
     // CR is bits 3..1 of RH_RF95_REG_1D_MODEM_CONFIG1
-    spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1, (spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) & ~RH_RF95_CODING_RATE) | cr);
+    updateModemRegisters((_modemConfig.reg_1d & ~RH_RF95_CODING_RATE) | cr, _modemConfig.reg_1e, _modemConfig.reg_26);
 }
  
 void RH_RF95::setLowDatarate()
@@ -775,17 +1159,6 @@ void RH_RF95::setLowDatarate()
     // or  motion,the  low  data  rate optimization  bit  is  used. Specifically for 125  kHz  bandwidth  and  SF  =  11  and  12,  
     // this  adds  a  small  overhead  to increase robustness to reference frequency variations over the timescale of the LoRa packet."
  
-    // read current value for BW and SF
-    uint8_t BW = spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) >> 4;	// bw is in bits 7..4
-    uint8_t SF = spiRead(RH_RF95_REG_1E_MODEM_CONFIG2) >> 4;	// sf is in bits 7..4
-   
-    // calculate symbol time (see Semtech AN1200.22 section 4)
-    float bw_tab[] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
-   
-    float bandwidth = bw_tab[BW];
-   
-    float symbolTime = 1000.0 * pow(2, SF) / bandwidth;	// ms
-   
     // the symbolTime for SF 11 BW 125 is 16.384ms. 
     // and, according to this :- 
     // https://www.thethingsnetwork.org/forum/t/a-point-to-note-lora-low-data-rate-optimisation-flag/12007
@@ -793,24 +1166,37 @@ void RH_RF95::setLowDatarate()
     // So the threshold used here is 16.0ms
  
     // the LDR is bit 3 of RH_RF95_REG_26_MODEM_CONFIG3
-    uint8_t current = spiRead(RH_RF95_REG_26_MODEM_CONFIG3) & ~RH_RF95_LOW_DATA_RATE_OPTIMIZE; // mask off the LDR bit
-    if (symbolTime > 16.0)
-	spiWrite(RH_RF95_REG_26_MODEM_CONFIG3, current | RH_RF95_LOW_DATA_RATE_OPTIMIZE);
+    updateModemRegisters(_modemConfig.reg_1d, _modemConfig.reg_1e,
+			 lowDatarateBits(_modemConfig.reg_1d, _modemConfig.reg_1e, _modemConfig.reg_26));
+}
+
+// Returns reg_26 with the LDR bit set or cleared to suit the BW and SF in reg_1d and reg_1e
+uint8_t RH_RF95::lowDatarateBits(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26)
+{
+    // calculate symbol time (see Semtech AN1200.22 section 4)
+    uint8_t bwindex = reg_1d >> 4;	// bw is in bits 7..4
+    uint8_t sf = reg_1e >> 4;		// sf is in bits 7..4
+    if (bwindex >= RH_RF95_NUM_BANDWIDTHS)
+	return reg_26;
+    uint32_t symbolTime = (1000000UL << sf) / BANDWIDTH_TABLE[bwindex]; // us
+
+    uint8_t current = reg_26 & ~RH_RF95_LOW_DATA_RATE_OPTIMIZE; // mask off the LDR bit
+    if (symbolTime > 16000)
+	return current | RH_RF95_LOW_DATA_RATE_OPTIMIZE;
     else
-	spiWrite(RH_RF95_REG_26_MODEM_CONFIG3, current);
-   
+	return current;
 }
  
 void RH_RF95::setPayloadCRC(bool on)
 {
     // Payload CRC is bit 2 of register 1E
-    uint8_t current = spiRead(RH_RF95_REG_1E_MODEM_CONFIG2) & ~RH_RF95_PAYLOAD_CRC_ON; // mask off the CRC
+    uint8_t current = _modemConfig.reg_1e & ~RH_RF95_PAYLOAD_CRC_ON; // mask off the CRC
    	
     if (on) {    	
-		spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2, current | RH_RF95_PAYLOAD_CRC_ON);		
+		updateModemRegisters(_modemConfig.reg_1d, current | RH_RF95_PAYLOAD_CRC_ON, _modemConfig.reg_26);
     }	
     else {
-		spiWrite(RH_RF95_REG_1E_MODEM_CONFIG2, current);
+		updateModemRegisters(_modemConfig.reg_1d, current, _modemConfig.reg_26);
     }
 }
 
@@ -838,14 +1224,14 @@ int RH_RF95::getSyncWord(){
 
 void RH_RF95::setImplicitHeaderMode(bool on, uint8_t expectedPayloadLength) {
 	
-    uint8_t current = spiRead(RH_RF95_REG_1D_MODEM_CONFIG1) & ~RH_RF95_IMPLICIT_HEADER_MODE_ON; // mask off the CRC
+    uint8_t current = _modemConfig.reg_1d & ~RH_RF95_IMPLICIT_HEADER_MODE_ON; // mask off the CRC
    	
     if (on) {    
-		spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1, current | RH_RF95_IMPLICIT_HEADER_MODE_ON);
+		updateModemRegisters(current | RH_RF95_IMPLICIT_HEADER_MODE_ON, _modemConfig.reg_1e, _modemConfig.reg_26);
         RH_RF95_IMPLICIT_HEADER_MODE_EXPECTED_PAYLOAD_LENGTH = expectedPayloadLength;
     }	
     else {
-		spiWrite(RH_RF95_REG_1D_MODEM_CONFIG1, current);
+		updateModemRegisters(current, _modemConfig.reg_1e, _modemConfig.reg_26);
     }
 }
 
@@ -867,10 +1253,10 @@ void RH_RF95::setExplicitHeaderMode(uint8_t mode) {
         RH_RF95_HEADER_LEN = 0;
     }
     else if(mode == 1) {
-        RH_RF95_HEADER_LEN = 1;
+        RH_RF95_HEADER_LEN = sizeof(RHAddress);
     }
     else if(mode == 2) {
-        RH_RF95_HEADER_LEN = 4;
+        RH_RF95_HEADER_LEN = 2 + 2 * sizeof(RHAddress);
     }
 
     RH_RF95_MAX_MESSAGE_LEN = (RH_RF95_MAX_PAYLOAD_LEN - RH_RF95_HEADER_LEN);    
@@ -911,6 +1297,91 @@ int RH_RF95::sampleRssi() {
     return rssiValue;
 }
 
+void RH_RF95::scanChannels(const float* frequencies, uint8_t count, uint16_t dwell, ChannelScan* results, uint16_t sfMask)
+{
+    waitPacketSent();
+    setModeIdle();
+    uint8_t reg_1d = _modemConfig.reg_1d;
+    uint8_t reg_1e = _modemConfig.reg_1e;
+    uint8_t reg_26 = _modemConfig.reg_26;
+    RHGenericSPI::Frequency spiFrequency = _spi.frequency();
+    _spi.setFrequency(RH_RF95_SCAN_SPI_FREQUENCY);
+    _spi.begin();
+
+    uint8_t i;
+    for (i = 0; i < count; i++)
+    {
+	ChannelScan* result = &results[i];
+	result->frequency = frequencies[i];
+	writeFrf((uint32_t)((frequencies[i] * 1000000.0) / RH_RF95_FSTEP));
+	int16_t offset = frequencies[i] >= 779.0 ? 157 : 164;
+
+	// Sample in continuous receive. A histogram of the raw register values gives the percentiles
+	// without storing the samples
+	uint32_t histogram[256];
+	memset(histogram, 0, sizeof(histogram));
+	uint32_t samples = 0;
+	uint64_t sum = 0;
+	fetchRxPayload();
+	spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_LONG_RANGE_MODE | RH_RF95_MODE_RXCONTINUOUS);
+	_mode = RHModeRx;
+	delayMicroseconds(RH_RF95_RSSI_SETTLE);
+	unsigned long start = millis();
+	do
+	{
+	    uint8_t raw = spiRead(RH_RF95_REG_1B_RSSI_VALUE);
+	    histogram[raw]++;
+	    sum += raw;
+	    samples++;
+	} while (millis() - start < dwell);
+	setModeIdle();
+
+	result->samples = samples;
+	result->mean = (float)sum / samples - offset;
+	uint32_t below = 0;
+	uint16_t raw;
+	bool first = true;
+	for (raw = 0; raw < 256; raw++)
+	{
+	    if (!histogram[raw])
+		continue;
+	    if (first)
+		result->min = raw - offset;
+	    first = false;
+	    result->max = raw - offset;
+	    // Percentile p is the lowest value with more than p% of samples at or below it
+	    uint32_t upto = below + histogram[raw];
+	    if (below * 100 <= samples * 10 && upto * 100 > samples * 10)
+		result->p10 = raw - offset;
+	    if (below * 100 <= samples * 50 && upto * 100 > samples * 50)
+		result->p50 = raw - offset;
+	    if (below * 100 <= samples * 90 && upto * 100 > samples * 90)
+		result->p90 = raw - offset;
+	    if (below * 100 <= samples * 99 && upto * 100 > samples * 99)
+		result->p99 = raw - offset;
+	    below = upto;
+	}
+
+	// Then look for preambles
+	result->cadDetected = 0;
+	uint8_t sf;
+	for (sf = 7; sf <= 12; sf++)
+	{
+	    if (!(sfMask & (1 << sf)))
+		continue;
+	    updateModemRegisters(reg_1d, (reg_1e & ~RH_RF95_SPREADING_FACTOR) | spreadingFactorBits(sf), reg_26);
+	    if (isChannelActive())
+		result->cadDetected |= (1 << sf);
+	}
+	updateModemRegisters(reg_1d, reg_1e, reg_26);
+    }
+
+    _spi.setFrequency(spiFrequency);
+    _spi.begin();
+    writeFrf(_frf + _frequencyCorrection);
+    spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Forget anything heard while scanning
+}
+
 bool RH_RF95::lastCrcOk(){
     return _lastCrcOk;
 }
@@ -927,3 +1398,403 @@ int RH_RF95::getMaxMessageLength() {
     return RH_RF95_MAX_MESSAGE_LEN;
 }
 
+
+///////////////////////////////////////////////////
+//
+// Link parameter fast path and airtime calculations
+//
+///////////////////////////////////////////////////
+bool RH_RF95::setLinkParams(uint8_t sf, long sbw, int8_t power)
+{
+    uint8_t reg_1d = (_modemConfig.reg_1d & ~RH_RF95_BW) | bandwidthBits(sbw);
+    uint8_t reg_1e = (_modemConfig.reg_1e & ~RH_RF95_SPREADING_FACTOR) | spreadingFactorBits(sf);
+    uint8_t reg_26 = lowDatarateBits(reg_1d, reg_1e, _modemConfig.reg_26);
+    bool changed = false;
+
+    if (   reg_1d != _modemConfig.reg_1d
+	|| reg_1e != _modemConfig.reg_1e
+	|| reg_26 != _modemConfig.reg_26)
+    {
+	// Modem config may only be changed while not transmitting or receiving
+	setModeIdle();
+	updateModemRegisters(reg_1d, reg_1e, reg_26);
+	changed = true;
+    }
+    if (power != _txPower)
+    {
+	setTxPower(power, _useRFO);
+	changed = true;
+    }
+    return changed;
+}
+
+uint8_t RH_RF95::spreadingFactor()
+{
+    return _modemConfig.reg_1e >> 4;
+}
+
+long RH_RF95::signalBandwidth()
+{
+    uint8_t bwindex = _modemConfig.reg_1d >> 4;
+    if (bwindex >= RH_RF95_NUM_BANDWIDTHS)
+	return 0;
+    return BANDWIDTH_TABLE[bwindex];
+}
+
+uint8_t RH_RF95::codingRate4()
+{
+    return 4 + ((_modemConfig.reg_1d & RH_RF95_CODING_RATE) >> 1);
+}
+
+int8_t RH_RF95::txPower()
+{
+    return _txPower;
+}
+
+uint32_t RH_RF95::symbolTime()
+{
+    long bw = signalBandwidth();
+    if (!bw)
+	return 0;
+    return (1000000UL << spreadingFactor()) / bw;
+}
+
+// From Semtech AN1200.13 LoRa Modem Designer's Guide, section 4
+uint32_t RH_RF95::timeOnAir(uint8_t len)
+{
+    uint32_t tsym = symbolTime();
+    int32_t  sf   = spreadingFactor();
+    int32_t  cr   = codingRate4() - 4;
+    int32_t  crc  = (_modemConfig.reg_1e & RH_RF95_PAYLOAD_CRC_ON) ? 1 : 0;
+    int32_t  ih   = (_modemConfig.reg_1d & RH_RF95_IMPLICIT_HEADER_MODE_ON) ? 1 : 0;
+    int32_t  de   = (_modemConfig.reg_26 & RH_RF95_LOW_DATA_RATE_OPTIMIZE) ? 1 : 0;
+    int32_t  pl   = len + RH_RF95_HEADER_LEN;
+
+    // Preamble is the programmed length plus 4.25 symbols of sync word and SFD
+    uint32_t preamble = (_preambleLength * tsym) + (17 * tsym) / 4;
+
+    // Number of payload symbols, rounded up to a whole number of codewords
+    int32_t num = 8 * pl - 4 * sf + 28 + 16 * crc - 20 * ih;
+    int32_t den = 4 * (sf - 2 * de);
+    int32_t symbols = 8;
+    if (num > 0)
+	symbols += ((num + den - 1) / den) * (cr + 4);
+
+    return preamble + (uint32_t)symbols * tsym;
+}
+
+////////////////////////////////////////////////////////////////////
+// Duty cycled receive
+void RH_RF95::setSniffMode(bool on, uint16_t interval)
+{
+    _sniffActive = false;
+    if (!on)
+    {
+	_sniffing = false;
+	setModeIdle();
+	return;
+    }
+
+    if (!interval)
+    {
+	// Wake often enough to be sure of catching a preamble of our own length, 
+	// with time left for CAD and for the receiver to lock on
+	uint32_t usable = _preambleLength > RH_RF95_SNIFF_MARGIN_SYMBOLS ? _preambleLength - RH_RF95_SNIFF_MARGIN_SYMBOLS : 0;
+	interval = (usable * symbolTime()) / 1000;
+    }
+    _sniffInterval = interval;
+    _sniffLastWake = millis() - interval; // Take the first look straight away
+    _sniffing = true;
+    setModeIdle();
+}
+
+bool RH_RF95::sniffing()
+{
+    return _sniffing;
+}
+
+uint16_t RH_RF95::sniffInterval()
+{
+    return _sniffInterval;
+}
+
+uint16_t RH_RF95::setWakeupPreamble(uint16_t interval)
+{
+    uint32_t tsym = symbolTime();
+    uint32_t symbols = tsym ? ((uint32_t)interval * 1000 + tsym - 1) / tsym : 0;
+    symbols += RH_RF95_SNIFF_MARGIN_SYMBOLS;
+    if (symbols > 0xffff)
+	symbols = 0xffff;
+    setPreambleLength(symbols);
+    return symbols;
+}
+
+uint32_t RH_RF95::sniffTimeToWake()
+{
+    if (!_sniffing || _mode != RHModeSleep)
+	return 0;
+    uint32_t elapsed = millis() - _sniffLastWake;
+    return elapsed >= _sniffInterval ? 0 : _sniffInterval - elapsed;
+}
+
+uint32_t RH_RF95::radioOnTime()
+{
+    return _rxOnTime;
+}
+
+uint32_t RH_RF95::wakeCount()
+{
+    return _wakeCount;
+}
+
+uint32_t RH_RF95::cadDetectCount()
+{
+    return _cadDetections;
+}
+
+void RH_RF95::resetSniffStats()
+{
+    _rxOnTime = 0;
+    _wakeCount = 0;
+    _cadDetections = 0;
+}
+
+void RH_RF95::waitAvailable()
+{
+    while (!available())
+	waitSniff(0xffffffff);
+}
+
+bool RH_RF95::waitAvailableTimeout(uint16_t timeout)
+{
+    unsigned long starttime = millis();
+    unsigned long elapsed;
+    while ((elapsed = millis() - starttime) < timeout)
+    {
+	if (available())
+	    return true;
+	waitSniff(timeout - elapsed);
+    }
+    return false;
+}
+
+void RH_RF95::waitSniff(uint32_t limit)
+{
+    if (!_sniffing)
+    {
+	YIELD;
+	return;
+    }
+    uint32_t wake = sniffTimeToWake();
+    if (wake)
+	delay(wake < limit ? wake : limit);
+    else if (_mode == RHModeCad)
+	waitIrq(cadTime());
+    else if (_mode == RHModeRx)
+	waitIrq(symbolTime());
+    else
+	YIELD;
+}
+
+// Called from available(). The CAD and receive results are dealt with as they arrive by handleInterrupt()
+void RH_RF95::pollSniff()
+{
+    // Leave the radio alone while transmitting, and keep any message until it is collected
+    if (_mode == RHModeTx || _mode == RHModeCad || _mode == RHModeRx || _rxBufValid)
+	return;
+
+    uint32_t now = millis();
+    if (now - _sniffLastWake < _sniffInterval)
+    {
+	sleep();
+	return;
+    }
+
+    _sniffLastWake = now;
+    _wakeCount++;
+    // CAD takes about 2 symbols, which is too short to time with millis()
+    _rxOnTime += 2 * symbolTime();
+    _cad = false;
+    mapDio0(0x80); // Interrupt on CadDone
+    spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_LONG_RANGE_MODE | RH_RF95_MODE_CAD);
+    _mode = RHModeCad;
+    _sniffActive = true;
+}
+
+void RH_RF95::pauseSniff()
+{
+    if (!_sniffing)
+	return;
+    if (_sniffActive && _mode == RHModeRx)
+	_rxOnTime += (millis() - _rxStart) * 1000;
+    // The FIFO cannot be written in sleep, and a CAD of our own must not be taken for a sniff
+    if (_sniffActive || _mode == RHModeSleep)
+	setModeIdle();
+    _sniffActive = false;
+}
+
+////////////////////////////////////////////////////////////////////
+// Multi spreading factor scanning
+bool RH_RF95::setSFScan(uint16_t sfMask, uint16_t preamble)
+{
+    if (_sfScanMask)
+    {
+	pauseSFScan();
+	setSymbolTimeout(_sfScanHomeTimeout);
+	_sfScanMask = 0;
+    }
+    if (!sfMask)
+	return true;
+
+    long bw = signalBandwidth();
+    if (!bw)
+	return false;
+    if (!preamble)
+	preamble = _preambleLength;
+    bool covered = planSFScan(sfMask, preamble, ((uint64_t)1000000 << RH_SF_SCAN_MIN) / bw, 2);
+    if (!_sfScanMask)
+	return false;
+
+    _sfScanHome = _modemConfig.reg_1e >> 4;
+    _sfScanHomeTimeout = _symbolTimeout;
+    // After CAD, the receiver only has to wait for the rest of the preamble
+    setSymbolTimeout(preamble < 4 ? 4 : preamble > 1023 ? 1023 : preamble);
+    _sniffing = false;
+    _sniffActive = false;
+    setModeIdle();
+    pollSFScan();
+    return covered;
+}
+
+// Called from available(). handleInterrupt() chains the CADs and receives after that
+void RH_RF95::pollSFScan()
+{
+    // Leave the radio alone while transmitting, and keep any message until it is collected
+    if (_mode == RHModeTx || _mode == RHModeCad || _mode == RHModeRx || _rxBufValid)
+	return;
+    startScanCAD();
+}
+
+void RH_RF95::startScanCAD()
+{
+    tuneSpreadingFactor(nextScanSF());
+    mapDio0(0x80); // Interrupt on CadDone
+    spiWrite(RH_RF95_REG_01_OP_MODE, RH_RF95_LONG_RANGE_MODE | RH_RF95_MODE_CAD);
+    _mode = RHModeCad;
+}
+
+void RH_RF95::pauseSFScan()
+{
+    if (!_sfScanMask)
+	return;
+    if (_sfScanSF)
+	setModeIdle();
+    _sfScanSF = 0;
+    tuneSpreadingFactor(_sfScanHome);
+}
+
+// Usually only RH_RF95_REG_1E_MODEM_CONFIG2 changes, and RH_RF95_REG_26_MODEM_CONFIG3 when crossing 
+// the 16 ms symbol time that needs low data rate optimisation
+void RH_RF95::tuneSpreadingFactor(uint8_t sf)
+{
+    uint8_t reg_1e = (_modemConfig.reg_1e & ~RH_RF95_SPREADING_FACTOR) | spreadingFactorBits(sf);
+    updateModemRegisters(_modemConfig.reg_1d, reg_1e, lowDatarateBits(_modemConfig.reg_1d, reg_1e, _modemConfig.reg_26));
+}
+
+////////////////////////////////////////////////////////////////////
+// Scheduled receive windows
+bool RH_RF95::setSymbolTimeout(uint16_t symbols)
+{
+    if (symbols < 4 || symbols > 1023)
+	return false;
+    if (symbols == _symbolTimeout)
+	return true;
+    // The top 2 bits share RH_RF95_REG_1E_MODEM_CONFIG2 with the SF and CRC settings
+    updateModemRegisters(_modemConfig.reg_1d,
+			 (_modemConfig.reg_1e & ~RH_RF95_SYM_TIMEOUT_MSB) | ((symbols >> 8) & RH_RF95_SYM_TIMEOUT_MSB),
+			 _modemConfig.reg_26);
+    spiWrite(RH_RF95_REG_1F_SYMB_TIMEOUT_LSB, symbols & 0xff);
+    _symbolTimeout = symbols;
+    return true;
+}
+
+uint16_t RH_RF95::symbolTimeout()
+{
+    return _symbolTimeout;
+}
+
+bool RH_RF95::receiveWindow(uint64_t start, uint16_t timeoutSymbols)
+{
+    if (timeoutSymbols < 4 || timeoutSymbols > 1023 || _mode == RHModeTx || _rxBufValid)
+	return false;
+    _rxWindowStart = start;
+    _rxWindowSymbols = timeoutSymbols;
+    _rxWindowState = RxWindowPending;
+    pollRxWindow();
+    return true;
+}
+
+RH_RF95::RxWindowState RH_RF95::rxWindowState()
+{
+    handleInterrupt();
+    pollRxWindow();
+    RxWindowState state = _rxWindowState;
+    // Report a result only once
+    if (state == RxWindowReceived || state == RxWindowTimeout)
+	_rxWindowState = RxWindowNone;
+    return state;
+}
+
+RH_RF95::RxWindowState RH_RF95::waitRxWindow()
+{
+    RxWindowState state;
+    while ((state = rxWindowState()) == RxWindowPending || state == RxWindowOpen)
+    {
+	uint64_t now = RHClock::instance()->micros();
+	if (state == RxWindowPending)
+	{
+	    // The clock sleeps to the exact time
+	    if (_rxWindowStart > now)
+		RHClock::instance()->delayMicros(_rxWindowStart - now);
+	    continue;
+	}
+	// RxTimeout is on DIO1, so only RxDone wakes us early. Before the symbol timeout is over nothing else
+	// can close the window. After it a preamble was found, and the packet ends with RxDone
+	uint64_t timeoutEnd = _rxWindowStart + (uint64_t)_rxWindowSymbols * symbolTime();
+	waitIrq(timeoutEnd > now ? timeoutEnd - now : symbolTime());
+    }
+    return state;
+}
+
+void RH_RF95::cancelRxWindow()
+{
+    if (_rxWindowState == RxWindowOpen)
+	setModeIdle();
+    _rxWindowState = RxWindowNone;
+}
+
+uint16_t RH_RF95::rxTimeouts()
+{
+    return _rxTimeouts;
+}
+
+void RH_RF95::pollRxWindow()
+{
+    if (_rxWindowState == RxWindowPending)
+    {
+	uint64_t now = RHClock::instance()->micros();
+	if (now < _rxWindowStart)
+	    return;
+	setModeIdle();
+	setSymbolTimeout(_rxWindowSymbols);
+	spiWrite(RH_RF95_REG_12_IRQ_FLAGS, 0xff); // Clear stale flags so a timeout is ours
+	setModeRxSingle();
+	_rxWindowStart = now;
+	_rxWindowState = RxWindowOpen;
+    }
+    else if (_rxWindowState == RxWindowOpen && !(_mode == RHModeRx && _rxSingle))
+    {
+	// handleInterrupt() has seen RxDone or RxTimeout
+	_rxWindowState = _rxBufValid ? RxWindowReceived : RxWindowTimeout;
+    }
+}
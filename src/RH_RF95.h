@@ -26,6 +26,21 @@
 #endif
 #endif // RH_PLATFORM_RASPI PI
 
+// Without interrupts, how often to check the IRQ flags once an operation is overdue, in microseconds
+#ifndef RH_RF95_IRQ_POLL_INTERVAL
+#define RH_RF95_IRQ_POLL_INTERVAL 100
+#endif
+
+// SPI bus frequency used while scanChannels() samples RSSI. The SX1276 allows up to 10 MHz
+#ifndef RH_RF95_SCAN_SPI_FREQUENCY
+#define RH_RF95_SCAN_SPI_FREQUENCY RHGenericSPI::Frequency8MHz
+#endif
+
+// Time for the RSSI to settle after retuning, before scanChannels() starts sampling, in microseconds
+#ifndef RH_RF95_RSSI_SETTLE
+#define RH_RF95_RSSI_SETTLE 1000
+#endif
+
 // This is the maximum number of interrupts the driver can support
 // Most Arduinos can handle 2, Megas can handle more
 #define RH_RF95_NUM_INTERRUPTS 3
@@ -107,6 +122,12 @@
 #define RH_RF95_REG_63_AGC_THRESH2                         0x63
 #define RH_RF95_REG_64_AGC_THRESH3                         0x64
 
+// Preamble symbols needed by a duty cycled receiver on top of its sleep interval:
+// CAD takes about 2 symbols, and the receiver must then still see enough preamble to lock on
+#ifndef RH_RF95_SNIFF_MARGIN_SYMBOLS
+#define RH_RF95_SNIFF_MARGIN_SYMBOLS 6
+#endif
+
 // RH_RF95_REG_01_OP_MODE                             0x01
 #define RH_RF95_LONG_RANGE_MODE                       0x80
 #define RH_RF95_ACCESS_SHARED_REG                     0x40
@@ -654,6 +675,16 @@ public:
     /// \return true if a new, complete, error-free uncollected message is available to be retreived by recv()
     virtual bool    available();
 
+    /// Blocks until a valid message is received. While sniffing, sleeps between polls of available()
+    /// until the next CAD is due, see sniffTimeToWake(), instead of reading the IRQ flags all the while
+    virtual void    waitAvailable();
+
+    /// Blocks until a valid message is received or the timeout expires, sleeping between polls
+    /// while sniffing as waitAvailable() does
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    /// \return true if a message is available
+    virtual bool    waitAvailableTimeout(uint16_t timeout);
+
     /// Turns the receiver on if it not already on.
     /// If there is a valid message available, copy it to buf and return true
     /// else return false.
@@ -750,9 +781,15 @@ public:
     /// To be used in a listen-before-talk mechanism (Collision Avoidance)
     /// with a reasonable time backoff algorithm.
     /// This is called automatically by waitCAD().
+    /// Without interrupts, sleeps until DIO0 signals CadDone when edge events are enabled (setEdgeTimestamps()),
+    /// else until CAD is due to finish, rather than polling the radio throughout.
     /// \return true if channel is in use.  
     virtual bool    isChannelActive();
 
+    /// \return How long CAD takes with the current modem settings, in microseconds. Used as the
+    /// waitCAD() backoff slot
+    virtual uint32_t cadTime();
+
     /// Enable TCXO mode
     /// Call this immediately after init(), to force your radio to use an external 
     /// frequency source, such as a Temperature Compensated Crystal Oscillator (TCXO), if available.
@@ -770,15 +807,37 @@ public:
     /// of the last received message. Caution: this measurement is not absolute, but is measured 
     /// relative to the local receiver's oscillator. 
     /// Apparent errors may be due to the transmitter, the receiver or both.
+    /// The frequency error registers are read in the same SPI batch as the rest of the packet status
+    /// when the packet is received, so calling this does not touch the radio.
     /// \return The estimated centre frequency offset in Hz of the last received message. 
+    /// Positive if the transmitter was above our centre frequency.
     /// If the modem bandwidth selector in 
     /// register RH_RF95_REG_1D_MODEM_CONFIG1 is invalid, returns 0.
     int frequencyError();
 
+    /// Offsets the transmitter and receiver centre frequency from the value last set
+    /// by setFrequency(), for example to track the crystal offset of a peer (see RHAfc).
+    /// The offset is rounded to the nearest synthesizer step (about 61Hz), and the FRF registers 
+    /// are only rewritten if the rounded value changes. setFrequency() clears the offset.
+    /// \param[in] hz The offset in Hz
+    /// \return true if the radio was retuned
+    bool setFrequencyCorrection(int32_t hz);
+
+    /// Returns the offset last set by setFrequencyCorrection()
+    /// \return The offset in Hz, rounded to synthesizer steps
+    int32_t frequencyCorrection();
+
+    /// Sets RH_RF95_REG_27_PPM_CORRECTION, which corrects the receiver's data rate for a 
+    /// transmitter whose crystal is off frequency by the given amount. Unlike setFrequencyCorrection()
+    /// this does not move the centre frequency.
+    /// \param[in] hz The frequency offset of the transmitter in Hz, as from frequencyError()
+    /// \return true if the register was changed
+    bool setPpmCorrection(int32_t hz);
+
     /// Returns the Signal-to-noise ratio (SNR) of the last received message, as measured
     /// by the receiver.
-    /// \return SNR of the last received message in dB
-    int lastSNR();
+    /// \return SNR of the last received message in tenths of a dB
+    virtual int lastSNR();
 
     /// brian.n.norman@gmail.com 9th Nov 2018
     /// Sets the radio spreading factor.
@@ -868,6 +927,204 @@ public:
 
 	// returns the maximum message length
 	int getMaxMessageLength();   
+
+    /// Changes the spreading factor, bandwidth and transmitter power in one call, writing only
+    /// those registers whose value actually changes. The current register values are kept in a
+    /// shadow copy, so unlike setSpreadingFactor() and friends this does not read back
+    /// any registers over SPI, which makes it cheap enough to call before every packet
+    /// (see RHAdaptiveRate). The LDR bit is recomputed as per setLowDatarate().
+    /// The transmitter pin selection of the last call to setTxPower() is retained.
+    /// \param[in] sf Spreading factor 6..12, clamped as per setSpreadingFactor()
+    /// \param[in] sbw Signal bandwidth in Hz, rounded as per setSignalBandwidth()
+    /// \param[in] power Transmitter power in dBm as per setTxPower()
+    /// \return true if any radio register was changed
+    virtual bool setLinkParams(uint8_t sf, long sbw, int8_t power);
+
+    /// Returns the currently configured spreading factor (6..12)
+    virtual uint8_t spreadingFactor();
+
+    /// Returns the currently configured signal bandwidth in Hz
+    virtual long signalBandwidth();
+
+    /// Returns the denominator of the currently configured coding rate (5..8)
+    uint8_t codingRate4();
+
+    /// Returns the transmitter power in dBm last set by setTxPower() or setLinkParams()
+    virtual int8_t txPower();
+
+    /// Returns the duration of one LoRa symbol with the current modem configuration
+    /// \return Symbol time in microseconds
+    uint32_t symbolTime();
+
+    /// Computes the time on air of a message with the current modem configuration,
+    /// preamble length and header mode, per Semtech AN1200.13.
+    /// \param[in] len Number of octets of message data, not including the RH_RF95 header
+    /// \return Time on air in microseconds
+    virtual uint32_t timeOnAir(uint8_t len);
+
+    /// Starts or stops duty cycled (preamble sniffing) receive. While sniffing, the radio sleeps
+    /// and wakes every interval ms to run CAD. Only if CAD detects a preamble does it enter 
+    /// single receive mode, and it goes back to sleep after the packet or on timeout. 
+    /// The schedule is driven by available(), so call it (or recv()) at least as often as the interval; 
+    /// sniffTimeToWake() says how long the caller may sleep before the next call. waitAvailable() and
+    /// waitAvailableTimeout() sleep that long between polls.
+    /// Senders must use a preamble longer than the interval, see setWakeupPreamble().
+    /// send() and isChannelActive() pause sniffing, and it resumes once the packet has been sent.
+    /// \param[in] on true to start sniffing, false to return to normal receive
+    /// \param[in] interval Sleep interval in ms. If 0, derived from our own preamble length
+    /// less RH_RF95_SNIFF_MARGIN_SYMBOLS, so that nodes with the same preamble length can hear each other.
+    void setSniffMode(bool on, uint16_t interval = 0);
+
+    /// \return true if duty cycled receive is on
+    bool sniffing();
+
+    /// \return The duty cycled receive interval in ms
+    uint16_t sniffInterval();
+
+    /// Sets a preamble long enough to be caught by a receiver sniffing every interval ms
+    /// with the current modem configuration. Use setPreambleLength() to go back to a normal preamble.
+    /// \param[in] interval The sleep interval of the receiver in ms
+    /// \return The preamble length set, in symbols
+    uint16_t setWakeupPreamble(uint16_t interval);
+
+    /// \return The number of ms until the next CAD while sniffing and asleep, else 0
+    uint32_t sniffTimeToWake();
+
+    /// \return The total time in microseconds the receiver has been on while sniffing, for CAD
+    /// and single receives. CAD is counted as 2 symbols, receives are timed to the nearest ms.
+    uint32_t radioOnTime();
+
+    /// \return The number of times the radio has woken up to run CAD while sniffing
+    uint32_t wakeCount();
+
+    /// \return The number of CADs that detected a preamble while sniffing
+    uint32_t cadDetectCount();
+
+    /// Zeroes radioOnTime(), wakeCount() and cadDetectCount()
+    void resetSniffStats();
+
+    /// Starts or stops scanning several spreading factors for messages, see RHGenericDriver::setSFScan().
+    /// CADs follow each other without a break, the next one started from handleInterrupt() as soon as 
+    /// the last is done, and changing spreading factor between them only writes the modem registers that differ.
+    /// So call available() (or recv() or waitAvailableTimeout()) continuously while scanning: on a Pi the
+    /// scan only moves on when the IRQ flags are polled.
+    /// The symbol timeout is set to the preamble length while scanning, so a false detection holds the 
+    /// receiver no longer than a real preamble would. Stopping restores the spreading factor and symbol timeout.
+    /// Scanning takes over from sniffing, see setSniffMode().
+    /// \param[in] sfMask Bit n set to scan spreading factor n, 7 to 12. 0 stops scanning
+    /// \param[in] preamble The shortest preamble the senders use, in symbols. If 0, our own preamble length
+    /// \return false if sfMask holds no spreading factor that can be scanned, or if the scan cannot
+    /// look at every spreading factor before the preamble is over
+    virtual bool setSFScan(uint16_t sfMask, uint16_t preamble = 0);
+
+    /// \brief The progress of a receive window set up by receiveWindow()
+    typedef enum
+    {
+	RxWindowNone = 0,  ///< No window scheduled, or the result has already been reported
+	RxWindowPending,   ///< Waiting for the start time
+	RxWindowOpen,      ///< Receiver is on in single receive mode
+	RxWindowReceived,  ///< A valid message was received and can be collected with recv()
+	RxWindowTimeout    ///< No preamble within the timeout, or a bad packet
+    } RxWindowState;
+
+    /// Sets the number of symbols a single receive waits for a preamble before giving up with RxTimeout.
+    /// Written to RH_RF95_REG_1F_SYMB_TIMEOUT_LSB and the 2 MSBs in RH_RF95_REG_1E_MODEM_CONFIG2.
+    /// \param[in] symbols Timeout in symbols, 4 to 1023. The chip default is 100.
+    /// \return true if symbols is valid
+    bool setSymbolTimeout(uint16_t symbols);
+
+    /// \return The symbol timeout last set by setSymbolTimeout()
+    uint16_t symbolTimeout();
+
+    /// Schedules the receiver to open in single receive mode at a given time, for example for a 
+    /// reply window after our own transmission. The radio itself closes the window after one packet or 
+    /// when no preamble is found within timeoutSymbols, so the receiver is only on for as long as needed.
+    /// Progress is driven by rxWindowState(), waitRxWindow() or available(), which leaves the radio 
+    /// alone while a window is pending or open. Only one window can be scheduled at a time: scheduling 
+    /// another replaces it. Duty cycled receive is suspended while a window is scheduled.
+    /// \param[in] start The time to open the window in microseconds on the RHClock::micros() timebase,
+    /// eg lastTxTime() / 1000 plus the reply delay. If already past, the window opens at the next poll.
+    /// \param[in] timeoutSymbols The symbol timeout, 4 to 1023, see setSymbolTimeout().
+    /// \return false if timeoutSymbols is invalid, a message is being transmitted, or a received message
+    /// has not yet been collected with recv(), since the window would overwrite it
+    bool receiveWindow(uint64_t start, uint16_t timeoutSymbols);
+
+    /// Polls the receive window. The final RxWindowReceived or RxWindowTimeout is reported once,
+    /// then the state returns to RxWindowNone.
+    /// \return The state of the window
+    RxWindowState rxWindowState();
+
+    /// Blocks until the receive window set up by receiveWindow() is closed. Sleeps until it opens, then
+    /// until DIO0 signals RxDone if setEdgeTimestamps() is in use, else until the symbol timeout is over
+    /// and then a symbol at a time while a packet is being received. It never spins on the SPI bus.
+    /// \return RxWindowReceived, RxWindowTimeout or RxWindowNone if no window was scheduled
+    RxWindowState waitRxWindow();
+
+    /// Cancels any receive window, putting the radio in idle mode if it was open
+    void cancelRxWindow();
+
+    /// \return The number of single receives that timed out without finding a preamble
+    uint16_t rxTimeouts();
+
+    /// \brief Everything known about a received message apart from its data
+    typedef struct
+    {
+	uint64_t    timestamp;  ///< When RxDone was signalled, ns on the RHClock::nanos() timebase
+	int16_t     rssi;       ///< RSSI in dBm, as lastRssi()
+	int16_t     snr;        ///< SNR in tenths of a dB, as lastSNR()
+	int32_t     freqError;  ///< Frequency error in Hz, as frequencyError()
+	RHAddress   to;         ///< TO header
+	RHAddress   from;       ///< FROM header
+	uint8_t     id;         ///< ID header
+	uint8_t     flags;      ///< FLAGS header
+    } RxMetadata;
+
+    /// As recv(), also returning the timestamp, signal measurements and headers of the message
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Pointer to available space in buf. Set to the actual number of octets copied.
+    /// \param[out] meta If not NULL, filled in for the message
+    /// \return true if a valid message was copied to buf
+    bool recv(uint8_t* buf, uint8_t* len, RxMetadata* meta);
+
+    /// \return When the RxDone of the last received packet was signalled, in ns on the RHClock::nanos() timebase
+    virtual uint64_t lastRxTime();
+
+    /// \return When the TxDone of the last transmitted packet was signalled, in ns on the RHClock::nanos() timebase
+    uint64_t lastTxTime();
+
+    /// Timestamps RxDone and TxDone from the kernel's record of the DIO0 edge, rather than from when the
+    /// driver next polls the IRQ flags, which removes the polling interval from the timestamps.
+    /// Only on Raspberry Pi, with a kernel that has the GPIO character device.
+    /// \param[in] pin The BCM GPIO number DIO0 is connected to
+    /// \return true if edge events are available
+    bool setEdgeTimestamps(uint8_t pin);
+
+    /// Result of scanChannels() for one channel. RSSI values are in dBm
+    typedef struct
+    {
+	float    frequency;   ///< Centre frequency in MHz
+	uint32_t samples;     ///< Number of RSSI samples taken
+	int16_t  min;         ///< Lowest RSSI
+	float    mean;        ///< Mean RSSI
+	int16_t  max;         ///< Highest RSSI
+	int16_t  p10;         ///< 10th percentile RSSI, a good estimate of the noise floor
+	int16_t  p50;         ///< Median RSSI
+	int16_t  p90;         ///< 90th percentile RSSI
+	int16_t  p99;         ///< 99th percentile RSSI, which shows short bursts of interference
+	uint16_t cadDetected; ///< Bit n set if CAD detected a LoRa preamble at spreading factor n
+    } ChannelScan;
+
+    /// Sweeps a list of channels, measuring the RSSI spectrum and optionally looking for LoRa activity.
+    /// On each channel the receiver listens for the dwell time while the RSSI register is read back to back
+    /// with the SPI bus at RH_RF95_SCAN_SPI_FREQUENCY, then CAD is run once at each spreading factor in sfMask.
+    /// Frequency, modem settings and SPI frequency are restored afterwards and the radio is left idle.
+    /// Messages on the air while scanning are not received. Do not scan while sniffing.
+    /// \param[in] frequencies Centre frequencies to scan in MHz
+    /// \param[in] count Number of frequencies
+    /// \param[in] dwell Time to sample RSSI on each channel in ms
+    /// \param[out] results One ChannelScan per frequency
+    /// \param[in] sfMask Bit n set to run CAD at spreading factor n, 7 to 12. 0 for RSSI only
+    void scanChannels(const float* frequencies, uint8_t count, uint16_t dwell, ChannelScan* results, uint16_t sfMask = 0);
  	
 protected:
     /// This is a low level function to handle the interrupts for one instance of RH_RF95.
@@ -883,6 +1140,78 @@ protected:
     /// Clear our local receive buffer
     void clearRxBuf();
 
+    /// Copies the payload of the received message from the FIFO into _buf, if it is still only in the FIFO.
+    /// Called before anything that could overwrite or clear the FIFO: transmitting, receiving again, sleeping
+    void fetchRxPayload();
+
+    /// Writes the modem configuration registers that differ from the shadow copy in _modemConfig
+    void updateModemRegisters(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26);
+
+    /// Maps a spreading factor to the SF bits of RH_RF95_REG_1E_MODEM_CONFIG2
+    static uint8_t spreadingFactorBits(uint8_t sf);
+
+    /// Maps a signal bandwidth in Hz to the BW bits of RH_RF95_REG_1D_MODEM_CONFIG1
+    static uint8_t bandwidthBits(long sbw);
+
+    /// Returns reg_26 with the LDR bit adjusted for the BW and SF in reg_1d and reg_1e
+    static uint8_t lowDatarateBits(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26);
+
+    /// Writes the 3 FRF registers in one burst
+    void writeFrf(uint32_t frf);
+
+    /// Starts receiving a single packet
+    void setModeRxSingle();
+
+    /// Runs the duty cycled receive schedule
+    void pollSniff();
+
+    /// Abandons any sniff CAD or receive in progress and wakes the radio to standby, so we can
+    /// transmit or run CAD for ourselves. TxDone puts the radio back to sleep, and available() takes up
+    /// the schedule again
+    void pauseSniff();
+
+    /// Waits between polls of available(): while sniffing, asleep until the next CAD is due, or until
+    /// DIO0 signals the end of the CAD or receive in progress, else for a YIELD
+    /// \param[in] limit Longest time to sleep until the next CAD, in ms
+    void waitSniff(uint32_t limit);
+
+    /// Starts the next scan CAD if the radio is free
+    void pollSFScan();
+
+    /// Starts a CAD on the spreading factor chosen by nextScanSF()
+    void startScanCAD();
+
+    /// Abandons any scan CAD or receive in progress and goes back to the configured spreading factor,
+    /// so we can transmit or run CAD for ourselves. available() takes up the scan again
+    void pauseSFScan();
+
+    /// Changes the spreading factor, and the low data rate optimisation to suit, in standby
+    void tuneSpreadingFactor(uint8_t sf);
+
+    /// Opens or closes the scheduled receive window
+    void pollRxWindow();
+
+    /// Reads any DIO0 edges recorded since the last call
+    /// \return The time of the newest, or 0 if there were none
+    uint64_t edgeTime();
+
+    /// Reads any DIO0 edges recorded since the last call, and keeps the newest until a flag claims it
+    void pollEdges();
+
+    /// Takes the time of the DIO0 edge kept by pollEdges() for a flag that has been found set
+    /// \param[in] flagsRead When the flags were read, which is the time returned if no edge was kept
+    /// \return The time of the edge
+    uint64_t claimEdge(uint64_t flagsRead);
+
+    /// Maps DIO0 to the interrupt of a new mode, and forgets edges that signalled the old one.
+    /// Called before the mode is entered, so that its interrupt is never signalled on the old mapping
+    /// \param[in] mapping Value for RH_RF95_REG_40_DIO_MAPPING1
+    void mapDio0(uint8_t mapping);
+
+    /// Sleeps until DIO0 rises or a timeout, for polling without interrupts
+    /// \param[in] timeout Longest time to sleep in microseconds
+    void waitIrq(uint32_t timeout);
+
     uint8_t				RH_RF95_HEADER_LEN;
 
     uint8_t RH_RF95_MAX_MESSAGE_LEN = RH_RF95_MAX_PAYLOAD_LEN;
@@ -925,6 +1254,13 @@ private:
     /// True when there is a valid message in the buffer
     volatile bool       _rxBufValid;
 
+    /// True when only the headers of the valid message are in _buf and its payload is still in the FIFO,
+    /// starting RH_RF95_HEADER_LEN octets after _rxFifoAddr. recv() then reads it straight into the caller's buffer
+    bool                _rxFifoPending;
+
+    /// FIFO address of the start of the last received packet
+    uint8_t             _rxFifoAddr;
+
     // True if we are using the HF port (779.0 MHz and above)
     bool                _usingHFport;
 
@@ -938,6 +1274,72 @@ private:
     bool                 _checkCrc;
 
     uint8_t 			 _explicitHeaderMode;
+
+    /// Shadow copy of the modem configuration registers, so they need not be read back
+    ModemConfig          _modemConfig;
+
+    /// Transmitter power and pin last set by setTxPower()
+    int8_t               _txPower;
+    bool                 _useRFO;
+
+    /// Preamble length last set by setPreambleLength()
+    uint16_t             _preambleLength;
+
+    /// Raw FEI register value captured with the last received packet
+    int32_t              _lastFreqError;
+
+    /// Nominal FRF value set by setFrequency()
+    uint32_t             _frf;
+
+    /// Current offset from _frf in synthesizer steps
+    int32_t              _frequencyCorrection;
+
+    /// Current value of RH_RF95_REG_27_PPM_CORRECTION
+    int32_t              _ppmCorrection;
+
+    /// true if the receiver is in RH_RF95_MODE_RXSINGLE
+    bool                 _rxSingle;
+
+    /// Duty cycled receive state
+    bool                 _sniffing;
+    uint16_t             _sniffInterval;
+    uint32_t             _sniffLastWake;
+    volatile bool        _sniffActive;     ///< A CAD started by pollSniff(), or the receive it led to, is running
+    uint32_t             _rxStart;
+
+    /// Duty cycled receive statistics
+    uint32_t             _rxOnTime;
+    uint32_t             _wakeCount;
+    uint32_t             _cadDetections;
+
+    /// Symbol timeout last set by setSymbolTimeout()
+    uint16_t             _symbolTimeout;
+
+    /// Spreading factor and symbol timeout to go back to when the scan stops or pauses
+    uint8_t              _sfScanHome;
+    uint16_t             _sfScanHomeTimeout;
+
+    /// Scheduled receive window
+    volatile RxWindowState _rxWindowState;
+    uint64_t             _rxWindowStart;        ///< When it opens, or opened once open, RHClock us
+    uint16_t             _rxWindowSymbols;
+
+    /// Number of single receives that timed out
+    volatile uint16_t    _rxTimeouts;
+
+    /// RxDone and TxDone times of the last packets received and sent, ns
+    uint64_t             _lastRxTime;
+    uint64_t             _lastTxTime;
+
+    /// Newest DIO0 edge read but not yet claimed by the flag it signals, ns, or 0
+    uint64_t             _pendingEdge;
+
+    /// When the flags that last claimed an edge were read, or DIO0 was last remapped, ns.
+    /// Edges from before then signalled flags already handled
+    uint64_t             _edgeCut;
+
+    /// GPIO edge event file descriptor for DIO0, or -1
+    int                  _edgeFd;
 };
 
 /// @example rf95_client.pde
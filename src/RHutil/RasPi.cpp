@@ -9,12 +9,13 @@
 #include <RadioHead.h>
 
 #if (RH_PLATFORM == RH_PLATFORM_RASPI)
-#include <sys/time.h>
-#include <time.h>
 #include "RasPi.h"
-
-//Initialize the values for sanity
-timeval RHStartTime;
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/gpio.h>
 
 void SPIClass::begin()
 {
@@ -36,9 +37,6 @@ void SPIClass::begin(uint16_t divider, uint8_t bitOrder, uint8_t dataMode)
   bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, 0);
 
   bcm2835_spi_begin();
-
-  //Initialize a timestamp for millis calculation
-  gettimeofday(&RHStartTime, NULL);
 }
 
 void SPIClass::end()
@@ -105,33 +103,73 @@ unsigned char digitalRead(unsigned char pin) {
   return bcm2835_gpio_lev(pin);
 }
 
-unsigned long millis()
+// Uniform in min to max - 1, like Arduino's
+long random(long min, long max)
 {
-  //Declare a variable to store current time
-  struct timeval RHCurrentTime;
-  //Get current time
-  gettimeofday(&RHCurrentTime,NULL);
-  //Calculate the difference between our start time and the end time
-  unsigned long difference = ((RHCurrentTime.tv_sec - RHStartTime.tv_sec) * 1000);
-  difference += ((RHCurrentTime.tv_usec - RHStartTime.tv_usec)/1000);
-  //Return the calculated value
-  return difference;
+  if (max <= min)
+    return min;
+  long diff = max - min;
+  return min + (long)(((double)rand() / ((double)RAND_MAX + 1)) * diff);
 }
 
-void delay (unsigned long ms)
+int gpioEdgeOpen(unsigned char pin)
 {
-  //Implement Delay function
+  int chip = open("/dev/gpiochip0", O_RDONLY);
+  if (chip < 0)
+    return -1;
+
+  struct gpioevent_request req;
+  memset(&req, 0, sizeof(req));
+  req.lineoffset = pin;
+  req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+  req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+  strncpy(req.consumer_label, "RadioHead", sizeof(req.consumer_label) - 1);
+  int ret = ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &req);
+  close(chip);
+  if (ret < 0)
+    return -1;
+
+  // Never block the polling loop
+  fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+  return req.fd;
+}
+
+bool gpioEdgeRead(int fd, uint64_t* age)
+{
+  struct gpioevent_data event;
+  uint64_t newest = 0;
+  while (read(fd, &event, sizeof(event)) == sizeof(event))
+    newest = event.timestamp;
+  if (!newest)
+    return false;
+
+  // Kernels since 5.7 stamp events with CLOCK_MONOTONIC, older ones with CLOCK_REALTIME
   struct timespec ts;
-  ts.tv_sec=0;
-  ts.tv_nsec=(ms * 1000);
-  nanosleep(&ts,&ts);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  if (newest > now || now - newest > 10000000000ULL)
+  {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+  *age = now > newest ? now - newest : 0;
+  return true;
 }
 
-long random(long min, long max)
+bool gpioEdgeWait(int fd, uint32_t timeout)
 {
-  long diff = max - min;
-  long ret = diff * rand() + min;
-  return ret;
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  // poll() only has ms resolution: round up so as not to return before the edge is due
+  return poll(&pfd, 1, (timeout + 999) / 1000) > 0;
+}
+
+void gpioEdgeClose(int fd)
+{
+  if (fd >= 0)
+    close(fd);
 }
 
 // Dump a buffer trying to display ASCII or HEX
@@ -166,10 +204,6 @@ void printbuffer(uint8_t buff[], int len)
 void SerialSimulator::begin(int baud)
 {
   //No implementation neccesary - Serial emulation on Linux = standard console
-  //
-  //Initialize a timestamp for millis calculation - we do this here as well in case SPI
-  //isn't used for some reason
-  gettimeofday(&RHStartTime, NULL);
 }
 
 size_t SerialSimulator::println(const char* s)
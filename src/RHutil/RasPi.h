@@ -81,12 +81,31 @@ void digitalWrite(unsigned char pin, unsigned char value);
 
 unsigned char digitalRead(unsigned char pin) ;
 
+// Timing functions are implemented by RHClock
 unsigned long millis();
 
+unsigned long micros();
+
 void delay (unsigned long delay);
 
+void delayMicroseconds(unsigned int us);
+
+void yield();
+
 long random(long min, long max);
 
+// Kernel timestamped GPIO edges, through the GPIO character device
+// Opens rising edge events on a BCM GPIO pin. Returns a file descriptor, or -1 if not supported
+int gpioEdgeOpen(unsigned char pin);
+
+// Reads all pending edges. If there were any, sets *age to how long ago the newest one happened, in ns
+bool gpioEdgeRead(int fd, uint64_t* age);
+
+// Sleeps until there is an edge to read or timeout microseconds pass. Returns true if there is an edge
+bool gpioEdgeWait(int fd, uint32_t timeout);
+
+void gpioEdgeClose(int fd);
+
 void printbuffer(uint8_t buff[], int len);
 
 #endif
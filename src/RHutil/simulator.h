@@ -19,8 +19,12 @@ extern int    _simulator_argc;
 extern char** _simulator_argv;
 
 // Definitions for various Arduino functions
+// Timing functions are implemented by RHClock
 extern void delay(unsigned long ms);
+extern void delayMicroseconds(unsigned int us);
 extern unsigned long millis();
+extern unsigned long micros();
+extern void yield();
 extern long random(long to);
 extern long random(long from, long to);
 
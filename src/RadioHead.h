@@ -1324,6 +1324,7 @@ these examples and explanations and extend them to suit your needs.
  // Simulate the sketch on Linux and OSX
  #include <RHutil/simulator.h>
  #define RH_HAVE_SERIAL
+ #define PROGMEM
 #include <netinet/in.h> // For htons and friends
 
 #else
@@ -1371,6 +1372,9 @@ these examples and explanations and extend them to suit your needs.
 #elif (RH_PLATFORM == RH_PLATFORM_ESP8266)
 // ESP8266 also has it
  #define YIELD yield();
+#elif (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+// Goes to RHClock, so that spin loops can advance a virtual clock
+ #define YIELD yield();
 #else
  #define YIELD
 #endif
@@ -1459,8 +1463,26 @@ these examples and explanations and extend them to suit your needs.
  #endif
 #endif
 
+// Node addresses are 8 bits, unless RH_WIDE_ADDRESSES is defined, in which case they are 16 bits,
+// for networks of more than 254 nodes. All nodes in a network must agree.
+// Uncomment this to enable wide addresses:
+//#define RH_WIDE_ADDRESSES
+#ifdef RH_WIDE_ADDRESSES
+typedef uint16_t RHAddress;
+#else
+typedef uint8_t RHAddress;
+#endif
+
 // This is the address that indicates a broadcast
+#ifdef RH_WIDE_ADDRESSES
+#define RH_BROADCAST_ADDRESS 0xffff
+#else
 #define RH_BROADCAST_ADDRESS 0xff
+#endif
+
+// Structures sent over the air that contain addresses are packed, so that wide addresses do
+// not introduce padding. Has no effect on the 8 bit layouts, which contain only octets
+#define RH_PACKED __attribute__((packed))
 
 // Uncomment this is to enable Encryption (see RHEncryptedDriver):
 // But ensure you have installed the Crypto directory from arduinolibs first:
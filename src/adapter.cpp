@@ -4,6 +4,10 @@
 #include <string.h>
 #include <RH_RF95.h>
 #include <RHReliableDatagram.h>
+#include <RHFragmenter.h>
+#include <RHFountain.h>
+#include <RHCompressedDriver.h>
+#include <RHClock.h>
 
 
 // Dragino Raspberry PI hat
@@ -21,7 +25,75 @@
 
 
 RH_RF95 radio(RF_CS_PIN, RF_IRQ_PIN);
+RHCompressedDriver compressor(radio);
+bool compressing = false;
 RHReliableDatagram* manager = NULL;
+RHFragmenter* fragmenter = NULL;
+RHFountain* fountain = NULL;
+
+// Metadata of a received message for the C API. Addresses are always 16 bits wide
+// so that the layout does not depend on RH_WIDE_ADDRESSES
+typedef struct {
+	uint64_t timestamp;
+	int16_t  rssi;
+	int16_t  snr;
+	int32_t  freqError;
+	uint16_t to;
+	uint16_t from;
+	uint8_t  id;
+	uint8_t  flags;
+} rx_meta_t;
+
+// waitCAD() counters for the C API
+typedef struct {
+	uint32_t attempts;
+	uint32_t cads;
+	uint32_t busy;
+	uint32_t timeouts;
+	uint64_t totalDelay;
+	uint32_t maxDelay;
+	uint32_t lastDelay;
+	uint16_t lastCads;
+} cad_stats_t;
+
+// Multi-SF scan counters for one spreading factor, for the C API
+typedef struct {
+	uint32_t cads;
+	uint32_t detections;
+	uint32_t received;
+	uint32_t maxGap;
+	uint32_t window;
+} sf_scan_stats_t;
+
+// Compression counters for the C API
+typedef struct {
+	uint32_t sent;
+	uint32_t compressed;
+	uint32_t octetsIn;
+	uint32_t octetsOut;
+	uint64_t airtimeSaved;
+	uint64_t cpuTime;
+	uint32_t received;
+	uint32_t dropped;
+} compression_stats_t;
+
+// The driver messages go through: the compressor once compressionInit() has been called, else the radio
+static RHGenericDriver& driver() {
+	return compressing ? (RHGenericDriver&)compressor : (RHGenericDriver&)radio;
+}
+
+// Fragment callbacks for the C API. Addresses are always 16 bits wide, as in rx_meta_t
+typedef uint8_t (*fragment_source_t)(uint32_t offset, uint8_t* buf, uint8_t len, void* arg);
+typedef bool (*fragment_sink_t)(uint16_t from, uint32_t offset, const uint8_t* data, uint8_t len, void* arg);
+
+static fragment_sink_t fragmentSink = NULL;
+
+static bool fragmentSinkAdapter(RHAddress from, uint32_t offset, const uint8_t* data, uint8_t len, void* arg) {
+	return fragmentSink(from, offset, data, len, arg);
+}
+
+// Columns of each row of the scanChannels() result
+#define SCAN_COLUMNS 10
 
 
 int _init() {
@@ -35,6 +107,8 @@ int _init() {
 		// IRQ Pin input/pull down 
 		pinMode(RF_IRQ_PIN, INPUT);
 		bcm2835_gpio_set_pud(RF_IRQ_PIN, BCM2835_GPIO_PUD_DOWN);
+		// Timestamp RxDone/TxDone from the DIO0 edge when the kernel supports it
+		radio.setEdgeTimestamps(RF_IRQ_PIN);
 	#endif
 		
 	#ifdef RF_RST_PIN
@@ -42,9 +116,9 @@ int _init() {
 		// Pulse a reset on module
 		pinMode(RF_RST_PIN, OUTPUT);
 		digitalWrite(RF_RST_PIN, LOW );
-		bcm2835_delay(150);
+		delay(150);
 		digitalWrite(RF_RST_PIN, HIGH );
-		bcm2835_delay(100);
+		delay(100);
 	 #endif
 		
 	 #ifdef RF_LED_PIN
@@ -93,28 +167,28 @@ void _setImplicitHeaderMode(bool on, uint8_t expectedPayloadLength) {
 }
 
 void _setThisAddress(uint8_t thisAddress) {
-	radio.setThisAddress(thisAddress);
+	driver().setThisAddress(thisAddress);
 }
 
 void _setTXHeaderTo(uint8_t txHeaderTo) {
-	radio.setHeaderTo(txHeaderTo);
+	driver().setHeaderTo(txHeaderTo);
 }
 
 void _setTXHeaderFrom(uint8_t txHeaderFrom) {
-	radio.setHeaderFrom(txHeaderFrom);
+	driver().setHeaderFrom(txHeaderFrom);
 }
 
 void _setTXHeaderID(uint8_t txHeaderID) {
-	radio.setHeaderId(txHeaderID);
+	driver().setHeaderId(txHeaderID);
 }
 
 void _setTXHeaderFlags(uint8_t txHeaderFlags, uint8_t flagsToClear) {
-	radio.setHeaderFlags(txHeaderFlags, flagsToClear);
+	driver().setHeaderFlags(txHeaderFlags, flagsToClear);
 }
 	
 
 int _send(uint8_t* data, uint8_t len) {
-	bool b = radio.send(data, len);
+	bool b = driver().send(data, len);
 	if (b) return 0;
 	else return -1;
 }
@@ -126,7 +200,7 @@ int _waitPacketSent() {
 }
 
 int _waitAvailableTimeout(int ms) {
-	return radio.waitAvailableTimeout(ms);
+	return driver().waitAvailableTimeout(ms);
 }
 
 int _available() {
@@ -137,22 +211,58 @@ int _available() {
 	}
 	
 	/* Radio available */
-	return (int) radio.available();
+	return (int) driver().available();
+}
+
+int _recvInto(uint8_t* buf, uint8_t cap, rx_meta_t* meta) {
+	/* The radio reads the payload from its FIFO straight into buf, truncated to cap */
+	uint8_t len = cap;
+	RH_RF95::RxMetadata meta2;
+
+	bool b;
+	if (compressing) {
+		/* The radio's metadata, taken before recv() clears it, but the compressor's flags and message */
+		if (!compressor.available())
+			return -1;
+		meta2.timestamp = radio.lastRxTime();
+		meta2.rssi = radio.lastRssi();
+		meta2.snr = radio.lastSNR();
+		meta2.freqError = radio.frequencyError();
+		meta2.to = radio.headerTo();
+		meta2.from = radio.headerFrom();
+		meta2.id = radio.headerId();
+		meta2.flags = compressor.headerFlags();
+		b = compressor.recv(buf, &len);
+	}
+	else
+		b = radio.recv(buf, &len, meta ? &meta2 : NULL);
+	if (!b)
+		return -1;
+
+	if (meta) {
+		meta->timestamp = meta2.timestamp;
+		meta->rssi = meta2.rssi;
+		meta->snr = meta2.snr;
+		meta->freqError = meta2.freqError;
+		meta->to = meta2.to;
+		meta->from = meta2.from;
+		meta->id = meta2.id;
+		meta->flags = meta2.flags;
+	}
+	return len;
 }
 
 int _recv(char* buf, uint8_t* len) {
-	uint8_t buf2[radio.getMaxMessageLength()];
-	uint8_t len2 = sizeof(buf2);
-	
-	bool b = radio.recv(buf2, &len2);
-	//printf("Received : %s (%d)\n", (char*)buf2, len2);
-
-	memcpy(buf, buf2, len2);
-	//buf[(int)len2] = 0;
-	*len = len2; 	
+	/* buf must hold maxMessageLength() octets */
+	int n = _recvInto((uint8_t*)buf, radio.getMaxMessageLength(), NULL);
+	*len = n < 0 ? 0 : n;
+	return n;
+}
 
-	if (b) return *len;
-	else return -1;
+int _recvWithMeta(char* buf, uint8_t* len, rx_meta_t* meta) {
+	int n = _recvInto((uint8_t*)buf, radio.getMaxMessageLength(), meta);
+	*len = n < 0 ? 0 : n;
+	return n;
 }
 
 int _maxMessageLength() {
@@ -172,7 +282,7 @@ int _enterSleepMode() {
 }
 
 int _managerInit(int address) {
-	manager = new RHReliableDatagram(radio, (uint8_t)address); 
+	manager = new RHReliableDatagram(driver(), (uint8_t)address); 
         
 	if (!bcm2835_init()) {
                 printf("Startup Failed\n");
@@ -184,14 +294,12 @@ int _managerInit(int address) {
 }
 
 int _recvfromAck(char* buf, uint8_t* len, uint8_t* from) {
-	uint8_t buf2[radio.getMaxMessageLength()];
-	uint8_t len2 = sizeof(buf2);
-	uint8_t from2;
+	uint8_t len2 = radio.getMaxMessageLength();
+	RHAddress from2;
 		
-	bool b = manager->recvfromAck(buf2, &len2, &from2);
-	//printf("Received : %s (%d) (from %d)\n", (char*)buf2, len2, from2);
-	strcpy(buf, (char*)buf2);
-	*len = len2; 	
+	bool b = manager->recvfromAck((uint8_t*)buf, &len2, &from2);
+	//printf("Received : %s (%d) (from %d)\n", buf, len2, from2);
+	*len = b ? len2 : 0;
 	*from = from2;
 
 	if (b) return *len;
@@ -199,15 +307,13 @@ int _recvfromAck(char* buf, uint8_t* len, uint8_t* from) {
 }
 
 int _recvfromAckTimeout(char* buf, uint8_t* len, uint16_t timeout, uint8_t* from) {
-	uint8_t buf2[radio.getMaxMessageLength()];
-	uint8_t len2 = sizeof(buf2);
-	uint8_t from2;
+	uint8_t len2 = radio.getMaxMessageLength();
+	RHAddress from2;
 
-	bool b = manager->recvfromAckTimeout(buf2, &len2, timeout, &from2);
+	bool b = manager->recvfromAckTimeout((uint8_t*)buf, &len2, timeout, &from2);
 
 	if (b) {
-		//printf("Received : %s (%d) (from %d)\n", (char*)buf2, len2, from2);
-		strcpy(buf, (char*)buf2);
+		//printf("Received : %s (%d) (from %d)\n", buf, len2, from2);
 		*len = len2; 	
 		*from = from2;
 		return *len;
@@ -248,6 +354,94 @@ int _resetRetransmissions() {
 	return 0;
 }
 
+int _fragmenterInit() {
+	/* Fragments are carried by the manager, so managerInit() must come first */
+	if (manager == NULL)
+		return -1;
+	if (fragmenter == NULL)
+		fragmenter = new RHFragmenter(*manager);
+	return 0;
+}
+
+int _sendFragmented(const uint8_t* data, uint32_t len, uint16_t dst) {
+	bool b = fragmenter->sendtoWait(data, len, dst);
+	if (b) return 0;
+	else return -1;
+}
+
+int _sendFragmentedFrom(fragment_source_t source, void* arg, uint32_t len, uint16_t dst) {
+	bool b = fragmenter->sendtoWait(source, arg, len, dst);
+	if (b) return 0;
+	else return -1;
+}
+
+int _recvFragmented(uint8_t* buf, uint32_t* len, uint16_t timeout, uint16_t* from) {
+	RHAddress from2;
+	bool b = timeout ? fragmenter->recvfromTimeout(buf, len, timeout, &from2)
+		: fragmenter->recvfrom(buf, len, &from2);
+	if (!b)
+		return -1;
+	*from = from2;
+	return (int) *len;
+}
+
+void _setFragmentSink(fragment_sink_t sink, void* arg) {
+	fragmentSink = sink;
+	fragmenter->setSink(sink ? fragmentSinkAdapter : NULL, arg);
+}
+
+int _compressionInit(const uint8_t* dict, uint16_t len, uint8_t id) {
+	/* Kept here, as the compressor does not copy the dictionary */
+	static uint8_t dictionary[RH_COMPRESS_MAX_DICT];
+	if (len > sizeof(dictionary))
+		return -1;
+	memcpy(dictionary, dict, len);
+	compressor.setDictionary(dictionary, len, id);
+	/* Messages go through the compressor from now on, and so does a manager initialised after this */
+	compressing = true;
+	return 0;
+}
+
+void _getCompressionStats(compression_stats_t* stats) {
+	const RHCompressedDriver::Stats& s = compressor.stats();
+	stats->sent = s.sent;
+	stats->compressed = s.compressed;
+	stats->octetsIn = s.octetsIn;
+	stats->octetsOut = s.octetsOut;
+	stats->airtimeSaved = s.airtimeSaved;
+	stats->cpuTime = s.cpuTime;
+	stats->received = s.received;
+	stats->dropped = s.dropped;
+}
+
+int _fountainInit() {
+	/* Coded blocks are carried by the manager, so managerInit() must come first */
+	if (manager == NULL)
+		return -1;
+	if (fountain == NULL)
+		fountain = new RHFountain(*manager);
+	return 0;
+}
+
+int _broadcastFountain(const uint8_t* data, uint32_t len, const uint16_t* receivers, uint16_t numReceivers) {
+	static RHAddress receivers2[RH_FOUNTAIN_MAX_RECEIVERS];
+	if (numReceivers > RH_FOUNTAIN_MAX_RECEIVERS)
+		return -1;
+	for (uint16_t i = 0; i < numReceivers; i++)
+		receivers2[i] = receivers[i];
+	return fountain->broadcast(data, len, numReceivers ? receivers2 : NULL, numReceivers);
+}
+
+int _recvFountain(uint8_t* buf, uint32_t* len, uint16_t timeout, uint16_t* from) {
+	RHAddress from2;
+	bool b = timeout ? fountain->recvfromTimeout(buf, len, timeout, &from2)
+		: fountain->recvfrom(buf, len, &from2);
+	if (!b)
+		return -1;
+	*from = from2;
+	return (int) *len;
+}
+
 int _setModeIdle() {
 	radio.setModeIdle();
 	return 0;
@@ -348,6 +542,14 @@ extern "C" {
 		return _recv(buf, len);
 	}
 
+	extern int recvWithMeta(char* buf, uint8_t* len, rx_meta_t* meta) {
+		return _recvWithMeta(buf, len, meta);
+	}
+
+	extern int recvInto(uint8_t* buf, uint8_t cap, rx_meta_t* meta) {
+		return _recvInto(buf, cap, meta);
+	}
+
 	extern int maxMessageLength() {
 		return _maxMessageLength();
 	}
@@ -395,6 +597,78 @@ extern "C" {
 	extern int setTimeout(uint16_t timeout) {
 		return _setTimeout(timeout);
 	}
+
+	extern int fragmenterInit() {
+		return _fragmenterInit();
+	}
+
+	extern int sendFragmented(const uint8_t* data, uint32_t len, uint16_t dst) {
+		return _sendFragmented(data, len, dst);
+	}
+
+	extern int sendFragmentedFrom(fragment_source_t source, void* arg, uint32_t len, uint16_t dst) {
+		return _sendFragmentedFrom(source, arg, len, dst);
+	}
+
+	extern int recvFragmented(uint8_t* buf, uint32_t* len, uint16_t timeout, uint16_t* from) {
+		return _recvFragmented(buf, len, timeout, from);
+	}
+
+	extern void setFragmentSink(fragment_sink_t sink, void* arg) {
+		_setFragmentSink(sink, arg);
+	}
+
+	extern void setFragmentLength(uint8_t len) {
+		fragmenter->setFragmentLength(len);
+	}
+
+	extern int fragmentLength() {
+		return fragmenter->fragmentLength();
+	}
+
+	extern uint32_t fragmentBufferSize() {
+		return RH_FRAG_BUFFER_SIZE;
+	}
+
+	extern uint32_t fragmentRetransmissions() {
+		return fragmenter->retransmissions();
+	}
+
+	extern int compressionInit(const uint8_t* dict, uint16_t len, uint8_t id) {
+		return _compressionInit(dict, len, id);
+	}
+
+	extern void getCompressionStats(compression_stats_t* stats) {
+		_getCompressionStats(stats);
+	}
+
+	extern void clearCompressionStats() {
+		compressor.clearStats();
+	}
+
+	extern int fountainInit() {
+		return _fountainInit();
+	}
+
+	extern int broadcastFountain(const uint8_t* data, uint32_t len, const uint16_t* receivers, uint16_t numReceivers) {
+		return _broadcastFountain(data, len, receivers, numReceivers);
+	}
+
+	extern int recvFountain(uint8_t* buf, uint32_t* len, uint16_t timeout, uint16_t* from) {
+		return _recvFountain(buf, len, timeout, from);
+	}
+
+	extern void setFountainFeedback(uint16_t window, uint8_t burst) {
+		fountain->setFeedback(window, burst);
+	}
+
+	extern uint32_t fountainBufferSize() {
+		return (uint32_t) RH_FOUNTAIN_MAX_BLOCKS * fountain->maxBlockLength();
+	}
+
+	extern int fountainBlocksSent() {
+		return fountain->blocksSent();
+	}
 	
 	extern int setModeIdle() {
 		return _setModeIdle();
@@ -419,10 +693,152 @@ extern "C" {
 	bool isChannelActive(){
 		return radio.isChannelActive();
 	}
+
+	void setCADTimeout(unsigned long timeout) {
+		radio.setCADTimeout(timeout);
+	}
+
+	void setCADBackoff(uint8_t minExponent, uint8_t maxExponent, uint32_t slotTime) {
+		radio.setCADBackoff(minExponent, maxExponent, slotTime);
+	}
+
+	void getCADStats(cad_stats_t* stats) {
+		const RHGenericDriver::CADStats& s = radio.cadStats();
+		stats->attempts = s.attempts;
+		stats->cads = s.cads;
+		stats->busy = s.busy;
+		stats->timeouts = s.timeouts;
+		stats->totalDelay = s.totalDelay;
+		stats->maxDelay = s.maxDelay;
+		stats->lastDelay = s.lastDelay;
+		stats->lastCads = s.lastCads;
+	}
+
+	void clearCADStats() {
+		radio.clearCADStats();
+	}
+
+	void setSniffMode(bool on, uint16_t interval) {
+		radio.setSniffMode(on, interval);
+	}
+
+	bool sniffing() {
+		return radio.sniffing();
+	}
+
+	uint16_t sniffInterval() {
+		return radio.sniffInterval();
+	}
+
+	uint16_t setWakeupPreamble(uint16_t interval) {
+		return radio.setWakeupPreamble(interval);
+	}
+
+	uint32_t sniffTimeToWake() {
+		return radio.sniffTimeToWake();
+	}
+
+	uint32_t radioOnTime() {
+		return radio.radioOnTime();
+	}
+
+	uint32_t wakeCount() {
+		return radio.wakeCount();
+	}
+
+	uint32_t cadDetectCount() {
+		return radio.cadDetectCount();
+	}
+
+	void resetSniffStats() {
+		radio.resetSniffStats();
+	}
+
+	bool setSymbolTimeout(uint16_t symbols) {
+		return radio.setSymbolTimeout(symbols);
+	}
+
+	uint16_t symbolTimeout() {
+		return radio.symbolTimeout();
+	}
+
+	// start is in us on the clockMicros() timebase
+	bool receiveWindow(uint64_t start, uint16_t timeoutSymbols) {
+		return radio.receiveWindow(start, timeoutSymbols);
+	}
+
+	int rxWindowState() {
+		return radio.rxWindowState();
+	}
+
+	int waitRxWindow() {
+		return radio.waitRxWindow();
+	}
+
+	void cancelRxWindow() {
+		radio.cancelRxWindow();
+	}
+
+	uint16_t rxTimeouts() {
+		return radio.rxTimeouts();
+	}
+
+	uint64_t clockMicros() {
+		return RHClock::instance()->micros();
+	}
+
+	bool setSFScan(uint16_t sfMask, uint16_t preamble) {
+		return radio.setSFScan(sfMask, preamble);
+	}
+
+	uint8_t lastRxSpreadingFactor() {
+		return radio.lastRxSpreadingFactor();
+	}
+
+	void getSFScanStats(uint8_t sf, sf_scan_stats_t* stats) {
+		const RHGenericDriver::SFScanStats& s = radio.sfScanStats(sf);
+		stats->cads = s.cads;
+		stats->detections = s.detections;
+		stats->received = s.received;
+		stats->maxGap = s.maxGap;
+		stats->window = s.window;
+	}
+
+	void clearSFScanStats() {
+		radio.clearSFScanStats();
+	}
+
+	// Fills count rows of SCAN_COLUMNS floats: frequency, samples, min, mean, max, p10, p50, p90, p99, cadDetected
+	int scanChannels(const float* frequencies, uint8_t count, uint16_t dwell, uint16_t sfMask, float* out) {
+		RH_RF95::ChannelScan results[count];
+		radio.scanChannels(frequencies, count, dwell, results, sfMask);
+		for (uint8_t i = 0; i < count; i++) {
+			float* row = out + i * SCAN_COLUMNS;
+			row[0] = results[i].frequency;
+			row[1] = results[i].samples;
+			row[2] = results[i].min;
+			row[3] = results[i].mean;
+			row[4] = results[i].max;
+			row[5] = results[i].p10;
+			row[6] = results[i].p50;
+			row[7] = results[i].p90;
+			row[8] = results[i].p99;
+			row[9] = results[i].cadDetected;
+		}
+		return 0;
+	}
 	
 	int frequencyError() {
 		return radio.frequencyError();
 	}
+
+	uint64_t lastRxTime() {
+		return radio.lastRxTime();
+	}
+
+	uint64_t lastTxTime() {
+		return radio.lastTxTime();
+	}
 	
 	int getLastRawRssi(){
 		return radio.getLastRawRssi();